@@ -0,0 +1,401 @@
+/*********************************************************************************************************************/
+/* Datei: AccessLog.cpp                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Binary log of all tile requests for offline replay, and process-wide request statistics            */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "AccessLog.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// records are collected and written in blocks of this size
+#define ACCESS_LOG_BUFFER			(64 * 1024)
+
+// written blocks kept for reuse
+#define ACCESS_LOG_IDLE				2
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct AccessLogBlock
+{
+	AccessLogBlock* next;
+	DWORD used;
+	BYTE data[ACCESS_LOG_BUFFER];
+};
+
+// Records are appended to block under lock. A full block is sealed under the lock and written outside of it by the
+// thread that filled it; written counts the blocks done, so that blocks reach the file in the order they were sealed.
+static struct
+{
+	SRWLOCK lock;
+	HANDLE file;
+	volatile LONG active;
+	INT64 origin;
+	AccessLogBlock* block;
+	AccessLogBlock* idle;
+	INT32 idleCount;
+	LONG sealed;
+
+	SRWLOCK writeLock;
+	CONDITION_VARIABLE turn;
+	LONG written;
+
+	// serializes SetAccessLog
+	SRWLOCK control;
+} accessLog = { SRWLOCK_INIT, INVALID_HANDLE_VALUE, 0, 0, NULL, NULL, 0, 0, SRWLOCK_INIT, CONDITION_VARIABLE_INIT, 0,
+	SRWLOCK_INIT };
+
+static struct
+{
+	volatile LONGLONG values[ACCESS_STATISTICS_COUNT];
+	LARGE_INTEGER frequency;
+} statistics;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static void AppendRecord(AccessRecord* record, const void* extra, DWORD extraLength);
+static LONG SealBlock(AccessLogBlock** block);
+static void WriteBlock(AccessLogBlock* block, LONG ticket);
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: SetAccessLog ***********************************************/
+/*********************************************************************************************************************/
+
+// Starts logging every tile request to a new file at path; NULL stops logging and closes the file.
+extern "C" __declspec(dllexport) BOOL SetAccessLog(wchar_t* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	HANDLE file = INVALID_HANDLE_VALUE;
+	AccessLogHeader header;
+	AccessLogBlock* block;
+	LARGE_INTEGER now;
+	DWORD written;
+	LONG ticket;
+
+	AcquireSRWLockExclusive(&accessLog.control);
+
+	//*** Stop appending and take the last block **********************************************************************
+	AcquireSRWLockExclusive(&accessLog.lock);
+	InterlockedExchange(&accessLog.active, 0);
+	ticket = SealBlock(&block);
+	ReleaseSRWLockExclusive(&accessLog.lock);
+
+	//*** Its turn comes after every block sealed before, so the file is no longer in use afterwards ******************
+	WriteBlock(block, ticket);
+
+	if (accessLog.file != INVALID_HANDLE_VALUE)
+	{
+		CloseHandle(accessLog.file);
+		accessLog.file = INVALID_HANDLE_VALUE;
+	}
+
+	if (path != NULL)
+		file = CreateFileW(path, GENERIC_WRITE, FILE_SHARE_READ, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file != INVALID_HANDLE_VALUE)
+	{
+		//*** The header carries the tick frequency of the timestamps *************************************************
+		QueryPerformanceFrequency(&now);
+		header.magic = ACCESS_LOG_MAGIC;
+		header.version = ACCESS_LOG_VERSION;
+		header.frequency = now.QuadPart;
+
+		WriteFile(file, &header, sizeof(header), &written, NULL);
+
+		QueryPerformanceCounter(&now);
+
+		AcquireSRWLockExclusive(&accessLog.lock);
+		accessLog.file = file;
+		accessLog.origin = now.QuadPart;
+		InterlockedExchange(&accessLog.active, 1);
+		ReleaseSRWLockExclusive(&accessLog.lock);
+	}
+
+	ReleaseSRWLockExclusive(&accessLog.control);
+
+	//*** Ende ********************************************************************************************************
+	return path == NULL || file != INVALID_HANDLE_VALUE;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: CloseAccessLog **********************************************/
+/*********************************************************************************************************************/
+
+// DLL_PROCESS_DETACH: writes the records still buffered and closes the log, so that its tail survives a host that
+// exits without stopping the log. At process exit the other threads are gone, so nothing waits for their turn, and a
+// lock left behind by one of them gives up the buffered records rather than hanging the exit.
+void CloseAccessLog()
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	AccessLogBlock* block;
+	DWORD written;
+
+	if (accessLog.file == INVALID_HANDLE_VALUE || !TryAcquireSRWLockExclusive(&accessLog.lock)) return;
+
+	InterlockedExchange(&accessLog.active, 0);
+	block = accessLog.block;
+	accessLog.block = NULL;
+
+	ReleaseSRWLockExclusive(&accessLog.lock);
+
+	if (block != NULL && block->used > 0) WriteFile(accessLog.file, block->data, block->used, &written, NULL);
+
+	free(block);
+
+	//*** Ende ********************************************************************************************************
+	CloseHandle(accessLog.file);
+	accessLog.file = INVALID_HANDLE_VALUE;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetAccessStatistics *******************************************/
+/*********************************************************************************************************************/
+
+// Copies the ACCESS_STATISTICS_COUNT counters of all tile requests of the process, optionally resetting them.
+extern "C" __declspec(dllexport) BOOL GetAccessStatistics(INT64* values, BOOL reset)
+{
+	if (values == NULL) return false;
+
+	for (int i = 0; i < ACCESS_STATISTICS_COUNT; i++)
+		values[i] = reset ? InterlockedExchange64(&statistics.values[i], 0) : statistics.values[i];
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: AccessStart ***********************************************/
+/*********************************************************************************************************************/
+
+INT64 AccessStart()
+{
+	LARGE_INTEGER now;
+
+	QueryPerformanceCounter(&now);
+
+	return now.QuadPart;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: LogTileAccess **********************************************/
+/*********************************************************************************************************************/
+
+// Counts the request and, while a log is open, appends it
+void LogTileAccess(INT64 handle, UINT64 slideId, INT32 level, INT32 x, INT32 y, INT64 start, BYTE source, bool failed)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	LARGE_INTEGER now;
+	AccessRecord record;
+	INT64 latency;
+
+	QueryPerformanceCounter(&now);
+
+	if (statistics.frequency.QuadPart == 0) QueryPerformanceFrequency(&statistics.frequency);
+
+	latency = (now.QuadPart - start) * 1000000 / statistics.frequency.QuadPart;
+
+	//*** Statistics are always kept **********************************************************************************
+	InterlockedIncrement64(&statistics.values[0]);
+
+	if (failed)
+		InterlockedIncrement64(&statistics.values[4]);
+	else if (source >= ACCESS_SOURCE_SHARED && source <= ACCESS_SOURCE_OPENSLIDE)
+		InterlockedIncrement64(&statistics.values[source]);
+
+	InterlockedExchangeAdd64(&statistics.values[5], latency);
+
+	if (accessLog.active == 0) return;
+
+	memset(&record, 0, sizeof(record));
+	record.time = start;
+	record.handle = handle;
+	record.slideId = slideId;
+	record.level = level;
+	record.x = x;
+	record.y = y;
+	record.latency = (latency > 0xFFFFFFFF) ? 0xFFFFFFFF : (UINT32)latency;
+	record.thread = GetCurrentThreadId();
+	record.kind = ACCESS_TILE;
+	record.source = source;
+	record.failed = failed ? 1 : 0;
+
+	AppendRecord(&record, NULL, 0);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: LogSlideOpen ***********************************************/
+/*********************************************************************************************************************/
+
+void LogSlideOpen(INT64 handle, UINT64 slideId, const char* path)
+{
+	AccessRecord record;
+
+	if (accessLog.active == 0 || path == NULL) return;
+
+	memset(&record, 0, sizeof(record));
+	record.time = AccessStart();
+	record.handle = handle;
+	record.slideId = slideId;
+	record.x = (INT32)strlen(path);
+	record.thread = GetCurrentThreadId();
+	record.kind = ACCESS_OPEN;
+
+	AppendRecord(&record, path, (DWORD)record.x);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: LogSlideClose **********************************************/
+/*********************************************************************************************************************/
+
+void LogSlideClose(INT64 handle, UINT64 slideId)
+{
+	AccessRecord record;
+
+	if (accessLog.active == 0) return;
+
+	memset(&record, 0, sizeof(record));
+	record.time = AccessStart();
+	record.handle = handle;
+	record.slideId = slideId;
+	record.thread = GetCurrentThreadId();
+	record.kind = ACCESS_CLOSE;
+
+	AppendRecord(&record, NULL, 0);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: AppendRecord ***********************************************/
+/*********************************************************************************************************************/
+
+// Adds the record and its padded extra bytes to the current block. The lock only covers the copy: a full block is
+// sealed and written by this thread after the lock is released, so other threads keep appending meanwhile.
+static void AppendRecord(AccessRecord* record, const void* extra, DWORD extraLength)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	static const BYTE padding[8] = { 0 };
+	DWORD padded = (extraLength + 7) & ~7u;
+	AccessLogBlock* full = NULL;
+	AccessLogBlock* block;
+	LONG ticket = 0;
+
+	if (sizeof(AccessRecord) + padded > ACCESS_LOG_BUFFER) return;
+
+	AcquireSRWLockExclusive(&accessLog.lock);
+
+	if (accessLog.active != 0)
+	{
+		record->time -= accessLog.origin;
+
+		if (accessLog.block != NULL && accessLog.block->used + sizeof(AccessRecord) + padded > ACCESS_LOG_BUFFER)
+			ticket = SealBlock(&full);
+
+		//*** A fresh block comes from the written ones if possible; without one the record is dropped ****************
+		if (accessLog.block == NULL && accessLog.idle != NULL)
+		{
+			accessLog.block = accessLog.idle;
+			accessLog.idle = accessLog.idle->next;
+			accessLog.idleCount--;
+			accessLog.block->used = 0;
+		}
+		else if (accessLog.block == NULL)
+		{
+			if ((accessLog.block = (AccessLogBlock*)malloc(sizeof(AccessLogBlock))) != NULL) accessLog.block->used = 0;
+		}
+
+		if ((block = accessLog.block) != NULL)
+		{
+			memcpy(block->data + block->used, record, sizeof(AccessRecord));
+			block->used += sizeof(AccessRecord);
+
+			if (extraLength > 0)
+			{
+				memcpy(block->data + block->used, extra, extraLength);
+				memcpy(block->data + block->used + extraLength, padding, padded - extraLength);
+				block->used += padded;
+			}
+		}
+	}
+
+	ReleaseSRWLockExclusive(&accessLog.lock);
+
+	if (full != NULL) WriteBlock(full, ticket);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: SealBlock ************************************************/
+/*********************************************************************************************************************/
+
+// Caller holds the lock. Takes the block being filled (NULL if there is none) out of the log and returns its turn in
+// the order of the writes; every sealed turn has to be passed to WriteBlock.
+static LONG SealBlock(AccessLogBlock** block)
+{
+	*block = accessLog.block;
+	accessLog.block = NULL;
+
+	return accessLog.sealed++;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: WriteBlock ************************************************/
+/*********************************************************************************************************************/
+
+// Writes a sealed block once the blocks sealed before it are written, then keeps it for reuse. Only the thread that
+// sealed the block waits here, and only for the writes ahead of it.
+static void WriteBlock(AccessLogBlock* block, LONG ticket)
+{
+	DWORD written;
+
+	AcquireSRWLockExclusive(&accessLog.writeLock);
+
+	while (accessLog.written != ticket) SleepConditionVariableSRW(&accessLog.turn, &accessLog.writeLock, INFINITE, 0);
+
+	ReleaseSRWLockExclusive(&accessLog.writeLock);
+
+	if (block != NULL && block->used > 0) WriteFile(accessLog.file, block->data, block->used, &written, NULL);
+
+	//*** Pass the turn on ********************************************************************************************
+	AcquireSRWLockExclusive(&accessLog.writeLock);
+	accessLog.written++;
+	ReleaseSRWLockExclusive(&accessLog.writeLock);
+
+	WakeAllConditionVariable(&accessLog.turn);
+
+	if (block == NULL) return;
+
+	AcquireSRWLockExclusive(&accessLog.lock);
+
+	if (accessLog.idleCount < ACCESS_LOG_IDLE)
+	{
+		block->next = accessLog.idle;
+		accessLog.idle = block;
+		accessLog.idleCount++;
+		block = NULL;
+	}
+
+	ReleaseSRWLockExclusive(&accessLog.lock);
+
+	//*** Ende ********************************************************************************************************
+	free(block);
+}
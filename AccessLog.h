@@ -0,0 +1,80 @@
+/*********************************************************************************************************************/
+/* Datei: AccessLog.h                                                                                                */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Binary log of all tile requests for offline replay, and process-wide request statistics            */
+/*********************************************************************************************************************/
+
+#ifndef ACCESS_LOG_H
+#define ACCESS_LOG_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define ACCESS_LOG_MAGIC			0x4C415653		// "SVAL"
+#define ACCESS_LOG_VERSION			1
+
+// record kinds
+#define ACCESS_TILE					0
+#define ACCESS_OPEN					1
+#define ACCESS_CLOSE				2
+
+// where a tile came from
+#define ACCESS_SOURCE_SHARED		1
+#define ACCESS_SOURCE_DISK			2
+#define ACCESS_SOURCE_OPENSLIDE		3
+
+// requests, shared cache hits, disk cache hits, openslide reads, failures, total latency in microseconds
+#define ACCESS_STATISTICS_COUNT		6
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur: AccessLogHeader *********************************************/
+/*********************************************************************************************************************/
+
+struct AccessLogHeader
+{
+	UINT32 magic;
+	UINT32 version;
+	INT64 frequency;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Struktur: AccessRecord ***********************************************/
+/*********************************************************************************************************************/
+
+// time is in performance counter ticks since the log was opened. An ACCESS_OPEN record is followed by the path of the
+// slide, x bytes long and padded with zeros to a multiple of 8 bytes.
+struct AccessRecord
+{
+	INT64 time;
+	INT64 handle;
+	UINT64 slideId;
+	INT32 level;
+	INT32 x;
+	INT32 y;
+	UINT32 latency;
+	UINT32 thread;
+	BYTE kind;
+	BYTE source;
+	BYTE failed;
+	BYTE reserved;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+INT64 AccessStart();
+void LogTileAccess(INT64 handle, UINT64 slideId, INT32 level, INT32 x, INT32 y, INT64 start, BYTE source, bool failed);
+void LogSlideOpen(INT64 handle, UINT64 slideId, const char* path);
+void LogSlideClose(INT64 handle, UINT64 slideId);
+void CloseAccessLog();
+
+#endif
@@ -0,0 +1,603 @@
+/*********************************************************************************************************************/
+/* Datei: Annotations.cpp                                                                                            */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Polygon annotations of a slide with an R-tree over their bounds, tile queries and scanline masks   */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+
+#include "Annotations.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define RTREE_FANOUT				16
+
+// polygons in a group beyond this many share the last mask value
+#define ANNOTATION_MAX_GROUPS		254
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static char* ReadTextFile(const wchar_t* path);
+static bool GetAttribute(const char* tag, const char* end, const char* name, char* value, size_t size);
+static void SortTileRecursive(std::vector<INT32>& items, const std::vector<double>& centers);
+static void BuildRTree(Annotations* annotations, std::vector<AnnotationNode>& nodes, std::vector<INT32>& entries);
+static void FindCandidates(Annotations* annotations, const double* rect, std::vector<INT32>* candidates);
+static bool PolygonIntersectsRect(Annotations* annotations, INT32 polygon, const double* rect);
+static bool SegmentIntersectsRect(const double* p, const double* q, const double* rect);
+static bool PointInPolygon(Annotations* annotations, INT32 polygon, double x, double y);
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: LoadAnnotationFile ********************************************/
+/*********************************************************************************************************************/
+
+// Reads the polygons of an ASAP annotation file, the format of the Camelyon16 annotations: <Annotation> elements with
+// a PartOfGroup attribute and <Coordinate X= Y=> children in level 0 pixels. Polygons, splines and rectangles are
+// taken as polygons; dots and point sets have no area and are skipped. Returns NULL if the file cannot be read.
+Annotations* LoadAnnotationFile(const wchar_t* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<INT32> start, groups, entries;
+	std::vector<double> points, bounds;
+	std::vector<AnnotationNode> nodes;
+	std::vector<std::string> names;
+	Annotations* annotations;
+	char* text;
+	char* cursor;
+	INT64 size;
+
+	if (path == NULL || (text = ReadTextFile(path)) == NULL) return NULL;
+
+	//*** Scan the annotation elements; <Annotations> and <AnnotationGroup> share the prefix **************************
+	for (cursor = text; (cursor = strstr(cursor, "<Annotation")) != NULL;)
+	{
+		char group[ANNOTATION_GROUP_NAME] = "";
+		char* tagEnd;
+		char* end;
+		size_t first = points.size();
+		INT32 index;
+
+		cursor += 11;
+		if (*cursor != ' ' && *cursor != '\t' && *cursor != '\r' && *cursor != '\n') continue;
+
+		if ((tagEnd = strchr(cursor, '>')) == NULL) break;
+		if ((end = strstr(tagEnd, "</Annotation>")) == NULL) end = tagEnd + strlen(tagEnd);
+
+		GetAttribute(cursor, tagEnd, "PartOfGroup", group, sizeof(group));
+
+		//*** The coordinates in document order; some files write the decimals with a comma ***************************
+		for (char* coordinate = tagEnd; (coordinate = strstr(coordinate, "<Coordinate")) != NULL && coordinate < end;)
+		{
+			char x[64], y[64];
+			char* coordinateEnd;
+
+			coordinate += 11;
+			if (*coordinate != ' ' && *coordinate != '\t' && *coordinate != '\r' && *coordinate != '\n') continue;
+			if ((coordinateEnd = strchr(coordinate, '>')) == NULL) break;
+
+			if (GetAttribute(coordinate, coordinateEnd, "X", x, sizeof(x)) && GetAttribute(coordinate, coordinateEnd, "Y", y, sizeof(y)))
+			{
+				std::replace(x, x + strlen(x), ',', '.');
+				std::replace(y, y + strlen(y), ',', '.');
+				points.push_back(strtod(x, NULL));
+				points.push_back(strtod(y, NULL));
+			}
+
+			coordinate = coordinateEnd;
+		}
+
+		cursor = end;
+
+		if (points.size() - first < 6)
+		{
+			points.resize(first);
+			continue;
+		}
+
+		//*** Bounds and group of the polygon *************************************************************************
+		double box[4] = { points[first], points[first + 1], points[first], points[first + 1] };
+
+		for (size_t i = first; i < points.size(); i += 2)
+		{
+			box[0] = (std::min)(box[0], points[i]);
+			box[1] = (std::min)(box[1], points[i + 1]);
+			box[2] = (std::max)(box[2], points[i]);
+			box[3] = (std::max)(box[3], points[i + 1]);
+		}
+
+		index = (INT32)(std::find(names.begin(), names.end(), std::string(group)) - names.begin());
+		if (index == (INT32)names.size()) names.push_back(group);
+
+		start.push_back((INT32)(first / 2));
+		bounds.insert(bounds.end(), box, box + 4);
+		groups.push_back((std::min)(index, ANNOTATION_MAX_GROUPS - 1));
+	}
+
+	free(text);
+
+	start.push_back((INT32)(points.size() / 2));
+
+	annotations = (Annotations*)calloc(1, sizeof(Annotations));
+	if (annotations == NULL) return NULL;
+
+	annotations->count = (INT32)groups.size();
+	annotations->bounds = bounds.empty() ? NULL : &bounds[0];
+	annotations->root = -1;
+
+	BuildRTree(annotations, nodes, entries);
+
+	//*** Copy into one charge against the memory budget **************************************************************
+	size = (INT64)(start.size() * sizeof(INT32) + points.size() * sizeof(double) + bounds.size() * sizeof(double) +
+		groups.size() * sizeof(INT32) + names.size() * ANNOTATION_GROUP_NAME + nodes.size() * sizeof(AnnotationNode) +
+		entries.size() * sizeof(INT32));
+
+	if (!ChargeMemory(MEMORY_SESSIONS, size))
+	{
+		free(annotations);
+		return NULL;
+	}
+
+	annotations->charged = size;
+	annotations->start = (INT32*)malloc(start.size() * sizeof(INT32));
+	annotations->points = (double*)malloc((points.size() + 1) * sizeof(double));
+	annotations->bounds = (double*)malloc((bounds.size() + 1) * sizeof(double));
+	annotations->groups = (INT32*)malloc((groups.size() + 1) * sizeof(INT32));
+	annotations->groupNames = (char(*)[ANNOTATION_GROUP_NAME])calloc(names.size() + 1, ANNOTATION_GROUP_NAME);
+	annotations->nodes = (AnnotationNode*)malloc((nodes.size() + 1) * sizeof(AnnotationNode));
+	annotations->entries = (INT32*)malloc((entries.size() + 1) * sizeof(INT32));
+
+	if (annotations->start == NULL || annotations->points == NULL || annotations->bounds == NULL ||
+		annotations->groups == NULL || annotations->groupNames == NULL || annotations->nodes == NULL ||
+		annotations->entries == NULL)
+	{
+		FreeAnnotations(annotations);
+		return NULL;
+	}
+
+	memcpy(annotations->start, &start[0], start.size() * sizeof(INT32));
+	if (!points.empty()) memcpy(annotations->points, &points[0], points.size() * sizeof(double));
+	if (!bounds.empty()) memcpy(annotations->bounds, &bounds[0], bounds.size() * sizeof(double));
+	if (!groups.empty()) memcpy(annotations->groups, &groups[0], groups.size() * sizeof(INT32));
+	if (!nodes.empty()) memcpy(annotations->nodes, &nodes[0], nodes.size() * sizeof(AnnotationNode));
+	if (!entries.empty()) memcpy(annotations->entries, &entries[0], entries.size() * sizeof(INT32));
+
+	for (size_t i = 0; i < names.size(); i++) strncpy(annotations->groupNames[i], names[i].c_str(), ANNOTATION_GROUP_NAME - 1);
+
+	annotations->groupCount = (INT32)names.size();
+	annotations->nodeCount = (INT32)nodes.size();
+	annotations->root = annotations->nodeCount - 1;
+
+	//*** Ende ********************************************************************************************************
+	return annotations;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: FreeAnnotations *********************************************/
+/*********************************************************************************************************************/
+
+void FreeAnnotations(Annotations* annotations)
+{
+	if (annotations == NULL) return;
+
+	ReleaseMemory(MEMORY_SESSIONS, annotations->charged);
+
+	free(annotations->start);
+	free(annotations->points);
+	free(annotations->bounds);
+	free(annotations->groups);
+	free(annotations->groupNames);
+	free(annotations->nodes);
+	free(annotations->entries);
+	free(annotations);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: QueryAnnotations *********************************************/
+/*********************************************************************************************************************/
+
+// Finds the polygons whose area intersects rect (minX, minY, maxX, maxY in level 0 pixels), in ascending order.
+// Stores up to maxIndices of them and returns how many there are.
+INT32 QueryAnnotations(Annotations* annotations, const double* rect, INT32* indices, INT32 maxIndices)
+{
+	std::vector<INT32> candidates;
+	INT32 found = 0;
+
+	FindCandidates(annotations, rect, &candidates);
+	std::sort(candidates.begin(), candidates.end());
+
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (!PolygonIntersectsRect(annotations, candidates[i], rect)) continue;
+
+		if (found < maxIndices && indices != NULL) indices[found] = candidates[i];
+		found++;
+	}
+
+	return found;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: RasterizeAnnotations *******************************************/
+/*********************************************************************************************************************/
+
+// Fills mask (width x height bytes) with 1 + the group of the polygon that covers the center of each pixel, 0 where
+// none does. Pixel (i, j) has its center at origin + (i + 0.5, j + 0.5) * scale in level 0 pixels. Where polygons
+// overlap, the higher group wins; a polygon covers a pixel by the even-odd rule.
+void RasterizeAnnotations(Annotations* annotations, double originX, double originY, double scale, INT32 width,
+	INT32 height, BYTE* mask)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	double rect[4] = { originX, originY, originX + width * scale, originY + height * scale };
+	std::vector<INT32> candidates;
+	std::vector<double> crossings;
+	std::vector<INT32> edges;
+
+	memset(mask, 0, (size_t)width * height);
+
+	FindCandidates(annotations, rect, &candidates);
+
+	//*** Paint the lower groups first, so that the higher ones overwrite them ****************************************
+	std::sort(candidates.begin(), candidates.end(), [annotations](INT32 a, INT32 b)
+	{
+		return annotations->groups[a] != annotations->groups[b] ? annotations->groups[a] < annotations->groups[b] : a < b;
+	});
+
+	for (size_t c = 0; c < candidates.size(); c++)
+	{
+		INT32 polygon = candidates[c];
+		INT32 first = annotations->start[polygon], last = annotations->start[polygon + 1];
+		BYTE value = (BYTE)(annotations->groups[polygon] + 1);
+		const double* points = annotations->points;
+
+		//*** Only the edges that reach into the rows of the mask *****************************************************
+		edges.clear();
+
+		for (INT32 i = first; i < last; i++)
+		{
+			INT32 j = (i + 1 < last) ? i + 1 : first;
+
+			if ((std::max)(points[2 * i + 1], points[2 * j + 1]) >= rect[1] &&
+				(std::min)(points[2 * i + 1], points[2 * j + 1]) <= rect[3])
+				edges.push_back(i);
+		}
+
+		for (INT32 row = 0; row < height; row++)
+		{
+			double y = originY + (row + 0.5) * scale;
+
+			//*** Where the row crosses the outline; the half-open test counts every vertex once **********************
+			crossings.clear();
+
+			for (size_t e = 0; e < edges.size(); e++)
+			{
+				INT32 i = edges[e], j = (i + 1 < last) ? i + 1 : first;
+				double y0 = points[2 * i + 1], y1 = points[2 * j + 1];
+
+				if ((y0 <= y) != (y1 <= y))
+					crossings.push_back(points[2 * i] + (y - y0) * (points[2 * j] - points[2 * i]) / (y1 - y0));
+			}
+
+			std::sort(crossings.begin(), crossings.end());
+
+			for (size_t k = 0; k + 1 < crossings.size(); k += 2)
+			{
+				INT32 left = (std::max)(0, (INT32)ceil((crossings[k] - originX) / scale - 0.5));
+				INT32 right = (std::min)(width - 1, (INT32)floor((crossings[k + 1] - originX) / scale - 0.5));
+
+				if (left <= right) memset(mask + (size_t)row * width + left, value, right - left + 1);
+			}
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ReadTextFile ***********************************************/
+/*********************************************************************************************************************/
+
+// The whole file, terminated with a zero byte
+static char* ReadTextFile(const wchar_t* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	LARGE_INTEGER size;
+	HANDLE file;
+	DWORD read;
+	char* text = NULL;
+
+	file = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (file == INVALID_HANDLE_VALUE) return NULL;
+
+	if (GetFileSizeEx(file, &size) && size.QuadPart < 0x7FFFFFFF && (text = (char*)malloc((size_t)size.QuadPart + 1)) != NULL)
+	{
+		if (ReadFile(file, text, (DWORD)size.QuadPart, &read, NULL) && read == (DWORD)size.QuadPart)
+		{
+			text[read] = 0;
+		}
+		else
+		{
+			free(text);
+			text = NULL;
+		}
+	}
+
+	CloseHandle(file);
+
+	//*** Ende ********************************************************************************************************
+	return text;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: GetAttribute ***********************************************/
+/*********************************************************************************************************************/
+
+// Copies the value of the attribute name="..." of the tag between tag and end
+static bool GetAttribute(const char* tag, const char* end, const char* name, char* value, size_t size)
+{
+	size_t length = strlen(name);
+
+	for (const char* c = tag; c + length + 2 < end; c++)
+	{
+		const char* close;
+
+		if ((c[-1] != ' ' && c[-1] != '\t' && c[-1] != '\r' && c[-1] != '\n') || strncmp(c, name, length) != 0 ||
+			c[length] != '=' || (c[length + 1] != '"' && c[length + 1] != '\''))
+			continue;
+
+		if ((close = strchr(c + length + 2, c[length + 1])) == NULL || close > end) return false;
+
+		length = (std::min)((size_t)(close - (c + length + 2)), size - 1);
+		memcpy(value, c + strlen(name) + 2, length);
+		value[length] = 0;
+
+		return true;
+	}
+
+	return false;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: SortTileRecursive ********************************************/
+/*********************************************************************************************************************/
+
+// Orders the items (x, y center pairs in centers) so that every run of RTREE_FANOUT items is spatially compact:
+// sorted by x into vertical slices, each slice sorted by y
+static void SortTileRecursive(std::vector<INT32>& items, const std::vector<double>& centers)
+{
+	size_t leaves = (items.size() + RTREE_FANOUT - 1) / RTREE_FANOUT;
+	size_t slices = (size_t)ceil(sqrt((double)leaves));
+	size_t sliceSize = (slices > 0) ? ((leaves + slices - 1) / slices) * RTREE_FANOUT : items.size();
+
+	std::sort(items.begin(), items.end(), [&centers](INT32 a, INT32 b) { return centers[2 * a] < centers[2 * b]; });
+
+	for (size_t first = 0; first < items.size(); first += sliceSize)
+	{
+		size_t last = (std::min)(first + sliceSize, items.size());
+
+		std::sort(items.begin() + first, items.begin() + last,
+			[&centers](INT32 a, INT32 b) { return centers[2 * a + 1] < centers[2 * b + 1]; });
+	}
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: BuildRTree ************************************************/
+/*********************************************************************************************************************/
+
+// Bulk-loads the tree bottom up: leaves over the polygons, then parents over each level until one node is left
+static void BuildRTree(Annotations* annotations, std::vector<AnnotationNode>& nodes, std::vector<INT32>& entries)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<double> centers;
+	size_t levelBegin, levelEnd;
+
+	if (annotations->count == 0) return;
+
+	//*** Leaves ******************************************************************************************************
+	for (INT32 i = 0; i < annotations->count; i++)
+	{
+		const double* box = annotations->bounds + 4 * i;
+
+		entries.push_back(i);
+		centers.push_back((box[0] + box[2]) / 2);
+		centers.push_back((box[1] + box[3]) / 2);
+	}
+
+	SortTileRecursive(entries, centers);
+
+	for (size_t first = 0; first < entries.size(); first += RTREE_FANOUT)
+	{
+		AnnotationNode node;
+
+		node.first = (INT32)first;
+		node.count = (INT32)(std::min)((size_t)RTREE_FANOUT, entries.size() - first);
+		node.leaf = 1;
+		memcpy(node.bounds, annotations->bounds + 4 * entries[first], sizeof(node.bounds));
+
+		for (INT32 i = 1; i < node.count; i++)
+		{
+			const double* box = annotations->bounds + 4 * entries[first + i];
+
+			node.bounds[0] = (std::min)(node.bounds[0], box[0]);
+			node.bounds[1] = (std::min)(node.bounds[1], box[1]);
+			node.bounds[2] = (std::max)(node.bounds[2], box[2]);
+			node.bounds[3] = (std::max)(node.bounds[3], box[3]);
+		}
+
+		nodes.push_back(node);
+	}
+
+	//*** Each level is reordered in place before its parents take contiguous runs of it ******************************
+	for (levelBegin = 0, levelEnd = nodes.size(); levelEnd - levelBegin > 1; levelBegin = levelEnd, levelEnd = nodes.size())
+	{
+		std::vector<AnnotationNode> level(nodes.begin() + levelBegin, nodes.begin() + levelEnd);
+		std::vector<INT32> order;
+
+		centers.clear();
+
+		for (size_t i = 0; i < level.size(); i++)
+		{
+			order.push_back((INT32)i);
+			centers.push_back((level[i].bounds[0] + level[i].bounds[2]) / 2);
+			centers.push_back((level[i].bounds[1] + level[i].bounds[3]) / 2);
+		}
+
+		SortTileRecursive(order, centers);
+
+		for (size_t i = 0; i < order.size(); i++) nodes[levelBegin + i] = level[order[i]];
+
+		for (size_t first = levelBegin; first < levelEnd; first += RTREE_FANOUT)
+		{
+			AnnotationNode node;
+
+			node.first = (INT32)first;
+			node.count = (INT32)(std::min)((size_t)RTREE_FANOUT, levelEnd - first);
+			node.leaf = 0;
+			memcpy(node.bounds, nodes[first].bounds, sizeof(node.bounds));
+
+			for (INT32 i = 1; i < node.count; i++)
+			{
+				const double* box = nodes[first + i].bounds;
+
+				node.bounds[0] = (std::min)(node.bounds[0], box[0]);
+				node.bounds[1] = (std::min)(node.bounds[1], box[1]);
+				node.bounds[2] = (std::max)(node.bounds[2], box[2]);
+				node.bounds[3] = (std::max)(node.bounds[3], box[3]);
+			}
+
+			nodes.push_back(node);
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: FindCandidates **********************************************/
+/*********************************************************************************************************************/
+
+// The polygons whose bounds intersect rect
+static void FindCandidates(Annotations* annotations, const double* rect, std::vector<INT32>* candidates)
+{
+	std::vector<INT32> stack;
+
+	if (annotations->root < 0) return;
+
+	stack.push_back(annotations->root);
+
+	while (!stack.empty())
+	{
+		AnnotationNode* node = &annotations->nodes[stack.back()];
+
+		stack.pop_back();
+
+		if (node->bounds[0] > rect[2] || node->bounds[2] < rect[0] || node->bounds[1] > rect[3] || node->bounds[3] < rect[1])
+			continue;
+
+		for (INT32 i = node->first; i < node->first + node->count; i++)
+		{
+			if (!node->leaf)
+			{
+				stack.push_back(i);
+				continue;
+			}
+
+			const double* box = annotations->bounds + 4 * annotations->entries[i];
+
+			if (box[0] <= rect[2] && box[2] >= rect[0] && box[1] <= rect[3] && box[3] >= rect[1])
+				candidates->push_back(annotations->entries[i]);
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: PolygonIntersectsRect ******************************************/
+/*********************************************************************************************************************/
+
+// An edge crosses the rectangle, or the rectangle lies completely inside the polygon
+static bool PolygonIntersectsRect(Annotations* annotations, INT32 polygon, const double* rect)
+{
+	INT32 first = annotations->start[polygon], last = annotations->start[polygon + 1];
+
+	for (INT32 i = first; i < last; i++)
+	{
+		INT32 j = (i + 1 < last) ? i + 1 : first;
+
+		if (SegmentIntersectsRect(annotations->points + 2 * i, annotations->points + 2 * j, rect)) return true;
+	}
+
+	return PointInPolygon(annotations, polygon, (rect[0] + rect[2]) / 2, (rect[1] + rect[3]) / 2);
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: SegmentIntersectsRect ******************************************/
+/*********************************************************************************************************************/
+
+// Liang-Barsky clipping of the segment p-q against the rectangle
+static bool SegmentIntersectsRect(const double* p, const double* q, const double* rect)
+{
+	double dx = q[0] - p[0], dy = q[1] - p[1];
+	double enter = 0, leave = 1;
+	double denominators[4] = { -dx, dx, -dy, dy };
+	double numerators[4] = { p[0] - rect[0], rect[2] - p[0], p[1] - rect[1], rect[3] - p[1] };
+
+	for (int i = 0; i < 4; i++)
+	{
+		if (denominators[i] == 0)
+		{
+			if (numerators[i] < 0) return false;
+			continue;
+		}
+
+		double t = numerators[i] / denominators[i];
+
+		if (denominators[i] < 0) enter = (std::max)(enter, t);
+		else leave = (std::min)(leave, t);
+
+		if (enter > leave) return false;
+	}
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: PointInPolygon **********************************************/
+/*********************************************************************************************************************/
+
+// Even-odd rule, like the rasterization
+static bool PointInPolygon(Annotations* annotations, INT32 polygon, double x, double y)
+{
+	INT32 first = annotations->start[polygon], last = annotations->start[polygon + 1];
+	const double* points = annotations->points;
+	bool inside = false;
+
+	for (INT32 i = first; i < last; i++)
+	{
+		INT32 j = (i + 1 < last) ? i + 1 : first;
+		double y0 = points[2 * i + 1], y1 = points[2 * j + 1];
+
+		if ((y0 <= y) != (y1 <= y) && x < points[2 * i] + (y - y0) * (points[2 * j] - points[2 * i]) / (y1 - y0))
+			inside = !inside;
+	}
+
+	return inside;
+}
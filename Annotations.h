@@ -0,0 +1,67 @@
+/*********************************************************************************************************************/
+/* Datei: Annotations.h                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Polygon annotations of a slide with an R-tree over their bounds, tile queries and scanline masks   */
+/*********************************************************************************************************************/
+
+#ifndef ANNOTATIONS_H
+#define ANNOTATIONS_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define ANNOTATION_GROUP_NAME		64
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// A node covers either polygons (leaf: entries[first] ...) or child nodes (nodes[first] ...)
+struct AnnotationNode
+{
+	double bounds[4];
+	INT32 first;
+	INT32 count;
+	INT32 leaf;
+};
+
+struct Annotations
+{
+	// polygon i has the points start[i] to start[i + 1] - 1; points are x, y pairs in level 0 pixels
+	INT32 count;
+	INT32* start;
+	double* points;
+	double* bounds;
+	INT32* groups;
+
+	// groups in the order of their first appearance in the file
+	INT32 groupCount;
+	char (*groupNames)[ANNOTATION_GROUP_NAME];
+
+	// R-tree bulk-loaded with sort-tile-recursive; root is the last node, -1 without polygons
+	AnnotationNode* nodes;
+	INT32 nodeCount;
+	INT32 root;
+	INT32* entries;
+
+	INT64 charged;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+Annotations* LoadAnnotationFile(const wchar_t* path);
+void FreeAnnotations(Annotations* annotations);
+INT32 QueryAnnotations(Annotations* annotations, const double* rect, INT32* indices, INT32 maxIndices);
+void RasterizeAnnotations(Annotations* annotations, double originX, double originY, double scale, INT32 width,
+	INT32 height, BYTE* mask);
+
+#endif
@@ -0,0 +1,342 @@
+/*********************************************************************************************************************/
+/* Datei: BufferPool.cpp                                                                                             */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Size-classed pool of aligned tile buffers with per-thread free lists                               */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+
+#include "BufferPool.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// size classes are powers of two from 64 KiB up to 64 MiB; larger buffers bypass the pool
+#define POOL_MIN_SHIFT				16
+#define POOL_CLASSES				11
+
+// every buffer is preceded by one cache line holding its header, so the data is cache-line aligned
+#define POOL_HEADER_SIZE			64
+
+// slabs are carved into buffers of one class; a slab holds at least one buffer
+#define POOL_SLAB_SIZE				(4 * 1024 * 1024)
+
+// buffers a thread keeps for itself per size class before returning them to the shared list
+#define POOL_THREAD_CACHE			8
+
+#define POOL_CLASS_DIRECT			-1
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct BufferHeader
+{
+	SLIST_ENTRY link;
+	INT32 sizeClass;
+	SIZE_T directSize;
+};
+
+struct ThreadCache
+{
+	BufferHeader* buffers[POOL_CLASSES][POOL_THREAD_CACHE];
+	int count[POOL_CLASSES];
+};
+
+static struct
+{
+	SLIST_HEADER freeList[POOL_CLASSES];
+	volatile LONG initialized;
+	volatile LONG largePages;
+	volatile LONGLONG slabBytes;
+} pool;
+
+static __declspec(thread) ThreadCache threadCache;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static void InitializePool();
+static BufferHeader* AllocateSlab(int sizeClass);
+static BYTE* AllocatePages(SIZE_T* size, bool largePages);
+static INT64 TrimTileBuffers(INT64 bytes);
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: SetTileBufferPool ********************************************/
+/*********************************************************************************************************************/
+
+// Switches the backing of new slabs to large pages. This needs the "Lock pages in memory" privilege; without it the
+// call returns false and the pool keeps using normal pages. Slabs already allocated are not affected.
+extern "C" __declspec(dllexport) BOOL SetTileBufferPool(BOOL largePages)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SIZE_T size;
+	BYTE* probe;
+
+	if (!largePages)
+	{
+		InterlockedExchange(&pool.largePages, 0);
+		return true;
+	}
+
+	//*** Probe once whether large pages can be allocated at all ******************************************************
+	size = GetLargePageMinimum();
+	if (size == 0 || (probe = AllocatePages(&size, true)) == NULL) return false;
+
+	VirtualFree(probe, 0, MEM_RELEASE);
+	InterlockedExchange(&pool.largePages, 1);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: AllocTileBuffer *********************************************/
+/*********************************************************************************************************************/
+
+BYTE* AllocTileBuffer(size_t size)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	BufferHeader* header;
+	int sizeClass = 0;
+
+	InitializePool();
+
+	//*** Find the size class *****************************************************************************************
+	while (sizeClass < POOL_CLASSES && ((size_t)1 << (POOL_MIN_SHIFT + sizeClass)) < size) sizeClass++;
+
+	//*** Too large for the pool: allocate the pages directly *********************************************************
+	if (sizeClass == POOL_CLASSES)
+	{
+		SIZE_T total = (POOL_HEADER_SIZE + size + 4095) & ~(SIZE_T)4095;
+		BYTE* pages;
+
+		if (!ChargeMemory(MEMORY_TILE_BUFFERS, (INT64)total)) return NULL;
+
+		if ((pages = AllocatePages(&total, false)) == NULL)
+		{
+			ReleaseMemory(MEMORY_TILE_BUFFERS, (INT64)total);
+			return NULL;
+		}
+
+		header = (BufferHeader*)pages;
+		header->sizeClass = POOL_CLASS_DIRECT;
+		header->directSize = total;
+
+		return pages + POOL_HEADER_SIZE;
+	}
+
+	//*** First the buffers of this thread, then the shared list, then a new slab *************************************
+	if (threadCache.count[sizeClass] > 0)
+		header = threadCache.buffers[sizeClass][--threadCache.count[sizeClass]];
+	else if ((header = (BufferHeader*)InterlockedPopEntrySList(&pool.freeList[sizeClass])) == NULL)
+		header = AllocateSlab(sizeClass);
+
+	if (header == NULL) return NULL;
+
+	return (BYTE*)header + POOL_HEADER_SIZE;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: FreeTileBuffer **********************************************/
+/*********************************************************************************************************************/
+
+void FreeTileBuffer(BYTE* buffer)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	BufferHeader* header;
+	int sizeClass;
+
+	if (buffer == NULL) return;
+
+	header = (BufferHeader*)(buffer - POOL_HEADER_SIZE);
+	sizeClass = header->sizeClass;
+
+	if (sizeClass == POOL_CLASS_DIRECT)
+	{
+		ReleaseMemory(MEMORY_TILE_BUFFERS, (INT64)header->directSize);
+		VirtualFree(header, 0, MEM_RELEASE);
+		return;
+	}
+
+	//*** Keep it for this thread, or hand it back to all threads *****************************************************
+	// a buffer that owns its slab always goes to the shared list, where TrimTileBuffers can give it back
+	if (header->directSize == 0 && threadCache.count[sizeClass] < POOL_THREAD_CACHE)
+		threadCache.buffers[sizeClass][threadCache.count[sizeClass]++] = header;
+	else
+		InterlockedPushEntrySList(&pool.freeList[sizeClass], &header->link);
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: ReleaseThreadBuffers *******************************************/
+/*********************************************************************************************************************/
+
+// Moves the buffers cached by the calling thread to the shared lists; called when a thread detaches from the DLL.
+void ReleaseThreadBuffers()
+{
+	if (pool.initialized != 2) return;
+
+	for (int sizeClass = 0; sizeClass < POOL_CLASSES; sizeClass++)
+	{
+		while (threadCache.count[sizeClass] > 0)
+		{
+			BufferHeader* header = threadCache.buffers[sizeClass][--threadCache.count[sizeClass]];
+			InterlockedPushEntrySList(&pool.freeList[sizeClass], &header->link);
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: InitializePool **********************************************/
+/*********************************************************************************************************************/
+
+static void InitializePool()
+{
+	if (pool.initialized == 2) return;
+
+	//*** The first caller initializes the lists, all others wait for it **********************************************
+	if (InterlockedCompareExchange(&pool.initialized, 1, 0) == 0)
+	{
+		for (int sizeClass = 0; sizeClass < POOL_CLASSES; sizeClass++) InitializeSListHead(&pool.freeList[sizeClass]);
+
+		//*** Idle buffers are given up like a cache when memory gets tight *******************************************
+		RegisterMemoryShedder(MEMORY_CACHES, TrimTileBuffers);
+
+		MemoryBarrier();
+		InterlockedExchange(&pool.initialized, 2);
+	}
+	else
+	{
+		while (pool.initialized != 2) YieldProcessor();
+	}
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: AllocateSlab ***********************************************/
+/*********************************************************************************************************************/
+
+// Allocates a slab for the class, pushes all but one of its buffers onto the shared list and returns that one.
+static BufferHeader* AllocateSlab(int sizeClass)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SIZE_T stride = POOL_HEADER_SIZE + ((SIZE_T)1 << (POOL_MIN_SHIFT + sizeClass));
+	SIZE_T size = (stride > POOL_SLAB_SIZE) ? stride : POOL_SLAB_SIZE;
+	SIZE_T charged, count;
+	BYTE* slab;
+
+	//*** Charge the size the pages will be rounded to; large pages may need an additional charge *********************
+	size = (size + 4095) & ~(SIZE_T)4095;
+	charged = size;
+
+	if (!ChargeMemory(MEMORY_TILE_BUFFERS, (INT64)charged)) return NULL;
+
+	if ((slab = AllocatePages(&size, pool.largePages != 0)) == NULL)
+	{
+		ReleaseMemory(MEMORY_TILE_BUFFERS, (INT64)charged);
+		return NULL;
+	}
+
+	if (size > charged && !ChargeMemory(MEMORY_TILE_BUFFERS, (INT64)(size - charged)))
+	{
+		ReleaseMemory(MEMORY_TILE_BUFFERS, (INT64)charged);
+		VirtualFree(slab, 0, MEM_RELEASE);
+		return NULL;
+	}
+
+	InterlockedExchangeAdd64(&pool.slabBytes, (LONGLONG)size);
+
+	//*** Carve the slab into buffers *********************************************************************************
+	count = size / stride;
+
+	for (SIZE_T i = 0; i < count; i++)
+	{
+		BufferHeader* header = (BufferHeader*)(slab + i * stride);
+
+		header->sizeClass = sizeClass;
+
+		// a slab that holds a single buffer can be given back on its own, so it remembers its size
+		header->directSize = (count == 1) ? size : 0;
+
+		if (i > 0) InterlockedPushEntrySList(&pool.freeList[sizeClass], &header->link);
+	}
+
+	return (BufferHeader*)slab;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: TrimTileBuffers *********************************************/
+/*********************************************************************************************************************/
+
+// Shedder of the memory budget: frees idle buffers of the classes that own a whole slab, largest first. These are
+// never held in the thread caches, so all idle ones are on the shared lists. Smaller buffers share their slab with
+// others and stay in the pool.
+static INT64 TrimTileBuffers(INT64 bytes)
+{
+	INT64 freed = 0;
+
+	for (int sizeClass = POOL_CLASSES - 1; sizeClass >= 0 && freed < bytes; sizeClass--)
+	{
+		BufferHeader* header;
+
+		if (POOL_SLAB_SIZE / (POOL_HEADER_SIZE + ((SIZE_T)1 << (POOL_MIN_SHIFT + sizeClass))) > 1) break;
+
+		while (freed < bytes && (header = (BufferHeader*)InterlockedPopEntrySList(&pool.freeList[sizeClass])) != NULL)
+		{
+			SIZE_T size = header->directSize;
+
+			if (size == 0)
+			{
+				InterlockedPushEntrySList(&pool.freeList[sizeClass], &header->link);
+				break;
+			}
+
+			VirtualFree(header, 0, MEM_RELEASE);
+			InterlockedExchangeAdd64(&pool.slabBytes, -(LONGLONG)size);
+			ReleaseMemory(MEMORY_TILE_BUFFERS, (INT64)size);
+			freed += size;
+		}
+	}
+
+	return freed;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: AllocatePages **********************************************/
+/*********************************************************************************************************************/
+
+// Commits page-aligned memory; size is rounded up to the page granularity that was actually used.
+static BYTE* AllocatePages(SIZE_T* size, bool largePages)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SIZE_T granularity;
+	BYTE* pages;
+
+	//*** Large pages when requested, falling back to normal pages ****************************************************
+	if (largePages && (granularity = GetLargePageMinimum()) != 0)
+	{
+		SIZE_T rounded = (*size + granularity - 1) / granularity * granularity;
+
+		if ((pages = (BYTE*)VirtualAlloc(NULL, rounded, MEM_RESERVE | MEM_COMMIT | MEM_LARGE_PAGES, PAGE_READWRITE)) != NULL)
+		{
+			*size = rounded;
+			return pages;
+		}
+	}
+
+	*size = (*size + 4095) & ~(SIZE_T)4095;
+
+	return (BYTE*)VirtualAlloc(NULL, *size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+}
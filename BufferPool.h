@@ -0,0 +1,22 @@
+/*********************************************************************************************************************/
+/* Datei: BufferPool.h                                                                                               */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Size-classed pool of aligned tile buffers with per-thread free lists                               */
+/*********************************************************************************************************************/
+
+#ifndef BUFFER_POOL_H
+#define BUFFER_POOL_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+BYTE* AllocTileBuffer(size_t size);
+void FreeTileBuffer(BYTE* buffer);
+void ReleaseThreadBuffers();
+
+#endif
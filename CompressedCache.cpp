@@ -0,0 +1,474 @@
+/*********************************************************************************************************************/
+/* Datei: CompressedCache.cpp                                                                                        */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   In-memory tier of losslessly compressed tiles behind the shared cache                              */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <list>
+#include <unordered_map>
+
+#include "CompressedCache.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// matches are found through a table of the last position of every hashed 4-byte sequence
+#define LZ_HASH_BITS				12
+#define LZ_MIN_MATCH				4
+#define LZ_MAX_OFFSET				65535
+
+// the last bytes of a tile are always literals, so that the matcher never reads past the end
+#define LZ_END_LITERALS				12
+
+// a tile is only kept if it shrinks to at most this fraction (in 1/16) of its size
+#define COMPRESSED_MAX_RATIO		12
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct CompressedKey
+{
+	UINT64 slideId;
+	INT32 level;
+	INT32 x;
+	INT32 y;
+
+	bool operator==(const CompressedKey& other) const
+	{
+		return slideId == other.slideId && level == other.level && x == other.x && y == other.y;
+	}
+};
+
+struct CompressedKeyHash
+{
+	size_t operator()(const CompressedKey& key) const
+	{
+		UINT64 hash = key.slideId ^ ((UINT64)(UINT32)key.level << 56) ^ ((UINT64)(UINT32)key.y << 28) ^ (UINT64)(UINT32)key.x;
+
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDULL;
+		hash ^= hash >> 33;
+
+		return (size_t)hash;
+	}
+};
+
+struct CompressedTile
+{
+	CompressedKey key;
+	BYTE* data;
+	UINT32 size;
+	UINT32 length;
+};
+
+// Compressed tiles, most recently used first
+static struct
+{
+	SRWLOCK lock;
+	std::list<CompressedTile> tiles;
+	std::unordered_map<CompressedKey, std::list<CompressedTile>::iterator, CompressedKeyHash> index;
+	INT64 bytes;
+	INT64 maxBytes;
+	volatile LONG registered;
+	volatile LONGLONG values[COMPRESSED_STATISTICS_COUNT];
+	LARGE_INTEGER frequency;
+} compressed;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static UINT32 CompressTile(const BYTE* source, UINT32 length, BYTE* target, UINT32 capacity);
+static bool DecompressTile(const BYTE* source, UINT32 size, BYTE* target, UINT32 length);
+static INT64 EvictTiles(INT64 bytes, INT64 limit);
+static INT64 TrimCompressedCache(INT64 bytes);
+
+
+/*********************************************************************************************************************/
+/***************************************** Funktion: SetCompressedTileCache ******************************************/
+/*********************************************************************************************************************/
+
+// Sets the size of the compressed tier in bytes of compressed data; 0 disables it and drops its tiles. Tiles land here
+// when the shared cache evicts them, or straight after decoding while no shared cache is attached.
+extern "C" __declspec(dllexport) BOOL SetCompressedTileCache(INT64 maxBytes)
+{
+	if (maxBytes < 0) return false;
+
+	//*** The tier is given up like the other caches when memory gets tight *******************************************
+	if (InterlockedExchange(&compressed.registered, 1) == 0) RegisterMemoryShedder(MEMORY_CACHES, TrimCompressedCache);
+
+	AcquireSRWLockExclusive(&compressed.lock);
+	compressed.maxBytes = maxBytes;
+	ReleaseSRWLockExclusive(&compressed.lock);
+
+	EvictTiles(0x7FFFFFFFFFFFFFFFLL, maxBytes);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************** Funktion: GetCompressedCacheStatistics ***************************************/
+/*********************************************************************************************************************/
+
+// Copies the COMPRESSED_STATISTICS_COUNT counters; reset clears the counters but not the first three, which describe
+// the current content. Uncompressed bytes divided by compressed bytes is the compression ratio.
+extern "C" __declspec(dllexport) BOOL GetCompressedCacheStatistics(INT64* values, BOOL reset)
+{
+	if (values == NULL) return false;
+
+	for (int i = 0; i < COMPRESSED_STATISTICS_COUNT; i++)
+		values[i] = (reset && i >= 3) ? InterlockedExchange64(&compressed.values[i], 0) : compressed.values[i];
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: CompressedCacheLookup ******************************************/
+/*********************************************************************************************************************/
+
+// Decompresses a hit straight into data; the lock is only held while the tile is found and copied out of the list
+bool CompressedCacheLookup(UINT64 slideId, INT32 level, INT32 x, INT32 y, BYTE* data, UINT32 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	CompressedKey key = { slideId, level, x, y };
+	LARGE_INTEGER start, end;
+	bool found = false;
+
+	if (compressed.maxBytes == 0) return false;
+
+	QueryPerformanceCounter(&start);
+	InterlockedIncrement64(&compressed.values[3]);
+
+	//*** Shared lock for the search, so that hits on other tiles decompress in parallel ******************************
+	AcquireSRWLockShared(&compressed.lock);
+
+	std::unordered_map<CompressedKey, std::list<CompressedTile>::iterator, CompressedKeyHash>::iterator it =
+		compressed.index.find(key);
+
+	if (it != compressed.index.end() && it->second->length == length)
+		found = DecompressTile(it->second->data, it->second->size, data, length);
+
+	ReleaseSRWLockShared(&compressed.lock);
+
+	if (!found) return false;
+
+	//*** Move the tile to the front; it may have been evicted meanwhile **********************************************
+	AcquireSRWLockExclusive(&compressed.lock);
+
+	if ((it = compressed.index.find(key)) != compressed.index.end())
+		compressed.tiles.splice(compressed.tiles.begin(), compressed.tiles, it->second);
+
+	ReleaseSRWLockExclusive(&compressed.lock);
+
+	if (compressed.frequency.QuadPart == 0) QueryPerformanceFrequency(&compressed.frequency);
+	QueryPerformanceCounter(&end);
+
+	InterlockedIncrement64(&compressed.values[4]);
+	InterlockedExchangeAdd64(&compressed.values[5], (end.QuadPart - start.QuadPart) * 1000000 / compressed.frequency.QuadPart);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: CompressedCacheStore *******************************************/
+/*********************************************************************************************************************/
+
+// Compresses outside of the lock; the charge is also taken before the lock, as charging may shed this very cache
+void CompressedCacheStore(UINT64 slideId, INT32 level, INT32 x, INT32 y, const BYTE* data, UINT32 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	CompressedKey key = { slideId, level, x, y };
+	CompressedTile tile = { key, NULL, 0, length };
+	UINT32 capacity = length / 16 * COMPRESSED_MAX_RATIO;
+	BYTE* buffer;
+	INT64 size;
+	bool present;
+
+	if (compressed.maxBytes == 0 || length == 0) return;
+
+	//*** Nothing to do if the tile is already there ******************************************************************
+	AcquireSRWLockShared(&compressed.lock);
+	present = (compressed.index.find(key) != compressed.index.end());
+	ReleaseSRWLockShared(&compressed.lock);
+
+	if (present || (buffer = (BYTE*)malloc(capacity)) == NULL) return;
+
+	if ((tile.size = CompressTile(data, length, buffer, capacity)) == 0)
+	{
+		free(buffer);
+		InterlockedIncrement64(&compressed.values[7]);
+		return;
+	}
+
+	//*** Shrink the buffer to the compressed size ********************************************************************
+	tile.data = (BYTE*)realloc(buffer, tile.size);
+	if (tile.data == NULL) tile.data = buffer;
+
+	size = (INT64)(tile.size + sizeof(CompressedTile));
+
+	if (size > compressed.maxBytes || !ChargeMemory(MEMORY_CACHES, size))
+	{
+		free(tile.data);
+		return;
+	}
+
+	AcquireSRWLockExclusive(&compressed.lock);
+
+	present = (compressed.index.find(key) != compressed.index.end());
+
+	if (!present)
+	{
+		compressed.tiles.push_front(tile);
+		compressed.index[key] = compressed.tiles.begin();
+		compressed.bytes += size;
+
+		InterlockedIncrement64(&compressed.values[0]);
+		InterlockedExchangeAdd64(&compressed.values[1], tile.size);
+		InterlockedExchangeAdd64(&compressed.values[2], length);
+		InterlockedIncrement64(&compressed.values[6]);
+	}
+
+	ReleaseSRWLockExclusive(&compressed.lock);
+
+	if (present)
+	{
+		free(tile.data);
+		ReleaseMemory(MEMORY_CACHES, size);
+	}
+
+	//*** Evict the least recently used tiles beyond the size of the tier *********************************************
+	EvictTiles(0x7FFFFFFFFFFFFFFFLL, compressed.maxBytes);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: EvictTiles ************************************************/
+/*********************************************************************************************************************/
+
+// Drops the least recently used tiles until bytes are freed or no more than limit bytes are left
+static INT64 EvictTiles(INT64 bytes, INT64 limit)
+{
+	INT64 freed = 0;
+
+	AcquireSRWLockExclusive(&compressed.lock);
+
+	while (freed < bytes && compressed.bytes > limit && !compressed.tiles.empty())
+	{
+		CompressedTile* tile = &compressed.tiles.back();
+		INT64 evicted = (INT64)(tile->size + sizeof(CompressedTile));
+
+		InterlockedDecrement64(&compressed.values[0]);
+		InterlockedExchangeAdd64(&compressed.values[1], -(LONGLONG)tile->size);
+		InterlockedExchangeAdd64(&compressed.values[2], -(LONGLONG)tile->length);
+		InterlockedIncrement64(&compressed.values[8]);
+
+		free(tile->data);
+		compressed.index.erase(tile->key);
+		compressed.tiles.pop_back();
+		compressed.bytes -= evicted;
+		freed += evicted;
+	}
+
+	ReleaseSRWLockExclusive(&compressed.lock);
+
+	ReleaseMemory(MEMORY_CACHES, freed);
+
+	return freed;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: TrimCompressedCache *******************************************/
+/*********************************************************************************************************************/
+
+// Shedder of the memory budget
+static INT64 TrimCompressedCache(INT64 bytes)
+{
+	return EvictTiles(bytes, 0);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: CompressTile ***********************************************/
+/*********************************************************************************************************************/
+
+// Byte-oriented LZ77 in the block layout of LZ4: a token with the literal count in the high and the match length - 4
+// in the low nibble, both continued in bytes of 255 when they reach 15, the literals, then a 16-bit offset. Background
+// pixels repeat every 4 bytes and become a few long matches. Returns 0 if the result does not fit into capacity.
+static UINT32 CompressTile(const BYTE* source, UINT32 length, BYTE* target, UINT32 capacity)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	INT32 table[1 << LZ_HASH_BITS];
+	UINT32 position = 0, anchor = 0, output = 0, misses = 0;
+	UINT32 limit = (length > LZ_END_LITERALS) ? length - LZ_END_LITERALS : 0;
+
+	memset(table, 0xFF, sizeof(table));
+
+	while (position < limit)
+	{
+		UINT32 sequence, hash, match, matchLength, literals;
+		INT32 candidate;
+
+		memcpy(&sequence, source + position, 4);
+		hash = (sequence * 2654435761U) >> (32 - LZ_HASH_BITS);
+		candidate = table[hash];
+		table[hash] = (INT32)position;
+
+		//*** Skip ahead faster the longer no match turns up **********************************************************
+		if (candidate < 0 || position - candidate > LZ_MAX_OFFSET || memcmp(source + candidate, source + position, 4) != 0)
+		{
+			position += 1 + (misses++ >> 6);
+			continue;
+		}
+
+		match = (UINT32)candidate;
+		matchLength = LZ_MIN_MATCH;
+
+		while (position + matchLength < length - 5 && source[match + matchLength] == source[position + matchLength])
+			matchLength++;
+
+		//*** Token, literals, offset and the rest of the match length ************************************************
+		literals = position - anchor;
+
+		if (output + 1 + literals / 255 + 1 + literals + 2 + (matchLength - LZ_MIN_MATCH) / 255 + 1 > capacity) return 0;
+
+		BYTE* token = target + output++;
+		*token = (BYTE)(((literals < 15) ? literals : 15) << 4);
+
+		if (literals >= 15)
+		{
+			UINT32 rest = literals - 15;
+
+			for (; rest >= 255; rest -= 255) target[output++] = 255;
+			target[output++] = (BYTE)rest;
+		}
+
+		memcpy(target + output, source + anchor, literals);
+		output += literals;
+
+		target[output++] = (BYTE)(position - match);
+		target[output++] = (BYTE)((position - match) >> 8);
+
+		matchLength -= LZ_MIN_MATCH;
+		*token |= (BYTE)((matchLength < 15) ? matchLength : 15);
+
+		if (matchLength >= 15)
+		{
+			UINT32 rest = matchLength - 15;
+
+			for (; rest >= 255; rest -= 255) target[output++] = 255;
+			target[output++] = (BYTE)rest;
+		}
+
+		position += matchLength + LZ_MIN_MATCH;
+		anchor = position;
+		misses = 0;
+	}
+
+	//*** The remaining bytes as the literals of a last token without a match *****************************************
+	UINT32 literals = length - anchor;
+
+	if (output + 1 + literals / 255 + 1 + literals > capacity) return 0;
+
+	target[output++] = (BYTE)(((literals < 15) ? literals : 15) << 4);
+
+	if (literals >= 15)
+	{
+		UINT32 rest = literals - 15;
+
+		for (; rest >= 255; rest -= 255) target[output++] = 255;
+		target[output++] = (BYTE)rest;
+	}
+
+	memcpy(target + output, source + anchor, literals);
+	output += literals;
+
+	//*** Ende ********************************************************************************************************
+	return output;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: DecompressTile **********************************************/
+/*********************************************************************************************************************/
+
+// Checks every length and offset against both buffers, so a damaged block fails instead of writing out of bounds
+static bool DecompressTile(const BYTE* source, UINT32 size, BYTE* target, UINT32 length)
+{
+	UINT32 input = 0, output = 0;
+
+	while (input < size)
+	{
+		UINT32 token = source[input++];
+		UINT32 literals = token >> 4, matchLength = token & 15, offset;
+		BYTE value;
+
+		if (literals == 15)
+		{
+			do
+			{
+				if (input >= size) return false;
+				value = source[input++];
+				literals += value;
+			}
+			while (value == 255);
+		}
+
+		if (literals > size - input || literals > length - output) return false;
+
+		memcpy(target + output, source + input, literals);
+		input += literals;
+		output += literals;
+
+		//*** The last token has no match *****************************************************************************
+		if (input == size) break;
+		if (size - input < 2) return false;
+
+		offset = source[input] | (source[input + 1] << 8);
+		input += 2;
+
+		if (matchLength == 15)
+		{
+			do
+			{
+				if (input >= size) return false;
+				value = source[input++];
+				matchLength += value;
+			}
+			while (value == 255);
+		}
+
+		matchLength += LZ_MIN_MATCH;
+
+		if (offset == 0 || offset > output || matchLength > length - output) return false;
+
+		//*** An overlapping match repeats a period; every copy doubles the part that can be copied at once ***********
+		BYTE* match = target + output - offset;
+
+		while (matchLength > 0)
+		{
+			UINT32 chunk = (UINT32)(target + output - match);
+
+			if (chunk > matchLength) chunk = matchLength;
+
+			memcpy(target + output, match, chunk);
+			output += chunk;
+			matchLength -= chunk;
+		}
+	}
+
+	return output == length;
+}
@@ -0,0 +1,30 @@
+/*********************************************************************************************************************/
+/* Datei: CompressedCache.h                                                                                          */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   In-memory tier of losslessly compressed tiles behind the shared cache                              */
+/*********************************************************************************************************************/
+
+#ifndef COMPRESSED_CACHE_H
+#define COMPRESSED_CACHE_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// tiles held, compressed bytes held, uncompressed bytes held, lookups, hits, total hit latency in microseconds,
+// tiles stored, tiles rejected as incompressible, tiles evicted
+#define COMPRESSED_STATISTICS_COUNT	9
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+bool CompressedCacheLookup(UINT64 slideId, INT32 level, INT32 x, INT32 y, BYTE* data, UINT32 length);
+void CompressedCacheStore(UINT64 slideId, INT32 level, INT32 x, INT32 y, const BYTE* data, UINT32 length);
+
+#endif
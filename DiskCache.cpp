@@ -0,0 +1,665 @@
+/*********************************************************************************************************************/
+/* Datei: DiskCache.cpp                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Persistent second-tier tile cache in append-only, memory-mapped pack files                         */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdint.h>
+#include <algorithm>
+#include <vector>
+
+#include "DiskCache.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define PACK_MAGIC					0x4B505653		// "SVPK"
+#define RECORD_MAGIC				0x454C4954		// "TILE"
+#define PACK_VERSION				1
+#define PACK_HEADER_SIZE			64
+#define RECORD_ALIGNMENT			16
+
+#define DISK_CACHE_MAX_PACKS		1024
+#define DISK_CACHE_MIN_PACK_SIZE	(4 * 1024 * 1024)
+
+// every pack is mapped as a whole, so the 32-bit build keeps them small
+#ifdef _WIN64
+#define DISK_CACHE_PACK_SIZE		(256 * 1024 * 1024)
+#else
+#define DISK_CACHE_PACK_SIZE		(32 * 1024 * 1024)
+#endif
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct PackHeader
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT64 size;
+	volatile UINT64 used;
+};
+
+struct RecordHeader
+{
+	UINT32 magic;
+	UINT32 length;
+	UINT64 slideId;
+	INT32 level;
+	INT32 x;
+	INT32 y;
+	UINT32 reserved;
+};
+
+struct Pack
+{
+	UINT32 id;
+	HANDLE file;
+	HANDLE mapping;
+	BYTE* view;
+	UINT64 size;
+};
+
+struct IndexEntry
+{
+	UINT64 key;
+	UINT32 pack;
+	UINT32 offset;
+	UINT32 length;
+	volatile LONG lastUse;
+};
+
+// All state is guarded by lock: lookups take it shared, stores and configuration changes exclusively.
+static struct
+{
+	SRWLOCK lock;
+	bool enabled;
+	wchar_t directory[MAX_PATH];
+	UINT64 maxBytes;
+	UINT64 packSize;
+
+	// ordered from the oldest to the newest pack; the last one receives new records
+	Pack packs[DISK_CACHE_MAX_PACKS];
+	int packCount;
+
+	// open addressing, linear probing, key 0 marks an empty slot
+	IndexEntry* index;
+	UINT32 indexCapacity;
+	UINT32 indexCount;
+
+	volatile LONG clock;
+} cache;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static UINT64 TileKey(UINT64 slideId, INT32 level, INT32 x, INT32 y);
+static bool OpenPack(UINT32 id, bool create, Pack* pack);
+static void ClosePack(Pack* pack, bool remove);
+static void ScanPack(const Pack* pack);
+static Pack* FindPack(UINT32 id);
+static IndexEntry* IndexFind(UINT64 key);
+static void IndexInsert(UINT64 key, UINT32 pack, UINT32 offset, UINT32 length, UINT32 lastUse);
+static bool IndexRebuild(UINT32 capacity);
+static void IndexDropPack(UINT32 pack);
+static bool AppendRecord(const RecordHeader* header, const BYTE* data, UINT32* offset);
+static void CompactOldestPack();
+static void CloseDiskCache();
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: SetDiskCache ***********************************************/
+/*********************************************************************************************************************/
+
+// Enables the cache in directory with a total size limit of maxBytes; a NULL or empty directory disables it.
+// Existing pack files in the directory are reused, so the cache survives a restart of the process. A limit below the
+// minimum pack size cannot be kept and is rejected. The directory belongs to one process: every process keeps its
+// own index of the packs, so the packs are opened without write sharing and a second process fails to enable it.
+extern "C" __declspec(dllexport) BOOL SetDiskCache(wchar_t* directory, INT64 maxBytes)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<UINT32> ids;
+	WIN32_FIND_DATAW find;
+	wchar_t pattern[MAX_PATH];
+	HANDLE search;
+	BOOL result = true;
+
+	AcquireSRWLockExclusive(&cache.lock);
+
+	//*** Close a previously configured cache *************************************************************************
+	CloseDiskCache();
+
+	if (directory == NULL || directory[0] == 0 || maxBytes <= 0)
+	{
+		ReleaseSRWLockExclusive(&cache.lock);
+		return true;
+	}
+
+	if (maxBytes < DISK_CACHE_MIN_PACK_SIZE)
+	{
+		ReleaseSRWLockExclusive(&cache.lock);
+		return false;
+	}
+
+	//*** Take over the configuration *********************************************************************************
+	wcsncpy(cache.directory, directory, MAX_PATH - 1);
+	cache.directory[MAX_PATH - 1] = 0;
+	cache.maxBytes = (UINT64)maxBytes;
+
+	// at least four packs, so that compaction never has to drop a large part of the cache at once
+	cache.packSize = cache.maxBytes / 4;
+	if (cache.packSize > DISK_CACHE_PACK_SIZE) cache.packSize = DISK_CACHE_PACK_SIZE;
+	if (cache.packSize < DISK_CACHE_MIN_PACK_SIZE) cache.packSize = DISK_CACHE_MIN_PACK_SIZE;
+
+	CreateDirectoryW(cache.directory, NULL);
+
+	//*** Collect the existing pack files *****************************************************************************
+	_snwprintf(pattern, MAX_PATH, L"%s\\pack_*.svc", cache.directory);
+
+	if ((search = FindFirstFileW(pattern, &find)) != INVALID_HANDLE_VALUE)
+	{
+		do
+		{
+			unsigned int id;
+
+			if (swscanf(find.cFileName, L"pack_%08x.svc", &id) == 1) ids.push_back(id);
+		}
+		while (FindNextFileW(search, &find));
+
+		FindClose(search);
+	}
+
+	std::sort(ids.begin(), ids.end());
+
+	//*** Map them and rebuild the index from their records ***********************************************************
+	if (!IndexRebuild(1024))
+	{
+		ReleaseSRWLockExclusive(&cache.lock);
+		return false;
+	}
+
+	for (size_t i = 0; i < ids.size() && cache.packCount < DISK_CACHE_MAX_PACKS; i++)
+	{
+		if (!OpenPack(ids[i], false, &cache.packs[cache.packCount])) continue;
+
+		ScanPack(&cache.packs[cache.packCount]);
+		cache.packCount++;
+	}
+
+	//*** Start with an empty pack if there is none *******************************************************************
+	if (cache.packCount == 0)
+	{
+		if (OpenPack(1, true, &cache.packs[0])) cache.packCount = 1;
+	}
+
+	cache.enabled = (cache.packCount > 0);
+	if (!cache.enabled)
+	{
+		CloseDiskCache();
+		result = false;
+	}
+
+	ReleaseSRWLockExclusive(&cache.lock);
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: DiskCacheLookup *********************************************/
+/*********************************************************************************************************************/
+
+bool DiskCacheLookup(UINT64 slideId, INT32 level, INT32 x, INT32 y, BYTE* data, UINT32 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	const RecordHeader* record;
+	IndexEntry* entry;
+	Pack* pack;
+	bool found = false;
+
+	if (!cache.enabled) return false;
+
+	AcquireSRWLockShared(&cache.lock);
+
+	if (cache.enabled && (entry = IndexFind(TileKey(slideId, level, x, y))) != NULL && entry->length == length)
+	{
+		if ((pack = FindPack(entry->pack)) != NULL)
+		{
+			record = (const RecordHeader*)(pack->view + entry->offset);
+
+			//*** The index only holds a hash, the record header carries the full key *********************************
+			if (record->magic == RECORD_MAGIC && record->slideId == slideId && record->level == level &&
+				record->x == x && record->y == y && record->length == length)
+			{
+				memcpy(data, record + 1, length);
+
+				//*** Lookups run in parallel under the shared lock, so the stamp is stored atomically ****************
+				InterlockedExchange(&entry->lastUse, InterlockedIncrement(&cache.clock));
+				found = true;
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&cache.lock);
+
+	return found;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: DiskCacheStore **********************************************/
+/*********************************************************************************************************************/
+
+void DiskCacheStore(UINT64 slideId, INT32 level, INT32 x, INT32 y, const BYTE* data, UINT32 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	RecordHeader header;
+	UINT64 key;
+	UINT32 offset;
+
+	if (!cache.enabled) return;
+
+	key = TileKey(slideId, level, x, y);
+
+	AcquireSRWLockExclusive(&cache.lock);
+
+	if (cache.enabled && IndexFind(key) == NULL)
+	{
+		header.magic = RECORD_MAGIC;
+		header.length = length;
+		header.slideId = slideId;
+		header.level = level;
+		header.x = x;
+		header.y = y;
+		header.reserved = 0;
+
+		if (AppendRecord(&header, data, &offset))
+			IndexInsert(key, cache.packs[cache.packCount - 1].id, offset, length, (UINT32)InterlockedIncrement(&cache.clock));
+	}
+
+	ReleaseSRWLockExclusive(&cache.lock);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: AppendRecord ***********************************************/
+/*********************************************************************************************************************/
+
+// Appends a record to the newest pack and starts a new pack when it is full. Called with the exclusive lock.
+static bool AppendRecord(const RecordHeader* header, const BYTE* data, UINT32* offset)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	UINT64 size = (sizeof(RecordHeader) + header->length + RECORD_ALIGNMENT - 1) & ~(UINT64)(RECORD_ALIGNMENT - 1);
+	Pack* pack = &cache.packs[cache.packCount - 1];
+	PackHeader* packHeader = (PackHeader*)pack->view;
+
+	if (PACK_HEADER_SIZE + size > cache.packSize) return false;
+
+	//*** Start a new pack when the current one is full ***************************************************************
+	if (packHeader->used + size > pack->size)
+	{
+		UINT32 id = pack->id + 1;
+
+		if (cache.packCount == DISK_CACHE_MAX_PACKS) CompactOldestPack();
+
+		if (!OpenPack(id, true, &cache.packs[cache.packCount])) return false;
+		cache.packCount++;
+
+		//*** Keep the total size below the limit *********************************************************************
+		while (cache.packCount > 1 && (UINT64)cache.packCount * cache.packSize > cache.maxBytes) CompactOldestPack();
+
+		pack = &cache.packs[cache.packCount - 1];
+		packHeader = (PackHeader*)pack->view;
+	}
+
+	//*** Write the record before publishing the new fill level *******************************************************
+	*offset = (UINT32)packHeader->used;
+	memcpy(pack->view + *offset, header, sizeof(RecordHeader));
+	memcpy(pack->view + *offset + sizeof(RecordHeader), data, header->length);
+	MemoryBarrier();
+	packHeader->used += size;
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: CompactOldestPack ********************************************/
+/*********************************************************************************************************************/
+
+// Drops the oldest pack. Tiles that were used recently are copied into the newest pack first, as long as it has
+// room, which gives an LRU-like replacement without tracking the order of every single tile.
+static void CompactOldestPack()
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Pack* oldest = &cache.packs[0];
+	Pack* newest = &cache.packs[cache.packCount - 1];
+	PackHeader* newestHeader = (PackHeader*)newest->view;
+	UINT32 now = (UINT32)cache.clock;
+	UINT32 window = cache.indexCount / 2;
+	UINT32 dropped = oldest->id;
+
+	if (cache.packCount < 2) return;
+
+	//*** Rescue recently used tiles **********************************************************************************
+	for (UINT32 i = 0; i < cache.indexCapacity; i++)
+	{
+		IndexEntry* entry = &cache.index[i];
+		const RecordHeader* record;
+		UINT64 size;
+
+		if (entry->key == 0 || entry->pack != oldest->id || now - (UINT32)entry->lastUse >= window) continue;
+
+		record = (const RecordHeader*)(oldest->view + entry->offset);
+		size = (sizeof(RecordHeader) + record->length + RECORD_ALIGNMENT - 1) & ~(UINT64)(RECORD_ALIGNMENT - 1);
+
+		if (newestHeader->used + size > newest->size) break;
+
+		memcpy(newest->view + newestHeader->used, record, sizeof(RecordHeader) + record->length);
+		entry->pack = newest->id;
+		entry->offset = (UINT32)newestHeader->used;
+		MemoryBarrier();
+		newestHeader->used += size;
+	}
+
+	//*** Remove the pack and all index entries that still point into it **********************************************
+	ClosePack(oldest, true);
+	memmove(&cache.packs[0], &cache.packs[1], (cache.packCount - 1) * sizeof(Pack));
+	cache.packCount--;
+
+	IndexDropPack(dropped);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: OpenPack *************************************************/
+/*********************************************************************************************************************/
+
+static bool OpenPack(UINT32 id, bool create, Pack* pack)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	wchar_t path[MAX_PATH];
+	PackHeader* header;
+	LARGE_INTEGER size;
+
+	_snwprintf(path, MAX_PATH, L"%s\\pack_%08x.svc", cache.directory, id);
+
+	pack->id = id;
+	pack->mapping = NULL;
+	pack->view = NULL;
+
+	//*** Open or create the file; no write sharing, as another writer would invalidate the index *********************
+	pack->file = CreateFileW(path, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL,
+		create ? CREATE_ALWAYS : OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_RANDOM_ACCESS, NULL);
+
+	if (pack->file == INVALID_HANDLE_VALUE) return false;
+
+	if (create) size.QuadPart = (LONGLONG)cache.packSize;
+	else if (!GetFileSizeEx(pack->file, &size) || size.QuadPart < PACK_HEADER_SIZE)
+	{
+		CloseHandle(pack->file);
+		DeleteFileW(path);
+		return false;
+	}
+
+	pack->size = (UINT64)size.QuadPart;
+
+	//*** Map the whole pack; creating the mapping also extends a new file to its full size ***************************
+	pack->mapping = CreateFileMappingW(pack->file, NULL, PAGE_READWRITE, (DWORD)(pack->size >> 32), (DWORD)pack->size, NULL);
+	if (pack->mapping != NULL) pack->view = (BYTE*)MapViewOfFile(pack->mapping, FILE_MAP_WRITE, 0, 0, 0);
+
+	if (pack->view == NULL)
+	{
+		ClosePack(pack, create);
+		return false;
+	}
+
+	header = (PackHeader*)pack->view;
+
+	//*** Initialize a new pack, reject a foreign or damaged one ******************************************************
+	if (create)
+	{
+		header->magic = PACK_MAGIC;
+		header->version = PACK_VERSION;
+		header->size = pack->size;
+		header->used = PACK_HEADER_SIZE;
+	}
+	else if (header->magic != PACK_MAGIC || header->version != PACK_VERSION || header->size != pack->size ||
+		header->used < PACK_HEADER_SIZE || header->used > pack->size)
+	{
+		ClosePack(pack, true);
+		return false;
+	}
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ClosePack ************************************************/
+/*********************************************************************************************************************/
+
+static void ClosePack(Pack* pack, bool remove)
+{
+	wchar_t path[MAX_PATH];
+
+	if (pack->view != NULL) UnmapViewOfFile(pack->view);
+	if (pack->mapping != NULL) CloseHandle(pack->mapping);
+	if (pack->file != NULL && pack->file != INVALID_HANDLE_VALUE) CloseHandle(pack->file);
+
+	pack->view = NULL;
+	pack->mapping = NULL;
+	pack->file = NULL;
+
+	if (remove)
+	{
+		_snwprintf(path, MAX_PATH, L"%s\\pack_%08x.svc", cache.directory, pack->id);
+		DeleteFileW(path);
+	}
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ScanPack *************************************************/
+/*********************************************************************************************************************/
+
+// Adds all complete records of a pack to the index; a record cut off by a crash ends the scan. The packs are scanned
+// from the oldest to the newest, so stamping the records from the clock seeds the use order with their write order.
+static void ScanPack(const Pack* pack)
+{
+	const PackHeader* header = (const PackHeader*)pack->view;
+	UINT64 offset = PACK_HEADER_SIZE;
+
+	while (offset + sizeof(RecordHeader) <= header->used)
+	{
+		const RecordHeader* record = (const RecordHeader*)(pack->view + offset);
+		UINT64 size = (sizeof(RecordHeader) + record->length + RECORD_ALIGNMENT - 1) & ~(UINT64)(RECORD_ALIGNMENT - 1);
+
+		if (record->magic != RECORD_MAGIC || offset + size > header->used) break;
+
+		IndexInsert(TileKey(record->slideId, record->level, record->x, record->y), pack->id, (UINT32)offset,
+			record->length, (UINT32)InterlockedIncrement(&cache.clock));
+
+		offset += size;
+	}
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: FindPack *************************************************/
+/*********************************************************************************************************************/
+
+static Pack* FindPack(UINT32 id)
+{
+	for (int i = cache.packCount - 1; i >= 0; i--)
+	{
+		if (cache.packs[i].id == id) return &cache.packs[i];
+	}
+
+	return NULL;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: IndexFind ************************************************/
+/*********************************************************************************************************************/
+
+static IndexEntry* IndexFind(UINT64 key)
+{
+	UINT32 mask = cache.indexCapacity - 1;
+
+	for (UINT32 i = (UINT32)key & mask;; i = (i + 1) & mask)
+	{
+		if (cache.index[i].key == key) return &cache.index[i];
+		if (cache.index[i].key == 0) return NULL;
+	}
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: IndexInsert ***********************************************/
+/*********************************************************************************************************************/
+
+// Inserts or replaces an entry; the table grows at a load factor of 3/4. If the memory budget has no room for a
+// larger table, the entry is left out and the record is simply not found again.
+static void IndexInsert(UINT64 key, UINT32 pack, UINT32 offset, UINT32 length, UINT32 lastUse)
+{
+	UINT32 mask;
+	UINT32 i;
+
+	if ((cache.indexCount + 1) * 4 > cache.indexCapacity * 3 && !IndexRebuild(cache.indexCapacity * 2)) return;
+
+	mask = cache.indexCapacity - 1;
+	for (i = (UINT32)key & mask; cache.index[i].key != 0 && cache.index[i].key != key; i = (i + 1) & mask);
+
+	if (cache.index[i].key == 0) cache.indexCount++;
+
+	cache.index[i].key = key;
+	cache.index[i].pack = pack;
+	cache.index[i].offset = offset;
+	cache.index[i].length = length;
+	cache.index[i].lastUse = (LONG)lastUse;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: IndexRebuild ***********************************************/
+/*********************************************************************************************************************/
+
+// Rehashes the index into a table of the given capacity, which is charged to the memory budget. False if the budget
+// has no room for it; the current table is kept then.
+static bool IndexRebuild(UINT32 capacity)
+{
+	IndexEntry* old = cache.index;
+	UINT32 oldCapacity = cache.indexCapacity;
+	IndexEntry* index;
+
+	if (!ChargeMemory(MEMORY_INDEXES, (INT64)capacity * sizeof(IndexEntry))) return false;
+
+	if ((index = (IndexEntry*)calloc(capacity, sizeof(IndexEntry))) == NULL)
+	{
+		ReleaseMemory(MEMORY_INDEXES, (INT64)capacity * sizeof(IndexEntry));
+		return false;
+	}
+
+	cache.index = index;
+	cache.indexCapacity = capacity;
+	cache.indexCount = 0;
+
+	for (UINT32 i = 0; i < oldCapacity; i++)
+	{
+		if (old[i].key != 0)
+			IndexInsert(old[i].key, old[i].pack, old[i].offset, old[i].length, (UINT32)old[i].lastUse);
+	}
+
+	free(old);
+	ReleaseMemory(MEMORY_INDEXES, (INT64)oldCapacity * sizeof(IndexEntry));
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: IndexDropPack **********************************************/
+/*********************************************************************************************************************/
+
+// Removes all entries of a pack in place, without a second table. The entries are cleared first; then every remaining
+// one is inserted again, walking the table from a slot that was empty before, so that no probe sequence crosses the
+// start of the walk and the gaps break none of them.
+static void IndexDropPack(UINT32 pack)
+{
+	UINT32 mask = cache.indexCapacity - 1;
+	UINT32 start = 0;
+
+	//*** At a load of at most 3/4 there always is an empty slot ******************************************************
+	while (cache.index[start].key != 0) start++;
+
+	for (UINT32 i = 0; i < cache.indexCapacity; i++)
+	{
+		if (cache.index[i].key != 0 && cache.index[i].pack == pack)
+		{
+			cache.index[i].key = 0;
+			cache.indexCount--;
+		}
+	}
+
+	for (UINT32 n = 1; n <= cache.indexCapacity; n++)
+	{
+		UINT32 i = (start + n) & mask;
+		IndexEntry entry = cache.index[i];
+
+		if (entry.key == 0) continue;
+
+		cache.index[i].key = 0;
+		cache.indexCount--;
+
+		IndexInsert(entry.key, entry.pack, entry.offset, entry.length, (UINT32)entry.lastUse);
+	}
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: CloseDiskCache **********************************************/
+/*********************************************************************************************************************/
+
+static void CloseDiskCache()
+{
+	for (int i = 0; i < cache.packCount; i++) ClosePack(&cache.packs[i], false);
+
+	free(cache.index);
+	ReleaseMemory(MEMORY_INDEXES, (INT64)cache.indexCapacity * sizeof(IndexEntry));
+
+	cache.index = NULL;
+	cache.indexCapacity = 0;
+	cache.indexCount = 0;
+	cache.packCount = 0;
+	cache.enabled = false;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: TileKey *************************************************/
+/*********************************************************************************************************************/
+
+static UINT64 TileKey(UINT64 slideId, INT32 level, INT32 x, INT32 y)
+{
+	UINT64 key = slideId ^ ((UINT64)(UINT32)level << 56) ^ ((UINT64)(UINT32)y << 28) ^ (UINT64)(UINT32)x;
+
+	//*** Finalizer of MurmurHash3, so that neighbouring tiles spread over the table **********************************
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+	key *= 0xC4CEB9FE1A85EC53ULL;
+	key ^= key >> 33;
+
+	return (key == 0) ? 1 : key;
+}
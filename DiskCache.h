@@ -0,0 +1,22 @@
+/*********************************************************************************************************************/
+/* Datei: DiskCache.h                                                                                                */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Persistent second-tier tile cache in append-only, memory-mapped pack files                         */
+/*********************************************************************************************************************/
+
+#ifndef DISK_CACHE_H
+#define DISK_CACHE_H
+
+#include <windows.h>
+#include <stdint.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+bool DiskCacheLookup(UINT64 slideId, INT32 level, INT32 x, INT32 y, BYTE* data, UINT32 length);
+void DiskCacheStore(UINT64 slideId, INT32 level, INT32 x, INT32 y, const BYTE* data, UINT32 length);
+
+#endif
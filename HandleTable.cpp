@@ -0,0 +1,277 @@
+/*********************************************************************************************************************/
+/* Datei: HandleTable.cpp                                                                                            */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Handles as generation-checked slots with reference counts, safe against concurrent close           */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+
+#include "HandleTable.h"
+#include "Session.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define HANDLE_SLOTS				16384
+
+// The state word of a slot: generation in the upper 32 bits (odd while the slot holds a session), a closing flag and
+// the number of references in the lower 31 bits. A handle is the generation followed by the slot index + 1.
+#define HANDLE_REFERENCES			0x7FFFFFFFLL
+#define HANDLE_CLOSING				0x80000000LL
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct HandleSlot
+{
+	volatile LONGLONG state;
+	INT32 kind;
+	void* object;
+};
+
+// Slots are taken and given back under the lock; acquiring and releasing references is lock-free
+static struct
+{
+	HandleSlot slots[HANDLE_SLOTS];
+	SRWLOCK lock;
+	INT32 freeSlots[HANDLE_SLOTS];
+	INT32 freeCount;
+	INT32 used;
+} table;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: RegisterHandle *********************************************/
+/*********************************************************************************************************************/
+
+// Puts the object into a free slot and returns its handle, or 0 if all slots are in use
+INT64 RegisterHandle(INT32 kind, void* object)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	HandleSlot* slot;
+	LONGLONG generation;
+	INT32 index;
+
+	AcquireSRWLockExclusive(&table.lock);
+
+	if (table.freeCount > 0) index = table.freeSlots[--table.freeCount];
+	else if (table.used < HANDLE_SLOTS) index = table.used++;
+	else index = -1;
+
+	ReleaseSRWLockExclusive(&table.lock);
+
+	if (index < 0) return 0;
+
+	//*** The object is stored before the odd generation makes the slot valid *****************************************
+	slot = &table.slots[index];
+	slot->kind = kind;
+	slot->object = object;
+
+	generation = ((slot->state >> 32) + 1) & 0xFFFFFFFF;
+	MemoryBarrier();
+	InterlockedExchange64(&slot->state, generation << 32);
+
+	//*** Ende ********************************************************************************************************
+	return (generation << 32) | (index + 1);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: AcquireHandle **********************************************/
+/*********************************************************************************************************************/
+
+// Takes a reference on the object of the handle. NULL if the handle is invalid, closed, being closed or of another
+// kind.
+void* AcquireHandle(INT64 handle, INT32 kind)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	INT64 index = (handle & 0xFFFFFFFF) - 1;
+	LONGLONG generation = (handle >> 32) & 0xFFFFFFFF;
+	HandleSlot* slot;
+	LONGLONG state;
+
+	if (index < 0 || index >= HANDLE_SLOTS || (generation & 1) == 0) return NULL;
+
+	slot = &table.slots[index];
+
+	do
+	{
+		state = slot->state;
+
+		if (((state >> 32) & 0xFFFFFFFF) != generation || (state & HANDLE_CLOSING) != 0) return NULL;
+		if ((state & HANDLE_REFERENCES) == HANDLE_REFERENCES) return NULL;
+	} while (InterlockedCompareExchange64(&slot->state, state + 1, state) != state);
+
+	//*** The kind cannot change while the reference is held **********************************************************
+	if (slot->kind != kind)
+	{
+		InterlockedDecrement64(&slot->state);
+		return NULL;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return slot->object;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ReleaseHandle **********************************************/
+/*********************************************************************************************************************/
+
+void ReleaseHandle(INT64 handle)
+{
+	INT64 index = (handle & 0xFFFFFFFF) - 1;
+
+	if (index < 0 || index >= HANDLE_SLOTS) return;
+
+	InterlockedDecrement64(&table.slots[index].state);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: UnregisterHandle ********************************************/
+/*********************************************************************************************************************/
+
+// Marks the slot as closing, so that no new references are handed out, waits until the references in flight are
+// released and frees the slot. Returns the object for destruction, or NULL if the handle was not valid, of another
+// kind or another thread is already closing it.
+void* UnregisterHandle(INT64 handle, INT32 kind)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	INT64 index = (handle & 0xFFFFFFFF) - 1;
+	LONGLONG generation = (handle >> 32) & 0xFFFFFFFF;
+	HandleSlot* slot;
+	void* object;
+	LONGLONG state;
+
+	if (index < 0 || index >= HANDLE_SLOTS || (generation & 1) == 0) return NULL;
+
+	slot = &table.slots[index];
+
+	do
+	{
+		state = slot->state;
+
+		if (((state >> 32) & 0xFFFFFFFF) != generation || (state & HANDLE_CLOSING) != 0) return NULL;
+		if (slot->kind != kind) return NULL;
+	} while (InterlockedCompareExchange64(&slot->state, state | HANDLE_CLOSING, state) != state);
+
+	//*** Wait for the calls that are still working on the session ****************************************************
+	for (int spin = 0; (slot->state & HANDLE_REFERENCES) != 0; spin++)
+	{
+		if (spin < 64) YieldProcessor();
+		else if (spin < 128) SwitchToThread();
+		else Sleep(1);
+	}
+
+	object = slot->object;
+	slot->object = NULL;
+
+	//*** An even generation marks the slot as free; old handles never match again ************************************
+	InterlockedExchange64(&slot->state, ((generation + 1) & 0xFFFFFFFF) << 32);
+
+	AcquireSRWLockExclusive(&table.lock);
+	table.freeSlots[table.freeCount++] = (INT32)index;
+	ReleaseSRWLockExclusive(&table.lock);
+
+	//*** Ende ********************************************************************************************************
+	return object;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: RegisterSession *********************************************/
+/*********************************************************************************************************************/
+
+INT64 RegisterSession(Session* session)
+{
+	return RegisterHandle(HANDLE_SESSION, session);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: AcquireSession **********************************************/
+/*********************************************************************************************************************/
+
+Session* AcquireSession(INT64 handle)
+{
+	return (Session*)AcquireHandle(handle, HANDLE_SESSION);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: ReleaseSession **********************************************/
+/*********************************************************************************************************************/
+
+void ReleaseSession(INT64 handle)
+{
+	ReleaseHandle(handle);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: UnregisterSession ********************************************/
+/*********************************************************************************************************************/
+
+Session* UnregisterSession(INT64 handle)
+{
+	return (Session*)UnregisterHandle(handle, HANDLE_SESSION);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: SetSessionStage *********************************************/
+/*********************************************************************************************************************/
+
+// Publishes the next stage of an open and wakes the calls waiting for it
+void SetSessionStage(Session* session, LONG stage)
+{
+	AcquireSRWLockExclusive(&session->stageLock);
+
+	session->stage = stage;
+
+	ReleaseSRWLockExclusive(&session->stageLock);
+
+	WakeAllConditionVariable(&session->stageChanged);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: WaitForSession **********************************************/
+/*********************************************************************************************************************/
+
+// Waits up to timeout milliseconds until the session reached stage. False if the open failed or the time ran out.
+bool WaitForSession(Session* session, LONG stage, DWORD timeout)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	DWORD start = GetTickCount(), elapsed;
+	bool reached;
+
+	//*** Sessions opened synchronously are ready before anyone sees their handle *************************************
+	if (session->stage >= stage) return true;
+	if (session->stage == SESSION_FAILED || timeout == 0) return false;
+
+	AcquireSRWLockShared(&session->stageLock);
+
+	while (session->stage < stage && session->stage != SESSION_FAILED)
+	{
+		elapsed = GetTickCount() - start;
+
+		if (timeout != INFINITE && elapsed >= timeout) break;
+		if (!SleepConditionVariableSRW(&session->stageChanged, &session->stageLock,
+			(timeout == INFINITE) ? INFINITE : timeout - elapsed, CONDITION_VARIABLE_LOCKMODE_SHARED) &&
+			GetLastError() != ERROR_TIMEOUT)
+			break;
+	}
+
+	reached = (session->stage >= stage);
+
+	ReleaseSRWLockShared(&session->stageLock);
+
+	//*** Ende ********************************************************************************************************
+	return reached;
+}
@@ -0,0 +1,98 @@
+/*********************************************************************************************************************/
+/* Datei: HandleTable.h                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Handles as generation-checked slots with reference counts, safe against concurrent close           */
+/*********************************************************************************************************************/
+
+#ifndef HANDLE_TABLE_H
+#define HANDLE_TABLE_H
+
+#include <windows.h>
+
+struct Session;
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// stages a session passes while it is opened; OpenImageAsync hands out the handle already in SESSION_OPENING
+#define SESSION_FAILED				-1
+#define SESSION_OPENING				0
+#define SESSION_GEOMETRY			1
+#define SESSION_READY				2
+
+// kinds of objects behind a handle; a handle is only accepted by the functions of its own kind
+#define HANDLE_SESSION				0
+#define HANDLE_TILE_ITERATOR		1
+#define HANDLE_HEATMAP				2
+#define HANDLE_VIEWPORT				3
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+INT64 RegisterHandle(INT32 kind, void* object);
+void* AcquireHandle(INT64 handle, INT32 kind);
+void ReleaseHandle(INT64 handle);
+void* UnregisterHandle(INT64 handle, INT32 kind);
+INT64 RegisterSession(Session* session);
+Session* AcquireSession(INT64 handle);
+void ReleaseSession(INT64 handle);
+Session* UnregisterSession(INT64 handle);
+void SetSessionStage(Session* session, LONG stage);
+bool WaitForSession(Session* session, LONG stage, DWORD timeout);
+
+
+/*********************************************************************************************************************/
+/******************************************** Struktur: SessionReference *********************************************/
+/*********************************************************************************************************************/
+
+// Holds a reference on the session of a handle for the lifetime of the object; session is NULL if the handle is not
+// (or no longer) valid. Every export that works on a session takes one, so CloseImage waits until they are gone.
+// The reference also waits until an asynchronous open has reached stage; session is NULL if the open failed.
+struct SessionReference
+{
+	INT64 handle;
+	Session* session;
+
+	SessionReference(INT64 handle, LONG stage = SESSION_READY) : handle(handle), session(AcquireSession(handle))
+	{
+		if (session != NULL && stage > SESSION_OPENING && !WaitForSession(session, stage, INFINITE))
+		{
+			ReleaseSession(handle);
+			session = NULL;
+		}
+	}
+
+	~SessionReference() { if (session != NULL) ReleaseSession(handle); }
+
+private:
+	SessionReference(const SessionReference&);
+	SessionReference& operator=(const SessionReference&);
+};
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur: HandleReference *********************************************/
+/*********************************************************************************************************************/
+
+// The same for the other kinds of handles (tile iterators, heatmaps, viewports): object is NULL if the handle is not
+// (or no longer) valid or of another kind, and the close of the handle waits until the reference is gone
+struct HandleReference
+{
+	INT64 handle;
+	void* object;
+
+	HandleReference(INT64 handle, INT32 kind) : handle(handle), object(AcquireHandle(handle, kind)) {}
+
+	~HandleReference() { if (object != NULL) ReleaseHandle(handle); }
+
+private:
+	HandleReference(const HandleReference&);
+	HandleReference& operator=(const HandleReference&);
+};
+
+#endif
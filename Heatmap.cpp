@@ -0,0 +1,873 @@
+/*********************************************************************************************************************/
+/* Datei: Heatmap.cpp                                                                                                */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Sparse pyramid of per-tile inference results, rendered as overlay tiles on the slide tile grid     */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include "Heatmap.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define HEATMAP_MAGIC				0x4D485653		// "SVHM"
+#define HEATMAP_VERSION				1
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// Start of a heatmap file. Only the chunks of level 0 are stored, each as chunkX, chunkY, the number of runs and the
+// runs (length, value as UINT16) of its cells, channel by channel; the upper levels are rebuilt when it is loaded.
+struct HeatmapFileHeader
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT64 slideId;
+	INT32 columns;
+	INT32 rows;
+	INT32 channels;
+	INT32 chunkCount;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static HeatmapChunk* GetChunk(Heatmap* heatmap, INT32 level, INT32 x, INT32 y, bool allocate);
+static UINT16* OpenChunk(Heatmap* heatmap, HeatmapChunk* chunk);
+static void CloseChunks(Heatmap* heatmap);
+static void DecodeChunk(Heatmap* heatmap, const HeatmapChunk* chunk, INT32 channel, UINT16* cells);
+static void EncodeRuns(Heatmap* heatmap, const UINT16* cells, std::vector<UINT16>* runs);
+static void DecodeRuns(Heatmap* heatmap, const UINT16* runs, INT32 runCount, INT32 channel, bool merge, UINT16* cells);
+static bool RefreshCell(Heatmap* heatmap, INT32 level, INT32 x, INT32 y);
+static void GetColor(UINT16 value, BYTE opacity, BYTE* color);
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: CreateHeatmapStore ********************************************/
+/*********************************************************************************************************************/
+
+// columns x rows cells at level 0; the pyramid goes up until a single cell is left. slideGrid holds step x, step y and
+// downsample of each of the slideLevels levels of the slide the overlay tiles are rendered for.
+Heatmap* CreateHeatmapStore(UINT64 slideId, INT32 columns, INT32 rows, double cellWidth, double cellHeight, INT32 channels,
+	INT32 tileWidth, INT32 tileHeight, const double* slideGrid, INT32 slideLevels)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Heatmap* heatmap;
+	INT64 size;
+
+	if (columns <= 0 || rows <= 0 || channels <= 0 || channels > 64 || slideLevels <= 0) return NULL;
+
+	heatmap = (Heatmap*)calloc(1, sizeof(Heatmap));
+	if (heatmap == NULL) return NULL;
+
+	InitializeSRWLock(&heatmap->lock);
+	heatmap->slideId = slideId;
+	heatmap->channels = channels;
+	heatmap->cellWidth = cellWidth;
+	heatmap->cellHeight = cellHeight;
+	heatmap->tileWidth = tileWidth;
+	heatmap->tileHeight = tileHeight;
+	heatmap->slideLevels = slideLevels;
+
+	//*** Count the pyramid levels ************************************************************************************
+	for (INT32 c = columns, r = rows; ; c = (c + 1) / 2, r = (r + 1) / 2)
+	{
+		heatmap->levelCount++;
+		if (c == 1 && r == 1) break;
+	}
+
+	heatmap->levels = (HeatmapLevel*)calloc(heatmap->levelCount, sizeof(HeatmapLevel));
+	heatmap->slideGrid = (double*)malloc(3 * slideLevels * sizeof(double));
+
+	if (heatmap->levels == NULL || heatmap->slideGrid == NULL)
+	{
+		FreeHeatmap(heatmap);
+		return NULL;
+	}
+
+	memcpy(heatmap->slideGrid, slideGrid, 3 * slideLevels * sizeof(double));
+	size = sizeof(Heatmap) + 3 * slideLevels * sizeof(double) + heatmap->levelCount * sizeof(HeatmapLevel);
+
+	//*** Only the chunk tables are allocated up front ****************************************************************
+	for (INT32 level = 0; level < heatmap->levelCount; level++)
+	{
+		HeatmapLevel* current = &heatmap->levels[level];
+
+		current->columns = (level == 0) ? columns : (heatmap->levels[level - 1].columns + 1) / 2;
+		current->rows = (level == 0) ? rows : (heatmap->levels[level - 1].rows + 1) / 2;
+		current->chunkColumns = (current->columns + HEATMAP_CHUNK - 1) / HEATMAP_CHUNK;
+		current->chunkRows = (current->rows + HEATMAP_CHUNK - 1) / HEATMAP_CHUNK;
+		current->chunks = (HeatmapChunk**)calloc((size_t)current->chunkColumns * current->chunkRows,
+			sizeof(HeatmapChunk*));
+
+		if (current->chunks == NULL)
+		{
+			FreeHeatmap(heatmap);
+			return NULL;
+		}
+
+		size += (INT64)current->chunkColumns * current->chunkRows * sizeof(HeatmapChunk*);
+	}
+
+	if (!ChargeMemory(MEMORY_SESSIONS, size))
+	{
+		FreeHeatmap(heatmap);
+		return NULL;
+	}
+
+	heatmap->charged = size;
+
+	//*** Ende ********************************************************************************************************
+	return heatmap;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: FreeHeatmap ***********************************************/
+/*********************************************************************************************************************/
+
+void FreeHeatmap(Heatmap* heatmap)
+{
+	if (heatmap == NULL) return;
+
+	for (INT32 level = 0; heatmap->levels != NULL && level < heatmap->levelCount; level++)
+	{
+		HeatmapLevel* current = &heatmap->levels[level];
+
+		for (INT32 i = 0; current->chunks != NULL && i < current->chunkColumns * current->chunkRows; i++)
+		{
+			if (current->chunks[i] == NULL) continue;
+
+			free(current->chunks[i]->data);
+			free(current->chunks[i]->cells);
+			free(current->chunks[i]);
+		}
+
+		free(current->chunks);
+	}
+
+	ReleaseMemory(MEMORY_SESSIONS, heatmap->charged);
+
+	free(heatmap->levels);
+	free(heatmap->slideGrid);
+	free(heatmap);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: SetHeatmapCells *********************************************/
+/*********************************************************************************************************************/
+
+// Stores count cells of level 0 (x, y pairs in coordinates, channels values each in values) and updates the cells
+// above them. Values are clamped to 0.0 to 1.0; NaN removes the value. Returns false if a chunk could not be allocated.
+bool SetHeatmapCells(Heatmap* heatmap, const INT32* coordinates, INT32 count, const float* values)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	HeatmapLevel* base = &heatmap->levels[0];
+	bool stored = true;
+
+	AcquireSRWLockExclusive(&heatmap->lock);
+
+	for (INT32 i = 0; i < count; i++)
+	{
+		INT32 x = coordinates[2 * i], y = coordinates[2 * i + 1];
+		const float* value = values + (size_t)i * heatmap->channels;
+		HeatmapChunk* chunk;
+		UINT16* cells;
+		UINT16* cell;
+
+		if (x < 0 || y < 0 || x >= base->columns || y >= base->rows) continue;
+
+		//*** Large batches are coded again on the way, so they do not hold all their chunks decoded at once **********
+		if (heatmap->openCount >= HEATMAP_OPEN_CHUNKS) CloseChunks(heatmap);
+
+		if ((chunk = GetChunk(heatmap, 0, x, y, true)) == NULL || (cells = OpenChunk(heatmap, chunk)) == NULL)
+		{
+			stored = false;
+			continue;
+		}
+
+		//*** Quantize to 16 bits, keeping 0 for "no value" ***********************************************************
+		cell = cells + (((y & (HEATMAP_CHUNK - 1)) << HEATMAP_CHUNK_SHIFT) + (x & (HEATMAP_CHUNK - 1))) * heatmap->channels;
+		chunk->dirty = true;
+
+		for (INT32 c = 0; c < heatmap->channels; c++)
+		{
+			float v = value[c];
+
+			if (v != v) cell[c] = 0;
+			else cell[c] = (UINT16)(1 + (INT32)((v < 0 ? 0 : (v > 1 ? 1 : v)) * 65534.0f + 0.5f));
+		}
+
+		//*** The ancestors, until one of them does not change ********************************************************
+		for (INT32 level = 1; level < heatmap->levelCount; level++)
+		{
+			x /= 2;
+			y /= 2;
+
+			if (!RefreshCell(heatmap, level, x, y)) break;
+		}
+	}
+
+	CloseChunks(heatmap);
+
+	ReleaseSRWLockExclusive(&heatmap->lock);
+
+	return stored;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: GetHeatmapCells *********************************************/
+/*********************************************************************************************************************/
+
+// Reads width x height cells of a pyramid level into values, channels per cell; cells without a value read as -1.0.
+// Every chunk the rectangle touches is decoded once.
+bool GetHeatmapCells(Heatmap* heatmap, INT32 level, INT32 x, INT32 y, INT32 width, INT32 height, float* values)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<UINT16> cells((size_t)HEATMAP_CHUNK * HEATMAP_CHUNK * heatmap->channels);
+
+	if (level < 0 || level >= heatmap->levelCount || width <= 0 || height <= 0) return false;
+
+	for (size_t i = 0; i < (size_t)width * height * heatmap->channels; i++) values[i] = -1.0f;
+
+	AcquireSRWLockShared(&heatmap->lock);
+
+	for (INT32 top = y & ~(HEATMAP_CHUNK - 1); top < y + height; top += HEATMAP_CHUNK)
+	{
+		for (INT32 left = x & ~(HEATMAP_CHUNK - 1); left < x + width; left += HEATMAP_CHUNK)
+		{
+			HeatmapChunk* chunk = GetChunk(heatmap, level, left, top, false);
+			INT32 bottom = (std::min)(top + HEATMAP_CHUNK, y + height);
+			INT32 right = (std::min)(left + HEATMAP_CHUNK, x + width);
+
+			if (chunk == NULL) continue;
+
+			DecodeChunk(heatmap, chunk, -1, &cells[0]);
+
+			for (INT32 row = (std::max)(top, y); row < bottom; row++)
+			{
+				for (INT32 column = (std::max)(left, x); column < right; column++)
+				{
+					const UINT16* cell = &cells[(((row - top) << HEATMAP_CHUNK_SHIFT) + column - left) *
+						heatmap->channels];
+					float* value = values + ((size_t)(row - y) * width + (column - x)) * heatmap->channels;
+
+					for (INT32 c = 0; c < heatmap->channels; c++)
+						if (cell[c] != 0) value[c] = (cell[c] - 1) / 65534.0f;
+				}
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&heatmap->lock);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: RenderHeatmapTile ********************************************/
+/*********************************************************************************************************************/
+
+// Writes the overlay of one channel for tile x, y of a slide level as premultiplied BGRA pixels, laid out like the
+// tile GetTileDecoded returns: a jet color map with the given opacity, transparent where there is no value. The cells
+// are taken from the coarsest pyramid level whose cells are still no larger than a pixel of the tile, so overview
+// tiles touch few cells. The channel is decoded once per chunk of the row of chunks the tile rows are in.
+void RenderHeatmapTile(Heatmap* heatmap, INT32 level, INT32 x, INT32 y, INT32 channel, BYTE opacity, BYTE* data)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<INT32> columns(heatmap->tileWidth);
+	std::vector<const HeatmapChunk*> decodedChunks;
+	std::vector<UINT16> decoded;
+	INT32 chunkRow = -1;
+	BYTE colors[256][4];
+	double stepX, stepY, downsample, cellWidth, cellHeight;
+	INT32 pyramid = 0;
+
+	memset(data, 0, (size_t)heatmap->tileWidth * heatmap->tileHeight * 4);
+
+	if (level < 0 || level >= heatmap->slideLevels || channel < 0 || channel >= heatmap->channels) return;
+
+	stepX = heatmap->slideGrid[3 * level];
+	stepY = heatmap->slideGrid[3 * level + 1];
+	downsample = heatmap->slideGrid[3 * level + 2];
+
+	//*** Pyramid level and cell size in level 0 pixels ***************************************************************
+	while (pyramid + 1 < heatmap->levelCount && heatmap->cellWidth * (2 << pyramid) <= downsample &&
+		heatmap->cellHeight * (2 << pyramid) <= downsample)
+		pyramid++;
+
+	cellWidth = heatmap->cellWidth * (1 << pyramid);
+	cellHeight = heatmap->cellHeight * (1 << pyramid);
+
+	for (INT32 i = 0; i < 256; i++) GetColor((UINT16)(1 + i * 257), opacity, colors[i]);
+
+	//*** The cell column of every pixel column ***********************************************************************
+	for (INT32 i = 0; i < heatmap->tileWidth; i++)
+		columns[i] = (INT32)floor((x * stepX + (i + 0.5) * downsample) / cellWidth);
+
+	AcquireSRWLockShared(&heatmap->lock);
+
+	for (INT32 row = 0; row < heatmap->tileHeight; row++)
+	{
+		INT32 cellY = (INT32)floor((y * stepY + (row + 0.5) * downsample) / cellHeight);
+		BYTE* pixel = data + (size_t)row * heatmap->tileWidth * 4;
+		const UINT16* plane = NULL;
+		INT32 chunkX = -1;
+
+		//*** The rows only move down, so the chunks of a row of chunks are not needed again once it is left **********
+		if ((cellY >> HEATMAP_CHUNK_SHIFT) != chunkRow)
+		{
+			chunkRow = cellY >> HEATMAP_CHUNK_SHIFT;
+			decodedChunks.clear();
+		}
+
+		for (INT32 i = 0; i < heatmap->tileWidth; i++, pixel += 4)
+		{
+			UINT16 value;
+
+			//*** The chunk changes at most every HEATMAP_CHUNK cells *************************************************
+			if ((columns[i] >> HEATMAP_CHUNK_SHIFT) != chunkX)
+			{
+				const HeatmapChunk* chunk = GetChunk(heatmap, pyramid, columns[i], cellY, false);
+				size_t n;
+
+				chunkX = columns[i] >> HEATMAP_CHUNK_SHIFT;
+				plane = NULL;
+
+				if (chunk != NULL)
+				{
+					n = std::find(decodedChunks.begin(), decodedChunks.end(), chunk) - decodedChunks.begin();
+
+					if (n == decodedChunks.size())
+					{
+						decodedChunks.push_back(chunk);
+						decoded.resize(decodedChunks.size() * HEATMAP_CHUNK * HEATMAP_CHUNK);
+						DecodeChunk(heatmap, chunk, channel, &decoded[n * HEATMAP_CHUNK * HEATMAP_CHUNK]);
+					}
+
+					plane = &decoded[n * HEATMAP_CHUNK * HEATMAP_CHUNK];
+				}
+			}
+
+			if (plane == NULL) continue;
+
+			value = plane[((cellY & (HEATMAP_CHUNK - 1)) << HEATMAP_CHUNK_SHIFT) + (columns[i] & (HEATMAP_CHUNK - 1))];
+
+			if (value != 0) memcpy(pixel, colors[(value - 1) / 257], 4);
+		}
+	}
+
+	ReleaseSRWLockShared(&heatmap->lock);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: SaveHeatmapFile *********************************************/
+/*********************************************************************************************************************/
+
+// Writes the chunks of level 0, run-length coded; background and saturated regions shrink to a few runs
+bool SaveHeatmapFile(Heatmap* heatmap, const wchar_t* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	HeatmapLevel* base = &heatmap->levels[0];
+	HeatmapFileHeader header;
+	std::vector<BYTE> file(sizeof(header));
+	std::vector<UINT16> cells((size_t)HEATMAP_CHUNK * HEATMAP_CHUNK * heatmap->channels);
+	std::vector<UINT16> runs;
+	HANDLE handle;
+	DWORD written;
+	bool saved;
+
+	AcquireSRWLockShared(&heatmap->lock);
+
+	header.magic = HEATMAP_MAGIC;
+	header.version = HEATMAP_VERSION;
+	header.slideId = heatmap->slideId;
+	header.columns = base->columns;
+	header.rows = base->rows;
+	header.channels = heatmap->channels;
+	header.chunkCount = 0;
+
+	for (INT32 chunkY = 0; chunkY < base->chunkRows; chunkY++)
+	{
+		for (INT32 chunkX = 0; chunkX < base->chunkColumns; chunkX++)
+		{
+			HeatmapChunk* chunk = base->chunks[chunkY * base->chunkColumns + chunkX];
+
+			if (chunk == NULL) continue;
+
+			DecodeChunk(heatmap, chunk, -1, &cells[0]);
+			EncodeRuns(heatmap, &cells[0], &runs);
+
+			INT32 record[3] = { chunkX, chunkY, (INT32)(runs.size() / 2) };
+
+			file.insert(file.end(), (BYTE*)record, (BYTE*)(record + 3));
+			file.insert(file.end(), (BYTE*)&runs[0], (BYTE*)(&runs[0] + runs.size()));
+			header.chunkCount++;
+		}
+	}
+
+	ReleaseSRWLockShared(&heatmap->lock);
+
+	memcpy(&file[0], &header, sizeof(header));
+
+	//*** Write everything at once ************************************************************************************
+	handle = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+
+	saved = WriteFile(handle, &file[0], (DWORD)file.size(), &written, NULL) && written == (DWORD)file.size();
+
+	CloseHandle(handle);
+
+	if (!saved) DeleteFileW(path);
+
+	//*** Ende ********************************************************************************************************
+	return saved;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: LoadHeatmapFile *********************************************/
+/*********************************************************************************************************************/
+
+// Adds the cells of a file written by SaveHeatmapFile for the same slide, tile grid and channel count, then rebuilds
+// the pyramid above them. Cells the file has no value for are left as they are. A truncated or corrupt file is
+// rejected before any of its cells is merged.
+bool LoadHeatmapFile(Heatmap* heatmap, const wchar_t* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	HeatmapLevel* base = &heatmap->levels[0];
+	HeatmapFileHeader header;
+	LARGE_INTEGER size;
+	std::vector<BYTE> file;
+	HANDLE handle;
+	DWORD read = 0;
+	size_t position = sizeof(header);
+	bool loaded = true;
+
+	//*** Read the whole file *****************************************************************************************
+	handle = CreateFileW(path, GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+	if (handle == INVALID_HANDLE_VALUE) return false;
+
+	if (GetFileSizeEx(handle, &size) && size.QuadPart >= (LONGLONG)sizeof(header) && size.QuadPart < 0x7FFFFFFF)
+	{
+		file.resize((size_t)size.QuadPart);
+		if (!ReadFile(handle, &file[0], (DWORD)file.size(), &read, NULL)) read = 0;
+	}
+
+	CloseHandle(handle);
+
+	if (file.empty() || read != (DWORD)file.size()) return false;
+
+	memcpy(&header, &file[0], sizeof(header));
+
+	if (header.magic != HEATMAP_MAGIC || header.version != HEATMAP_VERSION || header.slideId != heatmap->slideId ||
+		header.columns != base->columns || header.rows != base->rows || header.channels != heatmap->channels ||
+		header.chunkCount < 0)
+		return false;
+
+	//*** The records of chunkCount chunks have to fill the file exactly **********************************************
+	for (INT32 n = 0; n < header.chunkCount; n++)
+	{
+		INT32 record[3];
+
+		if (position + sizeof(record) > file.size()) return false;
+
+		memcpy(record, &file[position], sizeof(record));
+		position += sizeof(record);
+
+		if (record[0] < 0 || record[1] < 0 || record[0] >= base->chunkColumns || record[1] >= base->chunkRows ||
+			record[2] < 0 || (UINT64)position + (UINT64)record[2] * 4 > file.size())
+			return false;
+
+		position += (size_t)record[2] * 4;
+	}
+
+	if (position != file.size()) return false;
+
+	position = sizeof(header);
+
+	AcquireSRWLockExclusive(&heatmap->lock);
+
+	//*** Decode the chunks of level 0 ********************************************************************************
+	for (INT32 n = 0; n < header.chunkCount && loaded; n++)
+	{
+		INT32 record[3];
+		HeatmapChunk* chunk;
+		UINT16* cells;
+		const UINT16* runs;
+
+		if (position + sizeof(record) > file.size())
+		{
+			loaded = false;
+			break;
+		}
+
+		memcpy(record, &file[position], sizeof(record));
+		position += sizeof(record);
+
+		if (record[0] < 0 || record[1] < 0 || record[0] >= base->chunkColumns || record[1] >= base->chunkRows ||
+			record[2] < 0 || (UINT64)position + (UINT64)record[2] * 4 > file.size())
+		{
+			loaded = false;
+			break;
+		}
+
+		runs = (const UINT16*)&file[position];
+		position += (size_t)record[2] * 4;
+
+		if (heatmap->openCount >= HEATMAP_OPEN_CHUNKS) CloseChunks(heatmap);
+
+		if ((chunk = GetChunk(heatmap, 0, record[0] << HEATMAP_CHUNK_SHIFT, record[1] << HEATMAP_CHUNK_SHIFT, true)) == NULL ||
+			(cells = OpenChunk(heatmap, chunk)) == NULL)
+		{
+			loaded = false;
+			break;
+		}
+
+		DecodeRuns(heatmap, runs, record[2], -1, true, cells);
+		chunk->dirty = true;
+	}
+
+	//*** Rebuild the levels above, each from the chunks of the level below *******************************************
+	for (INT32 level = 1; level < heatmap->levelCount; level++)
+	{
+		HeatmapLevel* below = &heatmap->levels[level - 1];
+
+		for (INT32 chunkY = 0; chunkY < below->chunkRows; chunkY++)
+		{
+			for (INT32 chunkX = 0; chunkX < below->chunkColumns; chunkX++)
+			{
+				if (below->chunks[chunkY * below->chunkColumns + chunkX] == NULL) continue;
+
+				if (heatmap->openCount >= HEATMAP_OPEN_CHUNKS) CloseChunks(heatmap);
+
+				for (INT32 y = chunkY * HEATMAP_CHUNK / 2; y < (chunkY + 1) * HEATMAP_CHUNK / 2; y++)
+					for (INT32 x = chunkX * HEATMAP_CHUNK / 2; x < (chunkX + 1) * HEATMAP_CHUNK / 2; x++)
+						RefreshCell(heatmap, level, x, y);
+			}
+		}
+	}
+
+	CloseChunks(heatmap);
+
+	ReleaseSRWLockExclusive(&heatmap->lock);
+
+	//*** Ende ********************************************************************************************************
+	return loaded;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: GetChunk *************************************************/
+/*********************************************************************************************************************/
+
+// The chunk holding cell x, y of a level; NULL outside of the level, or if it was never written and allocate is false.
+// A new chunk has no runs, which stands for cells without a value.
+static HeatmapChunk* GetChunk(Heatmap* heatmap, INT32 level, INT32 x, INT32 y, bool allocate)
+{
+	HeatmapLevel* current = &heatmap->levels[level];
+	HeatmapChunk** chunk;
+
+	if (x < 0 || y < 0 || x >= current->columns || y >= current->rows) return NULL;
+
+	chunk = &current->chunks[(y >> HEATMAP_CHUNK_SHIFT) * current->chunkColumns + (x >> HEATMAP_CHUNK_SHIFT)];
+	if (*chunk != NULL || !allocate) return *chunk;
+
+	//*** Allocate it on the first write ******************************************************************************
+	if (!ChargeMemory(MEMORY_SESSIONS, sizeof(HeatmapChunk))) return NULL;
+
+	if ((*chunk = (HeatmapChunk*)calloc(1, sizeof(HeatmapChunk))) == NULL)
+	{
+		ReleaseMemory(MEMORY_SESSIONS, sizeof(HeatmapChunk));
+		return NULL;
+	}
+
+	heatmap->charged += sizeof(HeatmapChunk);
+
+	return *chunk;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: OpenChunk ************************************************/
+/*********************************************************************************************************************/
+
+// Decodes a chunk for a writer and keeps it decoded until CloseChunks; NULL if the cells cannot be allocated
+static UINT16* OpenChunk(Heatmap* heatmap, HeatmapChunk* chunk)
+{
+	size_t size = (size_t)HEATMAP_CHUNK * HEATMAP_CHUNK * heatmap->channels * sizeof(UINT16);
+	UINT16* cells;
+
+	if (chunk->cells != NULL) return chunk->cells;
+
+	if (!ChargeMemory(MEMORY_SESSIONS, (INT64)size)) return NULL;
+
+	if ((cells = (UINT16*)malloc(size)) == NULL)
+	{
+		ReleaseMemory(MEMORY_SESSIONS, (INT64)size);
+		return NULL;
+	}
+
+	heatmap->charged += size;
+
+	DecodeChunk(heatmap, chunk, -1, cells);
+	chunk->cells = cells;
+	chunk->dirty = false;
+	chunk->nextOpen = heatmap->open;
+	heatmap->open = chunk;
+	heatmap->openCount++;
+
+	return chunk->cells;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: CloseChunks ***********************************************/
+/*********************************************************************************************************************/
+
+// Codes the chunks a writer changed again and frees the decoded cells of all it opened. The coded form is never
+// larger than the cells, so this only gives memory back; if it cannot be allocated, the cells are kept as they are.
+static void CloseChunks(Heatmap* heatmap)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	size_t size = (size_t)HEATMAP_CHUNK * HEATMAP_CHUNK * heatmap->channels * sizeof(UINT16);
+	std::vector<UINT16> runs;
+	HeatmapChunk* chunk;
+	INT64 freed = 0;
+
+	while ((chunk = heatmap->open) != NULL)
+	{
+		heatmap->open = chunk->nextOpen;
+		chunk->nextOpen = NULL;
+
+		if (chunk->dirty)
+		{
+			size_t previous = chunk->plain ? size : (size_t)chunk->runCount * 2 * sizeof(UINT16);
+			size_t coded;
+			UINT16* data;
+
+			EncodeRuns(heatmap, chunk->cells, &runs);
+			coded = runs.size() * sizeof(UINT16);
+
+			free(chunk->data);
+			freed += previous;
+
+			//*** Runs that are not smaller than the cells are not worth decoding *************************************
+			if (coded < size && (data = (UINT16*)malloc(coded)) != NULL)
+			{
+				memcpy(data, &runs[0], coded);
+				chunk->data = data;
+				chunk->runCount = (INT32)(runs.size() / 2);
+				chunk->plain = false;
+				free(chunk->cells);
+				freed += size - coded;
+			}
+			else
+			{
+				chunk->data = chunk->cells;
+				chunk->runCount = 0;
+				chunk->plain = true;
+			}
+		}
+		else
+		{
+			free(chunk->cells);
+			freed += size;
+		}
+
+		chunk->cells = NULL;
+		chunk->dirty = false;
+	}
+
+	heatmap->openCount = 0;
+	heatmap->charged -= freed;
+
+	ReleaseMemory(MEMORY_SESSIONS, freed);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: DecodeChunk ***********************************************/
+/*********************************************************************************************************************/
+
+// Writes all channels of a chunk interleaved into cells, or with channel 0 or above only that channel
+static void DecodeChunk(Heatmap* heatmap, const HeatmapChunk* chunk, INT32 channel, UINT16* cells)
+{
+	INT32 count = HEATMAP_CHUNK * HEATMAP_CHUNK;
+
+	if (chunk->cells != NULL)
+	{
+		if (channel < 0) memcpy(cells, chunk->cells, (size_t)count * heatmap->channels * sizeof(UINT16));
+		else for (INT32 i = 0; i < count; i++) cells[i] = chunk->cells[i * heatmap->channels + channel];
+	}
+	else if (chunk->plain)
+	{
+		if (channel < 0) memcpy(cells, chunk->data, (size_t)count * heatmap->channels * sizeof(UINT16));
+		else for (INT32 i = 0; i < count; i++) cells[i] = chunk->data[i * heatmap->channels + channel];
+	}
+	else if (chunk->runCount == 0)
+	{
+		memset(cells, 0, (size_t)count * (channel < 0 ? heatmap->channels : 1) * sizeof(UINT16));
+	}
+	else
+	{
+		DecodeRuns(heatmap, chunk->data, chunk->runCount, channel, false, cells);
+	}
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: EncodeRuns ************************************************/
+/*********************************************************************************************************************/
+
+// Runs over the cells of one channel after the other, as (length, value) pairs
+static void EncodeRuns(Heatmap* heatmap, const UINT16* cells, std::vector<UINT16>* runs)
+{
+	runs->clear();
+
+	for (INT32 c = 0; c < heatmap->channels; c++)
+	{
+		for (INT32 i = 0; i < HEATMAP_CHUNK * HEATMAP_CHUNK;)
+		{
+			UINT16 value = cells[i * heatmap->channels + c];
+			INT32 length = 1;
+
+			while (i + length < HEATMAP_CHUNK * HEATMAP_CHUNK && length < 0xFFFF &&
+				cells[(i + length) * heatmap->channels + c] == value)
+				length++;
+
+			runs->push_back((UINT16)length);
+			runs->push_back(value);
+			i += length;
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: DecodeRuns ************************************************/
+/*********************************************************************************************************************/
+
+// Counterpart of EncodeRuns, for all channels or only one as DecodeChunk; with merge, runs without a value leave the
+// cells as they are
+static void DecodeRuns(Heatmap* heatmap, const UINT16* runs, INT32 runCount, INT32 channel, bool merge, UINT16* cells)
+{
+	INT32 count = HEATMAP_CHUNK * HEATMAP_CHUNK;
+
+	for (INT32 r = 0, cell = 0; r < runCount && cell < count * heatmap->channels; r++)
+	{
+		INT32 length = (std::min)((INT32)runs[2 * r], count * heatmap->channels - cell);
+		UINT16 value = runs[2 * r + 1];
+
+		//*** Runs of other channels are skipped as a whole ***********************************************************
+		if ((merge && value == 0) ||
+			(channel >= 0 && (cell + length <= channel * count || cell >= (channel + 1) * count)))
+		{
+			cell += length;
+			continue;
+		}
+
+		for (INT32 i = 0; i < length; i++, cell++)
+		{
+			if (channel < 0) cells[(cell % count) * heatmap->channels + cell / count] = value;
+			else if (cell / count == channel) cells[cell % count] = value;
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: RefreshCell ***********************************************/
+/*********************************************************************************************************************/
+
+// Recomputes a cell of level 1 or above as the mean of the children that have a value; returns whether it changed
+static bool RefreshCell(Heatmap* heatmap, INT32 level, INT32 x, INT32 y)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	UINT16 values[64];
+	UINT32 sums[64] = { 0 };
+	UINT32 counts[64] = { 0 };
+	HeatmapChunk* chunk;
+	UINT16* cells;
+	UINT16* cell;
+	bool present = false;
+
+	if (x >= heatmap->levels[level].columns || y >= heatmap->levels[level].rows) return false;
+
+	//*** Sum up the children per channel *****************************************************************************
+	for (INT32 child = 0; child < 4; child++)
+	{
+		INT32 childX = 2 * x + (child & 1), childY = 2 * y + (child >> 1);
+		HeatmapChunk* childChunk = GetChunk(heatmap, level - 1, childX, childY, false);
+
+		if (childChunk == NULL) continue;
+		if ((cells = OpenChunk(heatmap, childChunk)) == NULL) return false;
+
+		cell = cells + (((childY & (HEATMAP_CHUNK - 1)) << HEATMAP_CHUNK_SHIFT) + (childX & (HEATMAP_CHUNK - 1))) *
+			heatmap->channels;
+
+		for (INT32 c = 0; c < heatmap->channels; c++)
+		{
+			if (cell[c] == 0) continue;
+
+			sums[c] += cell[c] - 1;
+			counts[c]++;
+		}
+	}
+
+	for (INT32 c = 0; c < heatmap->channels; c++)
+	{
+		values[c] = (counts[c] != 0) ? (UINT16)(1 + (sums[c] + counts[c] / 2) / counts[c]) : 0;
+		present |= (values[c] != 0);
+	}
+
+	//*** A cell without a value does not need a chunk ****************************************************************
+	if ((chunk = GetChunk(heatmap, level, x, y, present)) == NULL) return present;
+	if ((cells = OpenChunk(heatmap, chunk)) == NULL) return false;
+
+	cell = cells + (((y & (HEATMAP_CHUNK - 1)) << HEATMAP_CHUNK_SHIFT) + (x & (HEATMAP_CHUNK - 1))) * heatmap->channels;
+
+	if (memcmp(cell, values, heatmap->channels * sizeof(UINT16)) == 0) return false;
+
+	memcpy(cell, values, heatmap->channels * sizeof(UINT16));
+	chunk->dirty = true;
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: GetColor *************************************************/
+/*********************************************************************************************************************/
+
+// Jet color map from blue over green to red, premultiplied with the opacity, as B, G, R, A
+static void GetColor(UINT16 value, BYTE opacity, BYTE* color)
+{
+	double v = (value - 1) / 65534.0;
+	double rgb[3] = { 1.5 - fabs(4 * v - 3), 1.5 - fabs(4 * v - 2), 1.5 - fabs(4 * v - 1) };
+
+	for (int i = 0; i < 3; i++)
+	{
+		double channel = (rgb[i] < 0) ? 0 : ((rgb[i] > 1) ? 1 : rgb[i]);
+		color[2 - i] = (BYTE)(channel * opacity + 0.5);
+	}
+
+	color[3] = opacity;
+}
@@ -0,0 +1,98 @@
+/*********************************************************************************************************************/
+/* Datei: Heatmap.h                                                                                                  */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Sparse pyramid of per-tile inference results, rendered as overlay tiles on the slide tile grid     */
+/*********************************************************************************************************************/
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// cells per side of a chunk; chunks are only allocated once one of their cells has a value
+#define HEATMAP_CHUNK_SHIFT			6
+#define HEATMAP_CHUNK				(1 << HEATMAP_CHUNK_SHIFT)
+
+// chunks a writer keeps decoded before it codes them again
+#define HEATMAP_OPEN_CHUNKS			256
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// A chunk is held run-length coded, runCount runs of (length, value) channel after channel as in a heatmap file, or
+// as plain cells where the runs would not be smaller. Writers decode it into cells and code it again once they are
+// done, so the decoded form only exists while the exclusive lock is held.
+struct HeatmapChunk
+{
+	UINT16* data;
+	INT32 runCount;
+	bool plain;
+
+	UINT16* cells;
+	bool dirty;
+	HeatmapChunk* nextOpen;
+};
+
+// Level n of the pyramid halves level n - 1; a cell holds the mean of the children that have a value
+struct HeatmapLevel
+{
+	INT32 columns;
+	INT32 rows;
+	INT32 chunkColumns;
+	INT32 chunkRows;
+
+	// chunkColumns x chunkRows pointers, NULL where no cell has a value
+	HeatmapChunk** chunks;
+};
+
+struct Heatmap
+{
+	// writers take the lock exclusively, renderers shared
+	SRWLOCK lock;
+	UINT64 slideId;
+
+	// values per cell; 0 means no value, 1 to 65535 map linearly onto 0.0 to 1.0
+	INT32 channels;
+
+	// cells of pyramid level 0 are the tiles of one slide level, cellWidth x cellHeight level 0 pixels each
+	double cellWidth;
+	double cellHeight;
+	HeatmapLevel* levels;
+	INT32 levelCount;
+
+	// tile grid of every slide level: step x, step y and downsample per level, as GetOpenSlideTile reads it
+	INT32 tileWidth;
+	INT32 tileHeight;
+	double* slideGrid;
+	INT32 slideLevels;
+
+	// chunks decoded by the writer holding the lock
+	HeatmapChunk* open;
+	INT32 openCount;
+
+	INT64 charged;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+Heatmap* CreateHeatmapStore(UINT64 slideId, INT32 columns, INT32 rows, double cellWidth, double cellHeight, INT32 channels,
+	INT32 tileWidth, INT32 tileHeight, const double* slideGrid, INT32 slideLevels);
+void FreeHeatmap(Heatmap* heatmap);
+bool SetHeatmapCells(Heatmap* heatmap, const INT32* coordinates, INT32 count, const float* values);
+bool GetHeatmapCells(Heatmap* heatmap, INT32 level, INT32 x, INT32 y, INT32 width, INT32 height, float* values);
+void RenderHeatmapTile(Heatmap* heatmap, INT32 level, INT32 x, INT32 y, INT32 channel, BYTE opacity, BYTE* data);
+bool SaveHeatmapFile(Heatmap* heatmap, const wchar_t* path);
+bool LoadHeatmapFile(Heatmap* heatmap, const wchar_t* path);
+
+#endif
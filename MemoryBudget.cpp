@@ -0,0 +1,191 @@
+/*********************************************************************************************************************/
+/* Datei: MemoryBudget.cpp                                                                                           */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Process-wide accounting of the memory of all sessions, buffers and caches against one cap          */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define MEMORY_MAX_SHEDDERS			16
+
+// shedding order: memory of a lower priority is given up first, and a charge may only shed lower priorities
+#define MEMORY_PRIORITY_PREFETCH	0
+#define MEMORY_PRIORITY_CACHE		1
+#define MEMORY_PRIORITY_INTERACTIVE	2
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+static struct
+{
+	volatile LONGLONG usage[MEMORY_CATEGORY_COUNT];
+	volatile LONGLONG total;
+	volatile LONGLONG peak;
+	volatile LONGLONG cap;
+
+	// shedders are only ever added; count is published after the entry
+	MemoryShedder shedders[MEMORY_MAX_SHEDDERS];
+	INT32 shedderCategories[MEMORY_MAX_SHEDDERS];
+	volatile LONG shedderCount;
+	SRWLOCK registration;
+} budget = { { 0 }, 0, 0, 0, { 0 }, { 0 }, 0, SRWLOCK_INIT };
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static int Priority(INT32 category);
+static void Shed(int belowPriority);
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: SetMemoryBudget *********************************************/
+/*********************************************************************************************************************/
+
+// Sets the hard cap in bytes for all memory the library accounts for (0 = no cap). Lowering the cap below the current
+// usage sheds prefetch buffers and caches right away; memory in use by sessions is never taken back.
+extern "C" __declspec(dllexport) BOOL SetMemoryBudget(INT64 capBytes)
+{
+	if (capBytes < 0) return false;
+
+	InterlockedExchange64(&budget.cap, capBytes);
+
+	if (capBytes > 0 && budget.total > capBytes) Shed(MEMORY_PRIORITY_INTERACTIVE);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: GetMemoryUsage **********************************************/
+/*********************************************************************************************************************/
+
+// Fills MEMORY_USAGE_COUNT values: the bytes of every category, the total, the peak total and the cap.
+extern "C" __declspec(dllexport) BOOL GetMemoryUsage(INT64* usage)
+{
+	if (usage == NULL) return false;
+
+	for (int i = 0; i < MEMORY_CATEGORY_COUNT; i++) usage[i] = budget.usage[i];
+
+	usage[MEMORY_CATEGORY_COUNT] = budget.total;
+	usage[MEMORY_CATEGORY_COUNT + 1] = budget.peak;
+	usage[MEMORY_CATEGORY_COUNT + 2] = budget.cap;
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ChargeMemory ***********************************************/
+/*********************************************************************************************************************/
+
+// Accounts for bytes about to be allocated. Over the cap, categories of lower priority are shed first; if that does
+// not make room, the charge is refused and the caller must not allocate.
+bool ChargeMemory(INT32 category, INT64 bytes)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	LONGLONG total, peak;
+	INT64 cap;
+
+	if (category < 0 || category >= MEMORY_CATEGORY_COUNT || bytes <= 0) return true;
+
+	InterlockedExchangeAdd64(&budget.usage[category], bytes);
+	total = InterlockedExchangeAdd64(&budget.total, bytes) + bytes;
+
+	//*** Track the peak **********************************************************************************************
+	while ((peak = budget.peak) < total && InterlockedCompareExchange64(&budget.peak, total, peak) != peak);
+
+	if ((cap = budget.cap) == 0 || total <= cap) return true;
+
+	//*** Make room at the expense of lower priorities ****************************************************************
+	Shed(Priority(category));
+
+	if (budget.total <= cap) return true;
+
+	ReleaseMemory(category, bytes);
+
+	//*** Ende ********************************************************************************************************
+	return false;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ReleaseMemory **********************************************/
+/*********************************************************************************************************************/
+
+void ReleaseMemory(INT32 category, INT64 bytes)
+{
+	if (category < 0 || category >= MEMORY_CATEGORY_COUNT || bytes <= 0) return;
+
+	InterlockedExchangeAdd64(&budget.usage[category], -bytes);
+	InterlockedExchangeAdd64(&budget.total, -bytes);
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: RegisterMemoryShedder ******************************************/
+/*********************************************************************************************************************/
+
+// Modules that hold memory they can give up register a shedder once for its category.
+void RegisterMemoryShedder(INT32 category, MemoryShedder shedder)
+{
+	AcquireSRWLockExclusive(&budget.registration);
+
+	if (budget.shedderCount < MEMORY_MAX_SHEDDERS)
+	{
+		budget.shedders[budget.shedderCount] = shedder;
+		budget.shedderCategories[budget.shedderCount] = category;
+		MemoryBarrier();
+		InterlockedIncrement(&budget.shedderCount);
+	}
+
+	ReleaseSRWLockExclusive(&budget.registration);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************** Funktion: Shed ***************************************************/
+/*********************************************************************************************************************/
+
+// Calls the shedders in priority order, lowest first, until the total is under the cap again
+static void Shed(int belowPriority)
+{
+	LONG count = budget.shedderCount;
+
+	for (int priority = 0; priority < belowPriority; priority++)
+	{
+		for (LONG i = 0; i < count; i++)
+		{
+			INT64 excess = budget.total - budget.cap;
+
+			if (budget.cap == 0 || excess <= 0) return;
+
+			if (Priority(budget.shedderCategories[i]) == priority) budget.shedders[i](excess);
+		}
+	}
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: Priority *************************************************/
+/*********************************************************************************************************************/
+
+static int Priority(INT32 category)
+{
+	switch (category)
+	{
+	case MEMORY_PREFETCH:	return MEMORY_PRIORITY_PREFETCH;
+	case MEMORY_CACHES:		return MEMORY_PRIORITY_CACHE;
+	default:				return MEMORY_PRIORITY_INTERACTIVE;
+	}
+}
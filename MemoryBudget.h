@@ -0,0 +1,48 @@
+/*********************************************************************************************************************/
+/* Datei: MemoryBudget.h                                                                                             */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Process-wide accounting of the memory of all sessions, buffers and caches against one cap          */
+/*********************************************************************************************************************/
+
+#ifndef MEMORY_BUDGET_H
+#define MEMORY_BUDGET_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// categories in the order reported by GetMemoryUsage
+#define MEMORY_SESSIONS				0		// sessions and their openslide handle, stain tables, tile iterators,
+											// annotations, heatmaps, pinned levels
+#define MEMORY_TILE_BUFFERS			1		// slabs of the tile buffer pool
+#define MEMORY_CACHES				2		// in-process and shared tile caches, additional pooled openslide handles
+#define MEMORY_PREFETCH				3		// read-ahead buffers
+#define MEMORY_INDEXES				4		// tile offset tables, index of the disk cache
+#define MEMORY_TRACING				5		// trace rings
+#define MEMORY_CATEGORY_COUNT		6
+
+// GetMemoryUsage reports the categories followed by the total, the peak total and the cap
+#define MEMORY_USAGE_COUNT			(MEMORY_CATEGORY_COUNT + 3)
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// Frees up to bytes of memory of its category, releases the charge and returns how much it freed
+typedef INT64 (*MemoryShedder)(INT64 bytes);
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+bool ChargeMemory(INT32 category, INT64 bytes);
+void ReleaseMemory(INT32 category, INT64 bytes);
+void RegisterMemoryShedder(INT32 category, MemoryShedder shedder);
+
+#endif
@@ -0,0 +1,190 @@
+/*********************************************************************************************************************/
+/* Datei: PinnedLevels.cpp                                                                                           */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Low-resolution levels decoded once into one in-memory mosaic per level                             */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "PinnedLevels.h"
+#include "MemoryBudget.h"
+#include "SlidePool.h"
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+static struct
+{
+	volatile LONGLONG maxPixels;
+} pinning;
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: SetLevelPinning *********************************************/
+/*********************************************************************************************************************/
+
+// Pins the smallest levels of every slide, as many as fit together into maxPixels pixels (4 bytes each); 0 turns it
+// off. A slide pins its levels on the first tile or region read after this, and keeps them until it is closed.
+extern "C" __declspec(dllexport) BOOL SetLevelPinning(INT64 maxPixels)
+{
+	if (maxPixels < 0) return false;
+
+	InterlockedExchange64(&pinning.maxPixels, maxPixels);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: GetLevelPinning *********************************************/
+/*********************************************************************************************************************/
+
+INT64 GetLevelPinning()
+{
+	return pinning.maxPixels;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: BuildPinnedLevels ********************************************/
+/*********************************************************************************************************************/
+
+// Reads the levels from the smallest one upwards, each in a single openslide_read_region, until the pixel budget or
+// the memory budget is used up. Returns NULL if not even the smallest level could be pinned.
+// The levels are read through a handle of their own: a failed read leaves its error in the handle for good, and that
+// must not be one the session reads tiles with.
+PinnedLevels* BuildPinnedLevels(const char* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	PinnedLevels* pinned = NULL;
+	INT64 budget = pinning.maxPixels;
+	openslide_t* slide;
+	INT32 count;
+
+	if (budget <= 0) return NULL;
+
+	//*** Open the slide once more; its cache is charged like that of a pooled handle *********************************
+	if (!ChargeMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE)) return NULL;
+
+	if ((slide = openslide_open(path)) == NULL)
+	{
+		ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+		return NULL;
+	}
+
+	if ((count = openslide_get_level_count(slide)) <= 0 ||
+		(pinned = (PinnedLevels*)calloc(1, sizeof(PinnedLevels))) == NULL)
+	{
+		openslide_close(slide);
+		ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+		return NULL;
+	}
+
+	pinned->levelCount = count;
+	pinned->levels = (PinnedLevel*)calloc(count, sizeof(PinnedLevel));
+
+	if (pinned->levels == NULL)
+	{
+		free(pinned);
+		openslide_close(slide);
+		ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+		return NULL;
+	}
+
+	for (INT32 level = count - 1; level >= 0; level--)
+	{
+		PinnedLevel* current = &pinned->levels[level];
+		INT64 size;
+
+		openslide_get_level_dimensions(slide, level, &current->width, &current->height);
+
+		if (current->width <= 0 || current->height <= 0 || current->width * current->height > budget) break;
+
+		//*** Charge before allocating; a full budget ends the pinning like the pixel budget **************************
+		size = current->width * current->height * 4;
+
+		if (size > (INT64)(SIZE_T)-1 || !ChargeMemory(MEMORY_SESSIONS, size)) break;
+
+		if ((current->pixels = (uint32_t*)malloc((size_t)size)) == NULL)
+		{
+			ReleaseMemory(MEMORY_SESSIONS, size);
+			break;
+		}
+
+		openslide_read_region(slide, current->pixels, 0, 0, level, current->width, current->height);
+
+		if (openslide_get_error(slide) != NULL)
+		{
+			free(current->pixels);
+			current->pixels = NULL;
+			ReleaseMemory(MEMORY_SESSIONS, size);
+			break;
+		}
+
+		pinned->charged += size;
+		budget -= current->width * current->height;
+	}
+
+	openslide_close(slide);
+	ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+
+	if (pinned->charged == 0)
+	{
+		FreePinnedLevels(pinned);
+		return NULL;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return pinned;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: FreePinnedLevels *********************************************/
+/*********************************************************************************************************************/
+
+void FreePinnedLevels(PinnedLevels* pinned)
+{
+	if (pinned == NULL) return;
+
+	for (INT32 level = 0; level < pinned->levelCount; level++) free(pinned->levels[level].pixels);
+
+	ReleaseMemory(MEMORY_SESSIONS, pinned->charged);
+
+	free(pinned->levels);
+	free(pinned);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: CopyPinnedRegion *********************************************/
+/*********************************************************************************************************************/
+
+// Copies width x height pixels at x, y of the level row by row into target; what lies outside of the level is
+// transparent, as openslide_read_region returns it
+void CopyPinnedRegion(const PinnedLevel* level, INT64 x, INT64 y, INT32 width, INT32 height, uint32_t* target)
+{
+	INT64 left = (x > 0) ? x : 0;
+	INT64 right = (x + width < level->width) ? x + width : level->width;
+
+	for (INT32 row = 0; row < height; row++)
+	{
+		uint32_t* line = target + (INT64)row * width;
+
+		if (y + row < 0 || y + row >= level->height || left >= right)
+		{
+			memset(line, 0, (size_t)width * 4);
+			continue;
+		}
+
+		if (left > x) memset(line, 0, (size_t)(left - x) * 4);
+
+		memcpy(line + (left - x), level->pixels + (y + row) * level->width + left, (size_t)(right - left) * 4);
+
+		if (right < x + width) memset(line + (right - x), 0, (size_t)(x + width - right) * 4);
+	}
+}
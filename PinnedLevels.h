@@ -0,0 +1,51 @@
+/*********************************************************************************************************************/
+/* Datei: PinnedLevels.h                                                                                             */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Low-resolution levels decoded once into one in-memory mosaic per level                             */
+/*********************************************************************************************************************/
+
+#ifndef PINNED_LEVELS_H
+#define PINNED_LEVELS_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "openslide.h"
+
+
+/*********************************************************************************************************************/
+/*********************************************** Struktur: PinnedLevel ***********************************************/
+/*********************************************************************************************************************/
+
+// The whole level as premultiplied ARGB, width * height pixels row by row; pixels is NULL if the level is not pinned
+struct PinnedLevel
+{
+	INT64 width;
+	INT64 height;
+	uint32_t* pixels;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Struktur: PinnedLevels ***********************************************/
+/*********************************************************************************************************************/
+
+struct PinnedLevels
+{
+	PinnedLevel* levels;
+	INT32 levelCount;
+	INT64 charged;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+INT64 GetLevelPinning();
+PinnedLevels* BuildPinnedLevels(const char* path);
+void FreePinnedLevels(PinnedLevels* pinned);
+void CopyPinnedRegion(const PinnedLevel* level, INT64 x, INT64 y, INT32 width, INT32 height, uint32_t* target);
+
+#endif
@@ -0,0 +1,392 @@
+/*********************************************************************************************************************/
+/* Datei: ReadAhead.cpp                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Merges the byte ranges of the tiles of a batch into few large sequential reads ahead of decoding   */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <algorithm>
+#include <vector>
+
+#include "ReadAhead.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// ranges closer than the gap are read as one span, including the bytes in between
+#define READ_AHEAD_GAP				(256 * 1024)
+#define READ_AHEAD_SPAN				(8 * 1024 * 1024)
+
+// upper bound of the bytes read ahead for a single batch
+#define READ_AHEAD_LIMIT			((UINT64)512 * 1024 * 1024)
+
+// batches read ahead at the same time; the hints of further batches are dropped
+#define READ_AHEAD_JOBS				4
+
+// spans in flight at the same time; several outstanding reads hide the latency of network storage
+#define READ_AHEAD_QUEUE			4
+
+// buffers kept for the next batch; idle ones are the first memory the budget takes back
+#define READ_AHEAD_IDLE				READ_AHEAD_QUEUE
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct ByteRange
+{
+	UINT64 offset;
+	UINT64 length;
+
+	bool operator<(const ByteRange& other) const { return offset < other.offset; }
+};
+
+struct PendingRead
+{
+	OVERLAPPED overlapped;
+	BYTE* buffer;
+	bool busy;
+};
+
+// the spans of one batch, read on the thread pool; module keeps the DLL loaded until the reads are done
+struct ReadAheadJob
+{
+	char* path;
+	std::vector<ByteRange> spans;
+	UINT64 maxSpan;
+	HMODULE module;
+};
+
+static struct
+{
+	volatile LONG maxGap;
+	volatile LONG maxSpan;
+
+	// idle buffers, guarded by lock; size is the length of every one of them
+	SRWLOCK lock;
+	BYTE* idle[READ_AHEAD_IDLE];
+	INT32 idleCount;
+	UINT64 size;
+	volatile LONG registered;
+
+	volatile LONG jobs;
+} readAhead = { READ_AHEAD_GAP, READ_AHEAD_SPAN, SRWLOCK_INIT };
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static VOID CALLBACK ReadAheadCallback(PTP_CALLBACK_INSTANCE instance, PVOID parameter);
+static void ReadSpans(const char* path, const std::vector<ByteRange>& spans, UINT64 maxSpan);
+static BYTE* TakePrefetchBuffer(UINT64 size);
+static void ReturnPrefetchBuffer(BYTE* buffer, UINT64 size);
+static INT64 TrimPrefetchBuffers(INT64 bytes);
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: SetReadAhead ***********************************************/
+/*********************************************************************************************************************/
+
+// Sets how far apart two tiles may lie to be read in one span and how long a span may get, both in bytes.
+// maxSpan 0 turns the read-ahead off.
+extern "C" __declspec(dllexport) BOOL SetReadAhead(INT32 maxGap, INT32 maxSpan)
+{
+	if (maxGap < 0 || maxSpan < 0) return false;
+
+	InterlockedExchange(&readAhead.maxGap, maxGap);
+	InterlockedExchange(&readAhead.maxSpan, maxSpan);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: ReadAheadTiles **********************************************/
+/*********************************************************************************************************************/
+
+// Collects the byte ranges of the tiles (x, y pairs) and merges neighbouring ranges into spans. The spans are read on
+// the thread pool with large overlapped reads while the caller decodes, so that openslide finds the tile data in the
+// file system cache instead of issuing one small random read per tile. Only a hint: returns at once, and drops the
+// batch if READ_AHEAD_JOBS batches are still being read. Spans of a single tile are skipped, openslide reads them just
+// as well.
+void ReadAheadTiles(const char* path, const TiffLevel* level, const INT32* coordinates, INT32 count)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<ByteRange> ranges, spans;
+	UINT64 maxGap = (UINT64)readAhead.maxGap;
+	UINT64 maxSpan = (UINT64)readAhead.maxSpan;
+	UINT64 total = 0;
+	ReadAheadJob* job;
+
+	if (maxSpan == 0 || path == NULL || level == NULL || level->offsets == NULL || count < 2) return;
+
+	//*** Byte ranges of the tiles in file order **********************************************************************
+	for (INT32 i = 0; i < count; i++)
+	{
+		INT32 x = coordinates[2 * i], y = coordinates[2 * i + 1];
+		ByteRange range;
+
+		if (x < 0 || y < 0 || x >= level->columns || y >= level->rows) continue;
+
+		range.offset = level->offsets[(INT64)y * level->columns + x];
+		range.length = level->lengths[(INT64)y * level->columns + x];
+
+		if (range.length > 0) ranges.push_back(range);
+	}
+
+	std::sort(ranges.begin(), ranges.end());
+
+	//*** Merge ranges that are close together, as long as the span does not get too long *****************************
+	for (size_t i = 0; i < ranges.size(); )
+	{
+		ByteRange span = ranges[i];
+		UINT64 end = span.offset + span.length;
+		size_t tiles = 1;
+
+		for (i++; i < ranges.size(); i++, tiles++)
+		{
+			UINT64 rangeEnd = (std::max)(end, ranges[i].offset + ranges[i].length);
+
+			if (ranges[i].offset > end + maxGap || rangeEnd - span.offset > maxSpan) break;
+
+			end = rangeEnd;
+		}
+
+		span.length = end - span.offset;
+
+		if (tiles < 2 || total + span.length > READ_AHEAD_LIMIT) continue;
+
+		spans.push_back(span);
+		total += span.length;
+	}
+
+	if (spans.empty()) return;
+
+	//*** Readers must not queue up behind read-ahead, so a busy pool drops the hint **********************************
+	if (InterlockedIncrement(&readAhead.jobs) > READ_AHEAD_JOBS)
+	{
+		InterlockedDecrement(&readAhead.jobs);
+		return;
+	}
+
+	job = new ReadAheadJob;
+	job->path = _strdup(path);
+	job->spans.swap(spans);
+	job->maxSpan = maxSpan;
+
+	//*** The reference on the DLL is given up by the callback, so an unload waits for the reads **********************
+	if (!GetModuleHandleExW(GET_MODULE_HANDLE_EX_FLAG_FROM_ADDRESS, (LPCWSTR)ReadAheadCallback, &job->module))
+		job->module = NULL;
+
+	if (job->path != NULL && job->module != NULL && TrySubmitThreadpoolCallback(ReadAheadCallback, job, NULL)) return;
+
+	//*** Without the thread pool the hint is dropped *****************************************************************
+	if (job->module != NULL) FreeLibrary(job->module);
+	free(job->path);
+	delete job;
+
+	InterlockedDecrement(&readAhead.jobs);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: ReadAheadCallback ********************************************/
+/*********************************************************************************************************************/
+
+static VOID CALLBACK ReadAheadCallback(PTP_CALLBACK_INSTANCE instance, PVOID parameter)
+{
+	ReadAheadJob* job = (ReadAheadJob*)parameter;
+	HMODULE module = job->module;
+
+	ReadSpans(job->path, job->spans, job->maxSpan);
+
+	free(job->path);
+	delete job;
+
+	InterlockedDecrement(&readAhead.jobs);
+	FreeLibraryWhenCallbackReturns(instance, module);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ReadSpans ************************************************/
+/*********************************************************************************************************************/
+
+// Reads the spans with up to READ_AHEAD_QUEUE overlapped reads in flight; the data itself is discarded
+static void ReadSpans(const char* path, const std::vector<ByteRange>& spans, UINT64 maxSpan)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	PendingRead pending[READ_AHEAD_QUEUE];
+	HANDLE file;
+
+	file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_FLAG_OVERLAPPED | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) return;
+
+	memset(pending, 0, sizeof(pending));
+
+	for (size_t next = 0, done = 0; done < spans.size(); )
+	{
+		bool issued = false;
+
+		for (int q = 0; q < READ_AHEAD_QUEUE && next < spans.size(); q++)
+		{
+			PendingRead* read = &pending[q];
+
+			if (read->busy) continue;
+
+			if (read->buffer == NULL) read->buffer = TakePrefetchBuffer(maxSpan);
+
+			if (read->overlapped.hEvent == NULL) read->overlapped.hEvent = CreateEvent(NULL, TRUE, FALSE, NULL);
+
+			if (read->buffer == NULL || read->overlapped.hEvent == NULL)
+			{
+				//*** Without a buffer the span is simply left to openslide *******************************************
+				next++;
+				done++;
+				issued = true;
+				continue;
+			}
+
+			read->overlapped.Offset = (DWORD)spans[next].offset;
+			read->overlapped.OffsetHigh = (DWORD)(spans[next].offset >> 32);
+			ResetEvent(read->overlapped.hEvent);
+
+			if (ReadFile(file, read->buffer, (DWORD)spans[next].length, NULL, &read->overlapped) ||
+				GetLastError() == ERROR_IO_PENDING)
+				read->busy = true;
+			else
+				done++;
+
+			next++;
+			issued = true;
+		}
+
+		//*** Wait for one of the reads when the queue is full or all spans are issued ********************************
+		if (!issued || next == spans.size())
+		{
+			for (int q = 0; q < READ_AHEAD_QUEUE; q++)
+			{
+				DWORD read;
+
+				if (!pending[q].busy) continue;
+
+				GetOverlappedResult(file, &pending[q].overlapped, &read, TRUE);
+				pending[q].busy = false;
+				done++;
+				break;
+			}
+		}
+	}
+
+	//*** Ende ********************************************************************************************************
+	for (int q = 0; q < READ_AHEAD_QUEUE; q++)
+	{
+		if (pending[q].overlapped.hEvent != NULL) CloseHandle(pending[q].overlapped.hEvent);
+
+		if (pending[q].buffer != NULL) ReturnPrefetchBuffer(pending[q].buffer, maxSpan);
+	}
+
+	CloseHandle(file);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: TakePrefetchBuffer ********************************************/
+/*********************************************************************************************************************/
+
+// Reuses an idle buffer of the size or allocates a new one. Prefetch buffers come last in the memory budget and never
+// push out anything else; NULL if the budget has no room.
+static BYTE* TakePrefetchBuffer(UINT64 size)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	BYTE* buffer = NULL;
+	UINT64 idleSize = 0;
+
+	AcquireSRWLockExclusive(&readAhead.lock);
+
+	if (readAhead.idleCount > 0)
+	{
+		buffer = readAhead.idle[--readAhead.idleCount];
+		idleSize = readAhead.size;
+	}
+
+	ReleaseSRWLockExclusive(&readAhead.lock);
+
+	if (buffer != NULL && idleSize == size) return buffer;
+
+	//*** A buffer of an earlier span length is given back ************************************************************
+	if (buffer != NULL)
+	{
+		VirtualFree(buffer, 0, MEM_RELEASE);
+		ReleaseMemory(MEMORY_PREFETCH, (INT64)idleSize);
+	}
+
+	if (InterlockedExchange(&readAhead.registered, 1) == 0) RegisterMemoryShedder(MEMORY_PREFETCH, TrimPrefetchBuffers);
+
+	if (!ChargeMemory(MEMORY_PREFETCH, (INT64)size)) return NULL;
+
+	if ((buffer = (BYTE*)VirtualAlloc(NULL, (SIZE_T)size, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) == NULL)
+		ReleaseMemory(MEMORY_PREFETCH, (INT64)size);
+
+	//*** Ende ********************************************************************************************************
+	return buffer;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: ReturnPrefetchBuffer *******************************************/
+/*********************************************************************************************************************/
+
+static void ReturnPrefetchBuffer(BYTE* buffer, UINT64 size)
+{
+	bool kept = false;
+
+	AcquireSRWLockExclusive(&readAhead.lock);
+
+	//*** Only buffers of one size are kept; a new span length replaces them one by one *******************************
+	if (readAhead.idleCount == 0) readAhead.size = size;
+
+	if (readAhead.idleCount < READ_AHEAD_IDLE && readAhead.size == size)
+	{
+		readAhead.idle[readAhead.idleCount++] = buffer;
+		kept = true;
+	}
+
+	ReleaseSRWLockExclusive(&readAhead.lock);
+
+	if (kept) return;
+
+	VirtualFree(buffer, 0, MEM_RELEASE);
+	ReleaseMemory(MEMORY_PREFETCH, (INT64)size);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: TrimPrefetchBuffers *******************************************/
+/*********************************************************************************************************************/
+
+// Shedder of the memory budget: frees idle prefetch buffers; the ones of reads in flight are returned afterwards.
+static INT64 TrimPrefetchBuffers(INT64 bytes)
+{
+	INT64 freed = 0;
+
+	AcquireSRWLockExclusive(&readAhead.lock);
+
+	while (freed < bytes && readAhead.idleCount > 0)
+	{
+		VirtualFree(readAhead.idle[--readAhead.idleCount], 0, MEM_RELEASE);
+		ReleaseMemory(MEMORY_PREFETCH, (INT64)readAhead.size);
+		freed += (INT64)readAhead.size;
+	}
+
+	ReleaseSRWLockExclusive(&readAhead.lock);
+
+	return freed;
+}
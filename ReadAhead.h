@@ -0,0 +1,22 @@
+/*********************************************************************************************************************/
+/* Datei: ReadAhead.h                                                                                                */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Merges the byte ranges of the tiles of a batch into few large sequential reads ahead of decoding   */
+/*********************************************************************************************************************/
+
+#ifndef READ_AHEAD_H
+#define READ_AHEAD_H
+
+#include <windows.h>
+
+#include "TiffIndex.h"
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+void ReadAheadTiles(const char* path, const TiffLevel* level, const INT32* coordinates, INT32 count);
+
+#endif
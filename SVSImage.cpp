@@ -13,10 +13,31 @@
 /*********************************************************************************************************************/
 
 #include <windows.h>
-#include <sstream>
-#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
 
 #include "Session.h"
+#include "StainNormalization.h"
+#include "DiskCache.h"
+#include "SharedCache.h"
+#include "CompressedCache.h"
+#include "BufferPool.h"
+#include "SlidePool.h"
+#include "MemoryBudget.h"
+#include "TileIterator.h"
+#include "TiffIndex.h"
+#include "PinnedLevels.h"
+#include "ReadAhead.h"
+#include "Trace.h"
+#include "AccessLog.h"
+#include "HandleTable.h"
+#include "TileServer.h"
+#include "Annotations.h"
+#include "Heatmap.h"
+#include "TileStatistics.h"
+#include "ScaledJpeg.h"
+#include "SlideMetadata.h"
 
 /*********************************************************************************************************************/
 /********************************************** Konstanten-Deklarationen *********************************************/
@@ -25,6 +46,86 @@
 #define LABEL_IMAGE	1
 #define MACRO_IMAGE	2
 
+// status of every slide reported by OpenImages and WaitForImage
+#define OPEN_SUCCEEDED			0
+#define OPEN_NO_PATH			1
+#define OPEN_UNSUPPORTED		2
+#define OPEN_OUT_OF_MEMORY		3
+#define OPEN_OUT_OF_HANDLES		4
+#define OPEN_PENDING			5
+
+// how GetTileDecodedHalo fills the margin beyond the edges of the level
+#define HALO_EDGE_TRANSPARENT	0
+#define HALO_EDGE_CLAMP			1
+#define HALO_EDGE_MIRROR		2
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct OpenBatch
+{
+	wchar_t** paths;
+	INT64* handles;
+	INT32* status;
+	LONG count;
+	volatile LONG next;
+};
+
+// Receives every image of RenderViewport, coarse to fine: width * height pixels laid out like GetTileDecoded, valid
+// only during the call. final is true for the image of the requested level, which is the last one.
+typedef void (CALLBACK* ViewportCallback)(INT64 viewport, INT32 level, BYTE* data, BOOL final, void* context);
+
+// A viewport of RenderViewport; its refinements are rendered by a background thread that takes a session reference for
+// one level at a time. While the thread runs, the viewport is linked into the running viewports through next.
+struct Viewport
+{
+	INT64 self;
+	INT64 handle;
+	Session* session;
+	INT32 level;
+	INT32 first;
+	INT32 x;
+	INT32 y;
+	INT32 width;
+	INT32 height;
+	ViewportCallback callback;
+	void* context;
+	HANDLE thread;
+	volatile LONG cancelled;
+	Viewport* next;
+};
+
+// Patches of one GetMultiScalePatches call still read by the thread pool; done is set once remaining drops to 0
+struct MultiScaleBatch
+{
+	volatile LONG remaining;
+	HANDLE done;
+};
+
+// One patch of GetMultiScalePatches: read from level and scaled down by scale, which is 1.0 for a native patch
+struct MultiScalePatch
+{
+	MultiScaleBatch* batch;
+	Session* session;
+	INT64 centerX;
+	INT64 centerY;
+	INT32 width;
+	INT32 height;
+	INT32 level;
+	double scale;
+	BYTE* data;
+	bool result;
+};
+
+// Viewports whose refinements are still rendered, so that CloseImage can cancel the ones of its slide
+static struct
+{
+	SRWLOCK lock;
+	Viewport* running;
+} viewports = { SRWLOCK_INIT, NULL };
+
 
 /*********************************************************************************************************************/
 /********************************************** Funktions-Deklarationen **********************************************/
@@ -33,12 +134,56 @@
 void Convert2Y1CbCrTileToArgb(unsigned char* src, unsigned char* dst, int width, int height);
 void Convert24BgrTo32Argb(unsigned char* src, unsigned char* dst, int width, int height);
 void Convert16BitGreyToArgb(unsigned char* src, unsigned char* dst, int width, int height);
-bool GetValue(char* imageDescription, std::string key, std::string* value);
-BOOL GetOpenSlideTile(INT64 handle, INT32 level, INT32 x, INT32 y);
-bool DescriptionContains(char* image, std::string searchString);
+bool NormalizeStain(Session* session, const uint32_t* src, BYTE* dst, int pixels);
+BOOL GetOpenSlideTile(Session* session, INT32 level, INT32 x, INT32 y, BYTE* data, TileStatistics* statistics = NULL);
+BOOL ReadTiles(Session* session, INT32 level, INT32* coordinates, INT32 count, BYTE* data,
+	TileStatistics* statistics = NULL);
+INT32 HaloSource(INT64 position, INT64 size, INT32 edge);
+BOOL ReadMultiScalePatches(Session* session, INT64 centerX, INT64 centerY, INT32 width, INT32 height,
+	MultiScalePatch* patches, INT32 count, BYTE* data);
+DWORD WINAPI MultiScaleWorker(LPVOID parameter);
+VOID CALLBACK MultiScaleCallback(PTP_CALLBACK_INSTANCE instance, PVOID parameter);
+BOOL ReadRegionFromTiles(Session* session, INT32 level, INT64 x, INT64 y, INT32 width, INT32 height, BYTE* data);
+BOOL ReadRegionScaled(Session* session, INT32 level, INT32 factor, INT64 x, INT64 y, INT32 width, INT32 height,
+	BYTE* data);
+DWORD WINAPI ViewportWorker(LPVOID parameter);
+void CancelViewports(INT64 handle);
+BOOL RenderViewportLevel(Viewport* viewport, INT32 level, BYTE* data);
+INT64 OpenSession(wchar_t* filename, INT32* status);
+INT32 LoadSession(Session* session);
+void FreeSession(Session* session);
+openslide_t* CheckOutSlide(Session* session);
+void ReturnSlide(Session* session, openslide_t* slide);
+DWORD WINAPI OpenBatchWorker(LPVOID parameter);
+BOOL WaitForThreads(HANDLE* threads, INT32 count);
+DWORD WINAPI OpenSessionWorker(LPVOID parameter);
+TiffIndex* GetTiffIndex(Session* session);
+PinnedLevel* GetPinnedLevel(Session* session, INT32 level);
 int LevelToTiffDirectory(Session* session, int level);
-INT32 GetDpi(char* imageDescription);
-float StringToFloat(std::string s);
+UINT64 GetSlideId(openslide_t* slide, const char* filename);
+bool GetTileOrigin(Session* session, INT32 level, INT32 x, INT32 y, double* originX, double* originY, double* scale);
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: DllMain *************************************************/
+/*********************************************************************************************************************/
+
+BOOL APIENTRY DllMain(HMODULE module, DWORD reason, LPVOID reserved)
+{
+	//*** Hand the tile buffers cached by an exiting thread back to the pool ******************************************
+	if (reason == DLL_THREAD_DETACH) ReleaseThreadBuffers();
+
+	//*** Hand its trace ring to the next thread **********************************************************************
+	if (reason == DLL_THREAD_DETACH) ReleaseTraceRing();
+
+	//*** Release the WIC factory its scaled reads created ************************************************************
+	if (reason == DLL_THREAD_DETACH) ReleaseThreadJpegFactory();
+
+	//*** Write the tail of the access log, even if the host never stopped it *****************************************
+	if (reason == DLL_PROCESS_DETACH) CloseAccessLog();
+
+	return true;
+}
 
 
 /*********************************************************************************************************************/
@@ -47,37 +192,288 @@ float StringToFloat(std::string s);
 
 extern "C" __declspec(dllexport) INT64 OpenImage(wchar_t* filename)
 {
-	//*** Variablen-Deklaration ***************************************************************************************
-	int additionalImageCount = 0;
-	char* imageDescription;
-	int layerImageCount = 1;
+	INT32 status;
+
+	return OpenSession(filename, &status);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: OpenImages ************************************************/
+/*********************************************************************************************************************/
+
+// Opens count slides concurrently on up to threads worker threads (0 = one per processor). handles receives the
+// handle of every slide (0 on failure) and status its OPEN_* code. Returns the number of slides opened.
+extern "C" __declspec(dllexport) INT32 OpenImages(wchar_t** paths, INT32 count, INT64* handles, INT32* status, INT32 threads)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	OpenBatch batch;
+	HANDLE* workers;
+	SYSTEM_INFO system;
+	INT32 started = 0, opened = 0;
+
+	if (paths == NULL || handles == NULL || status == NULL || count <= 0) return 0;
+
+	if (threads <= 0)
+	{
+		GetSystemInfo(&system);
+		threads = (INT32)system.dwNumberOfProcessors;
+	}
+
+	if (threads > count) threads = count;
+
+	batch.paths = paths;
+	batch.handles = handles;
+	batch.status = status;
+	batch.count = count;
+	batch.next = 0;
+
+	//*** The calling thread works along; without worker threads it opens all slides itself ***************************
+	workers = (HANDLE*)malloc(threads * sizeof(HANDLE));
+
+	for (INT32 i = 1; workers != NULL && i < threads; i++)
+	{
+		if ((workers[started] = CreateThread(NULL, 0, OpenBatchWorker, &batch, 0, NULL)) != NULL) started++;
+	}
+
+	OpenBatchWorker(&batch);
+
+	//*** The workers write into the batch on this stack, so they are joined before anything else ********************
+	WaitForThreads(workers, started);
+
+	for (INT32 i = 0; i < started; i++) CloseHandle(workers[i]);
+	free(workers);
+
+	for (INT32 i = 0; i < count; i++)
+	{
+		if (handles[i] != 0) opened++;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return opened;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: OpenBatchWorker *********************************************/
+/*********************************************************************************************************************/
+
+// Takes the next slide of the batch until all are taken
+DWORD WINAPI OpenBatchWorker(LPVOID parameter)
+{
+	OpenBatch* batch = (OpenBatch*)parameter;
+	LONG index;
+
+	while ((index = InterlockedIncrement(&batch->next) - 1) < batch->count)
+		batch->handles[index] = OpenSession(batch->paths[index], &batch->status[index]);
+
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: WaitForThreads **********************************************/
+/*********************************************************************************************************************/
+
+// Joins count threads. WaitForMultipleObjects takes at most MAXIMUM_WAIT_OBJECTS handles, so larger sets are joined in
+// chunks; should a wait fail, the threads of the chunk are joined one by one. Returns false if a handle was invalid.
+BOOL WaitForThreads(HANDLE* threads, INT32 count)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	BOOL joined = true;
+	DWORD chunk;
+
+	for (INT32 i = 0; i < count; i += (INT32)chunk)
+	{
+		chunk = (DWORD)(std::min)(count - i, (INT32)MAXIMUM_WAIT_OBJECTS);
+
+		if (WaitForMultipleObjects(chunk, &threads[i], TRUE, INFINITE) != WAIT_FAILED) continue;
+
+		for (DWORD j = 0; j < chunk; j++)
+		{
+			if (WaitForSingleObject(threads[i + j], INFINITE) == WAIT_FAILED) joined = false;
+		}
+	}
+
+	//*** Ende ********************************************************************************************************
+	return joined;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: OpenImageAsync **********************************************/
+/*********************************************************************************************************************/
+
+// Returns the handle at once and opens the slide on a background thread. Every call on the handle waits until the
+// open got far enough for it: size, tile and level queries and the associated images only need the slide opened,
+// everything else waits until the session is ready. WaitForImage polls for or waits on the stages. If the open
+// fails, the calls on the handle fail and the handle still has to be closed. Returns 0 if no handle is left.
+extern "C" __declspec(dllexport) INT64 OpenImageAsync(wchar_t* filename)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
 	Session* session;
-	int maxWidth;	
-	openslide_t* slide;
-	int maxDir;
-	int width;
-	int dir;
-	int64_t imgWidth, imgHeight;
+	HANDLE thread;
 
-	//*** Den Dateinamen prfen ***************************************************************************************
 	if (filename == NULL) return 0;
 
-	//*** Den Schnitt ffnen ******************************************************************************************	
-	if ((slide = openslide_open((const char*)filename)) == NULL)
-	{	
+	session = new Session(NULL);
+	session->filename = filename;
+	session->path = _strdup((const char*)filename);
+	session->openStatus = OPEN_PENDING;
+
+	if ((session->handle = RegisterSession(session)) == 0)
+	{
+		FreeSession(session);
 		return 0;
-	}	
+	}
 
-	//*** Die Werte initialisieren ************************************************************************************
-	maxWidth = 0;
-	maxDir = 0;
-	dir = 0;
+	//*** The background thread holds a reference, so CloseImage waits for the open to finish *************************
+	AcquireSession(session->handle);
+
+	if ((thread = CreateThread(NULL, 0, OpenSessionWorker, session, 0, NULL)) == NULL)
+		OpenSessionWorker(session);
+	else
+		CloseHandle(thread);
+
+	//*** Ende ********************************************************************************************************
+	return session->handle;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: OpenSessionWorker ********************************************/
+/*********************************************************************************************************************/
+
+DWORD WINAPI OpenSessionWorker(LPVOID parameter)
+{
+	Session* session = (Session*)parameter;
+	INT64 handle = session->handle;
+
+	if ((session->openStatus = LoadSession(session)) == OPEN_SUCCEEDED)
+		LogSlideOpen(handle, session->slideId, session->path);
+
+	ReleaseSession(handle);
+
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: WaitForImage ***********************************************/
+/*********************************************************************************************************************/
+
+// Waits up to timeout milliseconds (0 polls, -1 waits for good) until the slide reached stage (SESSION_GEOMETRY or
+// SESSION_READY) and returns the stage it is in. status receives its OPEN_* code, OPEN_PENDING while it opens.
+extern "C" __declspec(dllexport) INT32 WaitForImage(INT64 handle, INT32 stage, INT32 timeout, INT32* status)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return SESSION_FAILED;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_OPENING);
+	if ((session = reference.session) == NULL) return SESSION_FAILED;
+
+	WaitForSession(session, stage, (timeout < 0) ? INFINITE : (DWORD)timeout);
+
+	if (status != NULL) *status = session->openStatus;
+
+	//*** Ende ********************************************************************************************************
+	return session->stage;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: OpenSession ***********************************************/
+/*********************************************************************************************************************/
+
+// Opens the slide and registers its session; status receives one of the OPEN_* codes.
+INT64 OpenSession(wchar_t* filename, INT32* status)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Session* session;
+	INT64 traceOpen = TraceStart();
+
+	//*** Den Dateinamen prfen ***************************************************************************************
+	if (filename == NULL)
+	{
+		*status = OPEN_NO_PATH;
+		return 0;
+	}
 
 	//*** Die Session-Struktur anlegen ********************************************************************************
-	session = new Session(slide);
+	session = new Session(NULL);
 
 	//*** Den Dateinamen bernehmen ***********************************************************************************
 	session->filename = filename;
+
+	//*** Keep a copy of the path for opening further handles to the same file ****************************************
+	session->path = _strdup((const char*)filename);
+
+	//*** Open the slide completely before the handle is handed out ***************************************************
+	if ((*status = session->openStatus = LoadSession(session)) != OPEN_SUCCEEDED)
+	{
+		FreeSession(session);
+		return 0;
+	}
+
+	//*** The handle is a slot of the handle table, not the address of the session ************************************
+	if ((session->handle = RegisterSession(session)) == 0)
+	{
+		FreeSession(session);
+
+		*status = OPEN_OUT_OF_HANDLES;
+		return 0;
+	}
+
+	LogSlideOpen(session->handle, session->slideId, session->path);
+	TraceEnd("open", traceOpen, -1, 0, 0);
+
+	//*** Ende ********************************************************************************************************
+	*status = OPEN_SUCCEEDED;
+	return session->handle;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: LoadSession ***********************************************/
+/*********************************************************************************************************************/
+
+// Opens the slide of the session and fills in its values, cheapest first: the geometry is published as soon as the
+// slide is open, the identity, resolution and the read buffer follow. Returns one of the OPEN_* codes; on failure
+// the session is marked as failed, and what was loaded so far is released with the session by FreeSession.
+INT32 LoadSession(Session* session)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	openslide_t* slide;
+	int maxDir;
+	int64_t imgWidth, imgHeight;
+	INT64 traceStep;
+
+	//*** Den Schnitt ffnen ******************************************************************************************
+	traceStep = TraceStart();
+
+	// the tile cache openslide keeps in the handle belongs to the session
+	if (!ChargeMemory(MEMORY_SESSIONS, OPENSLIDE_CACHE_SIZE))
+	{
+		SetSessionStage(session, SESSION_FAILED);
+		return OPEN_OUT_OF_MEMORY;
+	}
+
+	if ((slide = openslide_open(session->path)) == NULL)
+	{
+		ReleaseMemory(MEMORY_SESSIONS, OPENSLIDE_CACHE_SIZE);
+		SetSessionStage(session, SESSION_FAILED);
+		return OPEN_UNSUPPORTED;
+	}
+
+	TraceEnd("openslide_open", traceStep, -1, 0, 0);
+
+	//*** Die Werte initialisieren ************************************************************************************
+	maxDir = 0;
+
 	session->slide = slide;
 
 	//*** Die Kompression der Kacheln bestimmen ***********************************************************************
@@ -95,6 +491,8 @@ extern "C" __declspec(dllexport) INT64 OpenImage(wchar_t* filename)
 	session->subY = 2;
 	session->photoMetric = 2; // 1 == Gray, 2 == RGB, 6 == YCbCr
 
+	traceStep = TraceStart();
+
 	//*** Die Kachelgre bestimmen ***********************************************************************************
 	session->tileHeight = atoi(openslide_get_property_value(slide, "openslide.level[0].tile-height"));
 	session->tileWidth = atoi(openslide_get_property_value(slide, "openslide.level[0].tile-width"));
@@ -104,348 +502,2260 @@ extern "C" __declspec(dllexport) INT64 OpenImage(wchar_t* filename)
 	session->imageWidth = (uint32)imgWidth;
 	session->imageHeight = (uint32)imgHeight;
 
-	//*** Die Dpi bestimmen *******************************************************************************************
-	if ((imageDescription = (char*)openslide_get_property_value(slide, "philips.DICOM_DERIVATION_DESCRIPTION")) == NULL) imageDescription = NULL;
-	session->dpi = GetDpi(imageDescription);
-	
 	//*** Das BaseLayer festlegen *************************************************************************************
 	session->baseLayerOffset = maxDir;
 
-	//*** Die Anzahl der Zwischenebenen bestimmen *********************************************************************
-	session->macroImageDir = 0;
-	session->labelImageDir = 0;
-	session->levels = openslide_get_level_count(slide);
+	//*** Die Anzahl der Zwischenebenen bestimmen *********************************************************************
+	session->macroImageDir = 0;
+	session->labelImageDir = 0;
+	session->levels = openslide_get_level_count(slide);
+
+	//*** The viewer can lay out the slide from here on ***************************************************************
+	SetSessionStage(session, SESSION_GEOMETRY);
+
+	//*** Identify the slide for the persistent caches ****************************************************************
+	session->slideId = GetSlideId(slide, session->path);
+
+	//*** Die Dpi bestimmen *******************************************************************************************
+	session->metadata = ReadSlideMetadata(slide);
+	session->dpi = (session->metadata != NULL) ? session->metadata->dpi : (INT32)(25400 / METADATA_DEFAULT_MPP + 0.5);
+
+	TraceEnd("property lookup", traceStep, -1, 0, 0);
+
+	//*** Die erforderliche Gre fr den Lese-Puffer bestimmen *******************************************************
+	session->bufferSize = 4 * session->tileWidth * session->tileHeight * sizeof(BYTE);
+
+	//*** Den Lese-Puffer anlegen *************************************************************************************
+	if ((session->buffer = AllocTileBuffer(session->bufferSize)) == NULL)
+	{
+		//*** Ende ****************************************************************************************************
+		SetSessionStage(session, SESSION_FAILED);
+		return OPEN_OUT_OF_MEMORY;
+	}
+
+	SetSessionStage(session, SESSION_READY);
+
+	//*** Ende ********************************************************************************************************
+	return OPEN_SUCCEEDED;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: CloseImage ***********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void CloseImage(INT64 handle)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Stop the refinements of its viewports, so that the wait below covers at most one level **********************
+	CancelViewports(handle);
+
+	//*** Block new calls on the handle and wait for the running ones *************************************************
+	if ((session = UnregisterSession(handle)) == NULL) return;
+
+	//*** Record the close in the access log **************************************************************************
+	if (session->stage == SESSION_READY) LogSlideClose(handle, session->slideId);
+
+	//*** Withdraw the slide from the tile server *********************************************************************
+	UnpublishClosedSlide(handle);
+
+	//*** Release the session and everything it holds *****************************************************************
+	FreeSession(session);
+
+	//*** Write the trace if it is to be written on every close *******************************************************
+	WriteTraceOnClose();
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: FreeSession ***********************************************/
+/*********************************************************************************************************************/
+
+// Releases everything a session holds, and the session itself. The one teardown for CloseImage and for the sessions
+// that fail to open or to get a handle, so that nothing LoadSession charged or allocated is left behind.
+void FreeSession(Session* session)
+{
+	//*** Close the additional handles of the pool ********************************************************************
+	FreeSlidePool(session->pool);
+
+	//*** Release the tile offset tables ******************************************************************************
+	FreeTiffIndex(session->tiff);
+
+	//*** Release the pinned levels ***********************************************************************************
+	FreePinnedLevels(session->pinned);
+
+	//*** Close the file handles of the scaled JPEG decoders **********************************************************
+	FreeScaledJpegPool(&session->jpegPool);
+
+	//*** Das TiffBild schlieen **************************************************************************************
+	if (session->slide != NULL)
+	{
+		openslide_close(session->slide);
+		ReleaseMemory(MEMORY_SESSIONS, OPENSLIDE_CACHE_SIZE);
+	}
+
+	free(session->path);
+
+	//*** Den Lese-Puffer wieder freigeben ****************************************************************************
+	FreeTileBuffer(session->buffer);
+
+	//*** Release the stain normalization tables **********************************************************************
+	FreeStainNormalization(session->stain);
+
+	//*** Release the annotations *************************************************************************************
+	FreeAnnotations(session->annotations);
+
+	//*** Release the metadata ****************************************************************************************
+	FreeSlideMetadata(session->metadata);
+
+	//*** Die Session-Struktur freigeben ******************************************************************************
+	delete session;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: GetImageSize **********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetImageSize(INT64 handle, INT32* x, INT32* y)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return;
+
+	//*** Die Hhe und Breite des Bildes zuweisen *********************************************************************
+	*y = session->imageHeight;
+	*x = session->imageWidth;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: GetImageDpi ***********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetImageDpi(INT64 handle, INT32* dpi)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return;
+
+	//*** Die Auflsung des Bildes zuweisen ***************************************************************************
+	*dpi = session->dpi;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetImageResolution ********************************************/
+/*********************************************************************************************************************/
+
+// Micrometres per level 0 pixel in x and y and the objective magnification, each 0 if the slide does not state it
+extern "C" __declspec(dllexport) BOOL GetImageResolution(INT64 handle, double* mppX, double* mppY, double* magnification)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || mppX == NULL || mppY == NULL || magnification == NULL) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL || session->metadata == NULL) return false;
+
+	*mppX = session->metadata->mppX;
+	*mppY = session->metadata->mppY;
+	*magnification = session->metadata->magnification;
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetImageProperties ********************************************/
+/*********************************************************************************************************************/
+
+// Copies all properties of the slide into buffer in one call: name\0value\0 pairs one after the other, ending with
+// one more \0. Values may be empty, so the pairs are walked by count, which may be NULL. Returns the number of bytes
+// this needs, so a call with size 0 asks for it; nothing is copied if size is too small. 0 if the handle is invalid.
+extern "C" __declspec(dllexport) INT32 GetImageProperties(INT64 handle, char* buffer, INT32 size, INT32* count)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	SlideMetadata* metadata;
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return 0;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL || (metadata = session->metadata) == NULL) return 0;
+
+	if (count != NULL) *count = metadata->propertyCount;
+
+	if (buffer != NULL && size >= metadata->propertiesLength)
+		std::memcpy(buffer, metadata->properties, metadata->propertiesLength);
+
+	//*** Ende ********************************************************************************************************
+	return metadata->propertiesLength;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: GetTileSize ***********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetTileSize(INT64 handle, INT32* x, INT32* y)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return;
+
+	//*** Die Hhe und Breite der Bildkacheln zuweisen ****************************************************************
+	*x = session->tileWidth;
+	*y = session->tileHeight;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: GetTileFormat **********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetTileFormat(INT64 handle, INT32* format)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return;
+
+	//*** TODO Finde eine Lsung dafr ... ****************************************************************************
+	if (session->compressionSheme == 33005) *format = 33003;
+
+	//*** Das Bildformat der Kacheln zuweisen *************************************************************************
+	else *format = session->compressionSheme;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: GetPhotometric *********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetPhotometric(INT64 handle, INT32* photometric)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return;
+
+	//*** Die Auflsung des Bildes zuweisen ***************************************************************************
+	*photometric = (int)session->photoMetric;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetYCbCrSubsampling *******************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetYCbCrSubsampling(INT64 handle, INT32* subX, INT32* subY)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return;
+
+	//*** Die Unterabtastund des Bildes in X-Richtung zuweisen ********************************************************
+	*subX = (int)session->subX;
+
+	//*** Die Unterabtastund des Bildes in X-Richtung zuweisen ********************************************************
+	*subY = (int)session->subY;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: GetLevels ************************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void GetLevels(INT64 handle, INT32* levels)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return;
+
+	//*** Die Anzahl der Levels zuweisen ******************************************************************************
+	*levels = session->levels;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: GetLevelSize ***********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) BOOL GetLevelSize(INT64 handle, INT32 level, INT32* x, INT32* y)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
+	if (handle == 0) return false;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
+
+	//*** Gre der Pyramidenstufe bestimmen **************************************************************************
+	int64_t w, h;
+
+	openslide_get_level_dimensions(session->slide, level, &w, &h);
+
+	*x = (INT32)w;
+	*y = (INT32)h;
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: NormalizeStain **********************************************/
+/*********************************************************************************************************************/
+
+// applies the active stain normalization while its tables are held by the shared lock, so SetStainNormalization
+// cannot free them during the copy; false (and nothing copied) when the normalization is switched off
+bool NormalizeStain(Session* session, const uint32_t* src, BYTE* dst, int pixels)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	bool normalized;
+
+	AcquireSRWLockShared(&session->stainLock);
+
+	if ((normalized = (session->stain != NULL)))
+		CopyTileNormalized(session->stain, src, dst, pixels);
+
+	ReleaseSRWLockShared(&session->stainLock);
+
+	//*** Ende ********************************************************************************************************
+	return normalized;
+}
+
+
+// This function should replace the two following functions for extracting tiles
+// OpenSlide lib only reads the tile as a UINT32 buffer, so there's no point
+// the following functions will just be "wrappers" around this one
+// the tile is written to data, which holds bufferSize bytes; nothing in the session is modified, so several threads
+// may read from the same session at the same time
+// with statistics the pixels are added to them while they are copied; data may then be NULL to skip the copy
+BOOL GetOpenSlideTile(Session* session, INT32 level, INT32 x, INT32 y, BYTE* data, TileStatistics* statistics) 
+{
+	tsize_t tileSize;
+	int64_t tileWidth, tileHeight;
+	uint32_t *tileBuffer = NULL;	
+	int64_t l_width, l_height;
+	int64_t step_x, step_y;
+	openslide_t* slide;
+	PinnedLevel* pinned;
+	BYTE* target;
+	double downsample;
+	bool failed = false;
+	bool normalized;
+	bool found;
+	INT64 trace;
+	INT64 access = AccessStart();
+	BYTE source = ACCESS_SOURCE_SHARED;
+
+	tileSize = session->bufferSize;
+	tileWidth = session->tileWidth;
+	tileHeight = session->tileHeight;
+
+	// get the size of the slide at current detalization level
+	openslide_get_level_dimensions(session->slide, level, &l_width, &l_height);
+
+	// recalculate the step for the tiles
+	step_y = (int64_t)floor((double)session->imageHeight/ ((double)l_height / (double)session->tileHeight));
+	step_x = (int64_t)floor((double)session->imageWidth / ((double)l_width/ (double)session->tileWidth));
+
+	// a pinned level is held in memory as a whole, so the tile is a strided copy out of it
+	if ((pinned = GetPinnedLevel(session, level)) != NULL)
+	{
+		downsample = openslide_get_level_downsample(session->slide, level);
+
+		// without an output buffer the statistics are taken from a buffer of the pool
+		if ((target = data) == NULL && (target = AllocTileBuffer((size_t)session->bufferSize)) == NULL) return false;
+
+		trace = TraceStart();
+		CopyPinnedRegion(pinned, (INT64)(x * step_x / downsample), (INT64)(y * step_y / downsample), (INT32)tileWidth,
+			(INT32)tileHeight, (uint32_t*)target);
+
+		NormalizeStain(session, (uint32_t*)target, target, (int)(tileWidth * tileHeight));
+		if (statistics != NULL) CopyTileStatistics((uint32_t*)target, NULL, (int)(tileWidth * tileHeight), statistics);
+		TraceEnd("pinned copy", trace, level, x, y);
+
+		if (target != data) FreeTileBuffer(target);
+
+		LogTileAccess(session->handle, session->slideId, level, x, y, access, ACCESS_SOURCE_SHARED, false);
+
+		return true;
+	}
+
+	// prepare an unsigned-int-32 bit buffer of size [tileWidth x tileHeight] for the tile
+	// the buffers are recycled through the tile buffer pool instead of going through malloc for every tile
+	if ((tileBuffer = (uint32_t*)AllocTileBuffer((size_t)(tileWidth * tileHeight * sizeof(uint32_t)))) == NULL)
+		return false;
+	
+	// a tile that was decoded before may still be in the shared memory cache of another process,
+	// or in the disk cache
+	trace = TraceStart();
+	found = SharedCacheLookup(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+	TraceEnd("shared cache lookup", trace, level, x, y);
+
+	// tiles the shared cache gave up may still be in the compressed tier
+	if (!found)
+	{
+		trace = TraceStart();
+		found = CompressedCacheLookup(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+		TraceEnd("compressed cache lookup", trace, level, x, y);
+
+		if (found) SharedCacheStore(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+	}
+
+	if (!found)
+	{
+		trace = TraceStart();
+		found = DiskCacheLookup(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+		TraceEnd("disk cache lookup", trace, level, x, y);
+
+		source = ACCESS_SOURCE_DISK;
+
+		if (found)
+		{
+			if (!SharedCacheStore(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize))
+				CompressedCacheStore(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+		}
+		else
+		{
+			source = ACCESS_SOURCE_OPENSLIDE;
+
+			// with a handle pool every read checks out its own openslide handle
+			trace = TraceStart();
+			slide = CheckOutSlide(session);
+			TraceEnd("handle wait", trace, level, x, y);
+
+			// read the tile of size [tileWidth x tileHeight] from the slide t current level
+			// note: the coordinates (x; y) are relative to the lowest level, hence the step_x and xtep_y
+			trace = TraceStart();
+			openslide_read_region(slide, tileBuffer, x * step_x, y * step_y, level, tileWidth, tileHeight);
+			TraceEnd("openslide_read_region", trace, level, x, y);
+
+			// it is possible to get the error description, if there was one
+			failed = (openslide_get_error(slide) != NULL);
+
+			ReturnSlide(session, slide);
+
+			// only tiles that were read without an error are kept
+			if (!failed)
+			{
+				if (!SharedCacheStore(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize))
+					CompressedCacheStore(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+
+				DiskCacheStore(session->slideId, level, x, y, (BYTE*)tileBuffer, session->bufferSize);
+			}
+		}
+	}
+	
+	if (failed) {
+		FreeTileBuffer((BYTE*)tileBuffer);
+		LogTileAccess(session->handle, session->slideId, level, x, y, access, source, true);
+		return false;
+	}
+	
+	// copy the uint32 buffer into a byte buffer of the same size 
+	// thus every uint32 value is divided into four separate RGBA bytes
+	// if stain normalization is enabled, it is applied in the same pass, and so are the statistics without it;
+	// with both, the statistics take a second pass over the normalized pixels while they are still in the cache
+	trace = TraceStart();
+	target = (data != NULL) ? data : (BYTE*)tileBuffer;
+
+	if ((normalized = NormalizeStain(session, tileBuffer, target, (int)(tileWidth * tileHeight))))
+	{
+		if (statistics != NULL) CopyTileStatistics((uint32_t*)target, NULL, (int)(tileWidth * tileHeight), statistics);
+	}
+	else if (statistics != NULL)
+		CopyTileStatistics(tileBuffer, data, (int)(tileWidth * tileHeight), statistics);
+	else
+		std::memcpy(data, tileBuffer, session->bufferSize);
+
+	TraceEnd(normalized ? "normalize" : "copy", trace, level, x, y);
+
+	// return the buffer to the pool
+	FreeTileBuffer((BYTE*)tileBuffer);
+
+	// count the request and write it to the access log
+	LogTileAccess(session->handle, session->slideId, level, x, y, access, source, false);
+
+	return true;
+}
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: GetTileJP2C ***********************************************/
+/*********************************************************************************************************************/
+
+
+
+extern "C" __declspec(dllexport) BOOL GetTileJP2C(INT64 handle, INT32 level, INT32 x, INT32 y, BYTE** data, INT32* length)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+	BYTE* tile;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	//*** Other threads may read from the same handle, so every call reads into a buffer of its own *******************
+	if ((tile = AllocTileBuffer((size_t)session->bufferSize)) == NULL) return false;
+
+	// Use the OpenSlide code:
+	if (!GetOpenSlideTile(session, level, x, y, tile)) {
+		FreeTileBuffer(tile);
+		return false;
+	}
+
+	level = session->bufferSize;
+	
+	//*** Den Zeiger auf die Bilddaten nernehmen *********************************************************************
+	std::memcpy(data, tile, session->bufferSize);
+	FreeTileBuffer(tile);
+
+	//*** Default: true ***********************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: GetTile *************************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) BOOL GetTileDecoded(INT64 handle, INT32 level, INT32 x, INT32 y, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0) return false;
+
+	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	// Use the OpenSlide code, which writes straight into the output argument
+	if (!GetOpenSlideTile(session, level, x, y, data)) {
+		return false;
+	}
+
+	// no need to convert the data from BGR to RGBA, as openslide already provides output as 32-bit RGBA buffer
+	
+	//*** Default: true ***********************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: GetTilesDecoded *********************************************/
+/*********************************************************************************************************************/
+
+// Reads count tiles of a level, given as x, y pairs, into data, one bufferSize block per tile in the order of the
+// pairs. The byte ranges of all tiles are read ahead in a few large requests before the first one is decoded, and the
+// tiles are decoded in file order. Returns false if one of the tiles could not be read.
+extern "C" __declspec(dllexport) BOOL GetTilesDecoded(INT64 handle, INT32 level, INT32* coordinates, INT32 count, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || coordinates == NULL || data == NULL || count < 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (level < 0 || level >= session->levels) return false;
+
+	//*** Ende ********************************************************************************************************
+	return ReadTiles(session, level, coordinates, count, data);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ReadTiles ************************************************/
+/*********************************************************************************************************************/
+
+// Reads the tiles of a batch into data, one bufferSize block per tile, while their byte ranges are read ahead in the
+// background. With statistics, one entry per tile, data may be NULL.
+BOOL ReadTiles(Session* session, INT32 level, INT32* coordinates, INT32 count, BYTE* data, TileStatistics* statistics)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<std::pair<UINT64, INT32> > order;
+	const TiffLevel* tiles = NULL;
+	TiffIndex* index;
+	BOOL result = true;
+	INT64 trace;
+
+	if ((index = GetTiffIndex(session)) != NULL && index->levels[level].offsets != NULL) tiles = &index->levels[level];
+
+	//*** Start bringing the data of the batch into the file system cache; decoding does not wait for it **************
+	trace = TraceStart();
+	ReadAheadTiles(session->path, tiles, coordinates, count);
+	TraceEnd("read ahead", trace, level, count, 0);
+
+	//*** Decode in file order, so that openslide walks through the file front to back ********************************
+	for (INT32 i = 0; i < count; i++)
+	{
+		INT32 x = coordinates[2 * i], y = coordinates[2 * i + 1];
+		UINT64 offset = 0;
+
+		if (tiles != NULL && x >= 0 && y >= 0 && x < tiles->columns && y < tiles->rows)
+			offset = tiles->offsets[(INT64)y * tiles->columns + x];
+
+		order.push_back(std::make_pair(offset, i));
+	}
+
+	std::sort(order.begin(), order.end());
+
+	for (size_t i = 0; i < order.size(); i++)
+	{
+		INT32 tile = order[i].second;
+
+		if (!GetOpenSlideTile(session, level, coordinates[2 * tile], coordinates[2 * tile + 1],
+			(data != NULL) ? data + (INT64)tile * session->bufferSize : NULL, (statistics != NULL) ? &statistics[tile] : NULL))
+			result = false;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: GetTileDecodedScaled *******************************************/
+/*********************************************************************************************************************/
+
+// Reads the tile at x, y of a level scaled down by factor (1, 2, 4 or 8) into data, which receives tileWidth / factor
+// x tileHeight / factor pixels laid out like GetTileDecoded. JPEG tiles are decoded at the reduced size directly;
+// other tiles are read at full size and averaged. False if factor does not divide the tile size.
+extern "C" __declspec(dllexport) BOOL GetTileDecodedScaled(INT64 handle, INT32 level, INT32 x, INT32 y, INT32 factor,
+	BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	INT32 width, height;
+	Session* session;
+	BYTE* source;
+	BOOL result;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || data == NULL) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (level < 0 || level >= session->levels) return false;
+	if (factor == 1) return GetOpenSlideTile(session, level, x, y, data);
+	if (factor != 2 && factor != 4 && factor != 8) return false;
+	if (session->tileWidth % factor != 0 || session->tileHeight % factor != 0) return false;
+
+	width = (INT32)session->tileWidth / factor;
+	height = (INT32)session->tileHeight / factor;
+
+	if (ReadRegionScaled(session, level, factor, (INT64)x * width, (INT64)y * height, width, height, data)) return true;
+
+	//*** Otherwise the full-size tile is averaged in blocks of factor x factor pixels ********************************
+	if ((source = AllocTileBuffer((size_t)session->bufferSize)) == NULL) return false;
+
+	if ((result = GetOpenSlideTile(session, level, x, y, source)) != false)
+	{
+		for (INT32 ty = 0; ty < height; ty++)
+		{
+			UINT32* target = (UINT32*)data + (size_t)ty * width;
+
+			for (INT32 tx = 0; tx < width; tx++)
+			{
+				UINT32 a = 0, r = 0, g = 0, b = 0, count = (UINT32)(factor * factor);
+
+				for (INT32 sy = ty * factor; sy < (ty + 1) * factor; sy++)
+				{
+					const UINT32* pixel = (const UINT32*)source + (size_t)sy * session->tileWidth + tx * factor;
+
+					for (INT32 sx = 0; sx < factor; sx++, pixel++)
+					{
+						a += *pixel >> 24;
+						r += (*pixel >> 16) & 0xFF;
+						g += (*pixel >> 8) & 0xFF;
+						b += *pixel & 0xFF;
+					}
+				}
+
+				target[tx] = ((a / count) << 24) | ((r / count) << 16) | ((g / count) << 8) | (b / count);
+			}
+		}
+	}
+
+	FreeTileBuffer(source);
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/**************************************** Funktion: GetTileDecodedStatistics *****************************************/
+/*********************************************************************************************************************/
+
+// GetTileDecoded that also returns the colour statistics of the tile, TILE_STATISTICS_COUNT values (see
+// TileStatistics.h), and with histogram not NULL its TILE_HISTOGRAM_SIZE bins. They are gathered in the pass that
+// copies the tile out of the read buffer. data may be NULL if only the statistics are wanted. whiteThreshold 0 uses
+// the default.
+extern "C" __declspec(dllexport) BOOL GetTileDecodedStatistics(INT64 handle, INT32 level, INT32 x, INT32 y,
+	INT32 whiteThreshold, BYTE* data, double* statistics, INT32* histogram)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	TileStatistics tile;
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || statistics == NULL) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (level < 0 || level >= session->levels) return false;
+
+	InitTileStatistics(&tile, whiteThreshold, histogram != NULL);
+
+	if (!GetOpenSlideTile(session, level, x, y, data, &tile)) return false;
+
+	FinishTileStatistics(&tile, statistics, histogram);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetTilesStatistics ********************************************/
+/*********************************************************************************************************************/
+
+// GetTilesDecoded with the statistics of every tile, TILE_STATISTICS_COUNT values and with histogram not NULL
+// TILE_HISTOGRAM_SIZE bins per tile, in the order of the pairs. data may be NULL, so a quality control sweep over a
+// level does not have to move any pixels to the caller.
+extern "C" __declspec(dllexport) BOOL GetTilesStatistics(INT64 handle, INT32 level, INT32* coordinates, INT32 count,
+	INT32 whiteThreshold, BYTE* data, double* statistics, INT32* histogram)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<TileStatistics> tiles;
+	Session* session;
+	BOOL result;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || coordinates == NULL || statistics == NULL || count < 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (level < 0 || level >= session->levels) return false;
+	if (count == 0) return true;
+
+	tiles.resize(count);
+	for (INT32 i = 0; i < count; i++) InitTileStatistics(&tiles[i], whiteThreshold, histogram != NULL);
+
+	result = ReadTiles(session, level, coordinates, count, data, &tiles[0]);
+
+	for (INT32 i = 0; i < count; i++)
+		FinishTileStatistics(&tiles[i], statistics + (INT64)i * TILE_STATISTICS_COUNT,
+			(histogram != NULL) ? histogram + (INT64)i * TILE_HISTOGRAM_SIZE : NULL);
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetTilesDecodedHalo *******************************************/
+/*********************************************************************************************************************/
+
+// Reads count tiles, given as x, y pairs, each together with a margin of halo pixels on every side, into data: one
+// block of (tileWidth + 2 * halo) x (tileHeight + 2 * halo) pixels per tile, laid out like GetTileDecoded, in the
+// order of the pairs. The margin comes from the neighbouring tiles; beyond the edges of the level it is transparent,
+// repeats the edge pixel or mirrors the level, as edge (HALO_EDGE_*) says. Every tile the batch touches, itself or as
+// a neighbour, is decoded exactly once and in file order, so a sweep over a level in batches of adjacent tiles reads
+// each tile about once instead of nine times.
+extern "C" __declspec(dllexport) BOOL GetTilesDecodedHalo(INT64 handle, INT32 level, INT32* coordinates, INT32 count,
+	INT32 halo, INT32 edge, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::map<std::pair<INT32, INT32>, INT32> sources;
+	std::vector<INT32> sourceCoordinates;
+	std::vector<BYTE> sourceData;
+	std::vector<INT32> columns, rows, tileColumns, tileRows;
+	INT32 tileWidth, tileHeight, paddedWidth, paddedHeight;
+	int64_t width, height;
+	Session* session;
+	BOOL result;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || coordinates == NULL || data == NULL || count < 0 || halo < 0) return false;
+	if (edge < HALO_EDGE_TRANSPARENT || edge > HALO_EDGE_MIRROR) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (level < 0 || level >= session->levels) return false;
+
+	openslide_get_level_dimensions(session->slide, level, &width, &height);
+
+	tileWidth = (INT32)session->tileWidth;
+	tileHeight = (INT32)session->tileHeight;
+	paddedWidth = tileWidth + 2 * halo;
+	paddedHeight = tileHeight + 2 * halo;
+
+	columns.resize(paddedWidth);
+	rows.resize(paddedHeight);
+
+	//*** Every tile of the grid that one of the padded tiles takes pixels from, once *********************************
+	// the columns and rows are mapped per axis with the tile size of that axis, so a margin that is mirrored or
+	// clamped several times over finds the tiles it ends up in
+	for (INT32 i = 0; i < count; i++)
+	{
+		tileColumns.clear();
+		tileRows.clear();
+
+		for (INT32 c = 0; c < paddedWidth; c++)
+		{
+			INT32 column = HaloSource((INT64)coordinates[2 * i] * tileWidth + c - halo, width, edge);
+			if (column >= 0) tileColumns.push_back(column / tileWidth);
+		}
+
+		for (INT32 r = 0; r < paddedHeight; r++)
+		{
+			INT32 row = HaloSource((INT64)coordinates[2 * i + 1] * tileHeight + r - halo, height, edge);
+			if (row >= 0) tileRows.push_back(row / tileHeight);
+		}
+
+		std::sort(tileColumns.begin(), tileColumns.end());
+		tileColumns.erase(std::unique(tileColumns.begin(), tileColumns.end()), tileColumns.end());
+		std::sort(tileRows.begin(), tileRows.end());
+		tileRows.erase(std::unique(tileRows.begin(), tileRows.end()), tileRows.end());
+
+		for (size_t ty = 0; ty < tileRows.size(); ty++)
+		{
+			for (size_t tx = 0; tx < tileColumns.size(); tx++)
+			{
+				std::pair<INT32, INT32> tile(tileColumns[tx], tileRows[ty]);
+
+				if (!sources.insert(std::make_pair(tile, (INT32)sources.size())).second) continue;
+
+				sourceCoordinates.push_back(tile.first);
+				sourceCoordinates.push_back(tile.second);
+			}
+		}
+	}
+
+	sourceData.resize(sources.size() * (size_t)session->bufferSize);
+
+	result = sources.empty() || ReadTiles(session, level, &sourceCoordinates[0], (INT32)sources.size(), &sourceData[0]);
+
+	//*** Assemble the padded tiles from the decoded ones *************************************************************
+	for (INT32 i = 0; i < count; i++)
+	{
+		BYTE* target = data + (INT64)i * paddedWidth * paddedHeight * 4;
+
+		//*** The level pixel every column and row of the padded tile shows, -1 for transparent ***********************
+		for (INT32 c = 0; c < paddedWidth; c++)
+			columns[c] = HaloSource((INT64)coordinates[2 * i] * tileWidth + c - halo, width, edge);
+
+		for (INT32 r = 0; r < paddedHeight; r++)
+			rows[r] = HaloSource((INT64)coordinates[2 * i + 1] * tileHeight + r - halo, height, edge);
+
+		for (INT32 r = 0; r < paddedHeight; r++)
+		{
+			BYTE* line = target + (INT64)r * paddedWidth * 4;
+
+			for (INT32 c = 0; c < paddedWidth;)
+			{
+				std::map<std::pair<INT32, INT32>, INT32>::iterator source;
+				INT32 run = 1;
+
+				if (rows[r] < 0 || columns[c] < 0 ||
+					(source = sources.find(std::make_pair(columns[c] / tileWidth, rows[r] / tileHeight))) == sources.end())
+				{
+					std::memset(line + c * 4, 0, 4);
+					c++;
+					continue;
+				}
+
+				//*** Consecutive pixels of the same source tile are copied at once ***********************************
+				while (c + run < paddedWidth && columns[c + run] == columns[c] + run && (columns[c] + run) % tileWidth != 0)
+					run++;
+
+				std::memcpy(line + c * 4, &sourceData[(size_t)source->second * session->bufferSize +
+					((size_t)(rows[r] % tileHeight) * tileWidth + columns[c] % tileWidth) * 4], (size_t)run * 4);
+
+				c += run;
+			}
+		}
+	}
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: GetTileDecodedHalo ********************************************/
+/*********************************************************************************************************************/
+
+// GetTilesDecodedHalo for a single tile
+extern "C" __declspec(dllexport) BOOL GetTileDecodedHalo(INT64 handle, INT32 level, INT32 x, INT32 y, INT32 halo,
+	INT32 edge, BYTE* data)
+{
+	INT32 coordinates[2] = { x, y };
+
+	return GetTilesDecodedHalo(handle, level, coordinates, 1, halo, edge, data);
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: GetMultiScalePatches *******************************************/
+/*********************************************************************************************************************/
+
+// Reads count concentric patches of width x height pixels around the level 0 point centerX, centerY into data, one
+// block per patch laid out like GetTileDecoded, in the order of downsamples. Patch i covers width * downsamples[i] x
+// height * downsamples[i] level 0 pixels. It is taken from the most detailed level that is not finer than needed and
+// scaled down with a box filter where that level does not match exactly. The patches are read in parallel from the
+// cached tiles of their levels. Area outside the slide is transparent.
+extern "C" __declspec(dllexport) BOOL GetMultiScalePatches(INT64 handle, INT64 centerX, INT64 centerY, INT32 width,
+	INT32 height, double* downsamples, INT32 count, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<MultiScalePatch> patches;
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || downsamples == NULL || data == NULL || count <= 0 || width <= 0 || height <= 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	//*** The level every patch is read from **************************************************************************
+	for (INT32 i = 0; i < count; i++)
+	{
+		MultiScalePatch patch;
+
+		if (!(downsamples[i] > 0)) return false;
+
+		patch.level = openslide_get_best_level_for_downsample(session->slide, downsamples[i]);
+		if (patch.level < 0) patch.level = 0;
+
+		patch.scale = downsamples[i] / openslide_get_level_downsample(session->slide, patch.level);
+		patches.push_back(patch);
+	}
+
+	//*** Ende ********************************************************************************************************
+	return ReadMultiScalePatches(session, centerX, centerY, width, height, &patches[0], count, data);
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: GetMultiLevelPatches *******************************************/
+/*********************************************************************************************************************/
+
+// GetMultiScalePatches with the native levels given instead of downsamples, so no patch is resampled
+extern "C" __declspec(dllexport) BOOL GetMultiLevelPatches(INT64 handle, INT64 centerX, INT64 centerY, INT32 width,
+	INT32 height, INT32* levels, INT32 count, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<MultiScalePatch> patches;
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || levels == NULL || data == NULL || count <= 0 || width <= 0 || height <= 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	for (INT32 i = 0; i < count; i++)
+	{
+		MultiScalePatch patch;
+
+		if (levels[i] < 0 || levels[i] >= session->levels) return false;
+
+		patch.level = levels[i];
+		patch.scale = 1.0;
+		patches.push_back(patch);
+	}
+
+	//*** Ende ********************************************************************************************************
+	return ReadMultiScalePatches(session, centerX, centerY, width, height, &patches[0], count, data);
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: ReadMultiScalePatches ******************************************/
+/*********************************************************************************************************************/
+
+// The patches after the first go to the process thread pool; the calling thread reads the first one itself
+BOOL ReadMultiScalePatches(Session* session, INT64 centerX, INT64 centerY, INT32 width, INT32 height,
+	MultiScalePatch* patches, INT32 count, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	MultiScaleBatch batch;
+	BOOL result = true;
+
+	batch.remaining = count - 1;
+	batch.done = (count > 1) ? CreateEventW(NULL, TRUE, FALSE, NULL) : NULL;
+
+	for (INT32 i = 0; i < count; i++)
+	{
+		patches[i].batch = &batch;
+		patches[i].session = session;
+		patches[i].centerX = centerX;
+		patches[i].centerY = centerY;
+		patches[i].width = width;
+		patches[i].height = height;
+		patches[i].data = data + (INT64)i * width * height * 4;
+		patches[i].result = false;
+	}
+
+	for (INT32 i = 1; i < count; i++)
+	{
+		//*** Without an event or a free slot in the pool the patch is read on the calling thread *********************
+		if (batch.done != NULL && TrySubmitThreadpoolCallback(MultiScaleCallback, &patches[i], NULL)) continue;
+
+		MultiScaleWorker(&patches[i]);
+		if (InterlockedDecrement(&batch.remaining) == 0 && batch.done != NULL) SetEvent(batch.done);
+	}
+
+	MultiScaleWorker(&patches[0]);
+
+	if (batch.done != NULL)
+	{
+		WaitForSingleObject(batch.done, INFINITE);
+		CloseHandle(batch.done);
+	}
+
+	for (INT32 i = 0; i < count; i++)
+	{
+		if (!patches[i].result) result = false;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: MultiScaleCallback ********************************************/
+/*********************************************************************************************************************/
+
+// Thread pool callback of ReadMultiScalePatches; the event is only set once the callback has returned, so the caller
+// may close it and drop the batch as soon as it is set
+VOID CALLBACK MultiScaleCallback(PTP_CALLBACK_INSTANCE instance, PVOID parameter)
+{
+	MultiScaleBatch* batch = ((MultiScalePatch*)parameter)->batch;
+
+	MultiScaleWorker(parameter);
+
+	if (InterlockedDecrement(&batch->remaining) == 0) SetEventWhenCallbackReturns(instance, batch->done);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: MultiScaleWorker *********************************************/
+/*********************************************************************************************************************/
+
+// Reads the region of the level under the patch and averages the level pixels under every patch pixel
+DWORD WINAPI MultiScaleWorker(LPVOID parameter)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	MultiScalePatch* patch = (MultiScalePatch*)parameter;
+	double downsample = openslide_get_level_downsample(patch->session->slide, patch->level);
+	double left = patch->centerX / downsample - patch->width * patch->scale / 2;
+	double top = patch->centerY / downsample - patch->height * patch->scale / 2;
+	INT32 size = (std::max)(patch->width, patch->height);
+	INT64 sourceX, sourceY;
+	INT32 sourceWidth, sourceHeight, factor;
+	std::vector<BYTE> source;
+
+	//*** A patch at the native scale is read as it is ****************************************************************
+	// the level downsamples are rounded from the level sizes, so a scale counts as exact while it moves the pixels
+	// at the border of the patch by less than half a pixel
+	if (fabs(patch->scale - 1.0) * size < 1.0)
+	{
+		patch->result = ReadRegionFromTiles(patch->session, patch->level, (INT64)floor(left + 0.5), (INT64)floor(top + 0.5),
+			patch->width, patch->height, patch->data);
+		return 0;
+	}
+
+	//*** At 1/2, 1/4 or 1/8 of the level, JPEG tiles are decoded at that size ****************************************
+	factor = (INT32)floor(patch->scale + 0.5);
+
+	if (fabs(patch->scale - factor) * size < factor && ReadRegionScaled(patch->session, patch->level, factor,
+		(INT64)floor(left / factor + 0.5), (INT64)floor(top / factor + 0.5), patch->width, patch->height, patch->data))
+	{
+		patch->result = true;
+		return 0;
+	}
+
+	sourceX = (INT64)floor(left);
+	sourceY = (INT64)floor(top);
+	sourceWidth = (INT32)ceil(left + patch->width * patch->scale) - (INT32)sourceX;
+	sourceHeight = (INT32)ceil(top + patch->height * patch->scale) - (INT32)sourceY;
+	source.resize((size_t)sourceWidth * sourceHeight * 4);
+
+	if (!ReadRegionFromTiles(patch->session, patch->level, sourceX, sourceY, sourceWidth, sourceHeight, &source[0]))
+		return 0;
+
+	//*** Box filter over the premultiplied pixels, alpha included ****************************************************
+	for (INT32 y = 0; y < patch->height; y++)
+	{
+		INT32 y0 = (std::min)((INT32)(top + y * patch->scale - sourceY), sourceHeight - 1);
+		INT32 y1 = (std::min)((std::max)(y0 + 1, (INT32)(top + (y + 1) * patch->scale - sourceY)), sourceHeight);
+		UINT32* target = (UINT32*)patch->data + (size_t)y * patch->width;
+
+		for (INT32 x = 0; x < patch->width; x++)
+		{
+			INT32 x0 = (std::min)((INT32)(left + x * patch->scale - sourceX), sourceWidth - 1);
+			INT32 x1 = (std::min)((std::max)(x0 + 1, (INT32)(left + (x + 1) * patch->scale - sourceX)), sourceWidth);
+			UINT32 a = 0, r = 0, g = 0, b = 0, count = (UINT32)((x1 - x0) * (y1 - y0));
+
+			for (INT32 sy = y0; sy < y1; sy++)
+			{
+				const UINT32* pixel = (const UINT32*)&source[0] + (size_t)sy * sourceWidth + x0;
+
+				for (INT32 sx = x0; sx < x1; sx++, pixel++)
+				{
+					a += *pixel >> 24;
+					r += (*pixel >> 16) & 0xFF;
+					g += (*pixel >> 8) & 0xFF;
+					b += *pixel & 0xFF;
+				}
+			}
+
+			target[x] = ((a / count) << 24) | ((r / count) << 16) | ((g / count) << 8) | (b / count);
+		}
+	}
+
+	patch->result = true;
+
+	//*** Ende ********************************************************************************************************
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: RenderViewport **********************************************/
+/*********************************************************************************************************************/
+
+// Renders the region x, y, width x height of level progressively. Before it returns, the callback receives an
+// approximation scaled up from the most detailed pinned level at or above level, or from the smallest level if none
+// is pinned. A background thread then renders every finer level down to level and hands each one to the callback as
+// its tiles are decoded. Returns the viewport, which is closed with CloseViewport, or 0 on invalid arguments.
+extern "C" __declspec(dllexport) INT64 RenderViewport(INT64 handle, INT32 level, INT32 x, INT32 y, INT32 width,
+	INT32 height, ViewportCallback callback, void* context)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<BYTE> data;
+	Viewport* viewport;
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || callback == NULL || width <= 0 || height <= 0) return 0;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return 0;
+
+	if (level < 0 || level >= session->levels) return 0;
+
+	viewport = new Viewport();
+	viewport->handle = handle;
+	viewport->session = session;
+	viewport->level = level;
+	viewport->x = x;
+	viewport->y = y;
+	viewport->width = width;
+	viewport->height = height;
+	viewport->callback = callback;
+	viewport->context = context;
+
+	//*** The callbacks already see the handle of the viewport ********************************************************
+	if ((viewport->self = RegisterHandle(HANDLE_VIEWPORT, viewport)) == 0)
+	{
+		delete viewport;
+		return 0;
+	}
+
+	//*** The first approximation comes from memory if possible *******************************************************
+	viewport->first = session->levels - 1;
+
+	for (INT32 l = level; l < session->levels; l++)
+	{
+		if (GetPinnedLevel(session, l) != NULL)
+		{
+			viewport->first = l;
+			break;
+		}
+	}
+
+	data.resize((size_t)width * height * 4);
+	RenderViewportLevel(viewport, viewport->first, &data[0]);
+	callback(viewport->self, viewport->first, &data[0], viewport->first == level, context);
+
+	if (viewport->first == level) return viewport->self;
+
+	//*** Once linked, CloseImage cancels the refinements *************************************************************
+	AcquireSRWLockExclusive(&viewports.lock);
+	viewport->next = viewports.running;
+	viewports.running = viewport;
+	ReleaseSRWLockExclusive(&viewports.lock);
+
+	if ((viewport->thread = CreateThread(NULL, 0, ViewportWorker, viewport, 0, NULL)) == NULL)
+		ViewportWorker(viewport);
+
+	//*** Ende ********************************************************************************************************
+	return viewport->self;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: CloseViewport **********************************************/
+/*********************************************************************************************************************/
+
+// Stops the refinements of a viewport after the level being rendered and frees it. No callback of the viewport is
+// running or follows once this returns, so it must not be called from the callback itself.
+extern "C" __declspec(dllexport) void CloseViewport(INT64 viewport)
+{
+	Viewport* closing = (Viewport*)UnregisterHandle(viewport, HANDLE_VIEWPORT);
+
+	if (closing == NULL) return;
+
+	InterlockedExchange(&closing->cancelled, 1);
+
+	if (closing->thread != NULL)
+	{
+		WaitForSingleObject(closing->thread, INFINITE);
+		CloseHandle(closing->thread);
+	}
+
+	delete closing;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: ViewportWorker **********************************************/
+/*********************************************************************************************************************/
+
+// Renders the levels below the first approximation one after the other, down to the requested level. The session is
+// only held while a level is rendered, so CloseImage never waits for more than one level and the callback may close
+// the slide; once the handle is closed or closing, the refinements end.
+DWORD WINAPI ViewportWorker(LPVOID parameter)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	Viewport* viewport = (Viewport*)parameter;
+	std::vector<BYTE> data((size_t)viewport->width * viewport->height * 4);
+	Viewport** link;
+	BOOL rendered;
+
+	for (INT32 level = viewport->first - 1; level >= viewport->level && viewport->cancelled == 0; level--)
+	{
+		if ((viewport->session = AcquireSession(viewport->handle)) == NULL) break;
+
+		rendered = RenderViewportLevel(viewport, level, &data[0]);
+		ReleaseSession(viewport->handle);
+
+		if (!rendered || viewport->cancelled != 0) break;
+
+		viewport->callback(viewport->self, level, &data[0], level == viewport->level, viewport->context);
+	}
+
+	//*** Unlink the viewport; no session is referred to any more *****************************************************
+	viewport->session = NULL;
+
+	AcquireSRWLockExclusive(&viewports.lock);
+
+	for (link = &viewports.running; *link != NULL; link = &(*link)->next)
+	{
+		if (*link != viewport) continue;
+
+		*link = viewport->next;
+		break;
+	}
+
+	ReleaseSRWLockExclusive(&viewports.lock);
+
+	//*** Ende ********************************************************************************************************
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: CancelViewports *********************************************/
+/*********************************************************************************************************************/
+
+// Cancels the refinements of the viewports of a slide; each ends after the level it is rendering
+void CancelViewports(INT64 handle)
+{
+	AcquireSRWLockShared(&viewports.lock);
+
+	for (Viewport* viewport = viewports.running; viewport != NULL; viewport = viewport->next)
+	{
+		if (viewport->handle == handle) InterlockedExchange(&viewport->cancelled, 1);
+	}
+
+	ReleaseSRWLockShared(&viewports.lock);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: RenderViewportLevel *******************************************/
+/*********************************************************************************************************************/
+
+// Reads the part of level under the viewport and scales it up to the viewport with the nearest pixel
+BOOL RenderViewportLevel(Viewport* viewport, INT32 level, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	double scale = openslide_get_level_downsample(viewport->session->slide, level) /
+		openslide_get_level_downsample(viewport->session->slide, viewport->level);
+	INT64 sourceX, sourceY;
+	INT32 sourceWidth, sourceHeight;
+	std::vector<BYTE> source;
+	std::vector<INT32> columns;
+
+	//*** The requested level is read as it is ************************************************************************
+	if (level == viewport->level)
+		return ReadRegionFromTiles(viewport->session, level, viewport->x, viewport->y, viewport->width, viewport->height,
+			data);
+
+	sourceX = (INT64)floor(viewport->x / scale);
+	sourceY = (INT64)floor(viewport->y / scale);
+	sourceWidth = (INT32)((INT64)ceil((viewport->x + viewport->width) / scale) - sourceX);
+	sourceHeight = (INT32)((INT64)ceil((viewport->y + viewport->height) / scale) - sourceY);
+	source.resize((size_t)sourceWidth * sourceHeight * 4);
+
+	if (!ReadRegionFromTiles(viewport->session, level, sourceX, sourceY, sourceWidth, sourceHeight, &source[0]))
+		return false;
+
+	//*** The source column of every target column is the same in every row *******************************************
+	columns.resize(viewport->width);
+
+	for (INT32 x = 0; x < viewport->width; x++)
+		columns[x] = (std::min)((INT32)((INT64)floor((viewport->x + x + 0.5) / scale) - sourceX), sourceWidth - 1);
+
+	for (INT32 y = 0; y < viewport->height; y++)
+	{
+		INT32 row = (std::min)((INT32)((INT64)floor((viewport->y + y + 0.5) / scale) - sourceY), sourceHeight - 1);
+		const UINT32* line = (const UINT32*)&source[0] + (size_t)row * sourceWidth;
+		UINT32* target = (UINT32*)data + (size_t)y * viewport->width;
+
+		for (INT32 x = 0; x < viewport->width; x++) target[x] = line[columns[x]];
+	}
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: ReadRegionFromTiles *******************************************/
+/*********************************************************************************************************************/
+
+// Reads a region of a level, which may reach beyond the level, by copying it out of the tiles it touches. Unlike
+// GetRegionDecoded, this goes through the tile caches, so overlapping regions decode every tile only once.
+BOOL ReadRegionFromTiles(Session* session, INT32 level, INT64 x, INT64 y, INT32 width, INT32 height, BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<INT32> coordinates;
+	std::vector<BYTE> tiles;
+	INT64 tileWidth = session->tileWidth, tileHeight = session->tileHeight;
+	INT64 left, top, right, bottom;
+	int64_t levelWidth, levelHeight;
+	BOOL result;
+
+	std::memset(data, 0, (size_t)width * height * 4);
+
+	openslide_get_level_dimensions(session->slide, level, &levelWidth, &levelHeight);
+
+	//*** The part of the region that lies on the level ***************************************************************
+	left = (std::max)(x, (INT64)0);
+	top = (std::max)(y, (INT64)0);
+	right = (std::min)(x + width, (INT64)levelWidth);
+	bottom = (std::min)(y + height, (INT64)levelHeight);
+
+	if (left >= right || top >= bottom) return true;
+
+	for (INT64 ty = top / tileHeight; ty <= (bottom - 1) / tileHeight; ty++)
+	{
+		for (INT64 tx = left / tileWidth; tx <= (right - 1) / tileWidth; tx++)
+		{
+			coordinates.push_back((INT32)tx);
+			coordinates.push_back((INT32)ty);
+		}
+	}
+
+	tiles.resize(coordinates.size() / 2 * (size_t)session->bufferSize);
+	result = ReadTiles(session, level, &coordinates[0], (INT32)(coordinates.size() / 2), &tiles[0]);
+
+	//*** Copy the rows of every tile that fall into the region *******************************************************
+	for (size_t i = 0; i < coordinates.size() / 2; i++)
+	{
+		INT64 tileX = coordinates[2 * i] * tileWidth, tileY = coordinates[2 * i + 1] * tileHeight;
+		INT64 fromX = (std::max)(left, tileX), toX = (std::min)(right, tileX + tileWidth);
+		INT64 fromY = (std::max)(top, tileY), toY = (std::min)(bottom, tileY + tileHeight);
+
+		for (INT64 row = fromY; row < toY; row++)
+			std::memcpy(data + ((row - y) * width + (fromX - x)) * 4,
+				&tiles[i * session->bufferSize + (size_t)(((row - tileY) * tileWidth + (fromX - tileX)) * 4)],
+				(size_t)(toX - fromX) * 4);
+	}
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: ReadRegionScaled *********************************************/
+/*********************************************************************************************************************/
+
+// Reads a region of a level scaled down by factor (2, 4 or 8); x, y, width and height are pixels of the scaled level.
+// The JPEG tiles the region touches are decoded at the reduced size straight from the file, so neither the full-size
+// tiles nor a resampling pass are needed. False if the level is not stored that way or a tile cannot be decoded like
+// this, in which case the caller reads at full size.
+BOOL ReadRegionScaled(Session* session, INT32 level, INT32 factor, INT64 x, INT64 y, INT32 width, INT32 height,
+	BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	INT64 tileWidth = session->tileWidth / factor, tileHeight = session->tileHeight / factor;
+	std::vector<uint32_t> tile;
+	ScaledJpegDecoder* decoder;
+	const TiffLevel* tiles;
+	TiffIndex* index;
+	INT64 left, top, right, bottom;
+	int64_t levelWidth, levelHeight;
+	BOOL result = true;
+	INT64 trace;
+
+	//*** A pinned level is scaled faster out of memory ***************************************************************
+	if (level < 0 || level >= session->levels || GetPinnedLevel(session, level) != NULL) return false;
+
+	if ((index = GetTiffIndex(session)) == NULL || level >= index->levelCount) return false;
+
+	tiles = &index->levels[level];
+
+	if (!IsScaledJpegLevel(tiles, (INT32)session->tileWidth, (INT32)session->tileHeight, factor)) return false;
+	if ((decoder = AcquireScaledJpegDecoder(&session->jpegPool, session->path)) == NULL) return false;
+
+	std::memset(data, 0, (size_t)width * height * 4);
+
+	openslide_get_level_dimensions(session->slide, level, &levelWidth, &levelHeight);
+
+	//*** The part of the region that lies on the scaled level ********************************************************
+	left = (std::max)(x, (INT64)0);
+	top = (std::max)(y, (INT64)0);
+	right = (std::min)(x + width, (INT64)(levelWidth + factor - 1) / factor);
+	bottom = (std::min)(y + height, (INT64)(levelHeight + factor - 1) / factor);
+
+	tile.resize((size_t)(tileWidth * tileHeight));
+
+	for (INT64 ty = top / tileHeight; result && left < right && top < bottom && ty <= (bottom - 1) / tileHeight; ty++)
+	{
+		for (INT64 tx = left / tileWidth; tx <= (right - 1) / tileWidth; tx++)
+		{
+			INT64 tileX = tx * tileWidth, tileY = ty * tileHeight;
+			INT64 fromX = (std::max)(left, tileX), toX = (std::min)(right, tileX + tileWidth);
+			INT64 fromY = (std::max)(top, tileY), toY = (std::min)(bottom, tileY + tileHeight);
+
+			trace = TraceStart();
+
+			if (!DecodeScaledJpegTile(decoder, tiles, (INT32)tx, (INT32)ty, (INT32)tileWidth, (INT32)tileHeight, &tile[0]))
+			{
+				result = false;
+				break;
+			}
+
+			NormalizeStain(session, &tile[0], (BYTE*)&tile[0], (int)(tileWidth * tileHeight));
+
+			TraceEnd("scaled jpeg decode", trace, level, (INT32)tx, (INT32)ty);
+
+			//*** Copy the rows of the tile that fall into the region *************************************************
+			for (INT64 row = fromY; row < toY; row++)
+				std::memcpy(data + ((row - y) * width + (fromX - x)) * 4,
+					&tile[(size_t)((row - tileY) * tileWidth + (fromX - tileX))], (size_t)(toX - fromX) * 4);
+		}
+	}
+
+	ReleaseScaledJpegDecoder(&session->jpegPool, decoder);
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: HaloSource ************************************************/
+/*********************************************************************************************************************/
+
+// Maps a pixel position that may lie outside of 0 to size - 1 back into the level, or to -1 for a transparent pixel
+INT32 HaloSource(INT64 position, INT64 size, INT32 edge)
+{
+	if (position >= 0 && position < size) return (INT32)position;
+
+	if (edge == HALO_EDGE_TRANSPARENT) return -1;
+
+	//*** Mirrored without repeating the edge pixel, as often as the margin needs *************************************
+	if (edge == HALO_EDGE_MIRROR && size > 1)
+	{
+		INT64 period = 2 * (size - 1);
+
+		position %= period;
+		if (position < 0) position += period;
+
+		return (INT32)((position < size) ? position : period - position);
+	}
+
+	return (INT32)((position < 0) ? 0 : size - 1);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: GetRegionDecoded *********************************************/
+/*********************************************************************************************************************/
+
+// Reads the region x, y, width, height, given in pixels of the level, into data (width * height * 4 bytes, premultiplied
+// ARGB like the tiles). The tiles the region touches are read ahead first.
+extern "C" __declspec(dllexport) BOOL GetRegionDecoded(INT64 handle, INT32 level, INT32 x, INT32 y, INT32 width, INT32 height,
+	BYTE* data)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<INT32> coordinates;
+	PinnedLevel* pinned;
+	TiffIndex* index;
+	Session* session;
+	openslide_t* slide;
+	double downsample;
+	bool failed;
+	INT64 trace;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || data == NULL || width <= 0 || height <= 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (level < 0 || level >= session->levels) return false;
+
+	//*** A pinned level needs neither read ahead nor openslide *******************************************************
+	if ((pinned = GetPinnedLevel(session, level)) != NULL)
+	{
+		trace = TraceStart();
+		CopyPinnedRegion(pinned, x, y, width, height, (uint32_t*)data);
+
+		NormalizeStain(session, (uint32_t*)data, data, width * height);
+		TraceEnd("pinned copy", trace, level, x, y);
+
+		return true;
+	}
+
+	//*** Read ahead the tiles the region touches *********************************************************************
+	if ((index = GetTiffIndex(session)) != NULL && index->levels[level].offsets != NULL)
+	{
+		INT32 tileWidth = (INT32)session->tileWidth, tileHeight = (INT32)session->tileHeight;
+
+		for (INT32 ty = (y > 0 ? y : 0) / tileHeight; ty <= (y + height - 1) / tileHeight; ty++)
+		{
+			for (INT32 tx = (x > 0 ? x : 0) / tileWidth; tx <= (x + width - 1) / tileWidth; tx++)
+			{
+				coordinates.push_back(tx);
+				coordinates.push_back(ty);
+			}
+		}
+
+		trace = TraceStart();
+
+		if (!coordinates.empty())
+			ReadAheadTiles(session->path, &index->levels[level], &coordinates[0], (INT32)(coordinates.size() / 2));
+
+		TraceEnd("read ahead", trace, level, x, y);
+	}
+
+	//*** openslide expects the position in level 0 coordinates *******************************************************
+	downsample = openslide_get_level_downsample(session->slide, level);
+
+	trace = TraceStart();
+	slide = CheckOutSlide(session);
+	TraceEnd("handle wait", trace, level, x, y);
+
+	trace = TraceStart();
+	openslide_read_region(slide, (uint32_t*)data, (int64_t)(x * downsample), (int64_t)(y * downsample), level, width, height);
+	TraceEnd("openslide_read_region", trace, level, x, y);
+	failed = (openslide_get_error(slide) != NULL);
+
+	ReturnSlide(session, slide);
+
+	if (failed) return false;
+
+	//*** The stain normalization works in place **********************************************************************
+	trace = TraceStart();
+	if (NormalizeStain(session, (uint32_t*)data, data, width * height)) TraceEnd("normalize", trace, level, x, y);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: SetSlideHandlePool ********************************************/
+/*********************************************************************************************************************/
+
+// Reads of the session are spread over count openslide handles to the same file (0 = one per processor, 1 = only the
+// primary handle). Waits for the reads that have a handle of the old pool checked out; may be called while reading.
+extern "C" __declspec(dllexport) BOOL SetSlideHandlePool(INT64 handle, INT32 count)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	SlidePool* pool = NULL;
+	SYSTEM_INFO system;
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0) return false;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
+
+	if (count <= 0)
+	{
+		GetSystemInfo(&system);
+		count = (INT32)system.dwNumberOfProcessors;
+	}
+
+	//*** The handles are opened before the lock, so reads only wait for the swap ************************************
+	if (count >= 2 && (pool = CreateSlidePool(session->slide, session->path, count)) == NULL) return false;
+
+	//*** Once the lock is held no read has a handle of the old pool checked out **************************************
+	AcquireSRWLockExclusive(&session->poolLock);
+	std::swap(pool, session->pool);
+	ReleaseSRWLockExclusive(&session->poolLock);
+
+	FreeSlidePool(pool);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: CheckOutSlide **********************************************/
+/*********************************************************************************************************************/
+
+// The openslide handle for one read: one of the pool, or the primary handle without a pool. The pool is not replaced
+// until the handle is given back with ReturnSlide on the same thread.
+openslide_t* CheckOutSlide(Session* session)
+{
+	AcquireSRWLockShared(&session->poolLock);
+
+	return (session->pool != NULL) ? AcquireSlide(session->pool) : session->slide;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: ReturnSlide ***********************************************/
+/*********************************************************************************************************************/
+
+void ReturnSlide(Session* session, openslide_t* slide)
+{
+	if (session->pool != NULL) ReleaseSlide(session->pool, slide);
+
+	ReleaseSRWLockShared(&session->poolLock);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: CreateTileIterator ********************************************/
+/*********************************************************************************************************************/
+
+// Enumerates the tiles of a level in the given order (TILE_ORDER_*). rect (x, y, width, height in pixels of the level)
+// and mask (maskWidth x maskHeight bytes covering the whole level, nonzero = tissue) restrict the tiles and may be NULL.
+// count receives the number of tiles. The iterator does not refer to the session and is freed with CloseTileIterator.
+// Returns the handle of the iterator, or 0 on invalid arguments.
+extern "C" __declspec(dllexport) INT64 CreateTileIterator(INT64 handle, INT32 level, INT32 order, INT32* rect, BYTE* mask,
+	INT32 maskWidth, INT32 maskHeight, INT32* count)
+{
+	//*** Variablen-Deklarationen *************************************************************************************
+	TileIterator* iterator;
+	UINT64* offsets = NULL;
+	INT64 result;
+	TiffIndex* index;
+	INT32 tiles[4];
+	INT32 columns, rows;
+	int64_t width, height;
+	Session* session;
+
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0) return 0;
+
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return 0;
+
+	if (level < 0 || level >= session->levels) return 0;
+
+	//*** Size of the level in tiles **********************************************************************************
+	openslide_get_level_dimensions(session->slide, level, &width, &height);
+
+	columns = (INT32)((width + session->tileWidth - 1) / session->tileWidth);
+	rows = (INT32)((height + session->tileHeight - 1) / session->tileHeight);
+
+	//*** Every tile the rectangle touches belongs to it **************************************************************
+	if (rect != NULL)
+	{
+		if (rect[2] <= 0 || rect[3] <= 0) return 0;
+
+		tiles[0] = rect[0] / (INT32)session->tileWidth;
+		tiles[1] = rect[1] / (INT32)session->tileHeight;
+		tiles[2] = (rect[0] + rect[2] + (INT32)session->tileWidth - 1) / (INT32)session->tileWidth - tiles[0];
+		tiles[3] = (rect[1] + rect[3] + (INT32)session->tileHeight - 1) / (INT32)session->tileHeight - tiles[1];
+	}
+
+	//*** The file order needs the tile offsets; without them TILE_ORDER_FILE falls back to Hilbert order *************
+	if (order == TILE_ORDER_FILE && (index = GetTiffIndex(session)) != NULL && index->levels[level].columns == columns &&
+		index->levels[level].rows == rows)
+		offsets = index->levels[level].offsets;
+
+	iterator = BuildTileIterator(columns, rows, order, offsets, (rect != NULL) ? tiles : NULL, mask, maskWidth, maskHeight);
+
+	if (iterator == NULL) return 0;
+
+	if (count != NULL) *count = (INT32)iterator->count;
+
+	if ((result = RegisterHandle(HANDLE_TILE_ITERATOR, iterator)) == 0) FreeTileIterator(iterator);
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: NextTiles ************************************************/
+/*********************************************************************************************************************/
+
+// Writes the x, y pairs of the next chunk of up to maxTiles tiles to coordinates and returns their number, 0 at the end.
+// Threads sharing one iterator get disjoint chunks, each of them a contiguous run of the order.
+extern "C" __declspec(dllexport) INT32 NextTiles(INT64 iterator, INT32* coordinates, INT32 maxTiles)
+{
+	if (iterator == 0 || coordinates == NULL) return 0;
+
+	HandleReference reference(iterator, HANDLE_TILE_ITERATOR);
+	if (reference.object == NULL) return 0;
+
+	return TakeTiles((TileIterator*)reference.object, coordinates, maxTiles);
+}
 
-	//*** Die erforderliche Gre fr den Lese-Puffer bestimmen *******************************************************
-	session->bufferSize = 4 * session->tileWidth * session->tileHeight * sizeof(BYTE);
 
-	//*** Den Lese-Puffer anlegen *************************************************************************************
-	if ((session->buffer = (BYTE*) malloc(session->bufferSize)) == NULL)
-	{		
-		//*** Die Session-Struktur wieder freigeben *******************************************************************
-		delete session;
+/*********************************************************************************************************************/
+/******************************************** Funktion: CloseTileIterator ********************************************/
+/*********************************************************************************************************************/
 
-		//*** Ende ****************************************************************************************************
-		return 0;
-	}
-	
-	//*** Ende ********************************************************************************************************
-	return (INT64)session;
+extern "C" __declspec(dllexport) void CloseTileIterator(INT64 iterator)
+{
+	//*** Waits for the calls still taking tiles from it **************************************************************
+	FreeTileIterator((TileIterator*)UnregisterHandle(iterator, HANDLE_TILE_ITERATOR));
 }
 
 
 /*********************************************************************************************************************/
-/************************************************ Funktion: CloseImage ***********************************************/
+/******************************************* Funktion: GetStainParameters ********************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void CloseImage(INT64 handle)
+extern "C" __declspec(dllexport) BOOL GetStainParameters(INT64 handle, INT32 method, float* params)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
 	Session* session;
+	bool estimated;
 
-	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0 || params == NULL || method <= STAIN_NONE || method > STAIN_MACENKO) return false;
 
-	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
 
-	//*** Das TiffBild schlieen **************************************************************************************
-	openslide_close(session->slide);
+	//*** Reuse an earlier estimation for the same method *************************************************************
+	AcquireSRWLockShared(&session->stainLock);
 
-	//*** Den Lese-Puffer wieder freigeben ****************************************************************************
-	free(session->buffer);
-	
-	//*** Die Session-Struktur freigeben ******************************************************************************
-	delete session;
+	if ((estimated = session->stainEstimated[method]))
+		for (int i = 0; i < STAIN_PARAMETER_COUNT; i++) params[i] = session->stainSource[method][i];
+
+	ReleaseSRWLockShared(&session->stainLock);
+
+	if (estimated) return true;
+
+	//*** Estimate the parameters from a low-resolution level, outside of the lock ************************************
+	if (!EstimateStainParameters(session->slide, method, params)) return false;
+
+	AcquireSRWLockExclusive(&session->stainLock);
+
+	for (int i = 0; i < STAIN_PARAMETER_COUNT; i++) session->stainSource[method][i] = params[i];
+	session->stainEstimated[method] = true;
+
+	ReleaseSRWLockExclusive(&session->stainLock);
+
+	//*** Ende ********************************************************************************************************
+	return true;
 }
 
 
 /*********************************************************************************************************************/
-/*********************************************** Funktion: GetImageSize **********************************************/
+/****************************************** Funktion: SetStainNormalization ******************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetImageSize(INT64 handle, INT32* x, INT32* y)
+// target holds STAIN_PARAMETER_COUNT values as returned by GetStainParameters for a reference slide;
+// NULL selects the default reference (Macenko only). method STAIN_NONE switches the normalization off.
+extern "C" __declspec(dllexport) BOOL SetStainNormalization(INT64 handle, INT32 method, float* target)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
+	float source[STAIN_PARAMETER_COUNT];
+	StainNormalization* previous;
+	StainNormalization* stain;
 	Session* session;
 
-	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
+	if (handle == 0) return false;
 
-	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return false;
 
-	//*** Die Hhe und Breite des Bildes zuweisen *********************************************************************
-	*y = session->imageHeight;
-	*x = session->imageWidth;
+	//*** Switch off, or build the lookup table for the new target ****************************************************
+	// the slide parameters are cached in the session per method, so only the first call for a method estimates them
+	if (method == STAIN_NONE)
+		stain = NULL;
+	else if (!GetStainParameters(handle, method, source))
+		return false;
+	else if ((stain = CreateStainNormalization(method, source, target)) == NULL)
+		return false;
+
+	//*** Swap the tables; readers hold the shared lock for their whole copy ******************************************
+	AcquireSRWLockExclusive(&session->stainLock);
+
+	previous = session->stain;
+	session->stain = stain;
+	session->stainHash = (LONG)HashStainNormalization(stain);
+
+	ReleaseSRWLockExclusive(&session->stainLock);
+
+	FreeStainNormalization(previous);
+
+	//*** Tiles the tile server encoded with the previous tables are of no use any more *******************************
+	DropServedTiles(session->slideId);
+
+	//*** Ende ********************************************************************************************************
+	return true;
 }
 
 
 /*********************************************************************************************************************/
-/*********************************************** Funktion: GetImageDpi ***********************************************/
+/********************************************* Funktion: LoadAnnotations *********************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetImageDpi(INT64 handle, INT32* dpi)
+// Loads the polygons of an ASAP annotation file (the Camelyon16 format) into the session, replacing those loaded
+// before; path NULL only removes them. Returns the number of polygons, or -1 if the file could not be read.
+extern "C" __declspec(dllexport) INT32 LoadAnnotations(INT64 handle, wchar_t* path)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
+	Annotations* annotations = NULL;
 	Session* session;
+	INT32 count;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	if (handle == 0) return -1;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return -1;
 
-	//*** Die Auflsung des Bildes zuweisen ***************************************************************************
-	*dpi = session->dpi;
+	//*** Parse outside of the lock, so that queries on the old annotations go on meanwhile ***************************
+	if (path != NULL && (annotations = LoadAnnotationFile(path)) == NULL) return -1;
+
+	//*** The count is taken under the lock; a concurrent call may free the new polygons right after it ***************
+	AcquireSRWLockExclusive(&session->annotationLock);
+	std::swap(session->annotations, annotations);
+	count = (session->annotations != NULL) ? session->annotations->count : 0;
+	ReleaseSRWLockExclusive(&session->annotationLock);
+
+	FreeAnnotations(annotations);
+
+	//*** Ende ********************************************************************************************************
+	return count;
 }
 
 
 /*********************************************************************************************************************/
-/*********************************************** Funktion: GetTileSize ***********************************************/
+/******************************************** Funktion: GetAnnotationInfo ********************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetTileSize(INT64 handle, INT32* x, INT32* y)
+// Group and bounds (minX, minY, maxX, maxY in level 0 pixels) of a polygon
+extern "C" __declspec(dllexport) BOOL GetAnnotationInfo(INT64 handle, INT32 index, INT32* group, double* bounds)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
 	Session* session;
+	bool found = false;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	if (handle == 0) return false;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
 
-	//*** Die Hhe und Breite der Bildkacheln zuweisen ****************************************************************
-	*x = session->tileWidth;
-	*y = session->tileHeight;
+	AcquireSRWLockShared(&session->annotationLock);
+
+	if (session->annotations != NULL && index >= 0 && index < session->annotations->count)
+	{
+		if (group != NULL) *group = session->annotations->groups[index];
+		if (bounds != NULL) std::memcpy(bounds, session->annotations->bounds + 4 * index, 4 * sizeof(double));
+		found = true;
+	}
+
+	ReleaseSRWLockShared(&session->annotationLock);
+
+	//*** Ende ********************************************************************************************************
+	return found;
 }
 
 
 /*********************************************************************************************************************/
-/********************************************** Funktion: GetTileFormat **********************************************/
+/***************************************** Funktion: GetAnnotationGroupName ******************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetTileFormat(INT64 handle, INT32* format)
+// Name of a group as given by PartOfGroup, e.g. "Tumor" or "Exclusion"; mask values are the group + 1
+extern "C" __declspec(dllexport) BOOL GetAnnotationGroupName(INT64 handle, INT32 group, char* name, INT32 size)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
 	Session* session;
+	bool found = false;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	if (handle == 0 || name == NULL || size <= 0) return false;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
 
-	//*** TODO Finde eine Lsung dafr ... ****************************************************************************
-	if (session->compressionSheme == 33005) *format = 33003;
+	AcquireSRWLockShared(&session->annotationLock);
 
-	//*** Das Bildformat der Kacheln zuweisen *************************************************************************
-	else *format = session->compressionSheme;
+	if (session->annotations != NULL && group >= 0 && group < session->annotations->groupCount)
+	{
+		strncpy(name, session->annotations->groupNames[group], size - 1);
+		name[size - 1] = 0;
+		found = true;
+	}
+
+	ReleaseSRWLockShared(&session->annotationLock);
+
+	//*** Ende ********************************************************************************************************
+	return found;
 }
 
 
 /*********************************************************************************************************************/
-/********************************************** Funktion: GetPhotometric *********************************************/
+/******************************************* Funktion: GetTileAnnotations ********************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetPhotometric(INT64 handle, INT32* photometric)
+// Stores up to maxIndices polygons that intersect the tile, in ascending order, and returns how many there are
+extern "C" __declspec(dllexport) INT32 GetTileAnnotations(INT64 handle, INT32 level, INT32 x, INT32 y, INT32* indices,
+	INT32 maxIndices)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
+	double originX, originY, scale, rect[4];
 	Session* session;
+	INT32 found = 0;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	if (handle == 0) return -1;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return -1;
 
-	//*** Die Auflsung des Bildes zuweisen ***************************************************************************
-	*photometric = (int)session->photoMetric;
+	if (!GetTileOrigin(session, level, x, y, &originX, &originY, &scale)) return -1;
+
+	rect[0] = originX;
+	rect[1] = originY;
+	rect[2] = originX + session->tileWidth * scale;
+	rect[3] = originY + session->tileHeight * scale;
+
+	AcquireSRWLockShared(&session->annotationLock);
+
+	if (session->annotations != NULL) found = QueryAnnotations(session->annotations, rect, indices, maxIndices);
+
+	ReleaseSRWLockShared(&session->annotationLock);
+
+	//*** Ende ********************************************************************************************************
+	return found;
 }
 
 
 /*********************************************************************************************************************/
-/******************************************* Funktion: GetYCbCrSubsampling *******************************************/
+/****************************************** Funktion: GetTileAnnotationMask ******************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetYCbCrSubsampling(INT64 handle, INT32* subX, INT32* subY)
+// Writes tileWidth x tileHeight bytes, one per pixel of the tile GetTileDecoded returns for the same coordinates:
+// 0 outside of all polygons, otherwise the group + 1 of the polygon that covers the pixel center
+extern "C" __declspec(dllexport) BOOL GetTileAnnotationMask(INT64 handle, INT32 level, INT32 x, INT32 y, BYTE* mask)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
+	double originX, originY, scale;
 	Session* session;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	if (handle == 0 || mask == NULL) return false;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
 
-	//*** Die Unterabtastund des Bildes in X-Richtung zuweisen ********************************************************
-	*subX = (int)session->subX;
+	if (!GetTileOrigin(session, level, x, y, &originX, &originY, &scale)) return false;
 
-	//*** Die Unterabtastund des Bildes in X-Richtung zuweisen ********************************************************
-	*subY = (int)session->subY;
+	AcquireSRWLockShared(&session->annotationLock);
+
+	if (session->annotations != NULL)
+		RasterizeAnnotations(session->annotations, originX, originY, scale, session->tileWidth, session->tileHeight, mask);
+	else
+		std::memset(mask, 0, (size_t)session->tileWidth * session->tileHeight);
+
+	ReleaseSRWLockShared(&session->annotationLock);
+
+	//*** Ende ********************************************************************************************************
+	return true;
 }
 
 
 /*********************************************************************************************************************/
-/************************************************ Funktion: GetLevels ************************************************/
+/**************************************** Funktion: GetTileAnnotationCoverage ****************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) void GetLevels(INT64 handle, INT32* levels)
+// Fraction of the pixels of the tile that each group covers, for the groups 0 to groups - 1; a label for patch
+// classification without fetching the whole mask
+extern "C" __declspec(dllexport) BOOL GetTileAnnotationCoverage(INT64 handle, INT32 level, INT32 x, INT32 y,
+	float* fractions, INT32 groups)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<INT64> counts;
+	std::vector<BYTE> mask;
 	Session* session;
+	size_t pixels;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return;
+	if (handle == 0 || fractions == NULL || groups <= 0) return false;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
 
-	//*** Die Anzahl der Levels zuweisen ******************************************************************************
-	*levels = session->levels;
+	pixels = (size_t)session->tileWidth * session->tileHeight;
+	mask.resize(pixels);
+
+	if (!GetTileAnnotationMask(handle, level, x, y, &mask[0])) return false;
+
+	//*** Count the mask values ***************************************************************************************
+	counts.assign(256, 0);
+	for (size_t i = 0; i < pixels; i++) counts[mask[i]]++;
+
+	for (INT32 group = 0; group < groups; group++)
+		fractions[group] = (group < 255) ? (float)((double)counts[group + 1] / pixels) : 0.0f;
+
+	//*** Ende ********************************************************************************************************
+	return true;
 }
 
 
 /*********************************************************************************************************************/
-/********************************************** Funktion: GetLevelSize ***********************************************/
+/********************************************** Funktion: CreateHeatmap **********************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) BOOL GetLevelSize(INT64 handle, INT32 level, INT32* x, INT32* y)
+// Creates an empty heatmap with one cell per tile of level and channels values per cell, e.g. the class
+// probabilities of a model. Memory is only taken for the chunks that receive values. The heatmap keeps the tile grid
+// of all levels, does not refer to the session afterwards and is freed with CloseHeatmap.
+extern "C" __declspec(dllexport) INT64 CreateHeatmap(INT64 handle, INT32 level, INT32 channels)
 {
 	//*** Variablen-Deklarationen *************************************************************************************
+	std::vector<double> grid;
+	double cellWidth, cellHeight, scale;
+	int64_t width, height;
+	Heatmap* heatmap;
 	Session* session;
+	INT64 result;
 
 	//*** Verlassen, wenn kein gltiges Handle angegeben ist **********************************************************
-	if (handle == 0) return false;
+	if (handle == 0) return 0;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle);
+	if ((session = reference.session) == NULL) return 0;
 
-	//*** Gre der Pyramidenstufe bestimmen **************************************************************************
-	int64_t w, h;
+	if (level < 0 || level >= session->levels) return 0;
 
-	openslide_get_level_dimensions(session->slide, level, &w, &h);
+	//*** Tile step and downsample of every level, as the tiles are read **********************************************
+	grid.resize(3 * session->levels);
 
-	*x = (INT32)w;
-	*y = (INT32)h;
+	for (INT32 i = 0; i < session->levels; i++)
+		if (!GetTileOrigin(session, i, 1, 1, &grid[3 * i], &grid[3 * i + 1], &grid[3 * i + 2])) return 0;
+
+	GetTileOrigin(session, level, 1, 1, &cellWidth, &cellHeight, &scale);
+
+	openslide_get_level_dimensions(session->slide, level, &width, &height);
+
+	heatmap = CreateHeatmapStore(session->slideId, (INT32)((width + session->tileWidth - 1) / session->tileWidth),
+		(INT32)((height + session->tileHeight - 1) / session->tileHeight), cellWidth, cellHeight, channels,
+		session->tileWidth, session->tileHeight, &grid[0], session->levels);
+
+	if (heatmap == NULL) return 0;
+	if ((result = RegisterHandle(HANDLE_HEATMAP, heatmap)) == 0) FreeHeatmap(heatmap);
 
 	//*** Ende ********************************************************************************************************
-	return true;
+	return result;
 }
 
 
-// This function should replace the two following functions for extracting tiles
-// OpenSlide lib only reads the tile as a UINT32 buffer, so there's no point
-// the following functions will just be "wrappers" around this one
-BOOL GetOpenSlideTile(INT64 handle, INT32 level, INT32 x, INT32 y) 
-{
-	Session* session;
-	tsize_t tileSize;
-	int64_t tileWidth, tileHeight;
-	uint32_t *tileBuffer = NULL;	
-	int64_t l_width, l_height;
-	int64_t step_x, step_y;
+/*********************************************************************************************************************/
+/******************************************** Funktion: SetHeatmapValues *********************************************/
+/*********************************************************************************************************************/
 
-	if (handle == 0) 
-		return false;
+// Stores the results of count tiles, given as x, y pairs of the level of the heatmap, with channels values in 0.0 to
+// 1.0 per tile; the coarser levels are updated right away. Several threads may write at the same time.
+extern "C" __declspec(dllexport) BOOL SetHeatmapValues(INT64 heatmap, INT32* coordinates, INT32 count, float* values)
+{
+	if (heatmap == 0 || coordinates == NULL || values == NULL) return false;
 
-	session = (Session*)handle;
+	HandleReference reference(heatmap, HANDLE_HEATMAP);
+	if (reference.object == NULL) return false;
 
-	tileSize = session->bufferSize;
-	tileWidth = session->tileWidth;
-	tileHeight = session->tileHeight;
+	return SetHeatmapCells((Heatmap*)reference.object, coordinates, count, values);
+}
 
-	// prepare an unsigned-int-32 bit buffer of size [tileWidth x tileHeight] for the tile
-	tileBuffer = (uint32_t*)malloc(tileWidth * tileHeight * sizeof(uint32_t));
 
-	// get the size of the slide at current detalization level
-	openslide_get_level_dimensions(session->slide, level, &l_width, &l_height);
+/*********************************************************************************************************************/
+/******************************************** Funktion: GetHeatmapValues *********************************************/
+/*********************************************************************************************************************/
 
-	// recalculate the step for the tiles
-	step_y = (int64_t)floor((double)session->imageHeight/ ((double)l_height / (double)session->tileHeight));
-	step_x = (int64_t)floor((double)session->imageWidth / ((double)l_width/ (double)session->tileWidth));
-	
-	// read the tile of size [tileWidth x tileHeight] from the slide t current level
-	// note: the coordinates (x; y) are relative to the lowest level, hence the step_x and xtep_y
-	openslide_read_region(session->slide, tileBuffer, x * step_x, y * step_y, level, tileWidth, tileHeight);
-	
-	// the tile buffer will be set to NULL if there was an error 
-	if (tileBuffer == NULL) {
-		// it is possible to get the error description, if there was one
-		// char* errorText = openslide_get_error(session->slide);
-		return false;
-	}
-	
-	// copy the uint32 buffer into a byte buffer of the same size 
-	// thus every uint32 value is divided into four separate RGBA bytes
-	std::memcpy(session->buffer, tileBuffer, session->bufferSize);
+// Reads width x height cells of a pyramid level (0 = one cell per tile, every further level halves it); cells
+// without a value read as -1.0
+extern "C" __declspec(dllexport) BOOL GetHeatmapValues(INT64 heatmap, INT32 level, INT32 x, INT32 y, INT32 width,
+	INT32 height, float* values)
+{
+	if (heatmap == 0 || values == NULL) return false;
 
-	// free the buffer
-	free(tileBuffer);
+	HandleReference reference(heatmap, HANDLE_HEATMAP);
+	if (reference.object == NULL) return false;
 
-	return true;
+	return GetHeatmapCells((Heatmap*)reference.object, level, x, y, width, height, values);
 }
 
+
 /*********************************************************************************************************************/
-/*********************************************** Funktion: GetTileJP2C ***********************************************/
+/********************************************* Funktion: GetHeatmapTile **********************************************/
 /*********************************************************************************************************************/
 
+// Renders one channel as an overlay for tile x, y of a slide level, in the layout of GetTileDecoded (premultiplied
+// BGRA, tileWidth x tileHeight), so that it can be blended onto the tile directly
+extern "C" __declspec(dllexport) BOOL GetHeatmapTile(INT64 heatmap, INT32 level, INT32 x, INT32 y, INT32 channel,
+	BYTE opacity, BYTE* data)
+{
+	if (heatmap == 0 || data == NULL) return false;
 
+	HandleReference reference(heatmap, HANDLE_HEATMAP);
+	if (reference.object == NULL) return false;
 
-extern "C" __declspec(dllexport) BOOL GetTileJP2C(INT64 handle, INT32 level, INT32 x, INT32 y, BYTE** data, INT32* length)
-{
-	//*** Variablen-Deklarationen *************************************************************************************
-	Session* session;
+	RenderHeatmapTile((Heatmap*)reference.object, level, x, y, channel, opacity, data);
 
-	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
-	if (handle == 0) return false;
+	return true;
+}
 
-	// Use the OpenSlide code:
-	if (!GetOpenSlideTile(handle, level, x, y)) {
-		return false;
-	}
 
-	session = (Session*)handle;
+/*********************************************************************************************************************/
+/*********************************************** Funktion: SaveHeatmap ***********************************************/
+/*********************************************************************************************************************/
 
-	level = session->bufferSize;
-	
-	//*** Den Zeiger auf die Bilddaten nernehmen *********************************************************************
-	std::memcpy(data, session->buffer, session->bufferSize);
+extern "C" __declspec(dllexport) BOOL SaveHeatmap(INT64 heatmap, wchar_t* path)
+{
+	if (heatmap == 0 || path == NULL) return false;
 
-	//*** Default: true ***********************************************************************************************
-	return true;
+	HandleReference reference(heatmap, HANDLE_HEATMAP);
+	if (reference.object == NULL) return false;
+
+	return SaveHeatmapFile((Heatmap*)reference.object, path);
 }
 
 
 /*********************************************************************************************************************/
-/************************************************* Funktion: GetTile *************************************************/
+/*********************************************** Funktion: LoadHeatmap ***********************************************/
 /*********************************************************************************************************************/
 
-extern "C" __declspec(dllexport) BOOL GetTileDecoded(INT64 handle, INT32 level, INT32 x, INT32 y, BYTE* data)
+// Reads a heatmap saved for the same slide, level and channel count into a heatmap created with CreateHeatmap
+extern "C" __declspec(dllexport) BOOL LoadHeatmap(INT64 heatmap, wchar_t* path)
 {
-	//*** Variablen-Deklarationen *************************************************************************************
-	Session* session;
+	if (heatmap == 0 || path == NULL) return false;
 
-	//*** False, wenn kein gltiges Handle angegeben ist **************************************************************
-	if (handle == 0) return false;
+	HandleReference reference(heatmap, HANDLE_HEATMAP);
+	if (reference.object == NULL) return false;
 
-	// Use the OpenSlide code:
-	if (!GetOpenSlideTile(handle, level, x, y)) {
-		return false;
-	}
+	return LoadHeatmapFile((Heatmap*)reference.object, path);
+}
 
-	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
-	
-	// copy data from the buffer into the output argument
-	std::memcpy(data, session->buffer, session->bufferSize);
 
-	// no need to convert the data from BGR to RGBA, as openslide already provides output as 32-bit RGBA buffer
-	
-	//*** Default: true ***********************************************************************************************
-	return true;
+/*********************************************************************************************************************/
+/********************************************** Funktion: CloseHeatmap ***********************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) void CloseHeatmap(INT64 heatmap)
+{
+	//*** Waits for the calls still working on it *********************************************************************
+	FreeHeatmap((Heatmap*)UnregisterHandle(heatmap, HANDLE_HEATMAP));
 }
 
 
@@ -463,7 +2773,8 @@ extern "C" __declspec(dllexport) BOOL GetSingleImageSize(INT64 handle, INT32 typ
 	if (handle == 0) return false;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
 
 	//*** Das entsprechende ImageDirectory bestimmen ******************************************************************
 	if (type == LABEL_IMAGE)
@@ -512,7 +2823,8 @@ extern "C" __declspec(dllexport) BOOL GetSingleImage(INT64 handle, INT32 type, B
 	if (handle == 0) return false;
 
 	//*** Die entsprechende Session-Struktur bestimmen ****************************************************************
-	session = (Session*)handle;
+	SessionReference reference(handle, SESSION_GEOMETRY);
+	if ((session = reference.session) == NULL) return false;
 
 	//*** Das entsprechende ImageDirectory bestimmen ******************************************************************
 	if (type == LABEL_IMAGE)
@@ -531,7 +2843,7 @@ extern "C" __declspec(dllexport) BOOL GetSingleImage(INT64 handle, INT32 type, B
 	if (handle == 0)
 		return false;
 
-	session = (Session*)handle;
+	session = reference.session;
 
 	width = session->imageWidth;
 	height = session->imageHeight;
@@ -676,31 +2988,6 @@ void Convert16BitGreyToArgb(unsigned char* src, unsigned char* dst, int width, i
 }
 
 
-/*********************************************************************************************************************/
-/*********************************************** Funktion: IsMacroImage **********************************************/
-/*********************************************************************************************************************/
-
-bool DescriptionContains(char* imageDescription, std::string searchString)
-{
-	//*** Variablen-Deklaration ***************************************************************************************
-	std::string description("");
-	size_t pos;
-	size_t pos2 = std::string::npos;
-
-	//*** Wenn keine Beschreibung vorhanden ist false zurckgeben ****************************************************
-	if (imageDescription == NULL) return false;
-
-	description.append(imageDescription);
-
-	//*** Nach der Zeichkette macro iin der Beschreibung suchen *******************************************************
-	pos = description.find(searchString);
-
-	//*** Testen ob "macro" gefunden wurde ****************************************************************************
-	if (pos == std::string::npos) return false;
-	else return true;
-}
-
-
 /*********************************************************************************************************************/
 /******************************************* Funktion: LevelToTiffDirectory ******************************************/
 /*********************************************************************************************************************/
@@ -719,74 +3006,104 @@ int LevelToTiffDirectory(Session* session, int level)
 
 
 /*********************************************************************************************************************/
-/********************************************** Funktion: StringToFloat **********************************************/
+/********************************************* Funktion: GetPinnedLevel **********************************************/
 /*********************************************************************************************************************/
 
-float StringToFloat(std::string s)
+// The pinned levels are read on the first use after SetLevelPinning; NULL if the level is not pinned
+PinnedLevel* GetPinnedLevel(Session* session, INT32 level)
 {
-	//*** Variablen-Deklaration ***************************************************************************************
-	std::stringstream stream;
-	float f;
+	PinnedLevels* pinned;
+
+	if (session->pinnedLoaded != 1)
+	{
+		if (GetLevelPinning() == 0) return NULL;
+
+		//*** Only the first thread reads the levels; the others go on through openslide until they are pinned *******
+		if (InterlockedCompareExchange(&session->pinnedLoaded, 2, 0) != 0) return NULL;
+
+		session->pinned = BuildPinnedLevels(session->path);
 
-	//*** ber den stringstream nach float kopieren *******************************************************************
-	stream << s;
-	stream >> f;
+		InterlockedExchange(&session->pinnedLoaded, 1);
+	}
+
+	pinned = session->pinned;
 
-	return f;
+	if (pinned == NULL || level < 0 || level >= pinned->levelCount || pinned->levels[level].pixels == NULL) return NULL;
+
+	return &pinned->levels[level];
 }
 
 
 /*********************************************************************************************************************/
-/************************************************ Funktion: GetValue *************************************************/
+/********************************************** Funktion: GetTiffIndex ***********************************************/
 /*********************************************************************************************************************/
 
-bool GetValue(char* imageDescription, std::string key, std::string* value)
+// The tile offset tables are read from the file on first use. NULL if the slide is no tiled TIFF.
+TiffIndex* GetTiffIndex(Session* session)
 {
-	//*** Variablen-Deklaration ***************************************************************************************
-	std::string desc(imageDescription);
-	size_t begin;
-	size_t end;
+	TiffIndex* index;
 
-	//*** Wenn keine ImageDesc angegeben 0 zurck *********************************************************************
-	if (imageDescription == NULL) return false;
+	if (session->tiffLoaded != 0) return session->tiff;
 
-	//*** Nach dem key in der Beschreibung suchen *********************************************************************
-	begin = desc.find(key);
+	//*** Two threads may both build the index; the one that comes second discards its copy ***************************
+	index = BuildTiffIndex(session->slide, session->path);
 
-	//*** Wenn nicht gefunden 0 zurck ********************************************************************************
-	if (begin == std::string::npos) return false;
+	if (index != NULL && InterlockedCompareExchangePointer((PVOID volatile*)&session->tiff, index, NULL) != NULL)
+		FreeTiffIndex(index);
 
-	//*** Das Ende der Key Value Beschreibung suchen ******************************************************************
-	end = desc.find("|", begin);
+	InterlockedExchange(&session->tiffLoaded, 1);
 
-	//*** Den Key berspringen ****************************************************************************************
-	begin = begin + key.length();
-
-	//*** Die Zeichkette mit dem Wert ausschneiden ********************************************************************
-	*value = desc.substr(begin, end - begin);
-
-	return true;
+	return session->tiff;
 }
 
 
 /*********************************************************************************************************************/
-/************************************************* Funktion: GetDpi **************************************************/
+/*********************************************** Funktion: GetSlideId ************************************************/
 /*********************************************************************************************************************/
 
-INT32 GetDpi(char* imageDescription)
+// 64-bit FNV-1a hash of openslide's quickhash-1 property, which identifies the slide content independently of the
+// path it was opened from; falls back to the filename for formats without a quickhash
+UINT64 GetSlideId(openslide_t* slide, const char* filename)
 {
 	//*** Variablen-Deklaration ***************************************************************************************
-	std::string pp_string = "";
-	float pp;
-	int dpi;
+	const char* identity;
+	UINT64 hash = 0xCBF29CE484222325ULL;
+
+	if ((identity = openslide_get_property_value(slide, "openslide.quickhash-1")) == NULL) identity = filename;
 
-	// this is a hard-coded value for the Camelyon16 slides
-	pp = 0.2430939999999998;
+	for (const char* c = identity; c != NULL && *c != 0; c++)
+	{
+		hash ^= (BYTE)*c;
+		hash *= 0x100000001B3ULL;
+	}
+
+	return hash;
+}
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: GetTileOrigin **********************************************/
+/*********************************************************************************************************************/
+
+// Level 0 position of the top left corner of a tile and the size of one of its pixels in level 0 pixels, from the
+// same tile step that GetOpenSlideTile reads with
+bool GetTileOrigin(Session* session, INT32 level, INT32 x, INT32 y, double* originX, double* originY, double* scale)
+{
+	int64_t l_width, l_height;
+	int64_t step_x, step_y;
+
+	if (level < 0 || level >= session->levels) return false;
 
-	//*** Von pp nach dpi umrechnen **********************************************************************************
-	dpi = (int)((1 / pp) * 25400);
+	openslide_get_level_dimensions(session->slide, level, &l_width, &l_height);
+	if (l_width <= 0 || l_height <= 0) return false;
+
+	step_y = (int64_t)floor((double)session->imageHeight / ((double)l_height / (double)session->tileHeight));
+	step_x = (int64_t)floor((double)session->imageWidth / ((double)l_width / (double)session->tileWidth));
 
-	return dpi;
+	*originX = (double)(x * step_x);
+	*originY = (double)(y * step_y);
+	*scale = openslide_get_level_downsample(session->slide, level);
+
+	return true;
 }
 
 extern "C" __declspec(dllexport) int Get() { return 43; }
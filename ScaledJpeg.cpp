@@ -0,0 +1,295 @@
+/*********************************************************************************************************************/
+/* Datei: ScaledJpeg.cpp                                                                                             */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Reduced-size decoding of JPEG tiles straight from the file for downsampled reads                   */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <wincodec.h>
+#include <string.h>
+#include <vector>
+
+#include "ScaledJpeg.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// a compressed tile larger than this is not read into memory
+#define JPEG_MAX_TILE_BYTES			(16 * 1024 * 1024)
+
+
+/*********************************************************************************************************************/
+/******************************************** Struktur: ScaledJpegDecoder ********************************************/
+/*********************************************************************************************************************/
+
+// Used by one read at a time and then put back into the pool of its slide; file and buffers are reused
+struct ScaledJpegDecoder
+{
+	HANDLE file;
+	std::vector<BYTE> stream;
+	std::vector<BYTE> pixels;
+	ScaledJpegDecoder* next;
+};
+
+// WIC factory of the calling thread, created on its first scaled read together with the COM initialization. Both are
+// kept until the thread ends: setting them up costs more than decoding a region, and CoUninitialize must not be
+// called from DllMain, so the initialization is left to the end of the thread.
+static __declspec(thread) IWICImagingFactory* threadFactory;
+static __declspec(thread) bool threadCom;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static IWICImagingFactory* GetThreadFactory();
+static void CloseScaledJpegDecoder(ScaledJpegDecoder* decoder);
+static bool BuildJpegStream(ScaledJpegDecoder* decoder, const TiffLevel* level, UINT64 offset, UINT64 length);
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: IsScaledJpegLevel ********************************************/
+/*********************************************************************************************************************/
+
+// True if the tiles of the level are JPEG with a tile size that divides by factor, which the JPEG decoder can scale
+// to 1/2, 1/4 and 1/8 while it decodes
+bool IsScaledJpegLevel(const TiffLevel* level, INT32 tileWidth, INT32 tileHeight, INT32 factor)
+{
+	if (level == NULL || level->offsets == NULL || level->compression != TIFF_COMPRESSION_JPEG) return false;
+	if (level->photometric != TIFF_PHOTOMETRIC_RGB && level->photometric != TIFF_PHOTOMETRIC_YCBCR) return false;
+	if (factor != 2 && factor != 4 && factor != 8) return false;
+
+	return tileWidth % factor == 0 && tileHeight % factor == 0;
+}
+
+
+/*********************************************************************************************************************/
+/**************************************** Funktion: AcquireScaledJpegDecoder *****************************************/
+/*********************************************************************************************************************/
+
+// Takes an idle decoder of the slide, or opens the file for a new one if all are in use
+ScaledJpegDecoder* AcquireScaledJpegDecoder(ScaledJpegPool* pool, const char* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	ScaledJpegDecoder* decoder;
+
+	AcquireSRWLockExclusive(&pool->lock);
+
+	if ((decoder = pool->idle) != NULL) pool->idle = decoder->next;
+
+	ReleaseSRWLockExclusive(&pool->lock);
+
+	if (decoder != NULL || path == NULL) return decoder;
+
+	decoder = new ScaledJpegDecoder();
+	decoder->next = NULL;
+	decoder->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (decoder->file == INVALID_HANDLE_VALUE)
+	{
+		CloseScaledJpegDecoder(decoder);
+		return NULL;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return decoder;
+}
+
+
+/*********************************************************************************************************************/
+/**************************************** Funktion: ReleaseScaledJpegDecoder *****************************************/
+/*********************************************************************************************************************/
+
+void ReleaseScaledJpegDecoder(ScaledJpegPool* pool, ScaledJpegDecoder* decoder)
+{
+	if (decoder == NULL) return;
+
+	AcquireSRWLockExclusive(&pool->lock);
+
+	decoder->next = pool->idle;
+	pool->idle = decoder;
+
+	ReleaseSRWLockExclusive(&pool->lock);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: FreeScaledJpegPool ********************************************/
+/*********************************************************************************************************************/
+
+// Called when the slide is closed; no decoder of it may be in use any more
+void FreeScaledJpegPool(ScaledJpegPool* pool)
+{
+	while (pool->idle != NULL)
+	{
+		ScaledJpegDecoder* decoder = pool->idle;
+
+		pool->idle = decoder->next;
+		CloseScaledJpegDecoder(decoder);
+	}
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: DecodeScaledJpegTile *******************************************/
+/*********************************************************************************************************************/
+
+// Decodes the tile at column, row of the level to width x height premultiplied ARGB pixels, where width and height
+// are the tile size divided by 2, 4 or 8. The JPEG decoder scales in its inverse DCT, so the full-size tile is
+// never produced. False if the tile cannot be decoded this way; the caller then takes the full-size path.
+bool DecodeScaledJpegTile(ScaledJpegDecoder* decoder, const TiffLevel* level, INT32 column, INT32 row, INT32 width,
+	INT32 height, uint32_t* target)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	IWICStream* stream = NULL;
+	IWICBitmapDecoder* jpeg = NULL;
+	IWICBitmapFrameDecode* frame = NULL;
+	IWICBitmapSourceTransform* transform = NULL;
+	WICPixelFormatGUID format = GUID_WICPixelFormat24bppBGR;
+	UINT scaledWidth = (UINT)width, scaledHeight = (UINT)height;
+	UINT stride = (UINT)width * 3;
+	IWICImagingFactory* factory;
+	INT64 tile;
+	HRESULT result;
+
+	if (column < 0 || row < 0 || column >= level->columns || row >= level->rows) return false;
+	if ((factory = GetThreadFactory()) == NULL) return false;
+
+	tile = (INT64)row * level->columns + column;
+
+	if (!BuildJpegStream(decoder, level, level->offsets[tile], level->lengths[tile])) return false;
+
+	decoder->pixels.resize((size_t)stride * height);
+
+	//*** Decode through the scaling interface of the JPEG decoder ****************************************************
+	result = factory->CreateStream(&stream);
+
+	if (SUCCEEDED(result)) result = stream->InitializeFromMemory(&decoder->stream[0], (DWORD)decoder->stream.size());
+	if (SUCCEEDED(result)) result = factory->CreateDecoder(GUID_ContainerFormatJpeg, NULL, &jpeg);
+	if (SUCCEEDED(result)) result = jpeg->Initialize(stream, WICDecodeMetadataCacheOnDemand);
+	if (SUCCEEDED(result)) result = jpeg->GetFrame(0, &frame);
+	if (SUCCEEDED(result)) result = frame->QueryInterface(IID_IWICBitmapSourceTransform, (void**)&transform);
+	if (SUCCEEDED(result)) result = transform->GetClosestSize(&scaledWidth, &scaledHeight);
+	if (SUCCEEDED(result) && (scaledWidth != (UINT)width || scaledHeight != (UINT)height)) result = E_FAIL;
+	if (SUCCEEDED(result)) result = transform->GetClosestPixelFormat(&format);
+	if (SUCCEEDED(result) && !IsEqualGUID(format, GUID_WICPixelFormat24bppBGR)) result = E_FAIL;
+	if (SUCCEEDED(result))
+		result = transform->CopyPixels(NULL, width, height, &format, WICBitmapTransformRotate0, stride,
+			(UINT)decoder->pixels.size(), &decoder->pixels[0]);
+
+	if (transform != NULL) transform->Release();
+	if (frame != NULL) frame->Release();
+	if (jpeg != NULL) jpeg->Release();
+	if (stream != NULL) stream->Release();
+
+	if (!SUCCEEDED(result)) return false;
+
+	//*** 24 bit BGR to opaque ARGB ***********************************************************************************
+	for (INT32 i = 0; i < width * height; i++)
+	{
+		const BYTE* pixel = &decoder->pixels[(size_t)i * 3];
+
+		target[i] = 0xFF000000 | ((uint32_t)pixel[2] << 16) | ((uint32_t)pixel[1] << 8) | pixel[0];
+	}
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/**************************************** Funktion: ReleaseThreadJpegFactory *****************************************/
+/*********************************************************************************************************************/
+
+// Called when a thread detaches from the DLL
+void ReleaseThreadJpegFactory()
+{
+	if (threadFactory == NULL) return;
+
+	threadFactory->Release();
+	threadFactory = NULL;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: GetThreadFactory *********************************************/
+/*********************************************************************************************************************/
+
+// A thread that is already in a single-threaded apartment keeps it; WIC works in either
+static IWICImagingFactory* GetThreadFactory()
+{
+	if (threadFactory != NULL) return threadFactory;
+
+	if (!threadCom)
+	{
+		CoInitializeEx(NULL, COINIT_MULTITHREADED);
+		threadCom = true;
+	}
+
+	if (!SUCCEEDED(CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory,
+		(LPVOID*)&threadFactory)))
+		threadFactory = NULL;
+
+	return threadFactory;
+}
+
+
+/*********************************************************************************************************************/
+/***************************************** Funktion: CloseScaledJpegDecoder ******************************************/
+/*********************************************************************************************************************/
+
+static void CloseScaledJpegDecoder(ScaledJpegDecoder* decoder)
+{
+	if (decoder->file != INVALID_HANDLE_VALUE) CloseHandle(decoder->file);
+
+	delete decoder;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: BuildJpegStream *********************************************/
+/*********************************************************************************************************************/
+
+// Reads the tile and makes a complete JPEG stream of it: SVS tiles are abbreviated streams whose tables are stored
+// once in the JPEGTables tag, so the tables go in front of the tile with the end marker of the one and the start
+// marker of the other removed. RGB tiles get an Adobe marker, so the decoder does not convert them from YCbCr.
+static bool BuildJpegStream(ScaledJpegDecoder* decoder, const TiffLevel* level, UINT64 offset, UINT64 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	static const BYTE start[] = { 0xFF, 0xD8 };
+	// APP14 "Adobe", version 100, no flags, transform 0: the components are stored as they are
+	static const BYTE adobe[] = { 0xFF, 0xEE, 0x00, 0x0E,
+		'A', 'd', 'o', 'b', 'e', 0x00, 0x64, 0x00, 0x00, 0x00, 0x00, 0x00 };
+	std::vector<BYTE>& stream = decoder->stream;
+	OVERLAPPED position = { 0 };
+	size_t prefix;
+	DWORD read;
+
+	if (length < 4 || length > JPEG_MAX_TILE_BYTES) return false;
+
+	//*** Start marker and tables *************************************************************************************
+	if (level->jpegTables != NULL && level->jpegTablesLength >= 4)
+		stream.assign(level->jpegTables, level->jpegTables + level->jpegTablesLength - 2);
+	else
+		stream.assign(start, start + 2);
+
+	if (level->photometric == TIFF_PHOTOMETRIC_RGB) stream.insert(stream.begin() + 2, adobe, adobe + sizeof(adobe));
+
+	//*** The tile behind it, without its own start marker ************************************************************
+	prefix = stream.size();
+	stream.resize(prefix + (size_t)length);
+
+	position.Offset = (DWORD)offset;
+	position.OffsetHigh = (DWORD)(offset >> 32);
+
+	if (!ReadFile(decoder->file, &stream[prefix], (DWORD)length, &read, &position) || read != (DWORD)length) return false;
+	if (stream[prefix] != 0xFF || stream[prefix + 1] != 0xD8) return false;
+
+	stream.erase(stream.begin() + prefix, stream.begin() + prefix + 2);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
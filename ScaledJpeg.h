@@ -0,0 +1,43 @@
+/*********************************************************************************************************************/
+/* Datei: ScaledJpeg.h                                                                                               */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Reduced-size decoding of JPEG tiles straight from the file for downsampled reads                   */
+/*********************************************************************************************************************/
+
+#ifndef SCALED_JPEG_H
+#define SCALED_JPEG_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "TiffIndex.h"
+
+struct ScaledJpegDecoder;
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur: ScaledJpegPool **********************************************/
+/*********************************************************************************************************************/
+
+// The decoders of one slide that are not in use, so that its file stays open from one read to the next
+struct ScaledJpegPool
+{
+	SRWLOCK lock;
+	ScaledJpegDecoder* idle;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+bool IsScaledJpegLevel(const TiffLevel* level, INT32 tileWidth, INT32 tileHeight, INT32 factor);
+ScaledJpegDecoder* AcquireScaledJpegDecoder(ScaledJpegPool* pool, const char* path);
+void ReleaseScaledJpegDecoder(ScaledJpegPool* pool, ScaledJpegDecoder* decoder);
+void FreeScaledJpegPool(ScaledJpegPool* pool);
+bool DecodeScaledJpegTile(ScaledJpegDecoder* decoder, const TiffLevel* level, INT32 column, INT32 row, INT32 width,
+	INT32 height, uint32_t* target);
+void ReleaseThreadJpegFactory();
+
+#endif
@@ -13,11 +13,19 @@
 // add reference to OpenSlide libraries
 #include "openslide.h"
 #include "openslide-features.h"
+#include "StainNormalization.h"
+#include "ScaledJpeg.h"
 
 typedef UINT16 uint16;
 typedef UINT32 uint32;
 typedef	INT32 tsize_t;
 
+struct SlidePool;
+struct TiffIndex;
+struct Annotations;
+struct PinnedLevels;
+struct SlideMetadata;
+
 
 /*********************************************************************************************************************/
 /************************************************* Struktur: Session *************************************************/
@@ -43,6 +51,30 @@ struct Session
 	short subX;
 	short subY;
 	INT32 dpi;
+	StainNormalization* stain;
+	SRWLOCK stainLock;
+	volatile LONG stainHash;
+	float stainSource[STAIN_MACENKO + 1][STAIN_PARAMETER_COUNT];
+	bool stainEstimated[STAIN_MACENKO + 1];
+	UINT64 slideId;
+	char* path;
+	SlidePool* pool;
+	// held shared while a read has a handle checked out, exclusive while SetSlideHandlePool replaces the pool
+	SRWLOCK poolLock;
+	TiffIndex* tiff;
+	volatile LONG tiffLoaded;
+	INT64 handle;
+	volatile LONG stage;
+	INT32 openStatus;
+	SRWLOCK stageLock;
+	CONDITION_VARIABLE stageChanged;
+	Annotations* annotations;
+	SRWLOCK annotationLock;
+	ScaledJpegPool jpegPool;
+	PinnedLevels* pinned;
+	// 0 until the levels are pinned, 2 while one thread reads them, 1 once pinned (or nothing could be pinned)
+	volatile LONG pinnedLoaded;
+	SlideMetadata* metadata;
 
 	
 	/*****************************************************************************************************************/
@@ -60,6 +92,28 @@ struct Session
 		labelImageDir=0;
 		macroImageDir=0;
 		baseLayerOffset=0;
+		stain=NULL;
+		InitializeSRWLock(&stainLock);
+		stainHash=0;
+		for (int i = 0; i <= STAIN_MACENKO; i++) stainEstimated[i]=false;
+		slideId=0;
+		path=NULL;
+		pool=NULL;
+		InitializeSRWLock(&poolLock);
+		tiff=NULL;
+		tiffLoaded=0;
+		handle=0;
+		stage=0;
+		openStatus=0;
+		InitializeSRWLock(&stageLock);
+		InitializeConditionVariable(&stageChanged);
+		annotations=NULL;
+		InitializeSRWLock(&annotationLock);
+		InitializeSRWLock(&jpegPool.lock);
+		jpegPool.idle=NULL;
+		pinned=NULL;
+		pinnedLoaded=0;
+		metadata=NULL;
 
 		//*** Referenz auf das Tiffbild bernehmen ********************************************************************
 		slide=img;
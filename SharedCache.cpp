@@ -0,0 +1,472 @@
+/*********************************************************************************************************************/
+/* Datei: SharedCache.cpp                                                                                            */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Tile cache in a named shared memory section, shared by all processes that load the library         */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <sddl.h>
+#include <aclapi.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "SharedCache.h"
+#include "CompressedCache.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define SHARED_CACHE_MAGIC			0x43485653		// "SVHC"
+#define SHARED_CACHE_VERSION		2
+#define SHARED_CACHE_NAME			L"Local\\SVSImageTileCache"
+#define SHARED_CACHE_HEADER_SIZE	4096
+#define SHARED_CACHE_WAYS			8
+#define SHARED_CACHE_SLOT_SIZE		(256 * 256 * 4)
+
+// milliseconds after which a slot still owned by a writer counts as abandoned by a process that died while writing
+#define SHARED_CACHE_ABANDONED		10000
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// Lives at the start of the section. The creating process fills it in and sets ready last.
+struct SharedHeader
+{
+	UINT32 magic;
+	UINT32 version;
+	UINT32 slotSize;
+	UINT32 slotCount;
+	volatile LONG ready;
+	volatile LONG clock;
+};
+
+// One slot per cached tile. seq is a sequence lock: odd while a writer owns the slot, incremented on every change.
+// claimed is the GetTickCount of the last attempt to own the slot, so that a slot left odd can be taken over.
+struct SharedSlot
+{
+	volatile LONG seq;
+	volatile LONG lastUse;
+	volatile LONG claimed;
+	UINT32 length;
+	INT32 level;
+	UINT64 slideId;
+	INT32 x;
+	INT32 y;
+};
+
+// Process-local view of the section; lock only guards attaching and detaching.
+static struct
+{
+	SRWLOCK lock;
+	HANDLE mapping;
+	BYTE* view;
+	SharedHeader* header;
+	SharedSlot* slots;
+	BYTE* data;
+	UINT32 sets;
+	INT64 charged;
+} shared;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static UINT32 SlotSet(UINT64 slideId, INT32 level, INT32 x, INT32 y);
+static void DetachSharedCache();
+static TOKEN_USER* GetProcessUser();
+static bool CreateUserSecurity(const TOKEN_USER* user, SECURITY_ATTRIBUTES* security);
+static bool IsOwnedByUser(HANDLE mapping, const TOKEN_USER* user);
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: SetSharedTileCache ********************************************/
+/*********************************************************************************************************************/
+
+// Creates or attaches the shared cache. The first process decides the size; later processes attach to the existing
+// section and ignore their own size arguments. sizeBytes 0 detaches this process. name NULL uses the default section.
+// Only processes of the same user can open the section, and a section of the name that another user created is not
+// attached to.
+extern "C" __declspec(dllexport) BOOL SetSharedTileCache(wchar_t* name, INT64 sizeBytes, INT32 slotSize)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SECURITY_ATTRIBUTES security;
+	SharedHeader* header;
+	TOKEN_USER* user;
+	UINT64 total;
+	UINT32 slotCount;
+	bool created, owned;
+
+	AcquireSRWLockExclusive(&shared.lock);
+
+	DetachSharedCache();
+
+	if (sizeBytes <= 0)
+	{
+		ReleaseSRWLockExclusive(&shared.lock);
+		return true;
+	}
+
+	if (name == NULL || name[0] == 0) name = SHARED_CACHE_NAME;
+	if (slotSize <= 0) slotSize = SHARED_CACHE_SLOT_SIZE;
+
+	//*** The slot count is a multiple of the associativity ***********************************************************
+	slotCount = (UINT32)(sizeBytes / ((INT64)slotSize + sizeof(SharedSlot)));
+	slotCount -= slotCount % SHARED_CACHE_WAYS;
+
+	if (slotCount == 0)
+	{
+		ReleaseSRWLockExclusive(&shared.lock);
+		return false;
+	}
+
+	total = SHARED_CACHE_HEADER_SIZE + (UINT64)slotCount * sizeof(SharedSlot) + (UINT64)slotCount * slotSize;
+
+	//*** Only the user of this process gets access, so that no other process can inject tile pixels ******************
+	if ((user = GetProcessUser()) == NULL || !CreateUserSecurity(user, &security))
+	{
+		free(user);
+		ReleaseSRWLockExclusive(&shared.lock);
+		return false;
+	}
+
+	//*** Create the section backed by the paging file, or open the one another process created ***********************
+	shared.mapping = CreateFileMappingW(INVALID_HANDLE_VALUE, &security, PAGE_READWRITE, (DWORD)(total >> 32),
+		(DWORD)total, name);
+	created = (shared.mapping != NULL && GetLastError() != ERROR_ALREADY_EXISTS);
+	owned = created || (shared.mapping != NULL && IsOwnedByUser(shared.mapping, user));
+
+	LocalFree(security.lpSecurityDescriptor);
+	free(user);
+
+	if (!owned)
+	{
+		DetachSharedCache();
+		ReleaseSRWLockExclusive(&shared.lock);
+		return false;
+	}
+
+	if (shared.mapping != NULL) shared.view = (BYTE*)MapViewOfFile(shared.mapping, FILE_MAP_ALL_ACCESS, 0, 0, 0);
+
+	if (shared.view == NULL)
+	{
+		DetachSharedCache();
+		ReleaseSRWLockExclusive(&shared.lock);
+		return false;
+	}
+
+	header = (SharedHeader*)shared.view;
+
+	//*** A new section is zero-filled, so only the header has to be written ******************************************
+	if (created)
+	{
+		header->magic = SHARED_CACHE_MAGIC;
+		header->version = SHARED_CACHE_VERSION;
+		header->slotSize = (UINT32)slotSize;
+		header->slotCount = slotCount;
+		header->clock = 0;
+		MemoryBarrier();
+		InterlockedExchange(&header->ready, 1);
+	}
+	else
+	{
+		//*** Wait until the creator has published the layout *********************************************************
+		for (int i = 0; i < 1000 && header->ready == 0; i++) Sleep(1);
+
+		if (header->ready == 0 || header->magic != SHARED_CACHE_MAGIC || header->version != SHARED_CACHE_VERSION)
+		{
+			DetachSharedCache();
+			ReleaseSRWLockExclusive(&shared.lock);
+			return false;
+		}
+	}
+
+	//*** Take the layout from the header *****************************************************************************
+	shared.header = header;
+	shared.slots = (SharedSlot*)(shared.view + SHARED_CACHE_HEADER_SIZE);
+	shared.data = (BYTE*)(shared.slots + header->slotCount);
+	shared.sets = header->slotCount / SHARED_CACHE_WAYS;
+
+	//*** The section exists once, so only the budget of the process that created it is charged **********************
+	if (created)
+		shared.charged = SHARED_CACHE_HEADER_SIZE + (INT64)header->slotCount * (sizeof(SharedSlot) + header->slotSize);
+
+	if (shared.charged > 0 && !ChargeMemory(MEMORY_CACHES, shared.charged))
+	{
+		shared.charged = 0;
+		DetachSharedCache();
+		ReleaseSRWLockExclusive(&shared.lock);
+		return false;
+	}
+
+	ReleaseSRWLockExclusive(&shared.lock);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: SharedCacheLookup ********************************************/
+/*********************************************************************************************************************/
+
+// Lock-free read: the data is copied optimistically and discarded if the sequence of the slot changed meanwhile.
+bool SharedCacheLookup(UINT64 slideId, INT32 level, INT32 x, INT32 y, BYTE* data, UINT32 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SharedSlot* slot;
+	bool found = false;
+	UINT32 set;
+
+	if (shared.header == NULL) return false;
+
+	AcquireSRWLockShared(&shared.lock);
+
+	if (shared.header != NULL && length <= shared.header->slotSize)
+	{
+		set = SlotSet(slideId, level, x, y);
+
+		for (int way = 0; way < SHARED_CACHE_WAYS && !found; way++)
+		{
+			UINT32 index = set * SHARED_CACHE_WAYS + way;
+			LONG seq;
+
+			slot = &shared.slots[index];
+			seq = slot->seq;
+
+			//*** Skip slots that are being written or hold another tile **********************************************
+			if ((seq & 1) != 0 || slot->length != length || slot->slideId != slideId || slot->level != level ||
+				slot->x != x || slot->y != y)
+				continue;
+
+			MemoryBarrier();
+			memcpy(data, shared.data + (UINT64)index * shared.header->slotSize, length);
+			MemoryBarrier();
+
+			//*** Valid only if no writer touched the slot during the copy ********************************************
+			if (slot->seq == seq)
+			{
+				slot->lastUse = InterlockedIncrement(&shared.header->clock);
+				found = true;
+			}
+		}
+	}
+
+	ReleaseSRWLockShared(&shared.lock);
+
+	return found;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: SharedCacheStore *********************************************/
+/*********************************************************************************************************************/
+
+// Replaces the least recently used way of the set. A slot that another writer currently owns is simply skipped, unless
+// it has been owned for SHARED_CACHE_ABANDONED: then its writer died, and the slot is taken over before any other.
+// The tile that is replaced moves down to the compressed tier. Returns whether the tile is in the cache afterwards.
+bool SharedCacheStore(UINT64 slideId, INT32 level, INT32 x, INT32 y, const BYTE* data, UINT32 length)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SharedSlot* victim = NULL;
+	UINT32 victimIndex = 0;
+	LONG victimSeq = 0;
+	LONG claim;
+	UINT32 set;
+	bool stored = false;
+
+	if (shared.header == NULL) return false;
+
+	AcquireSRWLockShared(&shared.lock);
+
+	if (shared.header != NULL && length <= shared.header->slotSize)
+	{
+		set = SlotSet(slideId, level, x, y);
+
+		//*** Find the oldest way, or stop if the tile is already there ***********************************************
+		for (int way = 0; way < SHARED_CACHE_WAYS; way++)
+		{
+			UINT32 index = set * SHARED_CACHE_WAYS + way;
+			SharedSlot* slot = &shared.slots[index];
+			LONG seq = slot->seq;
+
+			if ((seq & 1) != 0)
+			{
+				if (GetTickCount() - (DWORD)slot->claimed < SHARED_CACHE_ABANDONED) continue;
+
+				victim = slot;
+				victimIndex = index;
+				victimSeq = seq;
+				break;
+			}
+
+			if (slot->length == length && slot->slideId == slideId && slot->level == level && slot->x == x && slot->y == y)
+			{
+				victim = NULL;
+				stored = true;
+				break;
+			}
+
+			if (victim == NULL || slot->length == 0 || slot->lastUse - victim->lastUse < 0)
+			{
+				victim = slot;
+				victimIndex = index;
+				victimSeq = seq;
+
+				if (slot->length == 0) break;
+			}
+		}
+
+		//*** Own the slot by making its sequence odd; an abandoned one moves on to the next odd sequence *************
+		claim = ((victimSeq & 1) != 0) ? victimSeq + 2 : victimSeq + 1;
+
+		if (victim != NULL) InterlockedExchange(&victim->claimed, (LONG)GetTickCount());
+
+		if (victim != NULL && InterlockedCompareExchange(&victim->seq, claim, victimSeq) == victimSeq)
+		{
+			//*** The content of an abandoned slot may be torn and is dropped *****************************************
+			if (victim->length != 0 && (victimSeq & 1) == 0)
+				CompressedCacheStore(victim->slideId, victim->level, victim->x, victim->y,
+					shared.data + (UINT64)victimIndex * shared.header->slotSize, victim->length);
+
+			victim->length = length;
+			victim->slideId = slideId;
+			victim->level = level;
+			victim->x = x;
+			victim->y = y;
+			memcpy(shared.data + (UINT64)victimIndex * shared.header->slotSize, data, length);
+			victim->lastUse = InterlockedIncrement(&shared.header->clock);
+
+			//*** Published only if no one took the slot over meanwhile *********************************************
+			MemoryBarrier();
+			stored = (InterlockedCompareExchange(&victim->seq, claim + 1, claim) == claim);
+		}
+	}
+
+	ReleaseSRWLockShared(&shared.lock);
+
+	return stored;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: SlotSet *************************************************/
+/*********************************************************************************************************************/
+
+static UINT32 SlotSet(UINT64 slideId, INT32 level, INT32 x, INT32 y)
+{
+	UINT64 key = slideId ^ ((UINT64)(UINT32)level << 56) ^ ((UINT64)(UINT32)y << 28) ^ (UINT64)(UINT32)x;
+
+	key ^= key >> 33;
+	key *= 0xFF51AFD7ED558CCDULL;
+	key ^= key >> 33;
+
+	return (UINT32)(key % shared.sets);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: GetProcessUser **********************************************/
+/*********************************************************************************************************************/
+
+// The user of the token of this process; freed with free
+static TOKEN_USER* GetProcessUser()
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	TOKEN_USER* user = NULL;
+	DWORD size = 0;
+	HANDLE token;
+
+	if (!OpenProcessToken(GetCurrentProcess(), TOKEN_QUERY, &token)) return NULL;
+
+	GetTokenInformation(token, TokenUser, NULL, 0, &size);
+
+	if (size > 0 && (user = (TOKEN_USER*)malloc(size)) != NULL &&
+		!GetTokenInformation(token, TokenUser, user, size, &size))
+	{
+		free(user);
+		user = NULL;
+	}
+
+	CloseHandle(token);
+
+	//*** Ende ********************************************************************************************************
+	return user;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: CreateUserSecurity ********************************************/
+/*********************************************************************************************************************/
+
+// Security attributes that make the user the owner and give access to nobody else, with a protected DACL that
+// inherits nothing. The descriptor is freed with LocalFree.
+static bool CreateUserSecurity(const TOKEN_USER* user, SECURITY_ATTRIBUTES* security)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	wchar_t descriptor[512];
+	wchar_t* sid;
+
+	if (!ConvertSidToStringSidW(user->User.Sid, &sid)) return false;
+
+	_snwprintf(descriptor, 512, L"O:%sD:P(A;;GA;;;%s)", sid, sid);
+	descriptor[511] = 0;
+	LocalFree(sid);
+
+	security->nLength = sizeof(SECURITY_ATTRIBUTES);
+	security->bInheritHandle = FALSE;
+	security->lpSecurityDescriptor = NULL;
+
+	//*** Ende ********************************************************************************************************
+	return ConvertStringSecurityDescriptorToSecurityDescriptorW(descriptor, SDDL_REVISION_1,
+		&security->lpSecurityDescriptor, NULL) != FALSE;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: IsOwnedByUser **********************************************/
+/*********************************************************************************************************************/
+
+// Whether an existing section was created by the user; CreateUserSecurity makes the user the owner of the sections
+// it creates
+static bool IsOwnedByUser(HANDLE mapping, const TOKEN_USER* user)
+{
+	PSECURITY_DESCRIPTOR descriptor = NULL;
+	PSID owner = NULL;
+	bool owned;
+
+	if (GetSecurityInfo(mapping, SE_KERNEL_OBJECT, OWNER_SECURITY_INFORMATION, &owner, NULL, NULL, NULL,
+		&descriptor) != ERROR_SUCCESS)
+		return false;
+
+	owned = (owner != NULL && EqualSid(owner, user->User.Sid) != FALSE);
+	LocalFree(descriptor);
+
+	return owned;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: DetachSharedCache ********************************************/
+/*********************************************************************************************************************/
+
+static void DetachSharedCache()
+{
+	if (shared.view != NULL) UnmapViewOfFile(shared.view);
+	if (shared.mapping != NULL) CloseHandle(shared.mapping);
+
+	ReleaseMemory(MEMORY_CACHES, shared.charged);
+
+	shared.view = NULL;
+	shared.charged = 0;
+	shared.mapping = NULL;
+	shared.header = NULL;
+	shared.slots = NULL;
+	shared.data = NULL;
+	shared.sets = 0;
+}
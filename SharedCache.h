@@ -0,0 +1,22 @@
+/*********************************************************************************************************************/
+/* Datei: SharedCache.h                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Tile cache in a named shared memory section, shared by all processes that load the library         */
+/*********************************************************************************************************************/
+
+#ifndef SHARED_CACHE_H
+#define SHARED_CACHE_H
+
+#include <windows.h>
+#include <stdint.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+bool SharedCacheLookup(UINT64 slideId, INT32 level, INT32 x, INT32 y, BYTE* data, UINT32 length);
+bool SharedCacheStore(UINT64 slideId, INT32 level, INT32 x, INT32 y, const BYTE* data, UINT32 length);
+
+#endif
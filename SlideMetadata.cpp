@@ -0,0 +1,239 @@
+/*********************************************************************************************************************/
+/* Datei: SlideMetadata.cpp                                                                                          */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Resolution and properties of a slide, parsed once when it is opened                                */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "SlideMetadata.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// TIFF ResolutionUnit
+#define RESOLUTION_UNIT_INCH		2
+#define RESOLUTION_UNIT_CENTIMETER	3
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// The values every source states, collected during the pass over the properties and ranked after it
+struct MetadataSources
+{
+	double openslideMpp[2];
+	double aperioMpp;
+	double descriptionMpp;
+	double tiffResolution[2];
+	INT32 tiffUnit;
+	double openslidePower;
+	double aperioPower;
+	double descriptionPower;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static void ParseProperty(const char* name, const char* value, SlideMetadata* metadata, MetadataSources* sources);
+static void ParseDescription(const char* description, MetadataSources* sources);
+static double ParseNumber(const char* text);
+static double FirstOf(double first, double second, double third);
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: ReadSlideMetadata ********************************************/
+/*********************************************************************************************************************/
+
+// Packs all properties of the slide into one block and picks up the resolution and magnification on the way. The
+// property strings are only read, never copied into temporary strings. NULL if there is no room in the memory budget.
+SlideMetadata* ReadSlideMetadata(openslide_t* slide)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	const char* const* names = openslide_get_property_names(slide);
+	MetadataSources sources;
+	SlideMetadata* metadata;
+	size_t length = 1;
+	INT32 count = 0;
+	char* packed;
+	INT64 size;
+
+	//*** Size of the packed properties *******************************************************************************
+	for (INT32 i = 0; names != NULL && names[i] != NULL; i++)
+	{
+		const char* value = openslide_get_property_value(slide, names[i]);
+
+		length += strlen(names[i]) + 1 + ((value != NULL) ? strlen(value) : 0) + 1;
+		count++;
+	}
+
+	if (length > 0x7FFFFFFF) return NULL;
+
+	size = (INT64)(sizeof(SlideMetadata) + length);
+	if (!ChargeMemory(MEMORY_SESSIONS, size)) return NULL;
+
+	if ((metadata = (SlideMetadata*)calloc(1, (size_t)size)) == NULL)
+	{
+		ReleaseMemory(MEMORY_SESSIONS, size);
+		return NULL;
+	}
+
+	metadata->charged = size;
+	metadata->properties = (char*)(metadata + 1);
+	metadata->propertiesLength = (INT32)length;
+	metadata->propertyCount = count;
+
+	//*** Pack the properties and parse the ones that matter in the same pass *****************************************
+	memset(&sources, 0, sizeof(sources));
+	packed = metadata->properties;
+
+	for (INT32 i = 0; i < count; i++)
+	{
+		const char* value = openslide_get_property_value(slide, names[i]);
+		size_t nameLength = strlen(names[i]);
+		size_t valueLength = (value != NULL) ? strlen(value) : 0;
+
+		memcpy(packed, names[i], nameLength + 1);
+		packed += nameLength + 1;
+
+		if (value != NULL) memcpy(packed, value, valueLength);
+		packed[valueLength] = 0;
+		packed += valueLength + 1;
+
+		if (value != NULL) ParseProperty(names[i], value, metadata, &sources);
+	}
+
+	//*** openslide first, then the Aperio values, then the plain TIFF resolution *************************************
+	metadata->mppX = FirstOf(sources.openslideMpp[0], sources.aperioMpp, sources.descriptionMpp);
+	metadata->mppY = FirstOf(sources.openslideMpp[1], sources.aperioMpp, sources.descriptionMpp);
+
+	if (metadata->mppX == 0 && sources.tiffResolution[0] > 0)
+	{
+		if (sources.tiffUnit == RESOLUTION_UNIT_CENTIMETER) metadata->mppX = 10000 / sources.tiffResolution[0];
+		else if (sources.tiffUnit == RESOLUTION_UNIT_INCH) metadata->mppX = 25400 / sources.tiffResolution[0];
+	}
+
+	if (metadata->mppY == 0 && sources.tiffResolution[1] > 0)
+	{
+		if (sources.tiffUnit == RESOLUTION_UNIT_CENTIMETER) metadata->mppY = 10000 / sources.tiffResolution[1];
+		else if (sources.tiffUnit == RESOLUTION_UNIT_INCH) metadata->mppY = 25400 / sources.tiffResolution[1];
+	}
+
+	if (metadata->mppX == 0) metadata->mppX = metadata->mppY;
+	if (metadata->mppY == 0) metadata->mppY = metadata->mppX;
+
+	metadata->magnification = FirstOf(sources.openslidePower, sources.aperioPower, sources.descriptionPower);
+
+	//*** Dots per inch of level 0 ************************************************************************************
+	metadata->dpi = (INT32)(25400 / ((metadata->mppX > 0) ? metadata->mppX : METADATA_DEFAULT_MPP) + 0.5);
+
+	//*** Ende ********************************************************************************************************
+	return metadata;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: FreeSlideMetadata ********************************************/
+/*********************************************************************************************************************/
+
+void FreeSlideMetadata(SlideMetadata* metadata)
+{
+	if (metadata == NULL) return;
+
+	ReleaseMemory(MEMORY_SESSIONS, metadata->charged);
+	free(metadata);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ParseProperty **********************************************/
+/*********************************************************************************************************************/
+
+static void ParseProperty(const char* name, const char* value, SlideMetadata* metadata, MetadataSources* sources)
+{
+	if (strcmp(name, "openslide.mpp-x") == 0) sources->openslideMpp[0] = ParseNumber(value);
+	else if (strcmp(name, "openslide.mpp-y") == 0) sources->openslideMpp[1] = ParseNumber(value);
+	else if (strcmp(name, "openslide.objective-power") == 0) sources->openslidePower = ParseNumber(value);
+	else if (strcmp(name, "aperio.MPP") == 0) sources->aperioMpp = ParseNumber(value);
+	else if (strcmp(name, "aperio.AppMag") == 0) sources->aperioPower = ParseNumber(value);
+	else if (strcmp(name, "tiff.XResolution") == 0) sources->tiffResolution[0] = ParseNumber(value);
+	else if (strcmp(name, "tiff.YResolution") == 0) sources->tiffResolution[1] = ParseNumber(value);
+	else if (strcmp(name, "tiff.ImageDescription") == 0) ParseDescription(value, sources);
+	else if (strcmp(name, "tiff.ResolutionUnit") == 0)
+	{
+		if (_stricmp(value, "inch") == 0) sources->tiffUnit = RESOLUTION_UNIT_INCH;
+		else if (_stricmp(value, "centimeter") == 0) sources->tiffUnit = RESOLUTION_UNIT_CENTIMETER;
+		else sources->tiffUnit = atoi(value);
+	}
+	else if (strcmp(name, "openslide.vendor") == 0)
+	{
+		strncpy(metadata->vendor, value, METADATA_VENDOR_LENGTH - 1);
+	}
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: ParseDescription *********************************************/
+/*********************************************************************************************************************/
+
+// Walks the fields of an Aperio description once: a header line followed by "key = value" fields separated by '|'.
+// Other descriptions have no such fields and leave the sources alone.
+static void ParseDescription(const char* description, MetadataSources* sources)
+{
+	const char* field = strchr(description, '|');
+
+	while (field != NULL)
+	{
+		const char* key = field + 1;
+		const char* end = key;
+		size_t keyLength;
+
+		//*** The key ends at the first blank or '=' ******************************************************************
+		while (*end != 0 && *end != '|' && *end != '=' && *end != ' ') end++;
+		keyLength = end - key;
+
+		while (*end == ' ' || *end == '=') end++;
+
+		if (keyLength == 3 && strncmp(key, "MPP", 3) == 0) sources->descriptionMpp = ParseNumber(end);
+		else if (keyLength == 6 && strncmp(key, "AppMag", 6) == 0) sources->descriptionPower = ParseNumber(end);
+
+		//*** On to the next separator ********************************************************************************
+		while (*end != 0 && *end != '|') end++;
+		field = (*end == '|') ? end : NULL;
+	}
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: ParseNumber ***********************************************/
+/*********************************************************************************************************************/
+
+// The number at the start of text, which may be followed by anything; 0 if there is none or it is not positive
+static double ParseNumber(const char* text)
+{
+	char* end;
+	double value = strtod(text, &end);
+
+	return (end != text && value > 0) ? value : 0;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: FirstOf *************************************************/
+/*********************************************************************************************************************/
+
+static double FirstOf(double first, double second, double third)
+{
+	if (first > 0) return first;
+	if (second > 0) return second;
+
+	return third;
+}
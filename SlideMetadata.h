@@ -0,0 +1,55 @@
+/*********************************************************************************************************************/
+/* Datei: SlideMetadata.h                                                                                            */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Resolution and properties of a slide, parsed once when it is opened                                */
+/*********************************************************************************************************************/
+
+#ifndef SLIDE_METADATA_H
+#define SLIDE_METADATA_H
+
+#include <windows.h>
+
+#include "openslide.h"
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define METADATA_VENDOR_LENGTH		32
+
+// micrometres per pixel assumed for a slide that states no resolution (the scanners of the Camelyon16 slides)
+#define METADATA_DEFAULT_MPP		0.243094
+
+
+/*********************************************************************************************************************/
+/********************************************** Struktur: SlideMetadata **********************************************/
+/*********************************************************************************************************************/
+
+// mppX, mppY (micrometres per level 0 pixel) and magnification are 0 if the slide does not state them; dpi is derived
+// from mppX, or from METADATA_DEFAULT_MPP without it
+struct SlideMetadata
+{
+	double mppX;
+	double mppY;
+	double magnification;
+	INT32 dpi;
+	char vendor[METADATA_VENDOR_LENGTH];
+
+	// all properties as name\0value\0 pairs one after the other, followed by one more \0; lives behind the structure
+	char* properties;
+	INT32 propertiesLength;
+	INT32 propertyCount;
+	INT64 charged;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+SlideMetadata* ReadSlideMetadata(openslide_t* slide);
+void FreeSlideMetadata(SlideMetadata* metadata);
+
+#endif
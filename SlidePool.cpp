@@ -0,0 +1,217 @@
+/*********************************************************************************************************************/
+/* Datei: SlidePool.cpp                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Pool of openslide handles to the same file, checked out for every read                             */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+
+#include "SlidePool.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+static struct
+{
+	SRWLOCK lock;
+	SlidePool* first;
+	volatile LONG registered;
+} pools = { SRWLOCK_INIT, NULL, 0 };
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static INT64 TrimSlidePools(INT64 bytes);
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: CreateSlidePool *********************************************/
+/*********************************************************************************************************************/
+
+// Opens count - 1 additional handles to path next to the primary one. Returns NULL if not a single additional
+// handle could be opened, in which case the session keeps reading through its primary handle only. The caches of the
+// additional handles count as caches of the memory budget: the pool stops growing when they do not fit, and the
+// budget closes idle ones when it needs the memory.
+SlidePool* CreateSlidePool(openslide_t* primary, const char* path, INT32 count)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SlidePool* pool;
+
+	if (count < 2 || path == NULL) return NULL;
+
+	pool = new SlidePool();
+	InitializeSRWLock(&pool->lock);
+	InitializeConditionVariable(&pool->available);
+
+	pool->handles = (openslide_t**)calloc(count, sizeof(openslide_t*));
+	pool->idle = (openslide_t**)calloc(count, sizeof(openslide_t*));
+
+	if (pool->handles == NULL || pool->idle == NULL)
+	{
+		FreeSlidePool(pool);
+		return NULL;
+	}
+
+	//*** The primary handle is part of the pool **********************************************************************
+	pool->handles[0] = primary;
+	pool->count = 1;
+
+	//*** Open the additional handles; every one of them parses the file on its own ***********************************
+	if (InterlockedExchange(&pools.registered, 1) == 0) RegisterMemoryShedder(MEMORY_CACHES, TrimSlidePools);
+
+	for (INT32 i = 1; i < count; i++)
+	{
+		openslide_t* slide;
+
+		if (!ChargeMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE)) break;
+
+		if ((slide = openslide_open(path)) == NULL)
+		{
+			ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+			break;
+		}
+
+		pool->handles[pool->count++] = slide;
+	}
+
+	if (pool->count < 2)
+	{
+		FreeSlidePool(pool);
+		return NULL;
+	}
+
+	for (INT32 i = 0; i < pool->count; i++) pool->idle[i] = pool->handles[i];
+	pool->idleCount = pool->count;
+
+	AcquireSRWLockExclusive(&pools.lock);
+	pool->next = pools.first;
+	pools.first = pool;
+	ReleaseSRWLockExclusive(&pools.lock);
+
+	return pool;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: FreeSlidePool **********************************************/
+/*********************************************************************************************************************/
+
+// All handles must have been released; the primary handle stays open.
+void FreeSlidePool(SlidePool* pool)
+{
+	if (pool == NULL) return;
+
+	//*** Withdraw it from the budget first, so that no shedder works on it any more **********************************
+	AcquireSRWLockExclusive(&pools.lock);
+
+	for (SlidePool** link = &pools.first; *link != NULL; link = &(*link)->next)
+	{
+		if (*link == pool)
+		{
+			*link = pool->next;
+			break;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&pools.lock);
+
+	for (INT32 i = 1; i < pool->count; i++)
+	{
+		openslide_close(pool->handles[i]);
+		ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+	}
+
+	free(pool->handles);
+	free(pool->idle);
+	delete pool;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: AcquireSlide ***********************************************/
+/*********************************************************************************************************************/
+
+// Checks out an idle handle and blocks while all handles are in use.
+openslide_t* AcquireSlide(SlidePool* pool)
+{
+	openslide_t* slide;
+
+	AcquireSRWLockExclusive(&pool->lock);
+
+	while (pool->idleCount == 0) SleepConditionVariableSRW(&pool->available, &pool->lock, INFINITE, 0);
+
+	slide = pool->idle[--pool->idleCount];
+
+	ReleaseSRWLockExclusive(&pool->lock);
+
+	return slide;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ReleaseSlide ***********************************************/
+/*********************************************************************************************************************/
+
+void ReleaseSlide(SlidePool* pool, openslide_t* slide)
+{
+	AcquireSRWLockExclusive(&pool->lock);
+
+	pool->idle[pool->idleCount++] = slide;
+
+	ReleaseSRWLockExclusive(&pool->lock);
+
+	WakeConditionVariable(&pool->available);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: TrimSlidePools **********************************************/
+/*********************************************************************************************************************/
+
+// Shedder of the memory budget: closes idle additional handles, which gives up their openslide caches. The primary
+// handle of a session stays open, so every pool can still be read through it.
+static INT64 TrimSlidePools(INT64 bytes)
+{
+	INT64 freed = 0;
+
+	AcquireSRWLockShared(&pools.lock);
+
+	for (SlidePool* pool = pools.first; pool != NULL && freed < bytes; pool = pool->next)
+	{
+		AcquireSRWLockExclusive(&pool->lock);
+
+		for (INT32 i = pool->idleCount - 1; i >= 0 && freed < bytes; i--)
+		{
+			openslide_t* slide = pool->idle[i];
+
+			if (slide == pool->handles[0]) continue;
+
+			//*** Take it out of both lists ***************************************************************************
+			pool->idle[i] = pool->idle[--pool->idleCount];
+
+			for (INT32 j = 1; j < pool->count; j++)
+			{
+				if (pool->handles[j] == slide)
+				{
+					pool->handles[j] = pool->handles[--pool->count];
+					break;
+				}
+			}
+
+			openslide_close(slide);
+			ReleaseMemory(MEMORY_CACHES, OPENSLIDE_CACHE_SIZE);
+			freed += OPENSLIDE_CACHE_SIZE;
+		}
+
+		ReleaseSRWLockExclusive(&pool->lock);
+	}
+
+	ReleaseSRWLockShared(&pools.lock);
+
+	return freed;
+}
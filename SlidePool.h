@@ -0,0 +1,55 @@
+/*********************************************************************************************************************/
+/* Datei: SlidePool.h                                                                                                */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Pool of openslide handles to the same file, checked out for every read                             */
+/*********************************************************************************************************************/
+
+#ifndef SLIDE_POOL_H
+#define SLIDE_POOL_H
+
+#include <windows.h>
+
+#include "openslide.h"
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// openslide keeps a tile cache of this size in every handle; it is charged to the memory budget with the handle
+#define OPENSLIDE_CACHE_SIZE		(32 * 1024 * 1024)
+
+
+/*********************************************************************************************************************/
+/********************************************** Struktur: SlidePool **************************************************/
+/*********************************************************************************************************************/
+
+struct SlidePool
+{
+	SRWLOCK lock;
+	CONDITION_VARIABLE available;
+
+	// handles[0] is the primary handle of the session and is not closed by the pool
+	openslide_t** handles;
+	INT32 count;
+
+	// stack of the handles that are currently not in use
+	openslide_t** idle;
+	INT32 idleCount;
+
+	// all pools, so that the memory budget can close idle additional handles
+	SlidePool* next;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+SlidePool* CreateSlidePool(openslide_t* primary, const char* path, INT32 count);
+void FreeSlidePool(SlidePool* pool);
+openslide_t* AcquireSlide(SlidePool* pool);
+void ReleaseSlide(SlidePool* pool, openslide_t* slide);
+
+#endif
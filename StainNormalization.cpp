@@ -0,0 +1,686 @@
+/*********************************************************************************************************************/
+/* Datei: StainNormalization.cpp                                                                                     */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Reinhard / Macenko stain normalization applied while copying tiles out of the read buffer          */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <math.h>
+#include <algorithm>
+#include <vector>
+
+#include "StainNormalization.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// the level used for the estimation is the largest one below this pixel count
+#define STAIN_SAMPLE_LEVEL_PIXELS	(4 * 1024 * 1024)
+
+// upper bound for the number of optical density samples kept for the Macenko estimation
+#define STAIN_MAX_OD_SAMPLES		(1024 * 1024)
+
+// rows read from the sample level per openslide_read_region call
+#define STAIN_BAND_HEIGHT			256
+
+// Macenko: background intensity, OD threshold for tissue and the percentile for the robust extreme angles
+#define MACENKO_IO					240.0f
+#define MACENKO_BETA				0.15f
+#define MACENKO_ALPHA				1.0f
+
+// Reinhard: pixels brighter than this in every channel are treated as background
+#define REINHARD_WHITE				220
+
+// Macenko reference stain vectors and maximum concentrations
+static const float MacenkoReference[STAIN_PARAMETER_COUNT] =
+{
+	0.5626f, 0.7201f, 0.4062f,
+	0.2159f, 0.8012f, 0.5581f,
+	1.9705f, 1.0308f
+};
+
+// RGB -> LMS and LMS -> RGB (Reinhard et al., "Color Transfer between Images")
+static const float RgbToLms[3][3] =
+{
+	{ 0.3811f, 0.5783f, 0.0402f },
+	{ 0.1967f, 0.7244f, 0.0782f },
+	{ 0.0241f, 0.1288f, 0.8444f }
+};
+
+static const float LmsToRgb[3][3] =
+{
+	{ 4.4679f, -3.5873f, 0.1193f },
+	{ -1.2186f, 2.3809f, -0.1624f },
+	{ 0.0497f, -0.2439f, 1.2045f }
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static void RgbToLab(float r, float g, float b, float* lab);
+static void LabToRgb(const float* lab, float* rgb);
+static void MacenkoMatrix(const float* source, const float* target, float m[3][3]);
+static void EigenSymmetric3(double a[3][3], double vectors[3][3], double values[3]);
+static int SelectSampleLevel(openslide_t* slide);
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: ForEachSamplePixel ********************************************/
+/*********************************************************************************************************************/
+
+// Calls visit(r, g, b) for every opaque pixel of the estimation level, reading the level in horizontal bands
+template <typename Visitor> static bool ForEachSamplePixel(openslide_t* slide, int stride, Visitor& visit)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	int64_t width, height;
+	uint32_t* band;
+	double downsample;
+	int level;
+	int64_t index = 0;
+
+	//*** Determine the level and its size ****************************************************************************
+	level = SelectSampleLevel(slide);
+	openslide_get_level_dimensions(slide, level, &width, &height);
+	downsample = openslide_get_level_downsample(slide, level);
+
+	if (width <= 0 || height <= 0) return false;
+
+	//*** Allocate one band *******************************************************************************************
+	if ((band = (uint32_t*)malloc((size_t)width * STAIN_BAND_HEIGHT * sizeof(uint32_t))) == NULL) return false;
+
+	//*** For all bands ***********************************************************************************************
+	for (int64_t y = 0; y < height; y += STAIN_BAND_HEIGHT)
+	{
+		int64_t rows = (height - y < STAIN_BAND_HEIGHT) ? height - y : STAIN_BAND_HEIGHT;
+
+		//*** The coordinates of openslide_read_region are level-0 coordinates ****************************************
+		openslide_read_region(slide, band, 0, (int64_t)(y * downsample), level, width, rows);
+
+		if (openslide_get_error(slide) != NULL)
+		{
+			free(band);
+			return false;
+		}
+
+		for (int64_t i = 0; i < width * rows; i++, index++)
+		{
+			uint32_t p = band[i];
+
+			if ((index % stride) != 0 || (p >> 24) != 0xFF) continue;
+
+			visit((int)((p >> 16) & 0xFF), (int)((p >> 8) & 0xFF), (int)(p & 0xFF));
+		}
+	}
+
+	free(band);
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Struktur: ReinhardAccumulator *******************************************/
+/*********************************************************************************************************************/
+
+struct ReinhardAccumulator
+{
+	double sum[3];
+	double squares[3];
+	int64_t count;
+
+	ReinhardAccumulator()
+	{
+		for (int c = 0; c < 3; c++) sum[c] = squares[c] = 0;
+		count = 0;
+	}
+
+	void operator()(int r, int g, int b)
+	{
+		float lab[3];
+
+		//*** Skip the background *************************************************************************************
+		if (r >= REINHARD_WHITE && g >= REINHARD_WHITE && b >= REINHARD_WHITE) return;
+
+		RgbToLab((float)r, (float)g, (float)b, lab);
+
+		for (int c = 0; c < 3; c++)
+		{
+			sum[c] += lab[c];
+			squares[c] += (double)lab[c] * lab[c];
+		}
+		count++;
+	}
+};
+
+
+/*********************************************************************************************************************/
+/******************************************* Struktur: MacenkoAccumulator ********************************************/
+/*********************************************************************************************************************/
+
+struct MacenkoAccumulator
+{
+	std::vector<float> od;
+
+	void operator()(int r, int g, int b)
+	{
+		float odR = -logf((r + 1) / MACENKO_IO);
+		float odG = -logf((g + 1) / MACENKO_IO);
+		float odB = -logf((b + 1) / MACENKO_IO);
+
+		//*** Only pixels with enough absorption in every channel count as tissue *************************************
+		if (odR < MACENKO_BETA || odG < MACENKO_BETA || odB < MACENKO_BETA) return;
+
+		od.push_back(odR);
+		od.push_back(odG);
+		od.push_back(odB);
+	}
+};
+
+
+/*********************************************************************************************************************/
+/***************************************** Funktion: EstimateStainParameters *****************************************/
+/*********************************************************************************************************************/
+
+bool EstimateStainParameters(openslide_t* slide, INT32 method, float* params)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	int64_t width, height;
+	int stride;
+
+	//*** Keep the number of visited pixels bounded *******************************************************************
+	openslide_get_level_dimensions(slide, SelectSampleLevel(slide), &width, &height);
+	stride = (int)(width * height / STAIN_MAX_OD_SAMPLES) + 1;
+
+	for (int i = 0; i < STAIN_PARAMETER_COUNT; i++) params[i] = 0;
+
+	//*** Reinhard: mean and standard deviation in l-alpha-beta space *************************************************
+	if (method == STAIN_REINHARD)
+	{
+		ReinhardAccumulator acc;
+
+		if (!ForEachSamplePixel(slide, stride, acc) || acc.count == 0) return false;
+
+		for (int c = 0; c < 3; c++)
+		{
+			double mean = acc.sum[c] / acc.count;
+			double variance = acc.squares[c] / acc.count - mean * mean;
+
+			params[c] = (float)mean;
+			params[3 + c] = (float)sqrt(variance > 0 ? variance : 0);
+		}
+
+		return true;
+	}
+
+	//*** Macenko: stain vectors from the extreme angles in the plane of the two main OD directions *******************
+	if (method == STAIN_MACENKO)
+	{
+		MacenkoAccumulator acc;
+		double cov[3][3] = { { 0 } };
+		double mean[3] = { 0 };
+		double vectors[3][3], values[3];
+		double e1[3], e2[3], vMin[3], vMax[3];
+		std::vector<float> angles;
+		std::vector<float> concentrationH, concentrationE;
+		size_t count;
+		int first, second;
+
+		if (!ForEachSamplePixel(slide, stride, acc)) return false;
+
+		count = acc.od.size() / 3;
+		if (count < 16) return false;
+
+		//*** Covariance of the optical densities *********************************************************************
+		for (size_t i = 0; i < count; i++)
+			for (int c = 0; c < 3; c++) mean[c] += acc.od[i * 3 + c];
+
+		for (int c = 0; c < 3; c++) mean[c] /= count;
+
+		for (size_t i = 0; i < count; i++)
+		{
+			for (int r = 0; r < 3; r++)
+				for (int c = 0; c < 3; c++)
+					cov[r][c] += (acc.od[i * 3 + r] - mean[r]) * (acc.od[i * 3 + c] - mean[c]);
+		}
+
+		//*** The two eigenvectors with the largest eigenvalues span the stain plane **********************************
+		EigenSymmetric3(cov, vectors, values);
+
+		first = 0;
+		for (int k = 1; k < 3; k++) if (values[k] > values[first]) first = k;
+		second = (first == 0) ? 1 : 0;
+		for (int k = 0; k < 3; k++) if (k != first && values[k] > values[second]) second = k;
+
+		for (int c = 0; c < 3; c++)
+		{
+			e1[c] = vectors[c][first];
+			e2[c] = vectors[c][second];
+		}
+
+		//*** Orient both vectors into the positive OD octant *********************************************************
+		if (e1[0] + e1[1] + e1[2] < 0) for (int c = 0; c < 3; c++) e1[c] = -e1[c];
+		if (e2[0] + e2[1] + e2[2] < 0) for (int c = 0; c < 3; c++) e2[c] = -e2[c];
+
+		//*** Angle of every sample inside the plane ******************************************************************
+		angles.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			const float* od = &acc.od[i * 3];
+			double t1 = od[0] * e1[0] + od[1] * e1[1] + od[2] * e1[2];
+			double t2 = od[0] * e2[0] + od[1] * e2[1] + od[2] * e2[2];
+
+			angles[i] = (float)atan2(t2, t1);
+		}
+
+		//*** Robust extremes of the angle distribution ***************************************************************
+		size_t low = (size_t)(count * MACENKO_ALPHA / 100.0);
+		size_t high = (size_t)(count * (100.0 - MACENKO_ALPHA) / 100.0);
+		if (high >= count) high = count - 1;
+
+		std::nth_element(angles.begin(), angles.begin() + low, angles.end());
+		double minPhi = angles[low];
+		std::nth_element(angles.begin(), angles.begin() + high, angles.end());
+		double maxPhi = angles[high];
+
+		for (int c = 0; c < 3; c++)
+		{
+			vMin[c] = e1[c] * cos(minPhi) + e2[c] * sin(minPhi);
+			vMax[c] = e1[c] * cos(maxPhi) + e2[c] * sin(maxPhi);
+		}
+
+		//*** Haematoxylin is the vector with the larger red component ************************************************
+		const double* h = (vMin[0] > vMax[0]) ? vMin : vMax;
+		const double* e = (vMin[0] > vMax[0]) ? vMax : vMin;
+
+		for (int c = 0; c < 3; c++)
+		{
+			params[c] = (float)h[c];
+			params[3 + c] = (float)e[c];
+		}
+
+		//*** Concentrations by least squares and their 99th percentiles **********************************************
+		double pinv[2][3];
+		double hh = 0, he = 0, ee = 0;
+		for (int c = 0; c < 3; c++)
+		{
+			hh += h[c] * h[c];
+			he += h[c] * e[c];
+			ee += e[c] * e[c];
+		}
+
+		double det = hh * ee - he * he;
+		if (fabs(det) < 1e-12) return false;
+
+		for (int c = 0; c < 3; c++)
+		{
+			pinv[0][c] = (ee * h[c] - he * e[c]) / det;
+			pinv[1][c] = (hh * e[c] - he * h[c]) / det;
+		}
+
+		concentrationH.resize(count);
+		concentrationE.resize(count);
+		for (size_t i = 0; i < count; i++)
+		{
+			const float* od = &acc.od[i * 3];
+
+			concentrationH[i] = (float)(pinv[0][0] * od[0] + pinv[0][1] * od[1] + pinv[0][2] * od[2]);
+			concentrationE[i] = (float)(pinv[1][0] * od[0] + pinv[1][1] * od[1] + pinv[1][2] * od[2]);
+		}
+
+		high = (size_t)(count * 0.99);
+		if (high >= count) high = count - 1;
+
+		std::nth_element(concentrationH.begin(), concentrationH.begin() + high, concentrationH.end());
+		std::nth_element(concentrationE.begin(), concentrationE.begin() + high, concentrationE.end());
+
+		params[6] = concentrationH[high];
+		params[7] = concentrationE[high];
+
+		return params[6] > 0 && params[7] > 0;
+	}
+
+	return false;
+}
+
+
+/*********************************************************************************************************************/
+/**************************************** Funktion: CreateStainNormalization *****************************************/
+/*********************************************************************************************************************/
+
+StainNormalization* CreateStainNormalization(INT32 method, const float* source, const float* target)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	StainNormalization* stain;
+	float macenko[3][3];
+	BYTE* node;
+
+	if (method != STAIN_REINHARD && method != STAIN_MACENKO) return NULL;
+
+	//*** Reinhard needs an explicit target, Macenko falls back to the usual reference stains *************************
+	if (target == NULL)
+	{
+		if (method == STAIN_REINHARD) return NULL;
+		target = MacenkoReference;
+	}
+
+	stain = new StainNormalization();
+	stain->method = method;
+	for (int i = 0; i < STAIN_PARAMETER_COUNT; i++)
+	{
+		stain->source[i] = source[i];
+		stain->target[i] = target[i];
+	}
+
+	//*** Allocate the lookup table ***********************************************************************************
+	if (!ChargeMemory(MEMORY_SESSIONS, STAIN_LUT_SIZE))
+	{
+		delete stain;
+		return NULL;
+	}
+
+	if ((stain->lut = (BYTE*)malloc(STAIN_LUT_SIZE)) == NULL)
+	{
+		ReleaseMemory(MEMORY_SESSIONS, STAIN_LUT_SIZE);
+		delete stain;
+		return NULL;
+	}
+
+	if (method == STAIN_MACENKO) MacenkoMatrix(source, target, macenko);
+
+	//*** Sample the exact transform on the grid **********************************************************************
+	node = stain->lut;
+	for (int ri = 0; ri < STAIN_LUT_NODES; ri++)
+	{
+		for (int gi = 0; gi < STAIN_LUT_NODES; gi++)
+		{
+			for (int bi = 0; bi < STAIN_LUT_NODES; bi++, node += 3)
+			{
+				float in[3] = { (float)(ri * 8), (float)(gi * 8), (float)(bi * 8) };
+				float out[3];
+
+				if (method == STAIN_REINHARD)
+				{
+					float lab[3];
+
+					RgbToLab(in[0], in[1], in[2], lab);
+
+					for (int c = 0; c < 3; c++)
+					{
+						float sd = (source[3 + c] > 1e-6f) ? source[3 + c] : 1e-6f;
+						lab[c] = (lab[c] - source[c]) / sd * target[3 + c] + target[c];
+					}
+
+					LabToRgb(lab, out);
+				}
+				else
+				{
+					float od[3];
+
+					for (int c = 0; c < 3; c++) od[c] = -logf((in[c] + 1) / MACENKO_IO);
+
+					for (int c = 0; c < 3; c++)
+					{
+						float v = macenko[c][0] * od[0] + macenko[c][1] * od[1] + macenko[c][2] * od[2];
+						out[c] = MACENKO_IO * expf(-v);
+					}
+				}
+
+				//*** Store as B, G, R ********************************************************************************
+				for (int c = 0; c < 3; c++)
+				{
+					float v = out[2 - c] + 0.5f;
+					node[c] = (BYTE)(v < 0 ? 0 : (v > 255 ? 255 : v));
+				}
+			}
+		}
+	}
+
+	return stain;
+}
+
+
+/*********************************************************************************************************************/
+/***************************************** Funktion: FreeStainNormalization ******************************************/
+/*********************************************************************************************************************/
+
+void FreeStainNormalization(StainNormalization* stain)
+{
+	if (stain == NULL) return;
+
+	free(stain->lut);
+	ReleaseMemory(MEMORY_SESSIONS, STAIN_LUT_SIZE);
+	delete stain;
+}
+
+
+/*********************************************************************************************************************/
+/***************************************** Funktion: HashStainNormalization ******************************************/
+/*********************************************************************************************************************/
+
+// FNV-1a over method and parameters; 0 only without normalization, so the value tells the output of two tables apart
+UINT32 HashStainNormalization(const StainNormalization* stain)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	const BYTE* bytes;
+	UINT32 hash = 2166136261u;
+
+	if (stain == NULL) return 0;
+
+	hash = (hash ^ (UINT32)stain->method) * 16777619u;
+
+	bytes = (const BYTE*)stain->source;
+	for (size_t i = 0; i < sizeof(stain->source); i++) hash = (hash ^ bytes[i]) * 16777619u;
+
+	bytes = (const BYTE*)stain->target;
+	for (size_t i = 0; i < sizeof(stain->target); i++) hash = (hash ^ bytes[i]) * 16777619u;
+
+	//*** Ende ********************************************************************************************************
+	return (hash != 0) ? hash : 1;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: CopyTileNormalized ********************************************/
+/*********************************************************************************************************************/
+
+// Copies premultiplied ARGB pixels from src to dst and maps every opaque pixel through the trilinear lookup table.
+void CopyTileNormalized(const StainNormalization* stain, const uint32_t* src, BYTE* dst, int pixels)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	const int strideG = STAIN_LUT_NODES * 3;
+	const int strideR = STAIN_LUT_NODES * STAIN_LUT_NODES * 3;
+	const BYTE* lut = stain->lut;
+	uint32_t* out = (uint32_t*)dst;
+	uint32_t lastIn = 0, lastOut = 0;
+
+	for (int i = 0; i < pixels; i++)
+	{
+		uint32_t p = src[i];
+
+		//*** Transparent or partially covered pixels are passed through unchanged ************************************
+		if ((p >> 24) != 0xFF)
+		{
+			out[i] = p;
+			continue;
+		}
+
+		//*** Background and flat areas repeat the same colour over long runs *****************************************
+		if (p == lastIn && i > 0)
+		{
+			out[i] = lastOut;
+			continue;
+		}
+
+		int r = (p >> 16) & 0xFF, g = (p >> 8) & 0xFF, b = p & 0xFF;
+		int fr = r & 7, fg = g & 7, fb = b & 7;
+		const BYTE* n = lut + (r >> 3) * strideR + (g >> 3) * strideG + (b >> 3) * 3;
+		uint32_t result = 0xFF000000;
+
+		for (int c = 0; c < 3; c++)
+		{
+			// interpolate along b, then g, then r; the weights are in 1/8 steps
+			int c00 = n[c] * (8 - fb) + n[c + 3] * fb;
+			int c01 = n[c + strideG] * (8 - fb) + n[c + strideG + 3] * fb;
+			int c10 = n[c + strideR] * (8 - fb) + n[c + strideR + 3] * fb;
+			int c11 = n[c + strideR + strideG] * (8 - fb) + n[c + strideR + strideG + 3] * fb;
+			int c0 = c00 * (8 - fg) + c01 * fg;
+			int c1 = c10 * (8 - fg) + c11 * fg;
+			int v = (c0 * (8 - fr) + c1 * fr + 256) >> 9;
+
+			result |= (uint32_t)v << (8 * c);
+		}
+
+		out[i] = result;
+		lastIn = p;
+		lastOut = result;
+	}
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: SelectSampleLevel ********************************************/
+/*********************************************************************************************************************/
+
+static int SelectSampleLevel(openslide_t* slide)
+{
+	int levels = openslide_get_level_count(slide);
+
+	//*** From the finest to the coarsest level, take the first one that is small enough ******************************
+	for (int level = 0; level < levels; level++)
+	{
+		int64_t w, h;
+
+		openslide_get_level_dimensions(slide, level, &w, &h);
+		if (w * h <= STAIN_SAMPLE_LEVEL_PIXELS) return level;
+	}
+
+	return levels - 1;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: RgbToLab *************************************************/
+/*********************************************************************************************************************/
+
+static void RgbToLab(float r, float g, float b, float* lab)
+{
+	float lms[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		float v = RgbToLms[i][0] * r + RgbToLms[i][1] * g + RgbToLms[i][2] * b;
+		lms[i] = log10f(v < 1.0f ? 1.0f : v);
+	}
+
+	lab[0] = (lms[0] + lms[1] + lms[2]) / sqrtf(3.0f);
+	lab[1] = (lms[0] + lms[1] - 2 * lms[2]) / sqrtf(6.0f);
+	lab[2] = (lms[0] - lms[1]) / sqrtf(2.0f);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: LabToRgb *************************************************/
+/*********************************************************************************************************************/
+
+static void LabToRgb(const float* lab, float* rgb)
+{
+	float l = lab[0] / sqrtf(3.0f), a = lab[1] / sqrtf(6.0f), b = lab[2] / sqrtf(2.0f);
+	float lms[3];
+
+	lms[0] = powf(10.0f, l + a + b);
+	lms[1] = powf(10.0f, l + a - b);
+	lms[2] = powf(10.0f, l - 2 * a);
+
+	for (int i = 0; i < 3; i++)
+		rgb[i] = LmsToRgb[i][0] * lms[0] + LmsToRgb[i][1] * lms[1] + LmsToRgb[i][2] * lms[2];
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: MacenkoMatrix **********************************************/
+/*********************************************************************************************************************/
+
+// OD_target = HE_target * diag(maxC_target / maxC_source) * pinv(HE_source) * OD_source
+static void MacenkoMatrix(const float* source, const float* target, float m[3][3])
+{
+	const float* h = source;
+	const float* e = source + 3;
+	double hh = 0, he = 0, ee = 0, det;
+	double pinv[2][3];
+
+	for (int c = 0; c < 3; c++)
+	{
+		hh += h[c] * h[c];
+		he += h[c] * e[c];
+		ee += e[c] * e[c];
+	}
+
+	det = hh * ee - he * he;
+	if (fabs(det) < 1e-12) det = 1e-12;
+
+	for (int c = 0; c < 3; c++)
+	{
+		pinv[0][c] = (ee * h[c] - he * e[c]) / det * target[6] / source[6];
+		pinv[1][c] = (hh * e[c] - he * h[c]) / det * target[7] / source[7];
+	}
+
+	for (int r = 0; r < 3; r++)
+		for (int c = 0; c < 3; c++)
+			m[r][c] = (float)(target[r] * pinv[0][c] + target[3 + r] * pinv[1][c]);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: EigenSymmetric3 *********************************************/
+/*********************************************************************************************************************/
+
+// Cyclic Jacobi rotations; the eigenvectors are returned as the columns of vectors.
+static void EigenSymmetric3(double a[3][3], double vectors[3][3], double values[3])
+{
+	for (int r = 0; r < 3; r++)
+		for (int c = 0; c < 3; c++) vectors[r][c] = (r == c) ? 1.0 : 0.0;
+
+	for (int sweep = 0; sweep < 50; sweep++)
+	{
+		double off = a[0][1] * a[0][1] + a[0][2] * a[0][2] + a[1][2] * a[1][2];
+		if (off < 1e-20) break;
+
+		for (int p = 0; p < 2; p++)
+		{
+			for (int q = p + 1; q < 3; q++)
+			{
+				if (fabs(a[p][q]) < 1e-30) continue;
+
+				double theta = (a[q][q] - a[p][p]) / (2 * a[p][q]);
+				double t = ((theta >= 0) ? 1.0 : -1.0) / (fabs(theta) + sqrt(theta * theta + 1));
+				double c = 1 / sqrt(t * t + 1);
+				double s = t * c;
+
+				for (int k = 0; k < 3; k++)
+				{
+					double akp = a[k][p], akq = a[k][q];
+					a[k][p] = c * akp - s * akq;
+					a[k][q] = s * akp + c * akq;
+				}
+				for (int k = 0; k < 3; k++)
+				{
+					double apk = a[p][k], aqk = a[q][k];
+					a[p][k] = c * apk - s * aqk;
+					a[q][k] = s * apk + c * aqk;
+				}
+				for (int k = 0; k < 3; k++)
+				{
+					double vkp = vectors[k][p], vkq = vectors[k][q];
+					vectors[k][p] = c * vkp - s * vkq;
+					vectors[k][q] = s * vkp + c * vkq;
+				}
+			}
+		}
+	}
+
+	for (int k = 0; k < 3; k++) values[k] = a[k][k];
+}
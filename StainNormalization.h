@@ -0,0 +1,59 @@
+/*********************************************************************************************************************/
+/* Datei: StainNormalization.h                                                                                       */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Reinhard / Macenko stain normalization applied while copying tiles out of the read buffer          */
+/*********************************************************************************************************************/
+
+#ifndef STAIN_NORMALIZATION_H
+#define STAIN_NORMALIZATION_H
+
+#include <windows.h>
+#include <stdint.h>
+
+#include "openslide.h"
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define STAIN_NONE					0
+#define STAIN_REINHARD				1
+#define STAIN_MACENKO				2
+
+// Reinhard: mean l, alpha, beta followed by the standard deviations of l, alpha, beta
+// Macenko:  haematoxylin OD vector (r, g, b), eosin OD vector (r, g, b), 99th percentile concentration of H and E
+#define STAIN_PARAMETER_COUNT		8
+
+// number of grid nodes per colour axis of the 3D lookup table (node k samples the input value 8 * k)
+#define STAIN_LUT_NODES				33
+#define STAIN_LUT_SIZE				(STAIN_LUT_NODES * STAIN_LUT_NODES * STAIN_LUT_NODES * 3)
+
+
+/*********************************************************************************************************************/
+/******************************************** Struktur: StainNormalization *******************************************/
+/*********************************************************************************************************************/
+
+struct StainNormalization
+{
+	INT32 method;
+	float source[STAIN_PARAMETER_COUNT];
+	float target[STAIN_PARAMETER_COUNT];
+
+	// STAIN_LUT_NODES^3 entries of (B, G, R), indexed [r][g][b]
+	BYTE* lut;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+bool EstimateStainParameters(openslide_t* slide, INT32 method, float* params);
+StainNormalization* CreateStainNormalization(INT32 method, const float* source, const float* target);
+void FreeStainNormalization(StainNormalization* stain);
+UINT32 HashStainNormalization(const StainNormalization* stain);
+void CopyTileNormalized(const StainNormalization* stain, const uint32_t* src, BYTE* dst, int pixels);
+
+#endif
@@ -0,0 +1,432 @@
+/*********************************************************************************************************************/
+/* Datei: TiffIndex.cpp                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   File offsets and byte counts of the tiles of every level, read from the TIFF directories           */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <vector>
+
+#include "TiffIndex.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define TIFF_TAG_IMAGE_WIDTH		256
+#define TIFF_TAG_IMAGE_LENGTH		257
+#define TIFF_TAG_COMPRESSION		259
+#define TIFF_TAG_PHOTOMETRIC		262
+#define TIFF_TAG_TILE_WIDTH			322
+#define TIFF_TAG_TILE_LENGTH		323
+#define TIFF_TAG_TILE_OFFSETS		324
+#define TIFF_TAG_TILE_BYTE_COUNTS	325
+#define TIFF_TAG_JPEG_TABLES		347
+
+#define TIFF_TYPE_SHORT				3
+#define TIFF_TYPE_LONG				4
+#define TIFF_TYPE_UNDEFINED			7
+#define TIFF_TYPE_LONG8				16
+
+// guards against directory chains that loop or are corrupt
+#define TIFF_MAX_DIRECTORIES		1024
+#define TIFF_MAX_ENTRIES			4096
+#define TIFF_MAX_JPEG_TABLES		65536
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct TiffFile
+{
+	HANDLE file;
+	bool bigEndian;
+	bool bigTiff;
+};
+
+// Tiled directory as found in the file
+struct TiffDirectory
+{
+	UINT64 width;
+	UINT64 height;
+	UINT64 tileWidth;
+	UINT64 tileHeight;
+	UINT16 compression;
+	UINT16 photometric;
+	std::vector<UINT64> offsets;
+	std::vector<UINT64> lengths;
+	std::vector<BYTE> jpegTables;
+};
+
+// One directory entry; value holds the value itself if it fits into the entry, otherwise its offset
+struct TiffEntry
+{
+	UINT16 tag;
+	UINT16 type;
+	UINT64 count;
+	UINT64 value;
+	BYTE data[8];
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static bool ReadAt(TiffFile* tiff, UINT64 offset, void* data, DWORD length);
+static UINT64 Decode(const TiffFile* tiff, const BYTE* data, int size);
+static int TypeSize(UINT16 type);
+static bool ReadArray(TiffFile* tiff, const TiffEntry* entry, std::vector<UINT64>& values);
+static bool ReadBytes(TiffFile* tiff, const TiffEntry* entry, std::vector<BYTE>& bytes);
+static bool ReadDirectory(TiffFile* tiff, UINT64 offset, TiffDirectory* directory, UINT64* next);
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: BuildTiffIndex **********************************************/
+/*********************************************************************************************************************/
+
+// Reads all tiled directories of the file at path and assigns each openslide level the directory with the same size
+// and tile size. Returns NULL if the file is no TIFF or none of the levels could be matched.
+TiffIndex* BuildTiffIndex(openslide_t* slide, const char* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<TiffDirectory> directories;
+	TiffIndex* index;
+	TiffFile tiff;
+	BYTE header[16];
+	UINT64 offset;
+	INT32 matched = 0;
+
+	if (slide == NULL || path == NULL) return NULL;
+
+	tiff.file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (tiff.file == INVALID_HANDLE_VALUE) return NULL;
+
+	//*** Byte order and classic or BigTIFF ***************************************************************************
+	if (!ReadAt(&tiff, 0, header, 16) || (header[0] != header[1]) || (header[0] != 'I' && header[0] != 'M'))
+	{
+		CloseHandle(tiff.file);
+		return NULL;
+	}
+
+	tiff.bigEndian = (header[0] == 'M');
+	tiff.bigTiff = (Decode(&tiff, header + 2, 2) == 43);
+	offset = tiff.bigTiff ? Decode(&tiff, header + 8, 8) : Decode(&tiff, header + 4, 4);
+
+	if (!tiff.bigTiff && Decode(&tiff, header + 2, 2) != 42)
+	{
+		CloseHandle(tiff.file);
+		return NULL;
+	}
+
+	//*** Follow the chain of directories and keep the tiled ones *****************************************************
+	for (int i = 0; i < TIFF_MAX_DIRECTORIES && offset != 0; i++)
+	{
+		TiffDirectory directory;
+
+		if (!ReadDirectory(&tiff, offset, &directory, &offset)) break;
+
+		if (directory.tileWidth > 0 && directory.tileHeight > 0 && !directory.offsets.empty())
+			directories.push_back(directory);
+	}
+
+	CloseHandle(tiff.file);
+
+	//*** Assign the directories to the openslide levels **************************************************************
+	index = new TiffIndex();
+	index->levelCount = openslide_get_level_count(slide);
+	index->levels = (TiffLevel*)calloc((index->levelCount > 0) ? index->levelCount : 1, sizeof(TiffLevel));
+
+	for (INT32 level = 0; level < index->levelCount; level++)
+	{
+		char name[64];
+		const char* value;
+		int64_t width, height;
+		UINT64 tileWidth = 0, tileHeight = 0;
+
+		openslide_get_level_dimensions(slide, level, &width, &height);
+
+		_snprintf(name, sizeof(name), "openslide.level[%d].tile-width", level);
+		if ((value = openslide_get_property_value(slide, name)) != NULL) tileWidth = _strtoui64(value, NULL, 10);
+
+		_snprintf(name, sizeof(name), "openslide.level[%d].tile-height", level);
+		if ((value = openslide_get_property_value(slide, name)) != NULL) tileHeight = _strtoui64(value, NULL, 10);
+
+		for (size_t d = 0; d < directories.size(); d++)
+		{
+			TiffDirectory* directory = &directories[d];
+			TiffLevel* entry = &index->levels[level];
+			UINT64 tiles;
+			INT64 charge;
+
+			if (directory->width != (UINT64)width || directory->height != (UINT64)height) continue;
+			if (directory->tileWidth != tileWidth || directory->tileHeight != tileHeight) continue;
+
+			entry->columns = (INT32)((directory->width + directory->tileWidth - 1) / directory->tileWidth);
+			entry->rows = (INT32)((directory->height + directory->tileHeight - 1) / directory->tileHeight);
+			tiles = (UINT64)entry->columns * entry->rows;
+
+			//*** Only complete tables of a single image plane are usable *********************************************
+			if (directory->offsets.size() < tiles || directory->lengths.size() < tiles) continue;
+
+			//*** Without room in the memory budget the level stays without index *************************************
+			charge = (INT64)(tiles * 2 * sizeof(UINT64) + directory->jpegTables.size());
+			if (!ChargeMemory(MEMORY_INDEXES, charge)) break;
+
+			entry->offsets = (UINT64*)malloc(tiles * sizeof(UINT64));
+			entry->lengths = (UINT64*)malloc(tiles * sizeof(UINT64));
+
+			if (!directory->jpegTables.empty()) entry->jpegTables = (BYTE*)malloc(directory->jpegTables.size());
+
+			if (entry->offsets == NULL || entry->lengths == NULL ||
+				(!directory->jpegTables.empty() && entry->jpegTables == NULL))
+			{
+				free(entry->offsets);
+				free(entry->lengths);
+				free(entry->jpegTables);
+				entry->offsets = NULL;
+				entry->lengths = NULL;
+				entry->jpegTables = NULL;
+				ReleaseMemory(MEMORY_INDEXES, charge);
+				break;
+			}
+
+			memcpy(entry->offsets, &directory->offsets[0], tiles * sizeof(UINT64));
+			memcpy(entry->lengths, &directory->lengths[0], tiles * sizeof(UINT64));
+
+			//*** What a decoder needs to read the tiles without openslide ********************************************
+			entry->compression = directory->compression;
+			entry->photometric = directory->photometric;
+			entry->jpegTablesLength = (UINT32)directory->jpegTables.size();
+			if (entry->jpegTables != NULL) memcpy(entry->jpegTables, &directory->jpegTables[0], entry->jpegTablesLength);
+			matched++;
+
+			break;
+		}
+	}
+
+	if (matched == 0)
+	{
+		FreeTiffIndex(index);
+		return NULL;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return index;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: FreeTiffIndex **********************************************/
+/*********************************************************************************************************************/
+
+void FreeTiffIndex(TiffIndex* index)
+{
+	if (index == NULL) return;
+
+	for (INT32 level = 0; level < index->levelCount; level++)
+	{
+		TiffLevel* entry = &index->levels[level];
+
+		if (entry->offsets != NULL)
+			ReleaseMemory(MEMORY_INDEXES, (INT64)entry->columns * entry->rows * 2 * sizeof(UINT64) + entry->jpegTablesLength);
+
+		free(entry->offsets);
+		free(entry->lengths);
+		free(entry->jpegTables);
+	}
+
+	free(index->levels);
+	delete index;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ReadDirectory **********************************************/
+/*********************************************************************************************************************/
+
+// Reads the directory at offset; only the tags needed for the tile tables are kept
+static bool ReadDirectory(TiffFile* tiff, UINT64 offset, TiffDirectory* directory, UINT64* next)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	int countSize = tiff->bigTiff ? 8 : 2;
+	int entrySize = tiff->bigTiff ? 20 : 12;
+	int valueSize = tiff->bigTiff ? 8 : 4;
+	std::vector<BYTE> entries;
+	BYTE buffer[8];
+	UINT64 count;
+
+	directory->width = directory->height = directory->tileWidth = directory->tileHeight = 0;
+	directory->compression = directory->photometric = 0;
+
+	if (!ReadAt(tiff, offset, buffer, countSize)) return false;
+
+	count = Decode(tiff, buffer, countSize);
+	if (count == 0 || count > TIFF_MAX_ENTRIES) return false;
+
+	//*** All entries followed by the offset of the next directory in one read ****************************************
+	entries.resize((size_t)count * entrySize + valueSize);
+	if (!ReadAt(tiff, offset + countSize, &entries[0], (DWORD)entries.size())) return false;
+
+	*next = Decode(tiff, &entries[(size_t)count * entrySize], valueSize);
+
+	for (UINT64 i = 0; i < count; i++)
+	{
+		const BYTE* raw = &entries[(size_t)i * entrySize];
+		TiffEntry entry;
+
+		entry.tag = (UINT16)Decode(tiff, raw, 2);
+		entry.type = (UINT16)Decode(tiff, raw + 2, 2);
+		entry.count = Decode(tiff, raw + 4, tiff->bigTiff ? 8 : 4);
+		memcpy(entry.data, raw + (tiff->bigTiff ? 12 : 8), valueSize);
+		entry.value = Decode(tiff, entry.data, valueSize);
+
+		switch (entry.tag)
+		{
+		case TIFF_TAG_IMAGE_WIDTH:
+		case TIFF_TAG_IMAGE_LENGTH:
+		case TIFF_TAG_TILE_WIDTH:
+		case TIFF_TAG_TILE_LENGTH:
+		case TIFF_TAG_COMPRESSION:
+		case TIFF_TAG_PHOTOMETRIC:
+			{
+				// a single SHORT or LONG is stored left-aligned in the value field
+				UINT64 value = Decode(tiff, entry.data, TypeSize(entry.type) > 0 ? TypeSize(entry.type) : valueSize);
+
+				if (entry.tag == TIFF_TAG_IMAGE_WIDTH) directory->width = value;
+				else if (entry.tag == TIFF_TAG_IMAGE_LENGTH) directory->height = value;
+				else if (entry.tag == TIFF_TAG_TILE_WIDTH) directory->tileWidth = value;
+				else if (entry.tag == TIFF_TAG_TILE_LENGTH) directory->tileHeight = value;
+				else if (entry.tag == TIFF_TAG_COMPRESSION) directory->compression = (UINT16)value;
+				else directory->photometric = (UINT16)value;
+			}
+			break;
+
+		case TIFF_TAG_TILE_OFFSETS:
+			if (!ReadArray(tiff, &entry, directory->offsets)) directory->offsets.clear();
+			break;
+
+		case TIFF_TAG_TILE_BYTE_COUNTS:
+			if (!ReadArray(tiff, &entry, directory->lengths)) directory->lengths.clear();
+			break;
+
+		case TIFF_TAG_JPEG_TABLES:
+			if (!ReadBytes(tiff, &entry, directory->jpegTables)) directory->jpegTables.clear();
+			break;
+		}
+	}
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ReadArray ************************************************/
+/*********************************************************************************************************************/
+
+// Reads an array of SHORT, LONG or LONG8 values, either from the entry itself or from the offset it points to
+static bool ReadArray(TiffFile* tiff, const TiffEntry* entry, std::vector<UINT64>& values)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	int size = TypeSize(entry->type);
+	std::vector<BYTE> raw;
+	UINT64 bytes;
+
+	if (size == 0 || entry->count == 0 || entry->count > 0x10000000) return false;
+
+	bytes = entry->count * size;
+	raw.resize((size_t)bytes);
+
+	if (bytes <= (UINT64)(tiff->bigTiff ? 8 : 4))
+		memcpy(&raw[0], entry->data, (size_t)bytes);
+	else if (!ReadAt(tiff, entry->value, &raw[0], (DWORD)bytes))
+		return false;
+
+	values.resize((size_t)entry->count);
+
+	for (size_t i = 0; i < values.size(); i++) values[i] = Decode(tiff, &raw[i * size], size);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ReadBytes ************************************************/
+/*********************************************************************************************************************/
+
+// Reads the bytes of an UNDEFINED entry such as the JPEG tables
+static bool ReadBytes(TiffFile* tiff, const TiffEntry* entry, std::vector<BYTE>& bytes)
+{
+	if (entry->type != TIFF_TYPE_UNDEFINED || entry->count == 0 || entry->count > TIFF_MAX_JPEG_TABLES) return false;
+
+	bytes.resize((size_t)entry->count);
+
+	if (entry->count <= (UINT64)(tiff->bigTiff ? 8 : 4))
+	{
+		memcpy(&bytes[0], entry->data, (size_t)entry->count);
+		return true;
+	}
+
+	return ReadAt(tiff, entry->value, &bytes[0], (DWORD)entry->count);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: ReadAt **************************************************/
+/*********************************************************************************************************************/
+
+static bool ReadAt(TiffFile* tiff, UINT64 offset, void* data, DWORD length)
+{
+	OVERLAPPED position = { 0 };
+	DWORD read;
+
+	position.Offset = (DWORD)offset;
+	position.OffsetHigh = (DWORD)(offset >> 32);
+
+	return ReadFile(tiff->file, data, length, &read, &position) && read == length;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: Decode **************************************************/
+/*********************************************************************************************************************/
+
+// Unsigned integer of size bytes in the byte order of the file
+static UINT64 Decode(const TiffFile* tiff, const BYTE* data, int size)
+{
+	UINT64 value = 0;
+
+	for (int i = 0; i < size; i++)
+	{
+		if (tiff->bigEndian)
+			value = (value << 8) | data[i];
+		else
+			value |= (UINT64)data[i] << (8 * i);
+	}
+
+	return value;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: TypeSize *************************************************/
+/*********************************************************************************************************************/
+
+static int TypeSize(UINT16 type)
+{
+	switch (type)
+	{
+	case TIFF_TYPE_SHORT:	return 2;
+	case TIFF_TYPE_LONG:	return 4;
+	case TIFF_TYPE_LONG8:	return 8;
+	default:				return 0;
+	}
+}
@@ -0,0 +1,65 @@
+/*********************************************************************************************************************/
+/* Datei: TiffIndex.h                                                                                                */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   File offsets and byte counts of the tiles of every level, read from the TIFF directories           */
+/*********************************************************************************************************************/
+
+#ifndef TIFF_INDEX_H
+#define TIFF_INDEX_H
+
+#include <windows.h>
+
+#include "openslide.h"
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define TIFF_COMPRESSION_JPEG		7
+#define TIFF_PHOTOMETRIC_RGB		2
+#define TIFF_PHOTOMETRIC_YCBCR		6
+
+
+/*********************************************************************************************************************/
+/************************************************ Struktur: TiffLevel ************************************************/
+/*********************************************************************************************************************/
+
+// Tile table of one openslide level; offsets is NULL if the level has no matching tiled TIFF directory
+struct TiffLevel
+{
+	INT32 columns;
+	INT32 rows;
+
+	// row-major, columns * rows entries each
+	UINT64* offsets;
+	UINT64* lengths;
+
+	// TIFF compression and photometric interpretation; for JPEG the tables shared by all tiles, NULL if there are none
+	UINT16 compression;
+	UINT16 photometric;
+	BYTE* jpegTables;
+	UINT32 jpegTablesLength;
+};
+
+
+/*********************************************************************************************************************/
+/************************************************ Struktur: TiffIndex ************************************************/
+/*********************************************************************************************************************/
+
+struct TiffIndex
+{
+	TiffLevel* levels;
+	INT32 levelCount;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+TiffIndex* BuildTiffIndex(openslide_t* slide, const char* path);
+void FreeTiffIndex(TiffIndex* index);
+
+#endif
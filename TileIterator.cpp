@@ -0,0 +1,244 @@
+/*********************************************************************************************************************/
+/* Datei: TileIterator.cpp                                                                                           */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Enumerates the tiles of a level in an order with good locality and hands them out in chunks        */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <algorithm>
+#include <vector>
+
+#include "TileIterator.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// Sort key of one tile; ties keep the row-major position so the order is deterministic
+struct TileKey
+{
+	UINT64 key;
+	INT32 x;
+	INT32 y;
+
+	bool operator<(const TileKey& other) const
+	{
+		if (key != other.key) return key < other.key;
+		if (y != other.y) return y < other.y;
+		return x < other.x;
+	}
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static bool MaskCoversTile(const BYTE* mask, INT32 maskWidth, INT32 maskHeight, INT32 columns, INT32 rows, INT32 x,
+	INT32 y);
+static UINT64 MortonIndex(UINT32 x, UINT32 y);
+static UINT64 HilbertIndex(UINT32 n, UINT32 x, UINT32 y);
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: BuildTileIterator ********************************************/
+/*********************************************************************************************************************/
+
+// Collects the tiles of a columns x rows grid that lie in rect (x, y, width, height in tiles, NULL = whole grid) and
+// touch a nonzero pixel of mask (any resolution, covering the whole level, NULL = all tiles) and sorts them in the
+// requested order. offsets holds the file offset of every tile in row-major order, or NULL.
+TileIterator* BuildTileIterator(INT32 columns, INT32 rows, INT32 order, const UINT64* offsets, const INT32* rect,
+	const BYTE* mask, INT32 maskWidth, INT32 maskHeight)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<TileKey> tiles;
+	TileIterator* iterator;
+	INT32 firstX = 0, firstY = 0, endX = columns, endY = rows;
+	UINT32 side = 1;
+
+	if (columns <= 0 || rows <= 0) return NULL;
+	if (mask != NULL && (maskWidth <= 0 || maskHeight <= 0)) return NULL;
+
+	//*** Restrict the grid to the rectangle **************************************************************************
+	if (rect != NULL)
+	{
+		if (rect[2] <= 0 || rect[3] <= 0) return NULL;
+
+		firstX = (std::max)(0, rect[0]);
+		firstY = (std::max)(0, rect[1]);
+		endX = (std::min)(columns, rect[0] + rect[2]);
+		endY = (std::min)(rows, rect[1] + rect[3]);
+	}
+
+	if (order == TILE_ORDER_FILE && offsets == NULL) order = TILE_ORDER_HILBERT;
+
+	//*** The Hilbert curve is defined on a square with a power of two side *******************************************
+	while (side < (UINT32)columns || side < (UINT32)rows) side <<= 1;
+
+	for (INT32 y = firstY; y < endY; y++)
+	{
+		for (INT32 x = firstX; x < endX; x++)
+		{
+			TileKey tile;
+
+			if (mask != NULL && !MaskCoversTile(mask, maskWidth, maskHeight, columns, rows, x, y)) continue;
+
+			tile.x = x;
+			tile.y = y;
+
+			switch (order)
+			{
+			case TILE_ORDER_MORTON:		tile.key = MortonIndex(x, y); break;
+			case TILE_ORDER_HILBERT:	tile.key = HilbertIndex(side, x, y); break;
+			case TILE_ORDER_FILE:		tile.key = offsets[(INT64)y * columns + x]; break;
+			default:					tile.key = 0; break;
+			}
+
+			tiles.push_back(tile);
+		}
+	}
+
+	if (order != TILE_ORDER_ROW_MAJOR) std::sort(tiles.begin(), tiles.end());
+
+	//*** Keep only the coordinates ***********************************************************************************
+	if (!ChargeMemory(MEMORY_SESSIONS, (INT64)(tiles.size() + 1) * 2 * sizeof(INT32))) return NULL;
+
+	iterator = new TileIterator();
+	iterator->count = (LONG)tiles.size();
+	iterator->next = 0;
+	iterator->coordinates = (INT32*)malloc((tiles.size() + 1) * 2 * sizeof(INT32));
+
+	if (iterator->coordinates == NULL)
+	{
+		ReleaseMemory(MEMORY_SESSIONS, (INT64)(tiles.size() + 1) * 2 * sizeof(INT32));
+		delete iterator;
+		return NULL;
+	}
+
+	for (size_t i = 0; i < tiles.size(); i++)
+	{
+		iterator->coordinates[2 * i] = tiles[i].x;
+		iterator->coordinates[2 * i + 1] = tiles[i].y;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return iterator;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: TakeTiles ************************************************/
+/*********************************************************************************************************************/
+
+// Claims the next chunk of up to maxTiles consecutive tiles and writes their x, y pairs to coordinates. Every tile is
+// handed out exactly once, so worker threads sharing the iterator get disjoint chunks. Returns 0 when all are taken.
+INT32 TakeTiles(TileIterator* iterator, INT32* coordinates, INT32 maxTiles)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	LONG first, count;
+
+	if (maxTiles <= 0 || iterator->next >= iterator->count) return 0;
+
+	first = InterlockedExchangeAdd(&iterator->next, maxTiles);
+
+	if (first >= iterator->count) return 0;
+
+	count = (std::min)((LONG)maxTiles, iterator->count - first);
+
+	memcpy(coordinates, iterator->coordinates + 2 * first, count * 2 * sizeof(INT32));
+
+	return count;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: FreeTileIterator *********************************************/
+/*********************************************************************************************************************/
+
+void FreeTileIterator(TileIterator* iterator)
+{
+	if (iterator == NULL) return;
+
+	free(iterator->coordinates);
+	ReleaseMemory(MEMORY_SESSIONS, (INT64)(iterator->count + 1) * 2 * sizeof(INT32));
+	delete iterator;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: MaskCoversTile **********************************************/
+/*********************************************************************************************************************/
+
+// True if one of the mask pixels that overlap the tile is set
+static bool MaskCoversTile(const BYTE* mask, INT32 maskWidth, INT32 maskHeight, INT32 columns, INT32 rows, INT32 x,
+	INT32 y)
+{
+	INT32 left = (INT32)((INT64)x * maskWidth / columns);
+	INT32 top = (INT32)((INT64)y * maskHeight / rows);
+	INT32 right = (INT32)(((INT64)(x + 1) * maskWidth + columns - 1) / columns);
+	INT32 bottom = (INT32)(((INT64)(y + 1) * maskHeight + rows - 1) / rows);
+
+	for (INT32 my = top; my < bottom; my++)
+	{
+		for (INT32 mx = left; mx < right; mx++)
+		{
+			if (mask[(INT64)my * maskWidth + mx] != 0) return true;
+		}
+	}
+
+	return false;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: MortonIndex ***********************************************/
+/*********************************************************************************************************************/
+
+// Interleaves the bits of x and y (Z-order)
+static UINT64 MortonIndex(UINT32 x, UINT32 y)
+{
+	UINT64 key = 0;
+
+	for (int bit = 0; bit < 32; bit++)
+	{
+		key |= (UINT64)((x >> bit) & 1) << (2 * bit);
+		key |= (UINT64)((y >> bit) & 1) << (2 * bit + 1);
+	}
+
+	return key;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: HilbertIndex ***********************************************/
+/*********************************************************************************************************************/
+
+// Distance of (x, y) along the Hilbert curve that fills an n x n square, n a power of two
+static UINT64 HilbertIndex(UINT32 n, UINT32 x, UINT32 y)
+{
+	UINT64 d = 0;
+
+	for (UINT32 s = n / 2; s > 0; s /= 2)
+	{
+		UINT32 rx = (x & s) != 0;
+		UINT32 ry = (y & s) != 0;
+
+		d += (UINT64)s * s * ((3 * rx) ^ ry);
+
+		//*** Rotate the quadrant so that the sub-curve starts and ends at the right corners **************************
+		if (ry == 0)
+		{
+			if (rx == 1)
+			{
+				x = n - 1 - x;
+				y = n - 1 - y;
+			}
+
+			std::swap(x, y);
+		}
+	}
+
+	return d;
+}
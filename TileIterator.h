@@ -0,0 +1,50 @@
+/*********************************************************************************************************************/
+/* Datei: TileIterator.h                                                                                             */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Enumerates the tiles of a level in an order with good locality and hands them out in chunks        */
+/*********************************************************************************************************************/
+
+#ifndef TILE_ITERATOR_H
+#define TILE_ITERATOR_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define TILE_ORDER_ROW_MAJOR		0
+#define TILE_ORDER_MORTON			1
+#define TILE_ORDER_HILBERT			2
+
+// ascending offset of the tile data in the file; falls back to TILE_ORDER_HILBERT when the offsets are not known
+#define TILE_ORDER_FILE				3
+
+
+/*********************************************************************************************************************/
+/********************************************** Struktur: TileIterator ***********************************************/
+/*********************************************************************************************************************/
+
+struct TileIterator
+{
+	// x, y pairs in the order in which they are handed out
+	INT32* coordinates;
+	LONG count;
+
+	// index of the next tile to hand out; chunks are claimed with an interlocked add
+	volatile LONG next;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+TileIterator* BuildTileIterator(INT32 columns, INT32 rows, INT32 order, const UINT64* offsets, const INT32* rect,
+	const BYTE* mask, INT32 maskWidth, INT32 maskHeight);
+INT32 TakeTiles(TileIterator* iterator, INT32* coordinates, INT32 maxTiles);
+void FreeTileIterator(TileIterator* iterator);
+
+#endif
@@ -0,0 +1,1073 @@
+/*********************************************************************************************************************/
+/* Datei: TileServer.cpp                                                                                             */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Embedded HTTP/1.1 server for Deep Zoom descriptors and JPEG tiles of the published slides          */
+/*********************************************************************************************************************/
+
+// winsock2.h has to come before windows.h, which would otherwise pull in the old winsock.h
+#include <winsock2.h>
+#include <windows.h>
+#include <wincodec.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+#include <deque>
+#include <list>
+#include <map>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "TileServer.h"
+#include "Session.h"
+#include "HandleTable.h"
+#include "BufferPool.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// tile size and overlap of the Deep Zoom pyramid, the defaults of the Deep Zoom tools and of OpenSeadragon
+#define DZ_TILE_SIZE				254
+#define DZ_OVERLAP					1
+
+#define SERVER_THREADS				16
+#define SERVER_QUALITY				80
+#define SERVER_CACHE_SIZE			(256 * 1024 * 1024)
+
+// milliseconds an idle keep-alive connection is held open at most, and the largest request head accepted
+#define SERVER_KEEP_ALIVE			15000
+#define SERVER_MAX_HEAD				16384
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// stain is the hash of the stain normalization the tile was encoded with, 0 without one
+struct TileKey
+{
+	UINT64 slideId;
+	INT32 level;
+	INT32 column;
+	INT32 row;
+	INT32 quality;
+	UINT32 stain;
+
+	bool operator==(const TileKey& other) const
+	{
+		return slideId == other.slideId && level == other.level && column == other.column && row == other.row &&
+			quality == other.quality && stain == other.stain;
+	}
+};
+
+struct TileKeyHash
+{
+	size_t operator()(const TileKey& key) const
+	{
+		UINT64 hash = key.slideId ^ ((UINT64)(UINT32)key.level << 58) ^ ((UINT64)(UINT32)key.row << 29) ^
+			(UINT64)(UINT32)key.column ^ ((UINT64)(UINT32)key.quality << 40) ^ ((UINT64)key.stain << 20);
+
+		hash ^= hash >> 33;
+		hash *= 0xFF51AFD7ED558CCDULL;
+		hash ^= hash >> 33;
+
+		return (size_t)hash;
+	}
+};
+
+struct CachedTile
+{
+	TileKey key;
+	std::string jpeg;
+};
+
+// lock guards the published slides, control serializes start and stop, queueLock the connections and the sockets
+// the workers serve; idleSince holds the tick count since which a worker waits for the next request on a kept-alive
+// connection (0 while it serves one or has none), sleeping the number of workers waiting for a connection
+static struct
+{
+	SRWLOCK lock;
+	SRWLOCK control;
+	SRWLOCK queueLock;
+	CONDITION_VARIABLE queued;
+	volatile LONG running;
+	SOCKET listener;
+	HANDLE acceptThread;
+	std::vector<HANDLE> workers;
+	std::vector<SOCKET> active;
+	std::vector<DWORD> idleSince;
+	std::deque<SOCKET> connections;
+	size_t sleeping;
+	std::map<std::string, INT64> slides;
+	INT32 quality;
+} server;
+
+// Encoded tiles, most recently used first
+static struct
+{
+	SRWLOCK lock;
+	std::list<CachedTile> tiles;
+	std::unordered_map<TileKey, std::list<CachedTile>::iterator, TileKeyHash> index;
+	INT64 bytes;
+	INT64 maxBytes;
+	volatile LONG registered;
+} tileCache;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+extern "C" BOOL GetRegionDecoded(INT64 handle, INT32 level, INT32 x, INT32 y, INT32 width, INT32 height, BYTE* data);
+extern "C" __declspec(dllexport) void StopTileServer();
+BOOL ReadRegionScaled(Session* session, INT32 level, INT32 factor, INT64 x, INT64 y, INT32 width, INT32 height,
+	BYTE* data);
+
+static DWORD WINAPI AcceptConnections(LPVOID parameter);
+static DWORD WINAPI ServeConnections(LPVOID parameter);
+static void ServeConnection(SOCKET socket, INT32 index, IWICImagingFactory* factory);
+static bool HandleRequest(SOCKET socket, const std::string& head, IWICImagingFactory* factory);
+static bool SendResponse(SOCKET socket, const char* status, const char* type, const char* etag, const char* extra,
+	const char* body, size_t length, bool keepAlive, bool headOnly);
+static INT32 DeepZoomLevels(Session* session);
+static bool DeepZoomTileExists(Session* session, INT32 level, INT32 column, INT32 row);
+static bool RenderTile(INT64 handle, Session* session, INT32 level, INT32 column, INT32 row,
+	IWICImagingFactory* factory, std::string* jpeg);
+static bool EncodeJpeg(IWICImagingFactory* factory, BYTE* pixels, INT32 width, INT32 height, INT32 stride,
+	INT32 quality, std::string* jpeg);
+static bool CacheLookup(const TileKey& key, std::string* jpeg);
+static void CacheStore(const TileKey& key, const std::string& jpeg);
+static INT64 TrimTileCache(INT64 bytes);
+static std::string UrlDecode(const std::string& text);
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: StartTileServer *********************************************/
+/*********************************************************************************************************************/
+
+// Starts serving the published slides on port, on loopback only or on all interfaces. threads connections are served
+// at the same time (0 = 16); quality is the JPEG quality (0 = 80) and cacheBytes the size of the cache of encoded
+// tiles (-1 = 256 MiB, 0 = no cache). A running server is stopped first.
+//
+//   GET /<name>.dzi                              Deep Zoom descriptor
+//   GET /<name>_files/<level>/<column>_<row>.jpeg  tile
+extern "C" __declspec(dllexport) BOOL StartTileServer(INT32 port, BOOL loopbackOnly, INT32 threads, INT32 quality,
+	INT64 cacheBytes)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	sockaddr_in address;
+	WSADATA wsa;
+
+	StopTileServer();
+
+	if (port <= 0 || port > 65535) return false;
+
+	AcquireSRWLockExclusive(&server.control);
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsa) != 0)
+	{
+		ReleaseSRWLockExclusive(&server.control);
+		return false;
+	}
+
+	//*** Listen before the threads start, so that a port in use is reported to the caller ****************************
+	memset(&address, 0, sizeof(address));
+	address.sin_family = AF_INET;
+	address.sin_port = htons((u_short)port);
+	address.sin_addr.s_addr = htonl(loopbackOnly ? INADDR_LOOPBACK : INADDR_ANY);
+
+	server.listener = socket(AF_INET, SOCK_STREAM, IPPROTO_TCP);
+
+	if (server.listener == INVALID_SOCKET || bind(server.listener, (sockaddr*)&address, sizeof(address)) != 0 ||
+		listen(server.listener, SOMAXCONN) != 0)
+	{
+		if (server.listener != INVALID_SOCKET) closesocket(server.listener);
+		WSACleanup();
+		ReleaseSRWLockExclusive(&server.control);
+		return false;
+	}
+
+	server.quality = (quality > 0 && quality <= 100) ? quality : SERVER_QUALITY;
+	tileCache.maxBytes = (cacheBytes < 0) ? SERVER_CACHE_SIZE : cacheBytes;
+
+	//*** The encoded tiles are given up like the other caches when memory gets tight *********************************
+	if (InterlockedExchange(&tileCache.registered, 1) == 0) RegisterMemoryShedder(MEMORY_CACHES, TrimTileCache);
+
+	InterlockedExchange(&server.running, 1);
+
+	if (threads <= 0) threads = SERVER_THREADS;
+
+	server.active.assign(threads, INVALID_SOCKET);
+	server.idleSince.assign(threads, 0);
+	server.sleeping = 0;
+
+	for (INT32 i = 0; i < threads; i++)
+	{
+		HANDLE worker = CreateThread(NULL, 0, ServeConnections, (LPVOID)(INT_PTR)i, 0, NULL);
+
+		if (worker != NULL) server.workers.push_back(worker);
+	}
+
+	server.acceptThread = CreateThread(NULL, 0, AcceptConnections, NULL, 0, NULL);
+
+	ReleaseSRWLockExclusive(&server.control);
+
+	//*** Ende ********************************************************************************************************
+	return server.acceptThread != NULL && !server.workers.empty();
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: StopTileServer **********************************************/
+/*********************************************************************************************************************/
+
+// Closes the listener and all connections and waits for the requests in flight. The published slides stay published.
+extern "C" __declspec(dllexport) void StopTileServer()
+{
+	AcquireSRWLockExclusive(&server.control);
+
+	if (InterlockedExchange(&server.running, 0) == 0)
+	{
+		ReleaseSRWLockExclusive(&server.control);
+		return;
+	}
+
+	//*** Closing the listener ends the accept thread *****************************************************************
+	closesocket(server.listener);
+
+	if (server.acceptThread != NULL)
+	{
+		WaitForSingleObject(server.acceptThread, INFINITE);
+		CloseHandle(server.acceptThread);
+		server.acceptThread = NULL;
+	}
+
+	//*** Wake the idle workers and cut the connections the others are waiting on *************************************
+	AcquireSRWLockExclusive(&server.queueLock);
+
+	for (size_t i = 0; i < server.active.size(); i++)
+	{
+		if (server.active[i] != INVALID_SOCKET) shutdown(server.active[i], SD_BOTH);
+	}
+
+	ReleaseSRWLockExclusive(&server.queueLock);
+
+	WakeAllConditionVariable(&server.queued);
+
+	for (size_t i = 0; i < server.workers.size(); i++)
+	{
+		WaitForSingleObject(server.workers[i], INFINITE);
+		CloseHandle(server.workers[i]);
+	}
+
+	server.workers.clear();
+
+	while (!server.connections.empty())
+	{
+		closesocket(server.connections.front());
+		server.connections.pop_front();
+	}
+
+	WSACleanup();
+
+	//*** The cache is only of use while the server runs **************************************************************
+	TrimTileCache(tileCache.bytes);
+
+	ReleaseSRWLockExclusive(&server.control);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: PublishSlide ***********************************************/
+/*********************************************************************************************************************/
+
+// Makes the slide of the handle available as /<name>.dzi; handle 0 withdraws the name. Closing the slide withdraws
+// all of its names.
+extern "C" __declspec(dllexport) BOOL PublishSlide(INT64 handle, wchar_t* name)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	char utf8[512];
+
+	if (name == NULL || WideCharToMultiByte(CP_UTF8, 0, name, -1, utf8, sizeof(utf8), NULL, NULL) <= 1) return false;
+
+	//*** The name is a single path segment ***************************************************************************
+	if (strchr(utf8, '/') != NULL || strchr(utf8, '?') != NULL) return false;
+
+	if (handle != 0)
+	{
+		SessionReference reference(handle, SESSION_OPENING);
+		if (reference.session == NULL) return false;
+	}
+
+	AcquireSRWLockExclusive(&server.lock);
+
+	if (handle != 0) server.slides[utf8] = handle;
+	else server.slides.erase(utf8);
+
+	ReleaseSRWLockExclusive(&server.lock);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: UnpublishClosedSlide *******************************************/
+/*********************************************************************************************************************/
+
+// Called by CloseImage
+void UnpublishClosedSlide(INT64 handle)
+{
+	AcquireSRWLockExclusive(&server.lock);
+
+	for (std::map<std::string, INT64>::iterator it = server.slides.begin(); it != server.slides.end();)
+	{
+		if (it->second == handle) server.slides.erase(it++);
+		else ++it;
+	}
+
+	ReleaseSRWLockExclusive(&server.lock);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: AcceptConnections ********************************************/
+/*********************************************************************************************************************/
+
+static DWORD WINAPI AcceptConnections(LPVOID parameter)
+{
+	SOCKET connection;
+	DWORD timeout = SERVER_KEEP_ALIVE;
+	BOOL noDelay = TRUE;
+
+	for (;;)
+	{
+		//*** Closing the listener on stop makes accept fail; other failures concern a single connection **************
+		if ((connection = accept(server.listener, NULL, NULL)) == INVALID_SOCKET)
+		{
+			if (server.running == 0) break;
+			continue;
+		}
+
+		//*** An idle connection is dropped after the keep-alive time; responses go out without delay *****************
+		setsockopt(connection, SOL_SOCKET, SO_RCVTIMEO, (const char*)&timeout, sizeof(timeout));
+		setsockopt(connection, IPPROTO_TCP, TCP_NODELAY, (const char*)&noDelay, sizeof(noDelay));
+
+		AcquireSRWLockExclusive(&server.queueLock);
+		server.connections.push_back(connection);
+
+		//*** With every worker busy, the connection idle the longest is closed to make room for the new one **********
+		if (server.connections.size() > server.sleeping)
+		{
+			size_t oldest = server.idleSince.size();
+			DWORD now = GetTickCount();
+
+			for (size_t i = 0; i < server.idleSince.size(); i++)
+			{
+				if (server.idleSince[i] != 0 &&
+					(oldest == server.idleSince.size() || now - server.idleSince[i] > now - server.idleSince[oldest]))
+					oldest = i;
+			}
+
+			if (oldest < server.idleSince.size())
+			{
+				shutdown(server.active[oldest], SD_BOTH);
+				server.idleSince[oldest] = 0;
+			}
+		}
+
+		ReleaseSRWLockExclusive(&server.queueLock);
+
+		WakeConditionVariable(&server.queued);
+	}
+
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: ServeConnections *********************************************/
+/*********************************************************************************************************************/
+
+// Worker: serves one connection after the other, each until the client closes it or it stays idle too long
+static DWORD WINAPI ServeConnections(LPVOID parameter)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	INT32 index = (INT32)(INT_PTR)parameter;
+	IWICImagingFactory* factory = NULL;
+	SOCKET connection;
+
+	CoInitializeEx(NULL, COINIT_MULTITHREADED);
+	CoCreateInstance(CLSID_WICImagingFactory, NULL, CLSCTX_INPROC_SERVER, IID_IWICImagingFactory, (LPVOID*)&factory);
+
+	for (;;)
+	{
+		AcquireSRWLockExclusive(&server.queueLock);
+
+		while (server.running != 0 && server.connections.empty())
+		{
+			server.sleeping++;
+			SleepConditionVariableSRW(&server.queued, &server.queueLock, INFINITE, 0);
+			server.sleeping--;
+		}
+
+		if (server.running == 0)
+		{
+			ReleaseSRWLockExclusive(&server.queueLock);
+			break;
+		}
+
+		connection = server.connections.front();
+		server.connections.pop_front();
+		server.active[index] = connection;
+
+		ReleaseSRWLockExclusive(&server.queueLock);
+
+		ServeConnection(connection, index, factory);
+
+		AcquireSRWLockExclusive(&server.queueLock);
+		server.active[index] = INVALID_SOCKET;
+		server.idleSince[index] = 0;
+		ReleaseSRWLockExclusive(&server.queueLock);
+
+		closesocket(connection);
+	}
+
+	if (factory != NULL) factory->Release();
+	CoUninitialize();
+
+	//*** Ende ********************************************************************************************************
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: ServeConnection *********************************************/
+/*********************************************************************************************************************/
+
+// Reads request after request; bytes behind a request head are kept for the next one, so pipelined requests work.
+// Between two requests the connection is only kept while no other connection waits for a worker: the worker then
+// leaves it on its own, and AcceptConnections cuts it off while it waits in recv.
+static void ServeConnection(SOCKET socket, INT32 index, IWICImagingFactory* factory)
+{
+	std::string pending;
+	char chunk[4096];
+	bool served = false;
+	size_t end;
+
+	for (;;)
+	{
+		while ((end = pending.find("\r\n\r\n")) == std::string::npos)
+		{
+			bool idle = (served && pending.empty());
+			int received;
+
+			if (pending.size() > SERVER_MAX_HEAD) return;
+
+			if (idle)
+			{
+				AcquireSRWLockExclusive(&server.queueLock);
+
+				if (!server.connections.empty())
+				{
+					ReleaseSRWLockExclusive(&server.queueLock);
+					return;
+				}
+
+				server.idleSince[index] = GetTickCount() | 1;
+				ReleaseSRWLockExclusive(&server.queueLock);
+			}
+
+			received = recv(socket, chunk, sizeof(chunk), 0);
+
+			if (idle)
+			{
+				AcquireSRWLockExclusive(&server.queueLock);
+				server.idleSince[index] = 0;
+				ReleaseSRWLockExclusive(&server.queueLock);
+			}
+
+			if (received <= 0) return;
+
+			pending.append(chunk, received);
+		}
+
+		std::string head = pending.substr(0, end);
+		pending.erase(0, end + 4);
+
+		if (!HandleRequest(socket, head, factory)) return;
+		served = true;
+	}
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: HandleRequest **********************************************/
+/*********************************************************************************************************************/
+
+// Answers one request; false if the connection is to be closed afterwards
+static bool HandleRequest(SOCKET socket, const std::string& head, IWICImagingFactory* factory)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::string method, target, version, ifNoneMatch, path, name;
+	bool keepAlive, headOnly;
+	size_t lineEnd, first, second;
+	char etag[96], body[512];
+	std::string jpeg;
+	Session* session;
+	INT64 handle = 0;
+	INT32 level = 0, column = 0, row = 0;
+
+	//*** Request line ************************************************************************************************
+	lineEnd = head.find("\r\n");
+	std::string line = head.substr(0, lineEnd);
+
+	if ((first = line.find(' ')) == std::string::npos || (second = line.find(' ', first + 1)) == std::string::npos)
+	{
+		SendResponse(socket, "400 Bad Request", NULL, NULL, NULL, NULL, 0, false, false);
+		return false;
+	}
+
+	method = line.substr(0, first);
+	target = line.substr(first + 1, second - first - 1);
+	version = line.substr(second + 1);
+	keepAlive = (version == "HTTP/1.1");
+	headOnly = (method == "HEAD");
+
+	//*** Header fields; only the connection and the validator matter here ********************************************
+	for (size_t start = lineEnd; start != std::string::npos && start + 2 < head.size();)
+	{
+		size_t next = head.find("\r\n", start + 2);
+		std::string field = head.substr(start + 2, (next == std::string::npos) ? std::string::npos : next - start - 2);
+		size_t colon = field.find(':');
+
+		start = next;
+
+		if (colon == std::string::npos) continue;
+
+		std::string value = field.substr(colon + 1);
+		value.erase(0, value.find_first_not_of(" \t"));
+
+		if (colon == 10 && _strnicmp(field.c_str(), "connection", 10) == 0)
+		{
+			if (_strnicmp(value.c_str(), "close", 5) == 0) keepAlive = false;
+			else if (_strnicmp(value.c_str(), "keep-alive", 10) == 0) keepAlive = true;
+		}
+		else if (colon == 13 && _strnicmp(field.c_str(), "if-none-match", 13) == 0)
+		{
+			ifNoneMatch = value;
+		}
+	}
+
+	//*** A body that came with the request is never read, so after an error the connection is not used again *********
+	if (method != "GET" && !headOnly)
+		return SendResponse(socket, "405 Method Not Allowed", NULL, NULL, "Allow: GET, HEAD\r\n", NULL, 0, false, false);
+
+	//*** /<name>.dzi or /<name>_files/<level>/<column>_<row>.jpeg ****************************************************
+	if ((first = target.find('?')) != std::string::npos) target.erase(first);
+	path = (target.size() > 1 && target[0] == '/') ? UrlDecode(target.substr(1)) : std::string();
+
+	bool descriptor = (path.size() > 4 && path.compare(path.size() - 4, 4, ".dzi") == 0);
+
+	if (descriptor)
+	{
+		name = path.substr(0, path.size() - 4);
+	}
+	else if ((first = path.rfind("_files/")) != std::string::npos)
+	{
+		char extension[8] = { 0 };
+
+		name = path.substr(0, first);
+
+		if (sscanf(path.c_str() + first + 7, "%d/%d_%d.%7s", &level, &column, &row, extension) != 4 ||
+			(strcmp(extension, "jpeg") != 0 && strcmp(extension, "jpg") != 0))
+			name.clear();
+	}
+
+	if (!name.empty())
+	{
+		AcquireSRWLockShared(&server.lock);
+
+		std::map<std::string, INT64>::iterator it = server.slides.find(name);
+		if (it != server.slides.end()) handle = it->second;
+
+		ReleaseSRWLockShared(&server.lock);
+	}
+
+	//*** The reference keeps the slide open while the request is answered ********************************************
+	SessionReference reference(handle);
+
+	if ((session = reference.session) == NULL)
+		return SendResponse(socket, "404 Not Found", NULL, NULL, NULL, NULL, 0, false, headOnly);
+
+	if (descriptor)
+	{
+		sprintf(body, "<?xml version=\"1.0\" encoding=\"UTF-8\"?>\n<Image xmlns=\"http://schemas.microsoft.com/deepzoom/2008\" "
+			"Format=\"jpeg\" Overlap=\"%d\" TileSize=\"%d\"><Size Width=\"%u\" Height=\"%u\"/></Image>\n",
+			DZ_OVERLAP, DZ_TILE_SIZE, session->imageWidth, session->imageHeight);
+
+		return SendResponse(socket, "200 OK", "application/xml", NULL, NULL, body, strlen(body), keepAlive, headOnly);
+	}
+
+	if (!DeepZoomTileExists(session, level, column, row))
+		return SendResponse(socket, "404 Not Found", NULL, NULL, NULL, NULL, 0, false, headOnly);
+
+	//*** The tag follows from the request alone, so an unchanged tile is confirmed without reading it ****************
+	TileKey key = { session->slideId, level, column, row, server.quality, (UINT32)session->stainHash };
+
+	sprintf(etag, "\"%016llx-%d-%d-%d-%d-%08x\"", (unsigned long long)key.slideId, level, column, row, key.quality,
+		key.stain);
+
+	if (!ifNoneMatch.empty() && (ifNoneMatch == "*" || ifNoneMatch.find(etag) != std::string::npos))
+		return SendResponse(socket, "304 Not Modified", NULL, etag, NULL, NULL, 0, keepAlive, true);
+
+	if (!CacheLookup(key, &jpeg))
+	{
+		if (!RenderTile(handle, session, level, column, row, factory, &jpeg))
+			return SendResponse(socket, "404 Not Found", NULL, NULL, NULL, NULL, 0, false, headOnly);
+
+		//*** A tile rendered while the normalization changed may carry either one, so it is not kept *****************
+		if ((UINT32)session->stainHash == key.stain) CacheStore(key, jpeg);
+	}
+
+	//*** Ende ********************************************************************************************************
+	return SendResponse(socket, "200 OK", "image/jpeg", etag, NULL, jpeg.data(), jpeg.size(), keepAlive, headOnly);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: SendResponse ***********************************************/
+/*********************************************************************************************************************/
+
+// Sends status line, header and body; false if sending failed or the connection is to be closed
+static bool SendResponse(SOCKET socket, const char* status, const char* type, const char* etag, const char* extra,
+	const char* body, size_t length, bool keepAlive, bool headOnly)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::string response;
+	char field[160];
+
+	response = std::string("HTTP/1.1 ") + status + "\r\n";
+
+	if (type != NULL) response += std::string("Content-Type: ") + type + "\r\n";
+	if (etag != NULL) response += std::string("ETag: ") + etag + "\r\nCache-Control: public, max-age=3600\r\n";
+	if (extra != NULL) response += extra;
+
+	sprintf(field, "Content-Length: %u\r\n", (unsigned int)length);
+
+	response += field;
+	response += "Access-Control-Allow-Origin: *\r\n";
+	response += keepAlive ? "Connection: keep-alive\r\n\r\n" : "Connection: close\r\n\r\n";
+
+	//*** Head and a small body go out in one piece *******************************************************************
+	if (!headOnly && body != NULL && length <= 4096)
+	{
+		response.append(body, length);
+		body = NULL;
+	}
+
+	for (size_t sent = 0; sent < response.size();)
+	{
+		int count = send(socket, response.data() + sent, (int)(response.size() - sent), 0);
+
+		if (count <= 0) return false;
+		sent += count;
+	}
+
+	for (size_t sent = 0; !headOnly && body != NULL && sent < length;)
+	{
+		int count = send(socket, body + sent, (int)(length - sent), 0);
+
+		if (count <= 0) return false;
+		sent += count;
+	}
+
+	//*** Ende ********************************************************************************************************
+	return keepAlive;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: DeepZoomLevels **********************************************/
+/*********************************************************************************************************************/
+
+// The Deep Zoom pyramid halves the slide, rounding up, until it is a single pixel
+static INT32 DeepZoomLevels(Session* session)
+{
+	INT64 width = session->imageWidth, height = session->imageHeight;
+	INT32 levels = 1;
+
+	for (; width > 1 || height > 1; levels++)
+	{
+		width = (width + 1) / 2;
+		height = (height + 1) / 2;
+	}
+
+	return levels;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: DeepZoomTileExists ********************************************/
+/*********************************************************************************************************************/
+
+// True if the tile lies inside the Deep Zoom pyramid of the slide
+static bool DeepZoomTileExists(Session* session, INT32 level, INT32 column, INT32 row)
+{
+	INT32 levels = DeepZoomLevels(session), shift;
+	INT64 levelWidth, levelHeight;
+
+	if (level < 0 || level >= levels || column < 0 || row < 0) return false;
+
+	shift = levels - 1 - level;
+	levelWidth = ((INT64)session->imageWidth + ((INT64)1 << shift) - 1) >> shift;
+	levelHeight = ((INT64)session->imageHeight + ((INT64)1 << shift) - 1) >> shift;
+
+	return (INT64)column * DZ_TILE_SIZE < levelWidth && (INT64)row * DZ_TILE_SIZE < levelHeight;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: RenderTile ************************************************/
+/*********************************************************************************************************************/
+
+// Reads the tile from the native level closest above its scale, scales it down with a box filter, puts it on white
+// and encodes it. False if the tile lies outside the pyramid or cannot be read.
+static bool RenderTile(INT64 handle, Session* session, INT32 level, INT32 column, INT32 row,
+	IWICImagingFactory* factory, std::string* jpeg)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	INT32 levels = DeepZoomLevels(session), shift, columns, rows, left, top, width, height, stride;
+	INT32 native, sourceX, sourceY, sourceWidth, sourceHeight, factor;
+	INT64 levelWidth, levelHeight, scaledWidth, scaledHeight;
+	int64_t nativeWidth, nativeHeight;
+	double downsample, scale;
+	BYTE* source;
+	BYTE* pixels;
+	bool encoded;
+
+	if (level < 0 || level >= levels || column < 0 || row < 0) return false;
+
+	//*** Size of the Deep Zoom level and position of the tile in it, overlap included ********************************
+	shift = levels - 1 - level;
+	levelWidth = ((INT64)session->imageWidth + ((INT64)1 << shift) - 1) >> shift;
+	levelHeight = ((INT64)session->imageHeight + ((INT64)1 << shift) - 1) >> shift;
+	columns = (INT32)((levelWidth + DZ_TILE_SIZE - 1) / DZ_TILE_SIZE);
+	rows = (INT32)((levelHeight + DZ_TILE_SIZE - 1) / DZ_TILE_SIZE);
+
+	if (column >= columns || row >= rows) return false;
+
+	left = column * DZ_TILE_SIZE - (column > 0 ? DZ_OVERLAP : 0);
+	top = row * DZ_TILE_SIZE - (row > 0 ? DZ_OVERLAP : 0);
+	width = (INT32)(std::min)((INT64)DZ_TILE_SIZE, levelWidth - (INT64)column * DZ_TILE_SIZE) +
+		(column > 0 ? DZ_OVERLAP : 0) + (column < columns - 1 ? DZ_OVERLAP : 0);
+	height = (INT32)(std::min)((INT64)DZ_TILE_SIZE, levelHeight - (INT64)row * DZ_TILE_SIZE) +
+		(row > 0 ? DZ_OVERLAP : 0) + (row < rows - 1 ? DZ_OVERLAP : 0);
+
+	//*** The native level that is at least as detailed as the tile, and the region of it to read *********************
+	downsample = (double)((INT64)1 << shift);
+	native = openslide_get_best_level_for_downsample(session->slide, downsample);
+	if (native < 0) native = 0;
+
+	scale = downsample / openslide_get_level_downsample(session->slide, native);
+	openslide_get_level_dimensions(session->slide, native, &nativeWidth, &nativeHeight);
+
+	sourceX = (INT32)(left * scale);
+	sourceY = (INT32)(top * scale);
+	sourceWidth = (INT32)(std::min)((int64_t)ceil(width * scale), nativeWidth - sourceX);
+	sourceHeight = (INT32)(std::min)((int64_t)ceil(height * scale), nativeHeight - sourceY);
+
+	if (sourceWidth <= 0 || sourceHeight <= 0) return false;
+
+	stride = (width * 3 + 3) & ~3;
+	source = AllocTileBuffer((std::max)((size_t)sourceWidth * sourceHeight, (size_t)width * height) * 4);
+	pixels = AllocTileBuffer((size_t)stride * height);
+
+	if (source == NULL || pixels == NULL)
+	{
+		FreeTileBuffer(source);
+		FreeTileBuffer(pixels);
+		return false;
+	}
+
+	//*** At 1/2, 1/4 or 1/8 of a JPEG level the tiles are decoded at that size and need no averaging *****************
+	// the downsamples of the levels are rounded from their sizes, so the factor is checked against the sizes: the
+	// Deep Zoom level has to be the native level divided by it, give or take a pixel
+	factor = (INT32)floor(scale + 0.5);
+	scaledWidth = (nativeWidth + factor - 1) / factor;
+	scaledHeight = (nativeHeight + factor - 1) / factor;
+
+	if (factor > 1 && scaledWidth >= levelWidth - 1 && scaledWidth <= levelWidth + 1 &&
+		scaledHeight >= levelHeight - 1 && scaledHeight <= levelHeight + 1 &&
+		ReadRegionScaled(session, native, factor, left, top, width, height, source))
+	{
+		scale = 1.0;
+		sourceWidth = width;
+		sourceHeight = height;
+	}
+	else if (!GetRegionDecoded(handle, native, sourceX, sourceY, sourceWidth, sourceHeight, source))
+	{
+		FreeTileBuffer(source);
+		FreeTileBuffer(pixels);
+		return false;
+	}
+
+	//*** Average the source pixels under every tile pixel; premultiplied ARGB over white is c + 255 - a **************
+	for (INT32 y = 0; y < height; y++)
+	{
+		INT32 y0 = (std::min)((INT32)(y * scale), sourceHeight - 1);
+		INT32 y1 = (std::min)((std::max)(y0 + 1, (INT32)((y + 1) * scale)), sourceHeight);
+		BYTE* target = pixels + (size_t)y * stride;
+
+		for (INT32 x = 0; x < width; x++)
+		{
+			INT32 x0 = (std::min)((INT32)(x * scale), sourceWidth - 1);
+			INT32 x1 = (std::min)((std::max)(x0 + 1, (INT32)((x + 1) * scale)), sourceWidth);
+			UINT32 a = 0, r = 0, g = 0, b = 0, count = (UINT32)((x1 - x0) * (y1 - y0));
+
+			for (INT32 sy = y0; sy < y1; sy++)
+			{
+				const UINT32* pixel = (const UINT32*)source + (size_t)sy * sourceWidth + x0;
+
+				for (INT32 sx = x0; sx < x1; sx++, pixel++)
+				{
+					a += *pixel >> 24;
+					r += (*pixel >> 16) & 0xFF;
+					g += (*pixel >> 8) & 0xFF;
+					b += *pixel & 0xFF;
+				}
+			}
+
+			a /= count;
+			target[x * 3 + 0] = (BYTE)(std::min)(255u, b / count + 255 - a);
+			target[x * 3 + 1] = (BYTE)(std::min)(255u, g / count + 255 - a);
+			target[x * 3 + 2] = (BYTE)(std::min)(255u, r / count + 255 - a);
+		}
+	}
+
+	FreeTileBuffer(source);
+
+	encoded = (factory != NULL && EncodeJpeg(factory, pixels, width, height, stride, server.quality, jpeg));
+
+	FreeTileBuffer(pixels);
+
+	//*** Ende ********************************************************************************************************
+	return encoded;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: EncodeJpeg ************************************************/
+/*********************************************************************************************************************/
+
+// Encodes 24 bit BGR rows with the JPEG encoder of the Windows Imaging Component
+static bool EncodeJpeg(IWICImagingFactory* factory, BYTE* pixels, INT32 width, INT32 height, INT32 stride,
+	INT32 quality, std::string* jpeg)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	IWICBitmapEncoder* encoder = NULL;
+	IWICBitmapFrameEncode* frame = NULL;
+	IPropertyBag2* options = NULL;
+	IStream* stream = NULL;
+	WICPixelFormatGUID format = GUID_WICPixelFormat24bppBGR;
+	PROPBAG2 option;
+	VARIANT value;
+	STATSTG status;
+	HGLOBAL memory;
+	HRESULT result;
+
+	memset(&option, 0, sizeof(option));
+	option.pstrName = (LPOLESTR)L"ImageQuality";
+	VariantInit(&value);
+	value.vt = VT_R4;
+	value.fltVal = quality / 100.0f;
+
+	result = CreateStreamOnHGlobal(NULL, TRUE, &stream);
+
+	if (SUCCEEDED(result)) result = factory->CreateEncoder(GUID_ContainerFormatJpeg, NULL, &encoder);
+	if (SUCCEEDED(result)) result = encoder->Initialize(stream, WICBitmapEncoderNoCache);
+	if (SUCCEEDED(result)) result = encoder->CreateNewFrame(&frame, &options);
+	if (SUCCEEDED(result)) result = options->Write(1, &option, &value);
+	if (SUCCEEDED(result)) result = frame->Initialize(options);
+	if (SUCCEEDED(result)) result = frame->SetSize(width, height);
+	if (SUCCEEDED(result)) result = frame->SetPixelFormat(&format);
+	if (SUCCEEDED(result) && !IsEqualGUID(format, GUID_WICPixelFormat24bppBGR)) result = E_FAIL;
+	if (SUCCEEDED(result)) result = frame->WritePixels(height, stride, stride * height, pixels);
+	if (SUCCEEDED(result)) result = frame->Commit();
+	if (SUCCEEDED(result)) result = encoder->Commit();
+	if (SUCCEEDED(result)) result = stream->Stat(&status, STATFLAG_NONAME);
+	if (SUCCEEDED(result)) result = GetHGlobalFromStream(stream, &memory);
+
+	if (SUCCEEDED(result))
+	{
+		jpeg->assign((const char*)GlobalLock(memory), (size_t)status.cbSize.QuadPart);
+		GlobalUnlock(memory);
+	}
+
+	if (options != NULL) options->Release();
+	if (frame != NULL) frame->Release();
+	if (encoder != NULL) encoder->Release();
+	if (stream != NULL) stream->Release();
+
+	//*** Ende ********************************************************************************************************
+	return SUCCEEDED(result);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: CacheLookup ***********************************************/
+/*********************************************************************************************************************/
+
+static bool CacheLookup(const TileKey& key, std::string* jpeg)
+{
+	bool found = false;
+
+	if (tileCache.maxBytes == 0) return false;
+
+	AcquireSRWLockExclusive(&tileCache.lock);
+
+	std::unordered_map<TileKey, std::list<CachedTile>::iterator, TileKeyHash>::iterator it = tileCache.index.find(key);
+
+	if (it != tileCache.index.end())
+	{
+		tileCache.tiles.splice(tileCache.tiles.begin(), tileCache.tiles, it->second);
+		*jpeg = it->second->jpeg;
+		found = true;
+	}
+
+	ReleaseSRWLockExclusive(&tileCache.lock);
+
+	return found;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: CacheStore ************************************************/
+/*********************************************************************************************************************/
+
+// The charge is taken before the lock: charging may shed this very cache
+static void CacheStore(const TileKey& key, const std::string& jpeg)
+{
+	INT64 size = (INT64)(jpeg.size() + sizeof(CachedTile));
+	INT64 freed = 0;
+
+	if (tileCache.maxBytes == 0 || size > tileCache.maxBytes || !ChargeMemory(MEMORY_CACHES, size)) return;
+
+	AcquireSRWLockExclusive(&tileCache.lock);
+
+	if (tileCache.index.find(key) != tileCache.index.end())
+	{
+		freed = size;
+	}
+	else
+	{
+		CachedTile tile = { key, jpeg };
+
+		tileCache.tiles.push_front(tile);
+		tileCache.index[key] = tileCache.tiles.begin();
+		tileCache.bytes += size;
+
+		//*** Evict the least recently used tiles beyond the size of the cache ****************************************
+		while (tileCache.bytes > tileCache.maxBytes)
+		{
+			INT64 evicted = (INT64)(tileCache.tiles.back().jpeg.size() + sizeof(CachedTile));
+
+			tileCache.index.erase(tileCache.tiles.back().key);
+			tileCache.tiles.pop_back();
+			tileCache.bytes -= evicted;
+			freed += evicted;
+		}
+	}
+
+	ReleaseSRWLockExclusive(&tileCache.lock);
+
+	ReleaseMemory(MEMORY_CACHES, freed);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: DropServedTiles *********************************************/
+/*********************************************************************************************************************/
+
+// Called by SetStainNormalization: removes the cached tiles of a slide, whatever normalization they were encoded with
+void DropServedTiles(UINT64 slideId)
+{
+	INT64 freed = 0;
+
+	AcquireSRWLockExclusive(&tileCache.lock);
+
+	for (std::list<CachedTile>::iterator it = tileCache.tiles.begin(); it != tileCache.tiles.end();)
+	{
+		if (it->key.slideId != slideId)
+		{
+			++it;
+			continue;
+		}
+
+		INT64 evicted = (INT64)(it->jpeg.size() + sizeof(CachedTile));
+
+		tileCache.index.erase(it->key);
+		it = tileCache.tiles.erase(it);
+		tileCache.bytes -= evicted;
+		freed += evicted;
+	}
+
+	ReleaseSRWLockExclusive(&tileCache.lock);
+
+	ReleaseMemory(MEMORY_CACHES, freed);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: TrimTileCache **********************************************/
+/*********************************************************************************************************************/
+
+// Shedder of the memory budget, also used to empty the cache when the server stops
+static INT64 TrimTileCache(INT64 bytes)
+{
+	INT64 freed = 0;
+
+	AcquireSRWLockExclusive(&tileCache.lock);
+
+	while (freed < bytes && !tileCache.tiles.empty())
+	{
+		INT64 evicted = (INT64)(tileCache.tiles.back().jpeg.size() + sizeof(CachedTile));
+
+		tileCache.index.erase(tileCache.tiles.back().key);
+		tileCache.tiles.pop_back();
+		tileCache.bytes -= evicted;
+		freed += evicted;
+	}
+
+	ReleaseSRWLockExclusive(&tileCache.lock);
+
+	ReleaseMemory(MEMORY_CACHES, freed);
+
+	return freed;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: UrlDecode ************************************************/
+/*********************************************************************************************************************/
+
+static std::string UrlDecode(const std::string& text)
+{
+	std::string decoded;
+	unsigned int value;
+
+	for (size_t i = 0; i < text.size(); i++)
+	{
+		if (text[i] == '%' && i + 2 < text.size() && sscanf(text.c_str() + i + 1, "%2x", &value) == 1)
+		{
+			decoded += (char)value;
+			i += 2;
+		}
+		else decoded += text[i];
+	}
+
+	return decoded;
+}
@@ -0,0 +1,21 @@
+/*********************************************************************************************************************/
+/* Datei: TileServer.h                                                                                               */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Embedded HTTP/1.1 server for Deep Zoom descriptors and JPEG tiles of the published slides          */
+/*********************************************************************************************************************/
+
+#ifndef TILE_SERVER_H
+#define TILE_SERVER_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+void UnpublishClosedSlide(INT64 handle);
+void DropServedTiles(UINT64 slideId);
+
+#endif
@@ -0,0 +1,109 @@
+/*********************************************************************************************************************/
+/* Datei: TileStatistics.cpp                                                                                         */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Per-tile colour statistics gathered while the pixels are copied out of the read buffer             */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <string.h>
+
+#include "TileStatistics.h"
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: InitTileStatistics ********************************************/
+/*********************************************************************************************************************/
+
+void InitTileStatistics(TileStatistics* statistics, INT32 whiteThreshold, bool histogram)
+{
+	memset(statistics, 0, sizeof(TileStatistics));
+
+	statistics->whiteThreshold = (whiteThreshold > 0) ? (UINT32)whiteThreshold : TILE_WHITE_THRESHOLD;
+	statistics->withHistogram = histogram;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************* Funktion: CopyTileStatistics ********************************************/
+/*********************************************************************************************************************/
+
+// Copies premultiplied ARGB pixels from src to dst and adds them to the statistics in the same pass; dst may be NULL
+// if only the statistics are wanted. Pixels that are not opaque are masked out instead of skipped, so the loop has no
+// data-dependent branch and can be vectorized by the compiler when no histogram is counted.
+void CopyTileStatistics(const uint32_t* src, BYTE* dst, int pixels, TileStatistics* statistics)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	const uint32_t threshold = statistics->whiteThreshold;
+	uint32_t* out = (uint32_t*)dst;
+	UINT64 sumR = 0, sumG = 0, sumB = 0, squaresR = 0, squaresG = 0, squaresB = 0;
+	UINT32 opaque = 0, white = 0;
+	bool withHistogram = statistics->withHistogram;
+
+	for (int i = 0; i < pixels; i++)
+	{
+		uint32_t p = src[i];
+		uint32_t o = (p >> 24) == 0xFF;
+		uint32_t mask = 0u - o;
+		uint32_t r = (p >> 16) & 0xFF & mask, g = (p >> 8) & 0xFF & mask, b = p & 0xFF & mask;
+
+		if (out != NULL) out[i] = p;
+
+		sumR += r;
+		sumG += g;
+		sumB += b;
+		squaresR += r * r;
+		squaresG += g * g;
+		squaresB += b * b;
+		opaque += o;
+		white += o & (r >= threshold) & (g >= threshold) & (b >= threshold);
+
+		//*** Pixels that are not opaque add 0 to bin 0 ***************************************************************
+		if (withHistogram)
+		{
+			statistics->histogram[0][r] += o;
+			statistics->histogram[1][g] += o;
+			statistics->histogram[2][b] += o;
+		}
+	}
+
+	statistics->pixels += (UINT32)pixels;
+	statistics->opaque += opaque;
+	statistics->white += white;
+	statistics->sum[0] += sumR;
+	statistics->sum[1] += sumG;
+	statistics->sum[2] += sumB;
+	statistics->squares[0] += squaresR;
+	statistics->squares[1] += squaresG;
+	statistics->squares[2] += squaresB;
+}
+
+
+/*********************************************************************************************************************/
+/****************************************** Funktion: FinishTileStatistics *******************************************/
+/*********************************************************************************************************************/
+
+// Writes the TILE_STATISTICS_COUNT values and, if histogram is not NULL, the TILE_HISTOGRAM_SIZE bins
+void FinishTileStatistics(const TileStatistics* statistics, double* values, INT32* histogram)
+{
+	for (int c = 0; c < 3; c++)
+	{
+		double mean = 0, variance = 0;
+
+		if (statistics->opaque > 0)
+		{
+			mean = (double)statistics->sum[c] / statistics->opaque;
+			variance = (double)statistics->squares[c] / statistics->opaque - mean * mean;
+			if (variance < 0) variance = 0;
+		}
+
+		values[c] = mean;
+		values[3 + c] = variance;
+	}
+
+	values[6] = (statistics->opaque > 0) ? (double)statistics->white / statistics->opaque : 0;
+	values[7] = (statistics->pixels > 0) ? (double)(statistics->pixels - statistics->opaque) / statistics->pixels : 0;
+
+	if (histogram != NULL && statistics->withHistogram)
+		memcpy(histogram, statistics->histogram, TILE_HISTOGRAM_SIZE * sizeof(INT32));
+}
@@ -0,0 +1,56 @@
+/*********************************************************************************************************************/
+/* Datei: TileStatistics.h                                                                                           */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Per-tile colour statistics gathered while the pixels are copied out of the read buffer             */
+/*********************************************************************************************************************/
+
+#ifndef TILE_STATISTICS_H
+#define TILE_STATISTICS_H
+
+#include <windows.h>
+#include <stdint.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// values per tile: mean r, g, b and variance r, g, b of the opaque pixels, the fraction of the opaque pixels that are
+// white and the fraction of all pixels that are not opaque (outside the slide)
+#define TILE_STATISTICS_COUNT		8
+
+// histogram per tile: 256 bins of r, then g, then b, counting the opaque pixels
+#define TILE_HISTOGRAM_SIZE			(3 * 256)
+
+// a pixel is white if all three channels reach the threshold; used when the caller passes 0
+#define TILE_WHITE_THRESHOLD		220
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur: TileStatistics **********************************************/
+/*********************************************************************************************************************/
+
+// Running sums of one tile; the histogram is only counted if withHistogram is set
+struct TileStatistics
+{
+	UINT32 whiteThreshold;
+	bool withHistogram;
+	UINT32 pixels;
+	UINT32 opaque;
+	UINT32 white;
+	UINT64 sum[3];
+	UINT64 squares[3];
+	UINT32 histogram[3][256];
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+void InitTileStatistics(TileStatistics* statistics, INT32 whiteThreshold, bool histogram);
+void CopyTileStatistics(const uint32_t* src, BYTE* dst, int pixels, TileStatistics* statistics);
+void FinishTileStatistics(const TileStatistics* statistics, double* values, INT32* histogram);
+
+#endif
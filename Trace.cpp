@@ -0,0 +1,299 @@
+/*********************************************************************************************************************/
+/* Datei: Trace.cpp                                                                                                  */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Optional per-thread recording of pipeline spans, written as Chrome trace-event JSON                */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdio.h>
+#include <string>
+#include <vector>
+
+#include "Trace.h"
+#include "MemoryBudget.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+// spans kept per thread; older ones are overwritten
+#define TRACE_RING_SIZE				16384
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct TraceEvent
+{
+	const char* name;
+	INT64 start;
+	INT64 duration;
+	DWORD threadId;
+	INT32 level;
+	INT32 x;
+	INT32 y;
+};
+
+// Written only by the owning thread. head counts all spans ever written, in 64 bits so that it never wraps; it is
+// published after the span itself, so a reader takes a span as valid if its slot was not taken by a later span while
+// the ring was copied. Other threads read head with InterlockedCompareExchange64, which is atomic on 32 bits as well.
+struct TraceRing
+{
+	TraceRing* next;
+	volatile LONG owned;
+	volatile LONGLONG head;
+	TraceEvent events[TRACE_RING_SIZE];
+};
+
+static struct
+{
+	volatile LONG enabled;
+	TraceRing* volatile rings;
+	LARGE_INTEGER frequency;
+	INT64 origin;
+	SRWLOCK lock;
+	wchar_t closePath[MAX_PATH];
+} trace;
+
+static __declspec(thread) TraceRing* threadRing;
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static TraceRing* AttachRing();
+static BOOL WriteTrace(const wchar_t* path);
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: SetTracing ************************************************/
+/*********************************************************************************************************************/
+
+// Turns span recording on or off. If closePath is given, every CloseImage writes the spans recorded so far to that
+// file; DumpTrace writes them at any time.
+extern "C" __declspec(dllexport) BOOL SetTracing(BOOL enabled, wchar_t* closePath)
+{
+	AcquireSRWLockExclusive(&trace.lock);
+
+	if (trace.frequency.QuadPart == 0)
+	{
+		LARGE_INTEGER now;
+
+		QueryPerformanceFrequency(&trace.frequency);
+		QueryPerformanceCounter(&now);
+		trace.origin = now.QuadPart;
+	}
+
+	trace.closePath[0] = 0;
+	if (closePath != NULL) wcsncpy_s(trace.closePath, MAX_PATH, closePath, _TRUNCATE);
+
+	ReleaseSRWLockExclusive(&trace.lock);
+
+	InterlockedExchange(&trace.enabled, enabled ? 1 : 0);
+
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: DumpTrace ************************************************/
+/*********************************************************************************************************************/
+
+extern "C" __declspec(dllexport) BOOL DumpTrace(wchar_t* path)
+{
+	if (path == NULL) return false;
+
+	return WriteTrace(path);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: TraceStart ************************************************/
+/*********************************************************************************************************************/
+
+INT64 TraceStart()
+{
+	LARGE_INTEGER now;
+
+	if (trace.enabled == 0) return 0;
+
+	QueryPerformanceCounter(&now);
+
+	return now.QuadPart;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: TraceEnd *************************************************/
+/*********************************************************************************************************************/
+
+void TraceEnd(const char* name, INT64 start, INT32 level, INT32 x, INT32 y)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	LARGE_INTEGER now;
+	TraceRing* ring;
+	TraceEvent* event;
+
+	if (start == 0) return;
+
+	QueryPerformanceCounter(&now);
+
+	if ((ring = threadRing) == NULL && (ring = AttachRing()) == NULL) return;
+
+	//*** Fill the slot, then publish it ******************************************************************************
+	event = &ring->events[ring->head % TRACE_RING_SIZE];
+	event->name = name;
+	event->start = start;
+	event->duration = now.QuadPart - start;
+	event->threadId = GetCurrentThreadId();
+	event->level = level;
+	event->x = x;
+	event->y = y;
+
+	InterlockedIncrement64(&ring->head);
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: ReleaseTraceRing *********************************************/
+/*********************************************************************************************************************/
+
+// Called when a thread detaches from the DLL. The ring keeps its spans and is handed to the next new thread; every
+// span carries the id of the thread that recorded it, so the old ones are not attributed to the new owner.
+void ReleaseTraceRing()
+{
+	if (threadRing == NULL) return;
+
+	InterlockedExchange(&threadRing->owned, 0);
+	threadRing = NULL;
+}
+
+
+/*********************************************************************************************************************/
+/******************************************** Funktion: WriteTraceOnClose ********************************************/
+/*********************************************************************************************************************/
+
+void WriteTraceOnClose()
+{
+	wchar_t path[MAX_PATH];
+
+	if (trace.enabled == 0) return;
+
+	AcquireSRWLockShared(&trace.lock);
+	wcsncpy_s(path, MAX_PATH, trace.closePath, _TRUNCATE);
+	ReleaseSRWLockShared(&trace.lock);
+
+	if (path[0] != 0) WriteTrace(path);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: AttachRing ************************************************/
+/*********************************************************************************************************************/
+
+// Reuses the ring of a thread that has exited, or adds a new one to the lock-free list
+static TraceRing* AttachRing()
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	TraceRing* ring;
+
+	for (ring = trace.rings; ring != NULL; ring = ring->next)
+	{
+		if (ring->owned == 0 && InterlockedCompareExchange(&ring->owned, 1, 0) == 0) break;
+	}
+
+	if (ring == NULL)
+	{
+		if (!ChargeMemory(MEMORY_TRACING, sizeof(TraceRing))) return NULL;
+
+		if ((ring = (TraceRing*)VirtualAlloc(NULL, sizeof(TraceRing), MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE)) == NULL)
+		{
+			ReleaseMemory(MEMORY_TRACING, sizeof(TraceRing));
+			return NULL;
+		}
+
+		ring->owned = 1;
+
+		//*** Push onto the list; rings are never removed, so there is no ABA problem *********************************
+		do
+		{
+			ring->next = trace.rings;
+		} while (InterlockedCompareExchangePointer((PVOID volatile*)&trace.rings, ring, ring->next) != ring->next);
+	}
+
+	threadRing = ring;
+
+	//*** Ende ********************************************************************************************************
+	return ring;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: WriteTrace ************************************************/
+/*********************************************************************************************************************/
+
+// Writes a snapshot of all rings as complete ("X") events with timestamps in microseconds since tracing was set up
+static BOOL WriteTrace(const wchar_t* path)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<TraceEvent> events;
+	std::string json;
+	char line[384];
+	double scale;
+	HANDLE file;
+	DWORD written;
+	BOOL result;
+	bool comma = false;
+
+	if (trace.frequency.QuadPart == 0) return false;
+
+	scale = 1000000.0 / (double)trace.frequency.QuadPart;
+
+	json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n";
+
+	for (TraceRing* ring = trace.rings; ring != NULL; ring = ring->next)
+	{
+		LONGLONG head = InterlockedCompareExchange64(&ring->head, 0, 0);
+		LONGLONG first = (head > TRACE_RING_SIZE) ? head - TRACE_RING_SIZE : 0;
+		LONGLONG after;
+
+		//*** Copy, then drop the spans the owner may have overwritten meanwhile **************************************
+		events.assign(ring->events, ring->events + TRACE_RING_SIZE);
+		MemoryBarrier();
+		after = InterlockedCompareExchange64(&ring->head, 0, 0);
+
+		//*** The owner may be writing span after right now, into the slot of span after - TRACE_RING_SIZE ***********
+		if (after - TRACE_RING_SIZE + 1 > first) first = after - TRACE_RING_SIZE + 1;
+
+		for (LONGLONG i = first; i < head; i++)
+		{
+			const TraceEvent* event = &events[i % TRACE_RING_SIZE];
+
+			_snprintf(line, sizeof(line), "%s{\"name\":\"%s\",\"cat\":\"svsimage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,"
+				"\"pid\":%lu,\"tid\":%lu,\"args\":{\"level\":%d,\"x\":%d,\"y\":%d}}", comma ? ",\n" : "",
+				event->name, (event->start - trace.origin) * scale, event->duration * scale, GetCurrentProcessId(),
+				event->threadId, event->level, event->x, event->y);
+			line[sizeof(line) - 1] = 0;
+
+			json += line;
+			comma = true;
+		}
+	}
+
+	json += "\n]}\n";
+
+	//*** Write the file in one go ************************************************************************************
+	file = CreateFileW(path, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (file == INVALID_HANDLE_VALUE) return false;
+
+	result = WriteFile(file, json.c_str(), (DWORD)json.size(), &written, NULL) && written == json.size();
+
+	CloseHandle(file);
+
+	//*** Ende ********************************************************************************************************
+	return result;
+}
@@ -0,0 +1,25 @@
+/*********************************************************************************************************************/
+/* Datei: Trace.h                                                                                                    */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll                                                                                             */
+/* Description:   Optional per-thread recording of pipeline spans, written as Chrome trace-event JSON                */
+/*********************************************************************************************************************/
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <windows.h>
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+// TraceStart returns 0 while tracing is off, and TraceEnd ignores spans that started with 0, so the calls cost a
+// single flag test in normal operation. name must be a string literal; it is stored by pointer.
+INT64 TraceStart();
+void TraceEnd(const char* name, INT64 start, INT32 level, INT32 x, INT32 y);
+void ReleaseTraceRing();
+void WriteTraceOnClose();
+
+#endif
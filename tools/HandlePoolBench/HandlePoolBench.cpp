@@ -0,0 +1,184 @@
+/*********************************************************************************************************************/
+/* Datei: HandlePoolBench.cpp                                                                                        */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll tools                                                                                       */
+/* Description:   Measures tiles/s of one slide read from many threads for increasing openslide handle pool sizes    */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../SVSImageApi.h"
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct BenchRun
+{
+	INT64 handle;
+	INT32 level;
+	INT32 columns;
+	INT32 rows;
+	INT32 bufferSize;
+	LONG tiles;
+	volatile LONG next;
+	volatile LONG failed;
+};
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ReadTiles ************************************************/
+/*********************************************************************************************************************/
+
+// Worker: reads the tiles of the run in row-major order until all are taken
+static DWORD WINAPI ReadTiles(LPVOID parameter)
+{
+	BenchRun* run = (BenchRun*)parameter;
+	BYTE* buffer = (BYTE*)malloc(run->bufferSize);
+	LONG index;
+
+	while ((index = InterlockedIncrement(&run->next) - 1) < run->tiles)
+	{
+		INT32 tile = index % (run->columns * run->rows);
+
+		if (!GetTileDecoded(run->handle, run->level, tile % run->columns, tile / run->columns, buffer))
+			InterlockedIncrement(&run->failed);
+	}
+
+	free(buffer);
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: WaitForThreads **********************************************/
+/*********************************************************************************************************************/
+
+// Joins count threads in chunks, as WaitForMultipleObjects takes at most MAXIMUM_WAIT_OBJECTS handles; a chunk whose
+// wait fails is joined one by one. Returns false if a handle was invalid.
+static bool WaitForThreads(HANDLE* threads, INT32 count)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	bool joined = true;
+	DWORD chunk;
+
+	for (INT32 i = 0; i < count; i += (INT32)chunk)
+	{
+		chunk = (DWORD)((count - i < MAXIMUM_WAIT_OBJECTS) ? count - i : MAXIMUM_WAIT_OBJECTS);
+
+		if (WaitForMultipleObjects(chunk, &threads[i], TRUE, INFINITE) != WAIT_FAILED) continue;
+
+		for (DWORD j = 0; j < chunk; j++)
+		{
+			if (WaitForSingleObject(threads[i + j], INFINITE) == WAIT_FAILED) joined = false;
+		}
+	}
+
+	return joined;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: Measure *************************************************/
+/*********************************************************************************************************************/
+
+// Opens the slide with a fresh pool of the given size and returns the throughput in tiles per second
+static double Measure(char* path, INT32 level, INT32 threads, INT32 poolSize, LONG tiles)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	LARGE_INTEGER frequency, start, end;
+	HANDLE* workers;
+	INT32 started = 0;
+	INT32 tileWidth, tileHeight, width, height;
+	BenchRun run;
+
+	if ((run.handle = OpenImage((wchar_t*)path)) == 0) return -1;
+
+	GetTileSize(run.handle, &tileWidth, &tileHeight);
+	GetLevelSize(run.handle, level, &width, &height);
+
+	if (!SetSlideHandlePool(run.handle, poolSize) && poolSize > 1)
+	{
+		CloseImage(run.handle);
+		return -1;
+	}
+
+	run.level = level;
+	run.columns = (width + tileWidth - 1) / tileWidth;
+	run.rows = (height + tileHeight - 1) / tileHeight;
+	run.bufferSize = 4 * tileWidth * tileHeight;
+	run.tiles = tiles;
+	run.next = 0;
+	run.failed = 0;
+
+	//*** Start all threads at once and wait for them *****************************************************************
+	workers = (HANDLE*)malloc(threads * sizeof(HANDLE));
+
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+
+	for (INT32 i = 0; i < threads; i++)
+	{
+		if ((workers[started] = CreateThread(NULL, 0, ReadTiles, &run, 0, NULL)) != NULL) started++;
+	}
+
+	if (!WaitForThreads(workers, started)) fprintf(stderr, "pool %d: cannot wait for the threads\n", poolSize);
+
+	QueryPerformanceCounter(&end);
+
+	for (INT32 i = 0; i < started; i++) CloseHandle(workers[i]);
+	free(workers);
+
+	CloseImage(run.handle);
+
+	if (run.failed > 0) fprintf(stderr, "pool %d: %ld tiles failed\n", poolSize, run.failed);
+
+	return tiles / ((double)(end.QuadPart - start.QuadPart) / frequency.QuadPart);
+}
+
+
+/*********************************************************************************************************************/
+/************************************************** Funktion: main ***************************************************/
+/*********************************************************************************************************************/
+
+int main(int argc, char* argv[])
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	SYSTEM_INFO system;
+	INT32 level, threads;
+	LONG tiles;
+
+	if (argc < 2)
+	{
+		printf("usage: HandlePoolBench <slide> [level] [threads] [tiles]\n");
+		return 1;
+	}
+
+	GetSystemInfo(&system);
+
+	level = (argc > 2) ? atoi(argv[2]) : 0;
+	threads = (argc > 3) ? atoi(argv[3]) : (INT32)system.dwNumberOfProcessors;
+	tiles = (argc > 4) ? atol(argv[4]) : 4096;
+
+	//*** Warm up the file system cache so that the first pool size is not penalized **********************************
+	if (Measure(argv[1], level, threads, 1, tiles) < 0)
+	{
+		fprintf(stderr, "cannot open %s\n", argv[1]);
+		return 1;
+	}
+
+	printf("threads: %d, level: %d, tiles per run: %ld\n\n", threads, level, tiles);
+	printf("pool size    tiles/s\n");
+
+	//*** Double the pool size up to the number of threads, which is always measured last ****************************
+	for (INT32 poolSize = 1; ; poolSize = (poolSize * 2 > threads) ? threads : poolSize * 2)
+	{
+		printf("%9d %10.1f\n", poolSize, Measure(argv[1], level, threads, poolSize, tiles));
+
+		if (poolSize >= threads) break;
+	}
+
+	return 0;
+}
@@ -0,0 +1,29 @@
+/*********************************************************************************************************************/
+/* Datei: SVSImageApi.h                                                                                              */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll tools                                                                                       */
+/* Description:   Declarations of the svsimage.dll exports used by the command line tools                            */
+/*********************************************************************************************************************/
+
+#ifndef SVSIMAGE_API_H
+#define SVSIMAGE_API_H
+
+#include <windows.h>
+
+#define SVSIMAGE_API extern "C" __declspec(dllimport)
+
+// OpenImage passes its argument to openslide_open as a narrow path, so the tools hand in a char* cast to wchar_t*
+SVSIMAGE_API INT64 OpenImage(wchar_t* filename);
+SVSIMAGE_API void CloseImage(INT64 handle);
+SVSIMAGE_API void GetTileSize(INT64 handle, INT32* x, INT32* y);
+SVSIMAGE_API void GetLevels(INT64 handle, INT32* levels);
+SVSIMAGE_API BOOL GetLevelSize(INT64 handle, INT32 level, INT32* x, INT32* y);
+SVSIMAGE_API BOOL GetTileDecoded(INT64 handle, INT32 level, INT32 x, INT32 y, BYTE* data);
+SVSIMAGE_API BOOL GetRegionDecoded(INT64 handle, INT32 level, INT32 x, INT32 y, INT32 width, INT32 height, BYTE* data);
+SVSIMAGE_API BOOL SetSlideHandlePool(INT64 handle, INT32 count);
+SVSIMAGE_API BOOL SetSharedTileCache(wchar_t* name, INT64 sizeBytes, INT32 slotSize);
+SVSIMAGE_API BOOL SetDiskCache(wchar_t* directory, INT64 maxBytes);
+SVSIMAGE_API BOOL SetReadAhead(INT32 maxGap, INT32 maxSpan);
+SVSIMAGE_API BOOL GetAccessStatistics(INT64* values, BOOL reset);
+
+#endif
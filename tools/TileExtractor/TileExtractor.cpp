@@ -0,0 +1,905 @@
+/*********************************************************************************************************************/
+/* Datei: TileExtractor.cpp                                                                                          */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll tools                                                                                       */
+/* Description:   Extracts the tissue patches of a whole slide list into pack files, resumable after a crash         */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "../SVSImageApi.h"
+
+/*********************************************************************************************************************/
+/********************************************** Konstanten-Deklarationen *********************************************/
+/*********************************************************************************************************************/
+
+#define CHECKPOINT_MAGIC			0x58545653		// "SVTX"
+#define CHECKPOINT_VERSION			1
+#define PATCH_MAGIC					0x50545653		// "SVTP"
+
+// patches per unit of work; small enough to balance small slides, large enough to keep the queues quiet
+#define CHUNK_PATCHES				32
+
+// chunk of a checkpoint record that marks the whole slide as done
+#define CHUNK_SLIDE_DONE			-1
+
+// chunk of a task that opens the slide and plans its chunks
+#define CHUNK_PLAN					-1
+
+// a pixel of the tissue mask is tissue if its channels differ by at least this much (saturation, not white/black)
+#define TISSUE_SATURATION			20
+#define TISSUE_STRIP_ROWS			64
+
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+// Start of the checkpoint file; a resume only continues a checkpoint written with the same settings
+struct CheckpointHeader
+{
+	UINT32 magic;
+	UINT32 version;
+	INT32 level;
+	INT32 patchSize;
+	INT32 chunkPatches;
+	INT32 slideCount;
+	INT32 minTissue;				// per mille
+	INT32 threads;
+};
+
+// Appended after the patches of a chunk are written: the chunk is done and the shard of the worker is valid up to
+// offset. Everything a shard holds behind its last record is cut off on resume.
+struct CheckpointRecord
+{
+	INT32 slide;
+	INT32 chunk;
+	INT32 worker;
+	INT32 sequence;
+	INT64 offset;
+};
+
+// Precedes the pixels of every patch in a shard; the pixels are premultiplied ARGB as returned by GetRegionDecoded
+struct PatchHeader
+{
+	UINT32 magic;
+	INT32 slide;
+	INT32 level;
+	INT32 x;
+	INT32 y;
+	INT32 width;
+	INT32 height;
+	UINT32 length;
+};
+
+struct ExtractTask
+{
+	INT32 slide;
+	INT32 chunk;
+};
+
+// Owner takes from the back, thieves from the front
+struct WorkQueue
+{
+	SRWLOCK lock;
+	std::deque<ExtractTask> tasks;
+};
+
+struct SlideJob
+{
+	std::string path;
+	INT64 handle;
+	INT32 columns;
+	std::vector<INT32> patches;
+	std::vector<INT32> doneChunks;
+	volatile LONG remaining;
+	bool finished;
+};
+
+struct ShardState
+{
+	INT32 sequence;
+	INT64 offset;
+	bool resumed;
+};
+
+struct Extraction
+{
+	std::string output;
+	INT32 level;
+	INT32 patchSize;
+	INT32 minTissue;
+	INT32 threads;
+	INT64 shardBytes;
+	std::vector<SlideJob> slides;
+	std::vector<ShardState> shards;
+	WorkQueue* queues;
+	HANDLE checkpoint;
+	FILE* failures;
+	SRWLOCK checkpointLock;
+	SRWLOCK waitLock;
+	CONDITION_VARIABLE workChanged;
+	volatile LONG queued;
+	volatile LONG pending;
+	volatile LONG patchesWritten;
+	volatile LONG patchesFailed;
+	volatile LONG slidesDone;
+	volatile LONG slidesFailed;
+	volatile LONG aborted;
+};
+
+struct Worker
+{
+	Extraction* job;
+	INT32 index;
+	HANDLE shard;
+	INT32 sequence;
+	INT64 offset;
+	BYTE* buffer;
+};
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktions-Deklarationen **********************************************/
+/*********************************************************************************************************************/
+
+static bool ReadSlideList(const char* path, Extraction* job);
+static bool OpenCheckpoint(Extraction* job);
+static void TruncateShards(Extraction* job);
+static std::string ShardPath(Extraction* job, INT32 worker, INT32 sequence);
+static bool OpenShard(Worker* worker, bool resume);
+static DWORD WINAPI ExtractWorker(LPVOID parameter);
+static bool TakeTask(Worker* worker, ExtractTask* task);
+static void PlanSlide(Worker* worker, INT32 slide);
+static void ExtractChunk(Worker* worker, ExtractTask task);
+static void FinishSlide(Worker* worker, INT32 slide);
+static bool WriteCheckpoint(Extraction* job, CheckpointRecord* record);
+static void PublishWork(Extraction* job, LONG tasks);
+static void AbortExtraction(Extraction* job);
+static BYTE* BuildTissueMask(INT64 handle, INT32 level, INT32* width, INT32* height);
+
+
+/*********************************************************************************************************************/
+/************************************************** Funktion: main ***************************************************/
+/*********************************************************************************************************************/
+
+int main(int argc, char* argv[])
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::vector<HANDLE> threads;
+	std::vector<Worker> workers;
+	SYSTEM_INFO system;
+	Extraction job;
+	INT32 slidesOpen;
+
+	if (argc < 5)
+	{
+		printf("usage: TileExtractor <slide list> <output directory> <level> <patch size> [min tissue 0..1] [threads] "
+			"[shard MiB]\n");
+		return 1;
+	}
+
+	GetSystemInfo(&system);
+
+	job.output = argv[2];
+	job.level = atoi(argv[3]);
+	job.patchSize = atoi(argv[4]);
+	job.minTissue = (argc > 5) ? (INT32)(atof(argv[5]) * 1000 + 0.5) : 0;
+	job.threads = (argc > 6) ? atoi(argv[6]) : (INT32)system.dwNumberOfProcessors;
+	job.shardBytes = ((argc > 7) ? _atoi64(argv[7]) : 1024) * 1024 * 1024;
+	job.queued = 0;
+	job.pending = 0;
+	job.patchesWritten = 0;
+	job.patchesFailed = 0;
+	job.slidesDone = 0;
+	job.slidesFailed = 0;
+	job.aborted = 0;
+	InitializeSRWLock(&job.checkpointLock);
+	InitializeSRWLock(&job.waitLock);
+	InitializeConditionVariable(&job.workChanged);
+
+	if (job.level < 0 || job.patchSize <= 0 || job.threads <= 0)
+	{
+		fprintf(stderr, "invalid level, patch size or thread count\n");
+		return 1;
+	}
+
+	if (!ReadSlideList(argv[1], &job))
+	{
+		fprintf(stderr, "cannot read %s\n", argv[1]);
+		return 1;
+	}
+
+	CreateDirectoryA(job.output.c_str(), NULL);
+
+	//*** Continue a previous run if the output directory has a checkpoint of it **************************************
+	if (!OpenCheckpoint(&job)) return 1;
+
+	TruncateShards(&job);
+
+	//*** Patches that cannot be read are listed for a later retry; their chunk still counts as done ******************
+	if ((job.failures = fopen((job.output + "\\failed.txt").c_str(), "a")) == NULL)
+	{
+		fprintf(stderr, "cannot open %s\\failed.txt\n", job.output.c_str());
+		return 1;
+	}
+
+	//*** Deal the slides round-robin; each worker plans its slides and the others steal chunks of them ***************
+	job.queues = new WorkQueue[job.threads];
+	workers.resize(job.threads);
+
+	for (INT32 i = 0; i < job.threads; i++) InitializeSRWLock(&job.queues[i].lock);
+
+	slidesOpen = 0;
+
+	for (INT32 i = 0; i < (INT32)job.slides.size(); i++)
+	{
+		if (job.slides[i].finished) continue;
+
+		ExtractTask task = { i, CHUNK_PLAN };
+		job.queues[slidesOpen++ % job.threads].tasks.push_front(task);
+	}
+
+	job.queued = slidesOpen;
+	job.pending = slidesOpen;
+
+	printf("%d slides, %d left, %d threads, level %d, %d x %d patches\n", (INT32)job.slides.size(), slidesOpen,
+		job.threads, job.level, job.patchSize, job.patchSize);
+
+	for (INT32 i = 0; i < job.threads; i++)
+	{
+		workers[i].job = &job;
+		workers[i].index = i;
+		workers[i].shard = INVALID_HANDLE_VALUE;
+		workers[i].buffer = (BYTE*)malloc((size_t)job.patchSize * job.patchSize * 4);
+
+		if (workers[i].buffer == NULL || !OpenShard(&workers[i], true))
+		{
+			fprintf(stderr, "cannot prepare worker %d\n", i);
+			return 1;
+		}
+
+		threads.push_back(CreateThread(NULL, 0, ExtractWorker, &workers[i], 0, NULL));
+	}
+
+	//*** Report the progress until all work is done ******************************************************************
+	for (int tick = 1; job.pending > 0 && job.aborted == 0; tick++)
+	{
+		Sleep(100);
+
+		if (tick % 100 == 0)
+			printf("%ld patches, %ld/%d slides done\n", job.patchesWritten, job.slidesDone, slidesOpen);
+	}
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		WaitForSingleObject(threads[i], INFINITE);
+		CloseHandle(threads[i]);
+		CloseHandle(workers[i].shard);
+		free(workers[i].buffer);
+	}
+
+	CloseHandle(job.checkpoint);
+	fclose(job.failures);
+	delete[] job.queues;
+
+	printf("%ld patches written, %ld failed (see failed.txt), %ld slides done, %ld slides failed\n",
+		job.patchesWritten, job.patchesFailed, job.slidesDone, job.slidesFailed);
+
+	return (job.aborted != 0) ? 1 : 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ReadSlideList **********************************************/
+/*********************************************************************************************************************/
+
+// One slide path per line; the position in the list is the slide number in the pack files and the checkpoint
+static bool ReadSlideList(const char* path, Extraction* job)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	char line[4096];
+	FILE* file;
+
+	if ((file = fopen(path, "r")) == NULL) return false;
+
+	while (fgets(line, sizeof(line), file) != NULL)
+	{
+		SlideJob slide;
+		size_t length = strlen(line);
+
+		while (length > 0 && (line[length - 1] == '\n' || line[length - 1] == '\r' || line[length - 1] == ' ')) length--;
+		if (length == 0) continue;
+
+		slide.path.assign(line, length);
+		slide.handle = 0;
+		slide.columns = 0;
+		slide.remaining = 0;
+		slide.finished = false;
+
+		job->slides.push_back(slide);
+	}
+
+	fclose(file);
+
+	return !job->slides.empty();
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: OpenCheckpoint **********************************************/
+/*********************************************************************************************************************/
+
+// Creates the checkpoint, or reads the one of a previous run: its settings win over the command line for the thread
+// count, all other settings have to match. A record cut short by the crash is dropped.
+static bool OpenCheckpoint(Extraction* job)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	std::string path = job->output + "\\checkpoint.bin";
+	CheckpointHeader header;
+	CheckpointRecord record;
+	LARGE_INTEGER end;
+	DWORD read;
+	INT32 records = 0;
+
+	job->checkpoint = CreateFileA(path.c_str(), GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ, NULL, OPEN_ALWAYS,
+		FILE_ATTRIBUTE_NORMAL, NULL);
+
+	if (job->checkpoint == INVALID_HANDLE_VALUE)
+	{
+		fprintf(stderr, "cannot open %s\n", path.c_str());
+		return false;
+	}
+
+	//*** A new checkpoint only gets its header ***********************************************************************
+	if (GetLastError() != ERROR_ALREADY_EXISTS || !ReadFile(job->checkpoint, &header, sizeof(header), &read, NULL) ||
+		read != sizeof(header))
+	{
+		header.magic = CHECKPOINT_MAGIC;
+		header.version = CHECKPOINT_VERSION;
+		header.level = job->level;
+		header.patchSize = job->patchSize;
+		header.chunkPatches = CHUNK_PATCHES;
+		header.slideCount = (INT32)job->slides.size();
+		header.minTissue = job->minTissue;
+		header.threads = job->threads;
+
+		SetFilePointer(job->checkpoint, 0, NULL, FILE_BEGIN);
+		SetEndOfFile(job->checkpoint);
+		job->shards.assign(job->threads, ShardState());
+
+		return WriteFile(job->checkpoint, &header, sizeof(header), &read, NULL) && read == sizeof(header);
+	}
+
+	if (header.magic != CHECKPOINT_MAGIC || header.version != CHECKPOINT_VERSION || header.level != job->level ||
+		header.patchSize != job->patchSize || header.chunkPatches != CHUNK_PATCHES ||
+		header.slideCount != (INT32)job->slides.size() || header.minTissue != job->minTissue || header.threads <= 0)
+	{
+		fprintf(stderr, "%s belongs to a run with other settings; remove it to start over\n", path.c_str());
+		return false;
+	}
+
+	job->threads = header.threads;
+	job->shards.assign(job->threads, ShardState());
+
+	//*** Replay the records: finished slides, finished chunks and the valid length of every shard ********************
+	while (ReadFile(job->checkpoint, &record, sizeof(record), &read, NULL) && read == sizeof(record))
+	{
+		if (record.slide < 0 || record.slide >= header.slideCount || record.worker < 0 || record.worker >= job->threads)
+			break;
+
+		if (record.chunk == CHUNK_SLIDE_DONE) job->slides[record.slide].finished = true;
+		else job->slides[record.slide].doneChunks.push_back(record.chunk);
+
+		job->shards[record.worker].sequence = record.sequence;
+		job->shards[record.worker].offset = record.offset;
+		job->shards[record.worker].resumed = true;
+		records++;
+	}
+
+	end.QuadPart = sizeof(header) + (LONGLONG)records * sizeof(record);
+	SetFilePointerEx(job->checkpoint, end, NULL, FILE_BEGIN);
+	SetEndOfFile(job->checkpoint);
+
+	printf("resuming from %d checkpoint records\n", records);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: TruncateShards **********************************************/
+/*********************************************************************************************************************/
+
+// Cuts every shard back to its last checkpoint and removes the shard a worker may have started after it
+static void TruncateShards(Extraction* job)
+{
+	for (INT32 worker = 0; worker < job->threads; worker++)
+	{
+		ShardState* state = &job->shards[worker];
+		HANDLE file;
+
+		if (!state->resumed)
+		{
+			state->sequence = 0;
+			state->offset = 0;
+			continue;
+		}
+
+		DeleteFileA(ShardPath(job, worker, state->sequence + 1).c_str());
+
+		file = CreateFileA(ShardPath(job, worker, state->sequence).c_str(), GENERIC_WRITE, 0, NULL, OPEN_EXISTING,
+			FILE_ATTRIBUTE_NORMAL, NULL);
+
+		if (file == INVALID_HANDLE_VALUE) continue;
+
+		LARGE_INTEGER offset;
+		offset.QuadPart = state->offset;
+		SetFilePointerEx(file, offset, NULL, FILE_BEGIN);
+		SetEndOfFile(file);
+		CloseHandle(file);
+	}
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: ShardPath ************************************************/
+/*********************************************************************************************************************/
+
+static std::string ShardPath(Extraction* job, INT32 worker, INT32 sequence)
+{
+	char name[64];
+
+	sprintf(name, "\\shard-%03d-%04d.pack", worker, sequence);
+
+	return job->output + name;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: OpenShard ************************************************/
+/*********************************************************************************************************************/
+
+// Opens the shard the worker writes to: on start the one the checkpoint left it (or a new one), later the next one
+static bool OpenShard(Worker* worker, bool resume)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Extraction* job = worker->job;
+	LARGE_INTEGER offset;
+	bool append;
+
+	if (worker->shard != INVALID_HANDLE_VALUE) CloseHandle(worker->shard);
+
+	if (resume)
+	{
+		worker->sequence = job->shards[worker->index].sequence;
+		worker->offset = job->shards[worker->index].offset;
+	}
+	else
+	{
+		worker->sequence++;
+		worker->offset = 0;
+	}
+
+	//*** A shard that is already full is not continued ***************************************************************
+	if (worker->offset >= job->shardBytes)
+	{
+		worker->sequence++;
+		worker->offset = 0;
+	}
+
+	append = (worker->offset > 0);
+
+	worker->shard = CreateFileA(ShardPath(job, worker->index, worker->sequence).c_str(), GENERIC_WRITE, FILE_SHARE_READ,
+		NULL, append ? OPEN_EXISTING : CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, NULL);
+
+	if (worker->shard == INVALID_HANDLE_VALUE) return false;
+
+	offset.QuadPart = worker->offset;
+
+	//*** Ende ********************************************************************************************************
+	return SetFilePointerEx(worker->shard, offset, NULL, FILE_BEGIN) != 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ExtractWorker **********************************************/
+/*********************************************************************************************************************/
+
+// Runs tasks until no task is queued or running anywhere
+static DWORD WINAPI ExtractWorker(LPVOID parameter)
+{
+	Worker* worker = (Worker*)parameter;
+	Extraction* job = worker->job;
+	ExtractTask task;
+
+	while (job->pending > 0 && job->aborted == 0)
+	{
+		if (!TakeTask(worker, &task))
+		{
+			//*** Another worker is still planning a slide and may publish chunks to steal; sleep until it does *******
+			AcquireSRWLockExclusive(&job->waitLock);
+
+			while (job->queued == 0 && job->pending > 0 && job->aborted == 0)
+				SleepConditionVariableSRW(&job->workChanged, &job->waitLock, INFINITE, 0);
+
+			ReleaseSRWLockExclusive(&job->waitLock);
+			continue;
+		}
+
+		if (task.chunk == CHUNK_PLAN) PlanSlide(worker, task.slide);
+		else ExtractChunk(worker, task);
+
+		//*** The last task lets the idle workers exit ****************************************************************
+		if (InterlockedDecrement(&job->pending) == 0) PublishWork(job, 0);
+	}
+
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: TakeTask *************************************************/
+/*********************************************************************************************************************/
+
+// The newest task of the own queue, otherwise the oldest of another queue, starting at the next worker
+static bool TakeTask(Worker* worker, ExtractTask* task)
+{
+	Extraction* job = worker->job;
+	WorkQueue* queue = &job->queues[worker->index];
+	bool found = false;
+
+	AcquireSRWLockExclusive(&queue->lock);
+
+	if (!queue->tasks.empty())
+	{
+		*task = queue->tasks.back();
+		queue->tasks.pop_back();
+		found = true;
+	}
+
+	ReleaseSRWLockExclusive(&queue->lock);
+
+	for (INT32 i = 1; !found && i < job->threads; i++)
+	{
+		WorkQueue* victim = &job->queues[(worker->index + i) % job->threads];
+
+		AcquireSRWLockExclusive(&victim->lock);
+
+		if (!victim->tasks.empty())
+		{
+			*task = victim->tasks.front();
+			victim->tasks.pop_front();
+			found = true;
+		}
+
+		ReleaseSRWLockExclusive(&victim->lock);
+	}
+
+	if (found) InterlockedDecrement(&job->queued);
+
+	return found;
+}
+
+
+/*********************************************************************************************************************/
+/************************************************ Funktion: PlanSlide ************************************************/
+/*********************************************************************************************************************/
+
+// Opens the slide, keeps the patches with enough tissue and queues the chunks the checkpoint does not list yet
+static void PlanSlide(Worker* worker, INT32 index)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Extraction* job = worker->job;
+	SlideJob* slide = &job->slides[index];
+	WorkQueue* queue = &job->queues[worker->index];
+	INT32 levels, width, height, rows, chunks, maskWidth = 0, maskHeight = 0;
+	std::vector<bool> done;
+	BYTE* mask = NULL;
+	LONG queued = 0;
+
+	if ((slide->handle = OpenImage((wchar_t*)slide->path.c_str())) == 0)
+	{
+		fprintf(stderr, "cannot open %s\n", slide->path.c_str());
+		InterlockedIncrement(&job->slidesFailed);
+		return;
+	}
+
+	GetLevels(slide->handle, &levels);
+
+	if (job->level >= levels || !GetLevelSize(slide->handle, job->level, &width, &height))
+	{
+		fprintf(stderr, "%s has no level %d\n", slide->path.c_str(), job->level);
+		CloseImage(slide->handle);
+		InterlockedIncrement(&job->slidesFailed);
+		return;
+	}
+
+	//*** The tissue mask comes from the smallest level ***************************************************************
+	if (job->minTissue > 0) mask = BuildTissueMask(slide->handle, levels - 1, &maskWidth, &maskHeight);
+
+	slide->columns = width / job->patchSize;
+	rows = height / job->patchSize;
+
+	for (INT32 y = 0; y < rows; y++)
+	{
+		for (INT32 x = 0; x < slide->columns; x++)
+		{
+			if (mask != NULL)
+			{
+				INT32 left = (INT32)((INT64)x * job->patchSize * maskWidth / width);
+				INT32 top = (INT32)((INT64)y * job->patchSize * maskHeight / height);
+				INT32 right = (std::max)(left + 1, (INT32)((INT64)(x + 1) * job->patchSize * maskWidth / width));
+				INT32 bottom = (std::max)(top + 1, (INT32)((INT64)(y + 1) * job->patchSize * maskHeight / height));
+				INT32 tissue = 0;
+
+				right = (std::min)(right, maskWidth);
+				bottom = (std::min)(bottom, maskHeight);
+
+				for (INT32 my = top; my < bottom; my++)
+					for (INT32 mx = left; mx < right; mx++) tissue += mask[(size_t)my * maskWidth + mx];
+
+				if (right <= left || bottom <= top || tissue * 1000 < job->minTissue * (right - left) * (bottom - top))
+					continue;
+			}
+
+			slide->patches.push_back(y * slide->columns + x);
+		}
+	}
+
+	free(mask);
+
+	//*** Queue the chunks still to do; the owner takes the first chunk first, thieves the last ones ******************
+	chunks = ((INT32)slide->patches.size() + CHUNK_PATCHES - 1) / CHUNK_PATCHES;
+	done.assign(chunks, false);
+
+	for (size_t i = 0; i < slide->doneChunks.size(); i++)
+	{
+		if (slide->doneChunks[i] >= 0 && slide->doneChunks[i] < chunks) done[slide->doneChunks[i]] = true;
+	}
+
+	for (INT32 chunk = 0; chunk < chunks; chunk++) if (!done[chunk]) queued++;
+
+	if (queued == 0)
+	{
+		FinishSlide(worker, index);
+		return;
+	}
+
+	slide->remaining = queued;
+	InterlockedExchangeAdd(&job->pending, queued);
+
+	AcquireSRWLockExclusive(&queue->lock);
+
+	for (INT32 chunk = chunks - 1; chunk >= 0; chunk--)
+	{
+		ExtractTask task = { index, chunk };
+
+		if (!done[chunk]) queue->tasks.push_back(task);
+	}
+
+	ReleaseSRWLockExclusive(&queue->lock);
+
+	PublishWork(job, queued);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************** Funktion: ExtractChunk ***********************************************/
+/*********************************************************************************************************************/
+
+// Writes the patches of the chunk to the shard of the worker and records the chunk in the checkpoint
+static void ExtractChunk(Worker* worker, ExtractTask task)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Extraction* job = worker->job;
+	SlideJob* slide = &job->slides[task.slide];
+	INT32 first = task.chunk * CHUNK_PATCHES;
+	INT32 last = (std::min)(first + CHUNK_PATCHES, (INT32)slide->patches.size());
+	CheckpointRecord record;
+	PatchHeader header;
+	DWORD written;
+	INT32 failed = 0;
+
+	header.magic = PATCH_MAGIC;
+	header.slide = task.slide;
+	header.level = job->level;
+	header.width = job->patchSize;
+	header.height = job->patchSize;
+	header.length = (UINT32)job->patchSize * job->patchSize * 4;
+
+	for (INT32 i = first; i < last && job->aborted == 0; i++)
+	{
+		header.x = (slide->patches[i] % slide->columns) * job->patchSize;
+		header.y = (slide->patches[i] / slide->columns) * job->patchSize;
+
+		if (!GetRegionDecoded(slide->handle, job->level, header.x, header.y, header.width, header.height, worker->buffer))
+		{
+			AcquireSRWLockExclusive(&job->checkpointLock);
+			fprintf(job->failures, "%d\t%d\t%d\t%s\n", task.slide, header.x, header.y, slide->path.c_str());
+			ReleaseSRWLockExclusive(&job->checkpointLock);
+
+			InterlockedIncrement(&job->patchesFailed);
+			failed++;
+			continue;
+		}
+
+		if (!WriteFile(worker->shard, &header, sizeof(header), &written, NULL) || written != sizeof(header) ||
+			!WriteFile(worker->shard, worker->buffer, header.length, &written, NULL) || written != header.length)
+		{
+			fprintf(stderr, "cannot write %s\n", ShardPath(job, worker->index, worker->sequence).c_str());
+			AbortExtraction(job);
+			return;
+		}
+
+		worker->offset += sizeof(header) + header.length;
+		InterlockedIncrement(&job->patchesWritten);
+	}
+
+	if (job->aborted != 0) return;
+
+	//*** The chunk counts as done only once its patches are on disk and its failures are listed **********************
+	if (!FlushFileBuffers(worker->shard))
+	{
+		fprintf(stderr, "cannot flush %s\n", ShardPath(job, worker->index, worker->sequence).c_str());
+		AbortExtraction(job);
+		return;
+	}
+
+	if (failed > 0)
+	{
+		AcquireSRWLockExclusive(&job->checkpointLock);
+		fflush(job->failures);
+		ReleaseSRWLockExclusive(&job->checkpointLock);
+	}
+
+	record.slide = task.slide;
+	record.chunk = task.chunk;
+	record.worker = worker->index;
+	record.sequence = worker->sequence;
+	record.offset = worker->offset;
+
+	if (!WriteCheckpoint(job, &record)) return;
+
+	if (worker->offset >= job->shardBytes && !OpenShard(worker, false))
+	{
+		fprintf(stderr, "cannot create %s\n", ShardPath(job, worker->index, worker->sequence).c_str());
+		AbortExtraction(job);
+		return;
+	}
+
+	if (InterlockedDecrement(&slide->remaining) == 0) FinishSlide(worker, task.slide);
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: FinishSlide ***********************************************/
+/*********************************************************************************************************************/
+
+static void FinishSlide(Worker* worker, INT32 index)
+{
+	Extraction* job = worker->job;
+	SlideJob* slide = &job->slides[index];
+	CheckpointRecord record;
+
+	CloseImage(slide->handle);
+	slide->handle = 0;
+	std::vector<INT32>().swap(slide->patches);
+
+	record.slide = index;
+	record.chunk = CHUNK_SLIDE_DONE;
+	record.worker = worker->index;
+	record.sequence = worker->sequence;
+	record.offset = worker->offset;
+
+	if (WriteCheckpoint(job, &record)) InterlockedIncrement(&job->slidesDone);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: WriteCheckpoint *********************************************/
+/*********************************************************************************************************************/
+
+static bool WriteCheckpoint(Extraction* job, CheckpointRecord* record)
+{
+	DWORD written;
+	BOOL succeeded;
+
+	AcquireSRWLockExclusive(&job->checkpointLock);
+	succeeded = WriteFile(job->checkpoint, record, sizeof(*record), &written, NULL) && written == sizeof(*record);
+	ReleaseSRWLockExclusive(&job->checkpointLock);
+
+	if (!succeeded)
+	{
+		fprintf(stderr, "cannot write the checkpoint\n");
+		AbortExtraction(job);
+	}
+
+	return succeeded != 0;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: PublishWork ***********************************************/
+/*********************************************************************************************************************/
+
+// Counts newly queued tasks and wakes the idle workers; with 0 tasks it only wakes them to look at pending again
+static void PublishWork(Extraction* job, LONG tasks)
+{
+	AcquireSRWLockExclusive(&job->waitLock);
+	InterlockedExchangeAdd(&job->queued, tasks);
+	ReleaseSRWLockExclusive(&job->waitLock);
+
+	WakeAllConditionVariable(&job->workChanged);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: AbortExtraction *********************************************/
+/*********************************************************************************************************************/
+
+static void AbortExtraction(Extraction* job)
+{
+	InterlockedExchange(&job->aborted, 1);
+	PublishWork(job, 0);
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: BuildTissueMask *********************************************/
+/*********************************************************************************************************************/
+
+// One byte per pixel of the level, 1 for tissue; read in strips so that large levels need little memory
+static BYTE* BuildTissueMask(INT64 handle, INT32 level, INT32* width, INT32* height)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	UINT32* strip;
+	BYTE* mask;
+
+	if (!GetLevelSize(handle, level, width, height) || *width <= 0 || *height <= 0) return NULL;
+
+	mask = (BYTE*)malloc((size_t)*width * *height);
+	strip = (UINT32*)malloc((size_t)*width * TISSUE_STRIP_ROWS * 4);
+
+	if (mask == NULL || strip == NULL)
+	{
+		free(mask);
+		free(strip);
+		return NULL;
+	}
+
+	for (INT32 top = 0; top < *height; top += TISSUE_STRIP_ROWS)
+	{
+		INT32 rows = (std::min)(TISSUE_STRIP_ROWS, *height - top);
+		size_t pixels = (size_t)*width * rows;
+
+		if (!GetRegionDecoded(handle, level, 0, top, *width, rows, (BYTE*)strip))
+		{
+			memset(mask + (size_t)top * *width, 0, pixels);
+			continue;
+		}
+
+		//*** Transparent pixels lie outside the scanned area *********************************************************
+		for (size_t i = 0; i < pixels; i++)
+		{
+			UINT32 pixel = strip[i];
+			INT32 r = (pixel >> 16) & 0xFF, g = (pixel >> 8) & 0xFF, b = pixel & 0xFF;
+			INT32 high = (std::max)(r, (std::max)(g, b)), low = (std::min)(r, (std::min)(g, b));
+
+			mask[(size_t)top * *width + i] = ((pixel >> 24) != 0 && high - low >= TISSUE_SATURATION) ? 1 : 0;
+		}
+	}
+
+	free(strip);
+
+	//*** Ende ********************************************************************************************************
+	return mask;
+}
@@ -0,0 +1,329 @@
+/*********************************************************************************************************************/
+/* Datei: TraceReplay.cpp                                                                                            */
+/*********************************************************************************************************************/
+/* Projekt: svsimage.dll tools                                                                                       */
+/* Description:   Replays a tile access log against the library and reports cache hit rates and latencies            */
+/*********************************************************************************************************************/
+
+#include <windows.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <map>
+#include <string>
+#include <vector>
+
+#include "../SVSImageApi.h"
+#include "../../AccessLog.h"
+
+/*********************************************************************************************************************/
+/********************************************* Struktur-Deklarationen ************************************************/
+/*********************************************************************************************************************/
+
+struct Replay
+{
+	std::vector<AccessRecord> requests;
+	std::map<INT64, INT64> handles;
+	std::vector<UINT32> latencies;
+	INT64 frequency;
+	INT64 start;
+	double speed;
+	INT32 bufferSize;
+	volatile LONG next;
+	volatile LONG failed;
+	LONG skipped;
+};
+
+
+/*********************************************************************************************************************/
+/************************************************* Funktion: LoadLog *************************************************/
+/*********************************************************************************************************************/
+
+// Reads the log, opens every slide it references and keeps the tile requests of the slides that could be opened;
+// the requests of slides without an open record, or that could not be opened, are counted as skipped
+static bool LoadLog(const char* path, Replay* replay)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	AccessLogHeader header;
+	AccessRecord record;
+	FILE* file;
+
+	if ((file = fopen(path, "rb")) == NULL) return false;
+
+	if (fread(&header, sizeof(header), 1, file) != 1 || header.magic != ACCESS_LOG_MAGIC ||
+		header.version != ACCESS_LOG_VERSION)
+	{
+		fclose(file);
+		return false;
+	}
+
+	replay->frequency = header.frequency;
+
+	while (fread(&record, sizeof(record), 1, file) == 1)
+	{
+		if (record.kind == ACCESS_OPEN)
+		{
+			//*** The path follows the record *************************************************************************
+			std::string slide((size_t)record.x, '\0');
+			INT32 width, height;
+			INT64 handle;
+
+			if (record.x > 0 && fread(&slide[0], 1, record.x, file) != (size_t)record.x) break;
+			fseek(file, ((record.x + 7) & ~7) - record.x, SEEK_CUR);
+
+			if ((handle = OpenImage((wchar_t*)slide.c_str())) == 0)
+			{
+				fprintf(stderr, "cannot open %s, its requests are skipped\n", slide.c_str());
+				continue;
+			}
+
+			GetTileSize(handle, &width, &height);
+			replay->bufferSize = (std::max)(replay->bufferSize, 4 * width * height);
+			replay->handles[record.handle] = handle;
+		}
+		else if (record.kind == ACCESS_TILE)
+		{
+			if (replay->handles.count(record.handle) > 0) replay->requests.push_back(record);
+			else replay->skipped++;
+		}
+	}
+
+	fclose(file);
+
+	//*** Ende ********************************************************************************************************
+	return true;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: ReplayRequests **********************************************/
+/*********************************************************************************************************************/
+
+// Worker: takes the requests in log order and issues each no earlier than its original time divided by the speed.
+// The handles are only looked up; the map is complete before the workers start.
+static DWORD WINAPI ReplayRequests(LPVOID parameter)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	Replay* replay = (Replay*)parameter;
+	BYTE* buffer = (BYTE*)malloc(replay->bufferSize);
+	LARGE_INTEGER now, done;
+	LONG index;
+
+	while ((index = InterlockedIncrement(&replay->next) - 1) < (LONG)replay->requests.size())
+	{
+		const AccessRecord* request = &replay->requests[index];
+		std::map<INT64, INT64>::const_iterator handle = replay->handles.find(request->handle);
+
+		//*** Keep the pacing of the log; speed 0 replays as fast as possible *****************************************
+		if (replay->speed > 0)
+		{
+			INT64 due = replay->start + (INT64)((request->time - replay->requests[0].time) / replay->speed);
+
+			for (QueryPerformanceCounter(&now); now.QuadPart < due; QueryPerformanceCounter(&now))
+			{
+				DWORD wait = (DWORD)((due - now.QuadPart) * 1000 / replay->frequency);
+
+				Sleep(wait > 1 ? wait - 1 : 0);
+			}
+		}
+
+		QueryPerformanceCounter(&now);
+
+		if (handle == replay->handles.end() ||
+			!GetTileDecoded(handle->second, request->level, request->x, request->y, buffer))
+			InterlockedIncrement(&replay->failed);
+
+		QueryPerformanceCounter(&done);
+
+		replay->latencies[index] = (UINT32)((done.QuadPart - now.QuadPart) * 1000000 / replay->frequency);
+	}
+
+	free(buffer);
+	return 0;
+}
+
+
+/*********************************************************************************************************************/
+/********************************************* Funktion: WaitForThreads **********************************************/
+/*********************************************************************************************************************/
+
+// Joins the threads in chunks, as WaitForMultipleObjects takes at most MAXIMUM_WAIT_OBJECTS handles; a chunk whose
+// wait fails is joined one by one. Returns false if a handle was invalid.
+static bool WaitForThreads(std::vector<HANDLE>& threads)
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	bool joined = true;
+	DWORD chunk;
+
+	for (size_t i = 0; i < threads.size(); i += chunk)
+	{
+		chunk = (DWORD)(std::min)(threads.size() - i, (size_t)MAXIMUM_WAIT_OBJECTS);
+
+		if (WaitForMultipleObjects(chunk, &threads[i], TRUE, INFINITE) != WAIT_FAILED) continue;
+
+		for (DWORD j = 0; j < chunk; j++)
+		{
+			if (WaitForSingleObject(threads[i + j], INFINITE) == WAIT_FAILED) joined = false;
+		}
+	}
+
+	return joined;
+}
+
+
+/*********************************************************************************************************************/
+/*********************************************** Funktion: Percentile ************************************************/
+/*********************************************************************************************************************/
+
+static UINT32 Percentile(const std::vector<UINT32>& sorted, double fraction)
+{
+	if (sorted.empty()) return 0;
+
+	return sorted[(size_t)(fraction * (sorted.size() - 1))];
+}
+
+
+/*********************************************************************************************************************/
+/************************************************** Funktion: main ***************************************************/
+/*********************************************************************************************************************/
+
+int main(int argc, char* argv[])
+{
+	//*** Variablen-Deklaration ***************************************************************************************
+	INT64 statistics[ACCESS_STATISTICS_COUNT];
+	LARGE_INTEGER frequency, start, end;
+	std::vector<HANDLE> workers;
+	std::vector<UINT32> sorted;
+	SYSTEM_INFO system;
+	INT32 threads, pool = 1;
+	double seconds;
+	Replay replay;
+
+	if (argc < 2)
+	{
+		printf("usage: TraceReplay <log> [-speed factor] [-threads n] [-pool n] [-shared MiB] [-disk dir MiB]\n"
+			"                   [-readahead gapKiB spanKiB]\n"
+			"  -speed 1 keeps the original pacing, 2 replays twice as fast, 0 as fast as possible (default)\n");
+		return 1;
+	}
+
+	GetSystemInfo(&system);
+
+	replay.speed = 0;
+	replay.bufferSize = 0;
+	replay.next = 0;
+	replay.failed = 0;
+	replay.skipped = 0;
+	threads = (INT32)system.dwNumberOfProcessors;
+
+	//*** Apply the configuration to compare before the slides are opened *********************************************
+	for (int i = 2; i < argc; i++)
+	{
+		if (strcmp(argv[i], "-speed") == 0 && i + 1 < argc) replay.speed = atof(argv[++i]);
+		else if (strcmp(argv[i], "-threads") == 0 && i + 1 < argc) threads = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-pool") == 0 && i + 1 < argc) pool = atoi(argv[++i]);
+		else if (strcmp(argv[i], "-shared") == 0 && i + 1 < argc)
+			SetSharedTileCache(NULL, _atoi64(argv[++i]) << 20, 0);
+		else if (strcmp(argv[i], "-disk") == 0 && i + 2 < argc)
+		{
+			wchar_t directory[MAX_PATH];
+
+			MultiByteToWideChar(CP_ACP, 0, argv[i + 1], -1, directory, MAX_PATH);
+			SetDiskCache(directory, _atoi64(argv[i + 2]) << 20);
+			i += 2;
+		}
+		else if (strcmp(argv[i], "-readahead") == 0 && i + 2 < argc)
+		{
+			SetReadAhead(atoi(argv[i + 1]) * 1024, atoi(argv[i + 2]) * 1024);
+			i += 2;
+		}
+	}
+
+	if (!LoadLog(argv[1], &replay))
+	{
+		fprintf(stderr, "cannot read %s\n", argv[1]);
+		return 1;
+	}
+
+	if (replay.requests.empty())
+	{
+		fprintf(stderr, "no requests to replay, %ld skipped for slides without an open image\n", replay.skipped);
+		return 1;
+	}
+
+	if (pool > 1)
+	{
+		for (std::map<INT64, INT64>::iterator it = replay.handles.begin(); it != replay.handles.end(); ++it)
+			SetSlideHandlePool(it->second, pool);
+	}
+
+	//*** The log may be sorted by completion; replay in order of the request times ***********************************
+	std::stable_sort(replay.requests.begin(), replay.requests.end(),
+		[](const AccessRecord& a, const AccessRecord& b) { return a.time < b.time; });
+
+	replay.latencies.resize(replay.requests.size());
+	GetAccessStatistics(statistics, TRUE);
+
+	//*** Replay ******************************************************************************************************
+	QueryPerformanceFrequency(&frequency);
+	QueryPerformanceCounter(&start);
+	replay.start = start.QuadPart;
+
+	if (replay.frequency != frequency.QuadPart)
+	{
+		//*** Convert the log times to the ticks of this machine ******************************************************
+		for (size_t i = 0; i < replay.requests.size(); i++)
+			replay.requests[i].time = (INT64)((double)replay.requests[i].time * frequency.QuadPart / replay.frequency);
+	}
+
+	replay.frequency = frequency.QuadPart;
+
+	for (INT32 i = 0; i < threads; i++)
+	{
+		HANDLE worker = CreateThread(NULL, 0, ReplayRequests, &replay, 0, NULL);
+
+		if (worker != NULL) workers.push_back(worker);
+	}
+
+	if (workers.empty()) ReplayRequests(&replay);
+
+	//*** Neither the report nor CloseImage may run while a worker still replays **************************************
+	if (!WaitForThreads(workers))
+	{
+		fprintf(stderr, "cannot wait for the replay threads\n");
+		return 1;
+	}
+
+	QueryPerformanceCounter(&end);
+
+	for (size_t i = 0; i < workers.size(); i++) CloseHandle(workers[i]);
+
+	//*** Report ******************************************************************************************************
+	GetAccessStatistics(statistics, FALSE);
+
+	sorted = replay.latencies;
+	std::sort(sorted.begin(), sorted.end());
+	seconds = (double)(end.QuadPart - start.QuadPart) / frequency.QuadPart;
+
+	printf("requests:        %lu in %.2f s (%.1f tiles/s), %ld failed\n", (unsigned long)replay.requests.size(), seconds,
+		replay.requests.size() / seconds, replay.failed);
+
+	if (replay.skipped > 0) printf("skipped:         %ld requests of slides without an open image\n", replay.skipped);
+
+	if (statistics[0] > 0)
+	{
+		printf("shared cache:    %.1f %%\n", 100.0 * statistics[1] / statistics[0]);
+		printf("disk cache:      %.1f %%\n", 100.0 * statistics[2] / statistics[0]);
+		printf("openslide reads: %.1f %%\n", 100.0 * statistics[3] / statistics[0]);
+	}
+
+	printf("latency (ms):    p50 %.2f  p90 %.2f  p99 %.2f  max %.2f\n", Percentile(sorted, 0.5) / 1000.0,
+		Percentile(sorted, 0.9) / 1000.0, Percentile(sorted, 0.99) / 1000.0, sorted.back() / 1000.0);
+
+	//*** Ende ********************************************************************************************************
+	for (std::map<INT64, INT64>::iterator it = replay.handles.begin(); it != replay.handles.end(); ++it)
+		CloseImage(it->second);
+
+	return 0;
+}